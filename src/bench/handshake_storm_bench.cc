@@ -0,0 +1,462 @@
+/**
+ * @file    handshake_storm_bench.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Interactive relay latency during a storm of handshakes
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: handshake_storm_bench [-f] [-c clients] [-n pings] [-i usec]
+ *
+ * A Socks5Server runs on the main thread with a transport that does an
+ * obfs3 sized UniformDH exchange with the bridge before relaying data.  A
+ * second thread runs an echo bridge, and keeps the requested number of SOCKS
+ * clients handshaking at once: each one closes as soon as it gets the SOCKS
+ * response, and is replaced by a new one.  A third thread holds one
+ * established session open, and sends a byte through it every interval,
+ * timing how long the echo takes to come back.  The round trip times are
+ * reported, along with the handshake rate.
+ *
+ * By default the event_base is initialized with Socks5Server::kNrPriorities
+ * priorities, so the relay is serviced before the handshakes.  -f leaves the
+ * event_base with a single priority for comparison.
+ */
+
+#define _LOGGER "bench"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/crypto/uniform_dh.h"
+#include "schwanenlied/socks5_server.h"
+
+using ::schwanenlied::Socks5Server;
+using ::schwanenlied::crypto::UniformDH;
+
+namespace {
+
+/** How often the event loops check if the benchmark is done (ms) */
+constexpr long kDoneCheckInterval = 10;
+
+/** The SOCKS request and response length (IPv4 CONNECT) */
+constexpr size_t kSocksRequestLength = 3 + 10;
+constexpr size_t kSocksResponseLength = 2 + 10;
+
+/** Set once the interactive session is done */
+::std::atomic<bool> done(false);
+
+/** The number of storm handshakes completed */
+::std::atomic<uint64_t> nr_handshakes(0);
+
+/** A passthrough transport with a UniformDH exchange as the handshake */
+class StormSession : public Socks5Server::TransportSession<StormSession> {
+  friend class Socks5Server::TransportSession<StormSession>;
+
+ public:
+  StormSession(Socks5Server& server,
+               struct event_base* base,
+               const evutil_socket_t sock,
+               const ::std::string& addr) :
+      TransportSession(server, base, sock, addr) {}
+
+ protected:
+  bool on_outgoing_connected() override {
+    dh_.reset(new UniformDH());
+    const ::std::string pub_key = dh_->public_key();
+    return 0 == ::bufferevent_write(outgoing_, pub_key.data(), pub_key.size());
+  }
+
+  bool on_incoming_data() override {
+    return 0 == ::bufferevent_write_buffer(outgoing_,
+                                           ::bufferevent_get_input(incoming_));
+  }
+
+  bool on_outgoing_data_connecting() override {
+    struct evbuffer* buf = ::bufferevent_get_input(outgoing_);
+    if (::evbuffer_get_length(buf) < UniformDH::kKeyLength)
+      return true;
+
+    // The bridge echoes the public key, which is as good as any other
+    uint8_t pub_key[UniformDH::kKeyLength];
+    ::evbuffer_remove(buf, pub_key, sizeof(pub_key));
+    const bool ok = dh_->compute_key(pub_key, sizeof(pub_key));
+    dh_.reset();
+    return send_socks5_response(ok ? Reply::kSUCCEDED :
+                                Reply::kGENERAL_FAILURE);
+  }
+
+  bool on_outgoing_data() override {
+    return 0 == ::bufferevent_write_buffer(incoming_,
+                                           ::bufferevent_get_input(outgoing_));
+  }
+
+ private:
+  ::std::unique_ptr<UniformDH> dh_;
+};
+
+class StormFactory : public Socks5Server::SessionFactory {
+ public:
+  Socks5Server::Session* create_session(Socks5Server& server,
+                                        struct event_base* base,
+                                        const evutil_socket_t sock,
+                                        const ::std::string& addr,
+                                        const bool scrub_addrs) override {
+    (void)scrub_addrs;
+
+    return new_session<StormSession>(0, server, base, sock, addr);
+  }
+};
+
+/** The bridge and the storm clients, run on their own event_base */
+struct Load {
+  struct event_base* base;
+  struct sockaddr_in socks_addr;
+  uint8_t request[kSocksRequestLength];
+};
+
+double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Build a pipelined SOCKS method negotiation and CONNECT to addr */
+void socks_request(const struct sockaddr_in& addr,
+                   uint8_t* request) {
+  static const uint8_t header[] = { 0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x01 };
+  ::std::memcpy(request, header, sizeof(header));
+  ::std::memcpy(request + sizeof(header), &addr.sin_addr, 4);
+  ::std::memcpy(request + sizeof(header) + 4, &addr.sin_port, 2);
+}
+
+/** Check the SOCKS response for success */
+bool socks_response_ok(const uint8_t* response) {
+  return response[0] == 0x05 && response[1] == 0x00 &&
+      response[2] == 0x05 && response[3] == 0x00;
+}
+
+void storm_client_new(Load* load);
+
+void storm_read_cb(struct bufferevent* bev,
+                   void* arg) {
+  Load* load = reinterpret_cast<Load*>(arg);
+
+  struct evbuffer* buf = ::bufferevent_get_input(bev);
+  if (::evbuffer_get_length(buf) < kSocksResponseLength)
+    return;
+  if (socks_response_ok(::evbuffer_pullup(buf, kSocksResponseLength)))
+    ++nr_handshakes;
+  ::bufferevent_free(bev);
+  storm_client_new(load);
+}
+
+void storm_event_cb(struct bufferevent* bev,
+                    short what,
+                    void* arg) {
+  if (what & BEV_EVENT_CONNECTED)
+    return;
+
+  ::bufferevent_free(bev);
+  storm_client_new(reinterpret_cast<Load*>(arg));
+}
+
+void storm_client_new(Load* load) {
+  if (done)
+    return;
+
+  struct bufferevent* bev = ::bufferevent_socket_new(load->base, -1,
+                                                     BEV_OPT_CLOSE_ON_FREE);
+  if (bev == nullptr)
+    return;
+  ::bufferevent_setcb(bev, storm_read_cb, nullptr, storm_event_cb, load);
+  ::bufferevent_enable(bev, EV_READ);
+  ::bufferevent_write(bev, load->request, sizeof(load->request));
+  if (::bufferevent_socket_connect(bev, reinterpret_cast<struct sockaddr*>(
+          &load->socks_addr), sizeof(load->socks_addr)) != 0)
+    ::bufferevent_free(bev);
+}
+
+void bridge_read_cb(struct bufferevent* bev,
+                    void* arg) {
+  (void)arg;
+
+  ::bufferevent_write_buffer(bev, ::bufferevent_get_input(bev));
+}
+
+void bridge_event_cb(struct bufferevent* bev,
+                     short what,
+                     void* arg) {
+  (void)what;
+  (void)arg;
+
+  ::bufferevent_free(bev);
+}
+
+void bridge_accept_cb(struct evconnlistener* listener,
+                      evutil_socket_t sock,
+                      struct sockaddr* addr,
+                      int addr_len,
+                      void* arg) {
+  (void)listener;
+  (void)addr;
+  (void)addr_len;
+
+  Load* load = reinterpret_cast<Load*>(arg);
+  struct bufferevent* bev = ::bufferevent_socket_new(load->base, sock,
+                                                     BEV_OPT_CLOSE_ON_FREE);
+  if (bev == nullptr) {
+    ::evutil_closesocket(sock);
+    return;
+  }
+  ::bufferevent_setcb(bev, bridge_read_cb, nullptr, bridge_event_cb, load);
+  ::bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+/** Stop the event loop once the interactive session is done */
+struct event* done_check_new(struct event_base* base) {
+  event_callback_fn cb = [](evutil_socket_t sock,
+                            short what,
+                            void* arg) {
+    (void)sock;
+    (void)what;
+
+    if (done)
+      ::event_base_loopbreak(reinterpret_cast<struct event_base*>(arg));
+  };
+  struct event* ev = ::event_new(base, -1, EV_PERSIST, cb, base);
+  if (ev == nullptr)
+    return nullptr;
+  const struct timeval tv = { 0, kDoneCheckInterval * 1000 };
+  ::event_add(ev, &tv);
+  return ev;
+}
+
+bool read_all(const int fd,
+              uint8_t* buf,
+              size_t len) {
+  while (len > 0) {
+    const ssize_t ret = ::read(fd, buf, len);
+    if (ret <= 0)
+      return false;
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+/** Measure the round trip times through one established session */
+bool interactive(const struct sockaddr_in& socks_addr,
+                 const uint8_t* request,
+                 const size_t nr_pings,
+                 const useconds_t interval,
+                 ::std::vector<double>& rtts) {
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  const int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  uint8_t response[kSocksResponseLength];
+  bool ok = ::connect(fd, reinterpret_cast<const struct sockaddr*>(
+      &socks_addr), sizeof(socks_addr)) == 0 &&
+      ::write(fd, request, kSocksRequestLength) ==
+          static_cast<ssize_t>(kSocksRequestLength) &&
+      read_all(fd, response, sizeof(response)) &&
+      socks_response_ok(response);
+
+  for (size_t i = 0; ok && i < nr_pings; i++) {
+    ::usleep(interval);
+    uint8_t c = static_cast<uint8_t>(i);
+    const double start = now();
+    ok = ::write(fd, &c, 1) == 1 && read_all(fd, &c, 1) &&
+        c == static_cast<uint8_t>(i);
+    rtts.push_back(now() - start);
+  }
+
+  ::close(fd);
+  return ok;
+}
+
+double percentile(const ::std::vector<double>& sorted,
+                  const double p) {
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+void usage(const char* argv0) {
+  ::std::fprintf(stderr, "Usage: %s [-f] [-c clients] [-n pings] [-i usec]\n",
+                 argv0);
+  ::std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  bool flat = false;
+  size_t nr_clients = 32;
+  size_t nr_pings = 2000;
+  useconds_t interval = 1000;
+
+  int opt;
+  while ((opt = ::getopt(argc, argv, "fc:n:i:")) != -1) {
+    switch (opt) {
+    case 'f':
+      flat = true;
+      break;
+    case 'c':
+      nr_clients = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'n':
+      nr_pings = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'i':
+      interval = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_pings == 0)
+    usage(argv[0]);
+
+  ::el::Configurations conf;
+  conf.setToDefault();
+  conf.setGlobally(::el::ConfigurationType::ToFile, "false");
+  conf.setGlobally(::el::ConfigurationType::Enabled, "false");
+  ::el::Loggers::setDefaultConfigurations(conf, true);
+  (void)::el::Loggers::getLogger(_LOGGER);
+
+  // The SOCKS server
+  struct event_base* base = ::event_base_new();
+  if (base == nullptr ||
+      (!flat && ::event_base_priority_init(base,
+                                           Socks5Server::kNrPriorities))) {
+    ::std::fprintf(stderr, "Failed to allocate the event_base\n");
+    return 1;
+  }
+  StormFactory factory;
+  ::std::unique_ptr<Socks5Server> server(new Socks5Server("", &factory,
+                                                          base));
+  Load load;
+  if (!server->bind() || !server->addr(load.socks_addr)) {
+    ::std::fprintf(stderr, "Failed to bind the SOCKS server\n");
+    return 1;
+  }
+
+  // The bridge
+  load.base = ::event_base_new();
+  if (load.base == nullptr) {
+    ::std::fprintf(stderr, "Failed to allocate the event_base\n");
+    return 1;
+  }
+  struct sockaddr_in bridge_addr;
+  ::std::memset(&bridge_addr, 0, sizeof(bridge_addr));
+  bridge_addr.sin_family = AF_INET;
+  bridge_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  struct evconnlistener* bridge = ::evconnlistener_new_bind(
+      load.base, bridge_accept_cb, &load, LEV_OPT_CLOSE_ON_FREE |
+      LEV_OPT_REUSEABLE, -1, reinterpret_cast<struct sockaddr*>(&bridge_addr),
+      sizeof(bridge_addr));
+  socklen_t addr_len = sizeof(bridge_addr);
+  if (bridge == nullptr ||
+      ::getsockname(::evconnlistener_get_fd(bridge),
+                    reinterpret_cast<struct sockaddr*>(&bridge_addr),
+                    &addr_len) != 0) {
+    ::std::perror("Failed to set up the bridge");
+    return 1;
+  }
+  socks_request(bridge_addr, load.request);
+
+  struct event* done_ev = done_check_new(base);
+  struct event* load_done_ev = done_check_new(load.base);
+  if (done_ev == nullptr || load_done_ev == nullptr) {
+    ::std::fprintf(stderr, "Failed to allocate events\n");
+    return 1;
+  }
+  if (!flat)
+    ::event_priority_set(done_ev, Socks5Server::Priority::kTIMER);
+
+  // Storm, and time the interactive session
+  const double start = now();
+  ::std::thread load_thread([&load, nr_clients]() {
+    for (size_t i = 0; i < nr_clients; i++)
+      storm_client_new(&load);
+    ::event_base_dispatch(load.base);
+  });
+  ::std::vector<double> rtts;
+  bool ok = false;
+  ::std::thread interactive_thread([&]() {
+    ok = interactive(load.socks_addr, load.request, nr_pings, interval, rtts);
+    done = true;
+  });
+  ::event_base_dispatch(base);
+  interactive_thread.join();
+  load_thread.join();
+  const double elapsed = now() - start;
+
+  if (!ok || rtts.empty()) {
+    ::std::fprintf(stderr, "Interactive session failed\n");
+    return 1;
+  }
+  ::std::sort(rtts.begin(), rtts.end());
+
+  ::std::printf("Priorities: %s Clients: %zu Pings: %zu Interval: %u us\n",
+                flat ? "flat" : "prioritized", nr_clients, rtts.size(),
+                static_cast<unsigned>(interval));
+  ::std::printf("Handshakes: %llu (%.0f/s)\n",
+                static_cast<unsigned long long>(nr_handshakes.load()),
+                nr_handshakes / elapsed);
+  ::std::printf("RTT: p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms\n",
+                percentile(rtts, 0.5) * 1e3, percentile(rtts, 0.9) * 1e3,
+                percentile(rtts, 0.99) * 1e3, rtts.back() * 1e3);
+
+  ::event_free(done_ev);
+  ::event_free(load_done_ev);
+  server->close_sessions();
+
+  return 0;
+}
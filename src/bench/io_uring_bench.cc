@@ -0,0 +1,361 @@
+/**
+ * @file    io_uring_bench.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Relay throughput of the io_uring backend vs libevent2
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: io_uring_bench [-u] [-c connections] [-s bytes]
+ *
+ * Each connection is a loopback TCP connection, one end of which is an echo
+ * server that has its socket I/O done by either a socket bufferevent, or a
+ * net::IoUring (-u).  The other end streams the requested number of bytes
+ * and checks what is echoed back.  The time and CPU time taken are
+ * reported, and running it under `strace -c -f` gives the system call
+ * counts of each backend.
+ */
+
+#define _LOGGER "bench"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/net/io_uring.h"
+
+namespace {
+
+/** The most data written at once */
+constexpr size_t kChunkSize = 64 * 1024;
+
+/** The most data buffered by either end of a connection */
+constexpr size_t kMaxBuffered = 256 * 1024;
+
+struct Bench;
+
+struct Conn {
+  Bench* bench;
+  struct bufferevent* echo;
+#ifdef ENABLE_IO_URING
+  ::schwanenlied::net::IoUring::Socket* sock;
+#endif
+  struct bufferevent* peer;
+  size_t sent;
+  size_t received;
+};
+
+struct Bench {
+  struct event_base* base;
+  size_t size;
+  size_t nr_done;
+  size_t nr_conns;
+  bool failed;
+};
+
+/** The data sent, byte i of a stream is pattern[i % 256] */
+uint8_t pattern[kChunkSize + 256];
+
+double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_time(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void on_failure(Conn* conn,
+                const char* what) {
+  ::std::fprintf(stderr, "Connection failed: %s\n", what);
+  conn->bench->failed = true;
+  ::event_base_loopbreak(conn->bench->base);
+}
+
+void echo_read_cb(struct bufferevent* bev,
+                  void* arg) {
+  (void)arg;
+
+  struct evbuffer* out = ::bufferevent_get_output(bev);
+  ::evbuffer_add_buffer(out, ::bufferevent_get_input(bev));
+  if (::evbuffer_get_length(out) >= kMaxBuffered)
+    ::bufferevent_disable(bev, EV_READ);
+}
+
+void echo_write_cb(struct bufferevent* bev,
+                   void* arg) {
+  (void)arg;
+
+  ::bufferevent_enable(bev, EV_READ);
+}
+
+void peer_write_cb(struct bufferevent* bev,
+                   void* arg) {
+  Conn* conn = reinterpret_cast<Conn*>(arg);
+
+  struct evbuffer* out = ::bufferevent_get_output(bev);
+  while (conn->sent < conn->bench->size &&
+         ::evbuffer_get_length(out) < kMaxBuffered) {
+    const size_t len = ::std::min(kChunkSize, conn->bench->size - conn->sent);
+    ::evbuffer_add(out, pattern + (conn->sent & 0xff), len);
+    conn->sent += len;
+  }
+}
+
+void peer_read_cb(struct bufferevent* bev,
+                  void* arg) {
+  Conn* conn = reinterpret_cast<Conn*>(arg);
+
+  struct evbuffer* in = ::bufferevent_get_input(bev);
+  uint8_t buf[kChunkSize];
+  int len;
+  while ((len = ::evbuffer_remove(in, buf, sizeof(buf))) > 0) {
+    if (::std::memcmp(buf, pattern + (conn->received & 0xff), len) != 0)
+      return on_failure(conn, "Echoed data mismatch");
+    conn->received += len;
+  }
+
+  if (conn->received == conn->bench->size &&
+      ++conn->bench->nr_done == conn->bench->nr_conns)
+    ::event_base_loopbreak(conn->bench->base);
+}
+
+void event_cb(struct bufferevent* bev,
+              short what,
+              void* arg) {
+  (void)bev;
+
+  on_failure(reinterpret_cast<Conn*>(arg),
+             (what & BEV_EVENT_EOF) ? "EOF" : "Error");
+}
+
+bool connect_pair(const evutil_socket_t listener,
+                  const struct sockaddr_in& addr,
+                  evutil_socket_t& client,
+                  evutil_socket_t& server) {
+  client = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (client < 0)
+    return false;
+  if (::connect(client, reinterpret_cast<const struct sockaddr*>(&addr),
+                sizeof(addr)) != 0) {
+    ::close(client);
+    return false;
+  }
+  server = ::accept(listener, nullptr, nullptr);
+  if (server < 0) {
+    ::close(client);
+    return false;
+  }
+  ::evutil_make_socket_nonblocking(client);
+  ::evutil_make_socket_nonblocking(server);
+
+  return true;
+}
+
+void usage(const char* argv0) {
+  ::std::fprintf(stderr, "Usage: %s [-u] [-c connections] [-s bytes]\n",
+                 argv0);
+  ::std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  bool use_io_uring = false;
+  size_t nr_conns = 16;
+  size_t size = 16 * 1024 * 1024;
+
+  int opt;
+  while ((opt = ::getopt(argc, argv, "uc:s:")) != -1) {
+    switch (opt) {
+    case 'u':
+      use_io_uring = true;
+      break;
+    case 'c':
+      nr_conns = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 's':
+      size = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_conns == 0 || size == 0)
+    usage(argv[0]);
+
+  ::el::Configurations conf;
+  conf.setToDefault();
+  conf.setGlobally(::el::ConfigurationType::ToFile, "false");
+  conf.set(::el::Level::Debug, ::el::ConfigurationType::Enabled, "false");
+  ::el::Loggers::setDefaultConfigurations(conf, true);
+  (void)::el::Loggers::getLogger(_LOGGER);
+
+  for (size_t i = 0; i < sizeof(pattern); i++)
+    pattern[i] = static_cast<uint8_t>(i);
+
+  Bench bench = { ::event_base_new(), size, 0, nr_conns, false };
+  if (bench.base == nullptr) {
+    ::std::fprintf(stderr, "Failed to allocate the event_base\n");
+    return 1;
+  }
+
+#ifdef ENABLE_IO_URING
+  ::std::unique_ptr< ::schwanenlied::net::IoUring> ring;
+  if (use_io_uring) {
+    ring.reset(new ::schwanenlied::net::IoUring(bench.base, 0));
+    if (!ring->init()) {
+      ::std::fprintf(stderr, "Failed to initialize the io_uring\n");
+      return 1;
+    }
+  }
+#else
+  if (use_io_uring) {
+    ::std::fprintf(stderr, "Built without --enable-io-uring\n");
+    return 1;
+  }
+#endif
+
+  // Set up the connections
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  ::std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const evutil_socket_t listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) != 0 ||
+      ::listen(listener, static_cast<int>(nr_conns)) != 0 ||
+      ::getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr),
+                    &addr_len) != 0) {
+    ::std::perror("Failed to set up the listener");
+    return 1;
+  }
+
+  ::std::vector<Conn> conns(nr_conns);
+  for (auto& conn : conns) {
+    evutil_socket_t client, server;
+    if (!connect_pair(listener, addr, client, server)) {
+      ::std::perror("Failed to connect");
+      return 1;
+    }
+
+    conn.bench = &bench;
+    conn.sent = 0;
+    conn.received = 0;
+    conn.echo = ::bufferevent_socket_new(bench.base, server,
+                                         BEV_OPT_CLOSE_ON_FREE);
+    conn.peer = ::bufferevent_socket_new(bench.base, client,
+                                         BEV_OPT_CLOSE_ON_FREE);
+    if (conn.echo == nullptr || conn.peer == nullptr) {
+      ::std::fprintf(stderr, "Failed to allocate bufferevents\n");
+      return 1;
+    }
+#ifdef ENABLE_IO_URING
+    conn.sock = nullptr;
+    if (ring != nullptr) {
+      conn.sock = ring->attach(conn.echo);
+      if (conn.sock == nullptr) {
+        ::std::fprintf(stderr, "Failed to attach to the io_uring\n");
+        return 1;
+      }
+      conn.echo = conn.sock->bev();
+    }
+#endif
+
+    ::bufferevent_setcb(conn.echo, echo_read_cb, echo_write_cb, event_cb,
+                        &conn);
+    ::bufferevent_setwatermark(conn.echo, EV_WRITE, kMaxBuffered / 2, 0);
+    ::bufferevent_enable(conn.echo, EV_READ | EV_WRITE);
+    ::bufferevent_setcb(conn.peer, peer_read_cb, peer_write_cb, event_cb,
+                        &conn);
+    ::bufferevent_setwatermark(conn.peer, EV_WRITE, kMaxBuffered / 2, 0);
+    ::bufferevent_enable(conn.peer, EV_READ | EV_WRITE);
+  }
+  ::close(listener);
+
+  // Relay
+  struct rusage usage_start, usage_end;
+  ::getrusage(RUSAGE_SELF, &usage_start);
+  const double start = now();
+  for (auto& conn : conns)
+    peer_write_cb(conn.peer, &conn);
+  ::event_base_dispatch(bench.base);
+  const double elapsed = now() - start;
+  ::getrusage(RUSAGE_SELF, &usage_end);
+
+  const double total_mb = 2.0 * size * nr_conns / (1024 * 1024);
+  ::std::printf("Backend: %s Connections: %zu Bytes: %zu\n",
+                use_io_uring ? "io_uring" : "libevent2", nr_conns, size);
+  ::std::printf("Time: %.3f s Throughput: %.1f MB/s\n", elapsed,
+                total_mb / elapsed);
+  ::std::printf("CPU: %.3f s user %.3f s sys\n",
+                cpu_time(usage_end.ru_utime) - cpu_time(usage_start.ru_utime),
+                cpu_time(usage_end.ru_stime) - cpu_time(usage_start.ru_stime));
+#ifdef ENABLE_IO_URING
+  if (ring != nullptr)
+    ::std::printf("io_uring: %s\n", ring->to_string().c_str());
+#endif
+
+  // Tear down
+  for (auto& conn : conns) {
+    ::bufferevent_free(conn.peer);
+#ifdef ENABLE_IO_URING
+    if (conn.sock != nullptr) {
+      conn.sock->release();
+      continue;
+    }
+#endif
+    ::bufferevent_free(conn.echo);
+  }
+#ifdef ENABLE_IO_URING
+  ring.reset();
+#endif
+  ::event_base_loop(bench.base, EVLOOP_NONBLOCK);  // Finish freeing them
+  ::event_base_free(bench.base);
+
+  return bench.failed ? 1 : 0;
+}
@@ -0,0 +1,491 @@
+/**
+ * @file    relay_bench.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Socks5Server::Session relay cost per read callback
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: relay_bench [-v] [-p] [-n sessions] [-r round trips] [-s size]
+ *
+ * Each session is an embedded Socks5Server::Session running a passthrough
+ * transport over a pair of bufferevent pairs, so that no sockets are
+ * involved.  The application end sends a message of the requested size, the
+ * peer end echoes it back, and this is repeated the requested number of
+ * times.  The passthrough transport is either a TransportSession<T> that has
+ * the relay reads statically dispatched, or a Session subclass that goes
+ * through the generic state machine and virtual calls (-v).  The time and
+ * CPU time per relay callback (a call to on_incoming_data() or
+ * on_outgoing_data()) are reported.
+ *
+ * With -p the CPU cycles, instructions and cache misses taken by the relay
+ * are also read from the hardware performance counters.  This is Linux only,
+ * and needs perf_event_paranoid <= 2 and a PMU that the kernel can see (Many
+ * virtual machines do not expose one).  Running with many sessions
+ * (-n 10000) spreads the Sessions over more memory than the caches hold, so
+ * that the misses taken per callback reflect the Session member layout.
+ */
+
+#define _LOGGER "bench"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/socks5_server.h"
+
+using ::schwanenlied::Socks5Server;
+
+namespace {
+
+/** The number of relay callbacks made */
+uint64_t nr_callbacks;
+
+/** Move everything buffered by from to to */
+bool relay(struct bufferevent* from,
+           struct bufferevent* to) {
+  nr_callbacks++;
+  return 0 == ::bufferevent_write_buffer(to, ::bufferevent_get_input(from));
+}
+
+/** A passthrough transport with the relay path statically dispatched */
+class StaticSession : public Socks5Server::TransportSession<StaticSession> {
+  friend class Socks5Server::TransportSession<StaticSession>;
+
+ public:
+  StaticSession(Socks5Server& server,
+                struct event_base* base,
+                const evutil_socket_t sock,
+                const ::std::string& addr) :
+      TransportSession(server, base, sock, addr) {}
+
+ protected:
+  bool on_outgoing_connected() override {
+    return send_socks5_response(Reply::kSUCCEDED);
+  }
+
+  bool on_incoming_data() override {
+    return relay(incoming_, outgoing_);
+  }
+
+  bool on_outgoing_data_connecting() override {
+    return true;
+  }
+
+  bool on_outgoing_data() override {
+    return relay(outgoing_, incoming_);
+  }
+};
+
+/** The same passthrough transport, with every read a virtual call */
+class VirtualSession : public Socks5Server::Session {
+ public:
+  VirtualSession(Socks5Server& server,
+                 struct event_base* base,
+                 const evutil_socket_t sock,
+                 const ::std::string& addr) :
+      Session(server, base, sock, addr) {}
+
+ protected:
+  bool on_outgoing_connected() override {
+    return send_socks5_response(Reply::kSUCCEDED);
+  }
+
+  bool on_incoming_data() override {
+    return relay(incoming_, outgoing_);
+  }
+
+  bool on_outgoing_data_connecting() override {
+    return true;
+  }
+
+  bool on_outgoing_data() override {
+    return relay(outgoing_, incoming_);
+  }
+};
+
+template<class T>
+class Factory : public Socks5Server::SessionFactory {
+ public:
+  Socks5Server::Session* create_session(Socks5Server& server,
+                                        struct event_base* base,
+                                        const evutil_socket_t sock,
+                                        const ::std::string& addr,
+                                        const bool scrub_addrs) override {
+    (void)scrub_addrs;
+
+    return new_session<T>(0, server, base, sock, addr);
+  }
+};
+
+struct Bench;
+
+struct Conn {
+  Bench* bench;
+  struct bufferevent* app;
+  struct bufferevent* peer;
+  size_t nr_round_trips;
+};
+
+struct Bench : public Socks5Server::SessionObserver {
+  struct event_base* base;
+  size_t size;
+  size_t nr_round_trips;
+  size_t nr_established;
+  size_t nr_done;
+  size_t nr_conns;
+  bool failed;
+
+  void on_session_established(Socks5Server::Session* session) override {
+    (void)session;
+
+    if (++nr_established == nr_conns)
+      ::event_base_loopbreak(base);
+  }
+
+  void on_session_failed(Socks5Server::Session* session) override {
+    (void)session;
+
+    ::std::fprintf(stderr, "Session failed\n");
+    failed = true;
+    ::event_base_loopbreak(base);
+  }
+
+  void on_session_closed(Socks5Server::Session* session) override {
+    (void)session;
+  }
+};
+
+/** The message sent by the application end */
+uint8_t message[64 * 1024];
+
+double now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_time(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** A hardware performance counter for this process */
+class PerfCounter {
+ public:
+  PerfCounter(const char* name,
+              const uint64_t config) :
+      name_(name),
+      config_(config),
+      fd_(-1),
+      errno_(0) {}
+
+  ~PerfCounter() {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  /** Open the counter (disabled) */
+  void open() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    ::std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config_;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                     0));
+    if (fd_ < 0)
+      errno_ = errno;
+#else
+    errno_ = ENOSYS;
+#endif
+  }
+
+  void start() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ::ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  void stop() {
+#ifdef __linux__
+    if (fd_ >= 0)
+      ::ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+  }
+
+  /** Print the count, per relay callback */
+  void print(const uint64_t nr_callbacks) const {
+    uint64_t count;
+    if (fd_ < 0) {
+      ::std::printf("%s: unavailable (%s)\n", name_, ::std::strerror(errno_));
+    } else if (::read(fd_, &count, sizeof(count)) != sizeof(count)) {
+      ::std::printf("%s: read failed\n", name_);
+    } else {
+      ::std::printf("%s: %llu (%.2f/callback)\n", name_,
+                    static_cast<unsigned long long>(count),
+                    static_cast<double>(count) / nr_callbacks);
+    }
+  }
+
+ private:
+  PerfCounter(const PerfCounter&) = delete;
+  void operator=(const PerfCounter&) = delete;
+
+  const char* name_;
+  const uint64_t config_;
+  int fd_;
+  int errno_;
+};
+
+void app_send(Conn* conn) {
+  ::bufferevent_write(conn->app, message, conn->bench->size);
+}
+
+void app_read_cb(struct bufferevent* bev,
+                 void* arg) {
+  Conn* conn = reinterpret_cast<Conn*>(arg);
+
+  struct evbuffer* in = ::bufferevent_get_input(bev);
+  if (::evbuffer_get_length(in) < conn->bench->size)
+    return;
+  ::evbuffer_drain(in, conn->bench->size);
+
+  if (++conn->nr_round_trips < conn->bench->nr_round_trips)
+    app_send(conn);
+  else if (++conn->bench->nr_done == conn->bench->nr_conns)
+    ::event_base_loopbreak(conn->bench->base);
+}
+
+void peer_read_cb(struct bufferevent* bev,
+                  void* arg) {
+  (void)arg;
+
+  ::bufferevent_write_buffer(bev, ::bufferevent_get_input(bev));
+}
+
+void event_cb(struct bufferevent* bev,
+              short what,
+              void* arg) {
+  (void)bev;
+  (void)what;
+
+  Conn* conn = reinterpret_cast<Conn*>(arg);
+  ::std::fprintf(stderr, "Connection closed\n");
+  conn->bench->failed = true;
+  ::event_base_loopbreak(conn->bench->base);
+}
+
+void usage(const char* argv0) {
+  ::std::fprintf(stderr, "Usage: %s [-v] [-p] [-n sessions] "
+                 "[-r round trips] [-s size]\n", argv0);
+  ::std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  bool use_virtual = false;
+  bool use_perf = false;
+  size_t nr_conns = 100;
+  size_t nr_round_trips = 10000;
+  size_t size = 64;
+
+  int opt;
+  while ((opt = ::getopt(argc, argv, "vpn:r:s:")) != -1) {
+    switch (opt) {
+    case 'v':
+      use_virtual = true;
+      break;
+    case 'p':
+      use_perf = true;
+      break;
+    case 'n':
+      nr_conns = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'r':
+      nr_round_trips = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 's':
+      size = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_conns == 0 || nr_round_trips == 0 || size == 0 ||
+      size > sizeof(message))
+    usage(argv[0]);
+
+  ::el::Configurations conf;
+  conf.setToDefault();
+  conf.setGlobally(::el::ConfigurationType::ToFile, "false");
+  conf.setGlobally(::el::ConfigurationType::Enabled, "false");
+  ::el::Loggers::setDefaultConfigurations(conf, true);
+  (void)::el::Loggers::getLogger(_LOGGER);
+
+  Bench bench;
+  bench.base = ::event_base_new();
+  bench.size = size;
+  bench.nr_round_trips = nr_round_trips;
+  bench.nr_established = 0;
+  bench.nr_done = 0;
+  bench.nr_conns = nr_conns;
+  bench.failed = false;
+  if (bench.base == nullptr ||
+      ::event_base_priority_init(bench.base, Socks5Server::kNrPriorities)) {
+    ::std::fprintf(stderr, "Failed to allocate the event_base\n");
+    return 1;
+  }
+
+  Factory<StaticSession> static_factory;
+  Factory<VirtualSession> virtual_factory;
+  Socks5Server::SessionFactory* factory = &static_factory;
+  if (use_virtual)
+    factory = &virtual_factory;
+  ::std::unique_ptr<Socks5Server> server(new Socks5Server("", factory,
+                                                          bench.base));
+
+  // Set up the sessions
+  struct sockaddr_in addr;
+  ::std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(9);
+
+  const int opts = BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS;
+  ::std::vector<Conn> conns(nr_conns);
+  for (auto& conn : conns) {
+    struct bufferevent* plaintext[2];
+    struct bufferevent* ciphertext[2];
+    if (::bufferevent_pair_new(bench.base, opts, plaintext) != 0 ||
+        ::bufferevent_pair_new(bench.base, opts, ciphertext) != 0) {
+      ::std::fprintf(stderr, "Failed to allocate bufferevents\n");
+      return 1;
+    }
+
+    conn.bench = &bench;
+    conn.app = plaintext[1];
+    conn.peer = ciphertext[1];
+    conn.nr_round_trips = 0;
+    ::bufferevent_setcb(conn.app, app_read_cb, nullptr, event_cb, &conn);
+    ::bufferevent_enable(conn.app, EV_READ | EV_WRITE);
+    ::bufferevent_setcb(conn.peer, peer_read_cb, nullptr, event_cb, &conn);
+    ::bufferevent_enable(conn.peer, EV_READ | EV_WRITE);
+
+    if (server->create_embedded_session(bench, plaintext[0], ciphertext[0],
+                                        reinterpret_cast<struct sockaddr*>(
+                                            &addr), sizeof(addr),
+                                        "") == nullptr) {
+      ::std::fprintf(stderr, "Failed to create the session\n");
+      return 1;
+    }
+  }
+  if (bench.nr_established < nr_conns)
+    ::event_base_dispatch(bench.base);
+  if (bench.failed)
+    return 1;
+
+  // Relay
+#ifdef __linux__
+  PerfCounter counters[] = {
+    { "Cycles", PERF_COUNT_HW_CPU_CYCLES },
+    { "Instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    { "Cache misses", PERF_COUNT_HW_CACHE_MISSES }
+  };
+#else
+  PerfCounter counters[] = { { "Counters", 0 } };
+#endif
+  if (use_perf) {
+    for (auto& counter : counters)
+      counter.open();
+  }
+  nr_callbacks = 0;
+  struct rusage usage_start, usage_end;
+  ::getrusage(RUSAGE_SELF, &usage_start);
+  const double start = now();
+  for (auto& counter : counters)
+    counter.start();
+  for (auto& conn : conns)
+    app_send(&conn);
+  ::event_base_dispatch(bench.base);
+  for (auto& counter : counters)
+    counter.stop();
+  const double elapsed = now() - start;
+  ::getrusage(RUSAGE_SELF, &usage_end);
+  if (bench.failed)
+    return 1;
+
+  const double cpu =
+      cpu_time(usage_end.ru_utime) - cpu_time(usage_start.ru_utime) +
+      cpu_time(usage_end.ru_stime) - cpu_time(usage_start.ru_stime);
+  ::std::printf("Dispatch: %s Sessions: %zu Round trips: %zu Size: %zu\n",
+                use_virtual ? "virtual" : "static", nr_conns, nr_round_trips,
+                size);
+  ::std::printf("Relay callbacks: %llu\n",
+                static_cast<unsigned long long>(nr_callbacks));
+  ::std::printf("Time: %.3f s (%.1f ns/callback)\n", elapsed,
+                elapsed * 1e9 / nr_callbacks);
+  ::std::printf("CPU: %.3f s (%.1f ns/callback)\n", cpu,
+                cpu * 1e9 / nr_callbacks);
+  if (use_perf) {
+    for (const auto& counter : counters)
+      counter.print(nr_callbacks);
+  }
+
+  server->close_sessions();
+
+  return 0;
+}
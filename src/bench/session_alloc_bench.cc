@@ -0,0 +1,190 @@
+/**
+ * @file    session_alloc_bench.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Session allocation cost of the SessionSlab vs the general heap
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: session_alloc_bench [-m slab|heap|new] [-n live] [-r ops] [-s size]
+ *        [-a arena]
+ *
+ * Models Session churn: a set of live objects is kept, and every operation
+ * releases a random one and allocates a replacement.  The objects either come
+ * from a SessionSlab, from the general heap with the same bookkeeping and
+ * wiping as the slab (SessionSlab::allocate_object() without a slab), or
+ * straight from operator new/delete.  The CPU time per operation is reported.
+ */
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/session_arena.h"
+
+using ::schwanenlied::SessionSlab;
+
+namespace {
+
+enum class Mode {
+  kSLAB,
+  kHEAP,
+  kNEW
+};
+
+double cpu_time(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void* allocate(const Mode mode,
+               SessionSlab& slab,
+               const size_t len,
+               const size_t arena_len) {
+  void* p = nullptr;
+  switch (mode) {
+  case Mode::kSLAB:
+    p = SessionSlab::allocate_object(&slab, len, arena_len);
+    break;
+  case Mode::kHEAP:
+    p = SessionSlab::allocate_object(nullptr, len, arena_len);
+    break;
+  case Mode::kNEW:
+    p = ::operator new(len + arena_len);
+    break;
+  }
+
+  // Touch the object like a constructor would
+  if (p != nullptr)
+    ::std::memset(p, 0, len);
+  return p;
+}
+
+void release(const Mode mode,
+             void* p) {
+  if (mode == Mode::kNEW)
+    ::operator delete(p);
+  else
+    SessionSlab::release_object(p);
+}
+
+void usage(const char* argv0) {
+  ::std::fprintf(stderr, "Usage: %s [-m slab|heap|new] [-n live] [-r ops] "
+                 "[-s size] [-a arena]\n", argv0);
+  ::std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Mode mode = Mode::kSLAB;
+  const char* mode_str = "slab";
+  size_t nr_live = 1000;
+  size_t nr_ops = 10000000;
+  size_t len = 1536;
+  size_t arena_len = 512;
+
+  int opt;
+  while ((opt = ::getopt(argc, argv, "m:n:r:s:a:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mode_str = optarg;
+      if (::std::strcmp(optarg, "slab") == 0)
+        mode = Mode::kSLAB;
+      else if (::std::strcmp(optarg, "heap") == 0)
+        mode = Mode::kHEAP;
+      else if (::std::strcmp(optarg, "new") == 0)
+        mode = Mode::kNEW;
+      else
+        usage(argv[0]);
+      break;
+    case 'n':
+      nr_live = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'r':
+      nr_ops = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 's':
+      len = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'a':
+      arena_len = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_live == 0 || nr_ops == 0 || len == 0)
+    usage(argv[0]);
+
+  SessionSlab slab;
+  ::std::vector<void*> live(nr_live);
+  for (auto& p : live) {
+    p = allocate(mode, slab, len, arena_len);
+    if (p == nullptr) {
+      ::std::fprintf(stderr, "Allocation failed\n");
+      return 1;
+    }
+  }
+
+  // Churn
+  ::std::mt19937 rand(0x5eed);
+  ::std::uniform_int_distribution<size_t> victim(0, nr_live - 1);
+  struct rusage usage_start, usage_end;
+  ::getrusage(RUSAGE_SELF, &usage_start);
+  for (size_t i = 0; i < nr_ops; i++) {
+    void*& p = live[victim(rand)];
+    release(mode, p);
+    p = allocate(mode, slab, len, arena_len);
+    if (p == nullptr) {
+      ::std::fprintf(stderr, "Allocation failed\n");
+      return 1;
+    }
+  }
+  ::getrusage(RUSAGE_SELF, &usage_end);
+  const double cpu =
+      cpu_time(usage_end.ru_utime) - cpu_time(usage_start.ru_utime) +
+      cpu_time(usage_end.ru_stime) - cpu_time(usage_start.ru_stime);
+
+  ::std::printf("Mode: %s Live: %zu Ops: %zu Size: %zu Arena: %zu\n",
+                mode_str, nr_live, nr_ops, len, arena_len);
+  ::std::printf("CPU: %.3f s (%.1f ns/op)\n", cpu, cpu * 1e9 / nr_ops);
+  if (mode == Mode::kSLAB)
+    ::std::printf("Slab: %s\n", slab.to_string().c_str());
+
+  for (auto p : live)
+    release(mode, p);
+
+  return 0;
+}
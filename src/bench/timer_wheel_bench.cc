@@ -0,0 +1,276 @@
+/**
+ * @file    timer_wheel_bench.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Timer churn of the TimerWheel vs libevent2
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: timer_wheel_bench [-m wheel|heap|alloc] [-n timers] [-r rounds]
+ *
+ * Models Session timer churn: each round rearms every timer with a random
+ * delay of up to 10 ms (the ScrambleSuit IAT range) before it expires, and
+ * the last round is left to expire.  The timers are either TimerWheel
+ * Timers, libevent2 timers that are kept around and rearmed (the event_base
+ * min-heap), or libevent2 timers that are allocated and freed for every
+ * arming (the old per-Session connect timer).  The CPU time per arming and
+ * how far off the final expiries were are reported.
+ */
+
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <event2/event.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/timer_wheel.h"
+
+using ::schwanenlied::TimerWheel;
+
+namespace {
+
+/** The longest delay in usec */
+constexpr uint32_t kMaxDelay = 10000;
+
+/** The TimerWheel granularity in usec (Same as Socks5Server) */
+constexpr uint32_t kTick = 1000;
+
+/** The number of TimerWheel buckets (Same as Socks5Server) */
+constexpr size_t kNrSlots = 16;
+
+enum class Mode {
+  kWHEEL,
+  kHEAP,
+  kALLOC
+};
+
+struct Bench;
+
+struct Entry {
+  Entry() :
+      bench(nullptr),
+      timer(on_wheel_timer, this),
+      ev(nullptr),
+      deadline(0) {}
+
+  static void on_wheel_timer(void* arg);
+
+  Bench* bench;
+  TimerWheel::Timer timer;
+  struct event* ev;
+  uint64_t deadline;
+};
+
+struct Bench {
+  struct event_base* base;
+  size_t nr_fired;
+  uint64_t total_error;
+  uint64_t max_error;
+  uint64_t nr_early;
+};
+
+uint64_t now() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+double cpu_time(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void on_fired(Entry* entry) {
+  Bench* bench = entry->bench;
+  const uint64_t t = now();
+
+  bench->nr_fired++;
+  if (t < entry->deadline) {
+    bench->nr_early++;
+    bench->total_error += entry->deadline - t;
+  } else {
+    bench->total_error += t - entry->deadline;
+    if (t - entry->deadline > bench->max_error)
+      bench->max_error = t - entry->deadline;
+  }
+}
+
+void Entry::on_wheel_timer(void* arg) {
+  on_fired(reinterpret_cast<Entry*>(arg));
+}
+
+void on_event_timer(evutil_socket_t sock,
+                    short which,
+                    void* arg) {
+  (void)sock;
+  (void)which;
+
+  on_fired(reinterpret_cast<Entry*>(arg));
+}
+
+bool arm(const Mode mode,
+         TimerWheel& wheel,
+         Entry& entry,
+         const uint32_t usec) {
+  entry.deadline = now() + usec;
+
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = usec;
+  switch (mode) {
+  case Mode::kWHEEL:
+    return wheel.add(entry.timer, usec);
+  case Mode::kALLOC:
+    if (entry.ev != nullptr)
+      ::event_free(entry.ev);
+    entry.ev = evtimer_new(entry.bench->base, on_event_timer, &entry);
+    if (entry.ev == nullptr)
+      return false;
+    // FALLTHROUGH
+  case Mode::kHEAP:
+    return evtimer_add(entry.ev, &tv) == 0;
+  }
+
+  return false;
+}
+
+void usage(const char* argv0) {
+  ::std::fprintf(stderr,
+                 "Usage: %s [-m wheel|heap|alloc] [-n timers] [-r rounds]\n",
+                 argv0);
+  ::std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Mode mode = Mode::kWHEEL;
+  const char* mode_str = "wheel";
+  size_t nr_timers = 10000;
+  size_t nr_rounds = 100;
+
+  int opt;
+  while ((opt = ::getopt(argc, argv, "m:n:r:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mode_str = optarg;
+      if (::std::strcmp(optarg, "wheel") == 0)
+        mode = Mode::kWHEEL;
+      else if (::std::strcmp(optarg, "heap") == 0)
+        mode = Mode::kHEAP;
+      else if (::std::strcmp(optarg, "alloc") == 0)
+        mode = Mode::kALLOC;
+      else
+        usage(argv[0]);
+      break;
+    case 'n':
+      nr_timers = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'r':
+      nr_rounds = ::std::strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_timers == 0 || nr_rounds == 0)
+    usage(argv[0]);
+
+  Bench bench = { ::event_base_new(), 0, 0, 0, 0 };
+  if (bench.base == nullptr) {
+    ::std::fprintf(stderr, "Failed to allocate the event_base\n");
+    return 1;
+  }
+
+  ::std::unique_ptr<TimerWheel> wheel(new TimerWheel(bench.base, kTick,
+                                                     kNrSlots, 0));
+  ::std::vector<Entry> entries(nr_timers);
+  for (auto& entry : entries) {
+    entry.bench = &bench;
+    if (mode == Mode::kHEAP) {
+      entry.ev = evtimer_new(bench.base, on_event_timer, &entry);
+      if (entry.ev == nullptr) {
+        ::std::fprintf(stderr, "Failed to allocate a timer\n");
+        return 1;
+      }
+    }
+  }
+
+  // Churn
+  ::std::mt19937 rand(0x5eed);
+  ::std::uniform_int_distribution<uint32_t> delay(0, kMaxDelay);
+  struct rusage usage_start, usage_end;
+  ::getrusage(RUSAGE_SELF, &usage_start);
+  for (size_t i = 0; i < nr_rounds; i++) {
+    for (auto& entry : entries) {
+      if (!arm(mode, *wheel, entry, delay(rand))) {
+        ::std::fprintf(stderr, "Failed to arm a timer\n");
+        return 1;
+      }
+    }
+  }
+  ::getrusage(RUSAGE_SELF, &usage_end);
+  const double churn_cpu =
+      cpu_time(usage_end.ru_utime) - cpu_time(usage_start.ru_utime) +
+      cpu_time(usage_end.ru_stime) - cpu_time(usage_start.ru_stime);
+
+  // Expire the last round
+  ::event_base_dispatch(bench.base);
+
+  const size_t nr_armed = nr_timers * nr_rounds;
+  ::std::printf("Mode: %s Timers: %zu Rounds: %zu\n", mode_str, nr_timers,
+                nr_rounds);
+  ::std::printf("Churn: %.3f s CPU (%.1f ns/arm)\n", churn_cpu,
+                churn_cpu * 1e9 / nr_armed);
+  ::std::printf("Expired: %zu Early: %llu Mean error: %.1f usec "
+                "Max late: %llu usec\n", bench.nr_fired,
+                static_cast<unsigned long long>(bench.nr_early),
+                bench.nr_fired > 0 ?
+                    static_cast<double>(bench.total_error) / bench.nr_fired :
+                    0.0,
+                static_cast<unsigned long long>(bench.max_error));
+
+  // Tear down
+  for (auto& entry : entries) {
+    if (entry.ev != nullptr)
+      ::event_free(entry.ev);
+  }
+  entries.clear();
+  wheel.reset();
+  ::event_base_free(bench.base);
+
+  return bench.nr_fired == nr_timers ? 0 : 1;
+}
@@ -33,7 +33,10 @@
 
 #define _LOGGER "main"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <memory>
 
@@ -48,6 +51,9 @@
 
 #include "ext/optionparser.h"
 #include "schwanenlied/common.h"
+#include "schwanenlied/buffer_budget.h"
+#include "schwanenlied/net/io_uring.h"
+#include "schwanenlied/shaper.h"
 #include "schwanenlied/socks5_server.h"
 #include "schwanenlied/pt/obfs2/client.h"
 #include "schwanenlied/pt/obfs3/client.h"
@@ -92,6 +98,68 @@ LogLevel get_loglevel(const ::std::string& level) {
   return ::option::ARG_ILLEGAL;
 }
 
+/** Validator for buffer mode */
+::option::ArgStatus BufferModeValidator(const ::option::Option& option,
+                                        bool msg) {
+  if (option.arg != nullptr) {
+    const ::std::string mode(option.arg);
+    if (mode.compare("fixed") == 0 || mode.compare("adaptive") == 0)
+      return ::option::ARG_OK;
+  }
+
+  if (msg)
+    ::std::cerr << "Error: " << option.name
+                << " must be one of fixed, adaptive." << ::std::endl;
+
+  return ::option::ARG_ILLEGAL;
+}
+
+/** Validator for warm pool refill policy */
+::option::ArgStatus WarmPoolRefillValidator(const ::option::Option& option,
+                                            bool msg) {
+  if (option.arg != nullptr) {
+    const ::std::string policy(option.arg);
+    if (policy.compare("on-use") == 0 || policy.compare("eager") == 0)
+      return ::option::ARG_OK;
+  }
+
+  if (msg)
+    ::std::cerr << "Error: " << option.name
+                << " must be one of on-use, eager." << ::std::endl;
+
+  return ::option::ARG_ILLEGAL;
+}
+
+/** Parse a non-negative integer argument */
+bool parse_size(const char* arg,
+                size_t& value) {
+  if (arg == nullptr || arg[0] < '0' || arg[0] > '9')
+    return false;
+
+  char* end = nullptr;
+  const unsigned long long tmp = ::std::strtoull(arg, &end, 10);
+  if (end == nullptr || *end != '\0')
+    return false;
+  if (tmp > ::std::numeric_limits<size_t>::max())
+    return false;
+
+  value = static_cast<size_t>(tmp);
+  return true;
+}
+
+/** Validator for integer arguments */
+::option::ArgStatus SizeValidator(const ::option::Option& option, bool msg) {
+  size_t value;
+  if (parse_size(option.arg, value))
+    return ::option::ARG_OK;
+
+  if (msg)
+    ::std::cerr << "Error: " << option.name
+                << " must be a non-negative integer." << ::std::endl;
+
+  return ::option::ARG_ILLEGAL;
+}
+
 enum kOptionIndex {
   kUNKNOWN,
   kHELP,
@@ -99,7 +167,33 @@ enum kOptionIndex {
   kLOG_MIN_SEVERITY,
   kNO_LOG,
   kNO_SAFE_LOGGING,
-  kWAIT_FOR_DEBUGGER
+  kWAIT_FOR_DEBUGGER,
+  kBUFFER_MODE,
+  kBUFFER_MIN,
+  kBUFFER_MAX,
+  kBUFFER_BUDGET,
+  kBUFFER_MIN_SHARE,
+  kOPTIMISTIC_SOCKS,
+  kHANDSHAKE_LIMIT,
+  kHANDSHAKE_QUEUE_LIMIT,
+  kLISTEN_BACKLOG,
+  kNO_DEFER_ACCEPT,
+  kTCP_CORK,
+  kTCP_FASTOPEN,
+  kTCP_KEEPALIVE,
+  kTCP_USER_TIMEOUT,
+  kIDLE_TIMEOUT,
+  kIDLE_REAP,
+  kWARM_POOL,
+  kWARM_POOL_IDLE,
+  kWARM_POOL_REFILL,
+  kHANDSHAKE_RACE,
+  kRATE_LIMIT,
+  kRATE_BURST,
+  kBRIDGE_RATE_LIMIT,
+  kBRIDGE_RATE_BURST,
+  kRELAY_QUANTUM,
+  kIO_URING
 };
 
 const ::option::Descriptor kUsage[] = {
@@ -118,15 +212,89 @@ const ::option::Descriptor kUsage[] = {
     "  --no-safe-logging   Disable safe (scrubbed address) logging." },
   { kWAIT_FOR_DEBUGGER, 0, "", "wait-for-debugger", ::option::Arg::None,
     "  --wait-for-debugger Sleep after parsing command line args." },
+  { kBUFFER_MODE, 0, "", "buffer-mode", BufferModeValidator,
+    "  --buffer-mode {fixed,adaptive}\n"
+    "                      Set the backpressure threshold mode (default: adaptive)." },
+  { kBUFFER_MIN, 0, "", "buffer-min", SizeValidator,
+    "  --buffer-min BYTES  Set the minimum adaptive backpressure threshold." },
+  { kBUFFER_MAX, 0, "", "buffer-max", SizeValidator,
+    "  --buffer-max BYTES  Set the maximum adaptive backpressure threshold." },
+  { kBUFFER_BUDGET, 0, "", "buffer-budget", SizeValidator,
+    "  --buffer-budget BYTES\n"
+    "                      Set the total buffer budget (default: 0, unlimited)." },
+  { kBUFFER_MIN_SHARE, 0, "", "buffer-min-share", SizeValidator,
+    "  --buffer-min-share BYTES\n"
+    "                      Set the minimum per-session buffer budget share." },
+  { kOPTIMISTIC_SOCKS, 0, "", "optimistic-socks", ::option::Arg::None,
+    "  --optimistic-socks  Send the SOCKS response before the handshake completes." },
+  { kHANDSHAKE_LIMIT, 0, "", "handshake-limit", SizeValidator,
+    "  --handshake-limit N Set the maximum concurrent handshakes (default: 0, unlimited)." },
+  { kHANDSHAKE_QUEUE_LIMIT, 0, "", "handshake-queue-limit", SizeValidator,
+    "  --handshake-queue-limit N\n"
+    "                      Reject sessions when N are awaiting a handshake slot." },
+  { kLISTEN_BACKLOG, 0, "", "listen-backlog", SizeValidator,
+    "  --listen-backlog N  Set the SOCKS listener backlog." },
+  { kNO_DEFER_ACCEPT, 0, "", "no-defer-accept", ::option::Arg::None,
+    "  --no-defer-accept   Accept clients before they send data." },
+  { kTCP_CORK, 0, "", "tcp-cork", ::option::Arg::None,
+    "  --tcp-cork          Cork bridge connections during the handshake." },
+  { kTCP_FASTOPEN, 0, "", "tcp-fastopen", ::option::Arg::None,
+    "  --tcp-fastopen      Use TCP Fast Open for bridge connections." },
+  { kTCP_KEEPALIVE, 0, "", "tcp-keepalive", SizeValidator,
+    "  --tcp-keepalive SECS\n"
+    "                      Probe bridge connections idle for SECS (default: 0, off)." },
+  { kTCP_USER_TIMEOUT, 0, "", "tcp-user-timeout", SizeValidator,
+    "  --tcp-user-timeout MSEC\n"
+    "                      Drop bridge connections with data unacked for MSEC (default: 0, off)." },
+  { kIDLE_TIMEOUT, 0, "", "idle-timeout", SizeValidator,
+    "  --idle-timeout SECS Release the buffers of sessions idle for SECS (default: 0, off)." },
+  { kIDLE_REAP, 0, "", "idle-reap", SizeValidator,
+    "  --idle-reap SECS    Close sessions idle for SECS (default: 0, off)." },
+  { kWARM_POOL, 0, "", "warm-pool", SizeValidator,
+    "  --warm-pool N       Keep N handshaked connections to each used bridge (default: 0)." },
+  { kWARM_POOL_IDLE, 0, "", "warm-pool-idle", SizeValidator,
+    "  --warm-pool-idle SECS\n"
+    "                      Close unused warm connections after SECS (default: 60)." },
+  { kWARM_POOL_REFILL, 0, "", "warm-pool-refill", WarmPoolRefillValidator,
+    "  --warm-pool-refill {on-use,eager}\n"
+    "                      Also replace expired warm connections? (default: on-use)." },
+  { kHANDSHAKE_RACE, 0, "", "handshake-race", SizeValidator,
+    "  --handshake-race MSEC\n"
+    "                      Race a full handshake against slow resumptions (default: 0, off)." },
+  { kRATE_LIMIT, 0, "", "rate-limit", SizeValidator,
+    "  --rate-limit BYTES  Limit all relayed traffic to BYTES/sec per direction (default: 0, unlimited)." },
+  { kRATE_BURST, 0, "", "rate-burst", SizeValidator,
+    "  --rate-burst BYTES  Set the global rate limit burst size (default: the rate)." },
+  { kBRIDGE_RATE_LIMIT, 0, "", "bridge-rate-limit", SizeValidator,
+    "  --bridge-rate-limit BYTES\n"
+    "                      Limit each bridge to BYTES/sec per direction (default: 0, unlimited)." },
+  { kBRIDGE_RATE_BURST, 0, "", "bridge-rate-burst", SizeValidator,
+    "  --bridge-rate-burst BYTES\n"
+    "                      Set the per-bridge rate limit burst size (default: the rate)." },
+  { kRELAY_QUANTUM, 0, "", "relay-quantum", SizeValidator,
+    "  --relay-quantum BYTES\n"
+    "                      Relay at most BYTES per session per loop iteration (default: 0, unlimited, minimum: 2048)." },
+#ifdef ENABLE_IO_URING
+  { kIO_URING, 0, "", "io-uring", ::option::Arg::None,
+    "  --io-uring          Relay established sessions with io_uring." },
+#endif
   { 0, 0, nullptr, nullptr, 0, nullptr }
 };
 
+using BufferBudget = schwanenlied::BufferBudget;
+#ifdef ENABLE_IO_URING
+using IoUring = schwanenlied::net::IoUring;
+#endif
+using Shaper = schwanenlied::Shaper;
 using Socks5Server = schwanenlied::Socks5Server;
+using Socks5Config = schwanenlied::Socks5Server::Config;
 using Socks5Factory = schwanenlied::Socks5Server::SessionFactory;
 using Obfs2Factory = schwanenlied::pt::obfs2::Client::SessionFactory;
 using Obfs3Factory = schwanenlied::pt::obfs3::Client::SessionFactory;
 using ScrambleSuitFactory = schwanenlied::pt::scramblesuit::Client::SessionFactory;
 
+constexpr size_t kDefaultBudgetMinShare = 16384;
+
 constexpr char kLogFileName[] = "obfsclient.log";
 
 constexpr char kObfs2MethodName[] = "obfs2";
@@ -184,10 +352,17 @@ void init_logging(const ::std::string& path,
 }
 
 bool init_libevent() {
-  if (ev_base == nullptr)
+  if (ev_base == nullptr) {
     ev_base = ::event_base_new();
+    if (ev_base == nullptr)
+      return false;
 
-  return ev_base != nullptr;
+    // Relay traffic should preempt handshakes, which should preempt timers
+    if (0 != ::event_base_priority_init(ev_base, Socks5Server::kNrPriorities))
+      LOG(WARNING) << "Failed to initialize event priorities";
+  }
+
+  return true;
 }
 
 template<class Factory>
@@ -196,6 +371,7 @@ bool init_pt(const allium_ptcfg* cfg,
              const char* name,
              ::std::list< ::std::unique_ptr<Socks5Factory>>& factories,
              ::std::list< ::std::unique_ptr<Socks5Server>>& listeners,
+             const Socks5Config& config,
              const bool scrub_addrs = true) {
   if (::allium_ptcfg_method_requested(cfg, name) != 1)
     return false;
@@ -208,7 +384,7 @@ bool init_pt(const allium_ptcfg* cfg,
 
   Factory* factory = new Factory;
   Socks5Server* listener = new Socks5Server(state_dir, factory, ev_base,
-                                            scrub_addrs);
+                                            scrub_addrs, config);
   if (!listener->bind()) {
     LOG(ERROR) << "Failed to bind() a SOCKSv5 listener";
     ::allium_ptcfg_method_error(cfg, name, "Socks5::bind()");
@@ -269,9 +445,122 @@ int main(int argc, char* argv[]) {
       LogLevel::kINFO;
   const bool scrub_ips = !options[kNO_SAFE_LOGGING];
   volatile bool wait_for_debugger = options[kWAIT_FOR_DEBUGGER];
+  Socks5Config config;
+  if (options[kBUFFER_MODE] &&
+      ::std::string(options[kBUFFER_MODE].arg).compare("fixed") == 0)
+    config.buffer_mode = Socks5Server::BufferMode::kFIXED;
+  if (options[kBUFFER_MIN])
+    parse_size(options[kBUFFER_MIN].arg, config.buffer_min);
+  if (options[kBUFFER_MAX])
+    parse_size(options[kBUFFER_MAX].arg, config.buffer_max);
+  config.optimistic_socks = options[kOPTIMISTIC_SOCKS];
+  if (options[kHANDSHAKE_LIMIT])
+    parse_size(options[kHANDSHAKE_LIMIT].arg, config.handshake_limit);
+  if (options[kHANDSHAKE_QUEUE_LIMIT])
+    parse_size(options[kHANDSHAKE_QUEUE_LIMIT].arg,
+               config.handshake_queue_limit);
+  if (options[kLISTEN_BACKLOG]) {
+    // 0 would tell libevent that the socket is already listening
+    size_t backlog = 0;
+    parse_size(options[kLISTEN_BACKLOG].arg, backlog);
+    config.listen_backlog = static_cast<int>(::std::min<size_t>(backlog,
+        ::std::numeric_limits<int>::max()));
+  }
+  config.defer_accept = !options[kNO_DEFER_ACCEPT];
+  config.tcp_cork = options[kTCP_CORK];
+  config.tcp_fastopen = options[kTCP_FASTOPEN];
+  if (options[kTCP_KEEPALIVE]) {
+    size_t keepalive = 0;
+    parse_size(options[kTCP_KEEPALIVE].arg, keepalive);
+    config.tcp_keepalive = static_cast<int>(::std::min<size_t>(keepalive,
+        ::std::numeric_limits<int>::max()));
+  }
+  if (options[kTCP_USER_TIMEOUT]) {
+    size_t user_timeout = 0;
+    parse_size(options[kTCP_USER_TIMEOUT].arg, user_timeout);
+    config.tcp_user_timeout = static_cast<unsigned int>(
+        ::std::min<size_t>(user_timeout,
+                           ::std::numeric_limits<unsigned int>::max()));
+  }
+  if (options[kIDLE_TIMEOUT]) {
+    size_t idle = 0;
+    parse_size(options[kIDLE_TIMEOUT].arg, idle);
+    config.idle_timeout = static_cast<int>(::std::min<size_t>(idle,
+        ::std::numeric_limits<int>::max()));
+  }
+  if (options[kIDLE_REAP]) {
+    size_t idle = 0;
+    parse_size(options[kIDLE_REAP].arg, idle);
+    config.idle_reap = static_cast<int>(::std::min<size_t>(idle,
+        ::std::numeric_limits<int>::max()));
+  }
+  if (options[kWARM_POOL])
+    parse_size(options[kWARM_POOL].arg, config.warm_pool_size);
+  if (options[kWARM_POOL_IDLE]) {
+    size_t idle = 0;
+    parse_size(options[kWARM_POOL_IDLE].arg, idle);
+    config.warm_pool_idle = static_cast<int>(::std::min<size_t>(idle,
+        ::std::numeric_limits<int>::max()));
+  }
+  if (options[kWARM_POOL_REFILL] &&
+      ::std::string(options[kWARM_POOL_REFILL].arg).compare("eager") == 0)
+    config.warm_pool_refill = Socks5Server::WarmPoolRefill::kEAGER;
+  if (options[kHANDSHAKE_RACE]) {
+    size_t delay = 0;
+    parse_size(options[kHANDSHAKE_RACE].arg, delay);
+    config.handshake_race_delay = static_cast<int>(::std::min<size_t>(delay,
+        ::std::numeric_limits<int>::max()));
+  }
+  Shaper::Rate global_rate;
+  Shaper::Rate bridge_rate;
+  size_t relay_quantum = 0;
+  if (options[kRATE_LIMIT])
+    parse_size(options[kRATE_LIMIT].arg, global_rate.rate);
+  if (options[kRATE_BURST])
+    parse_size(options[kRATE_BURST].arg, global_rate.burst);
+  if (options[kBRIDGE_RATE_LIMIT])
+    parse_size(options[kBRIDGE_RATE_LIMIT].arg, bridge_rate.rate);
+  if (options[kBRIDGE_RATE_BURST])
+    parse_size(options[kBRIDGE_RATE_BURST].arg, bridge_rate.burst);
+  if (options[kRELAY_QUANTUM])
+    parse_size(options[kRELAY_QUANTUM].arg, relay_quantum);
+#ifdef ENABLE_IO_URING
+  const bool use_io_uring = options[kIO_URING];
+#endif
+  size_t budget_limit = 0;
+  size_t budget_min_share = kDefaultBudgetMinShare;
+  if (options[kBUFFER_BUDGET])
+    parse_size(options[kBUFFER_BUDGET].arg, budget_limit);
+  if (options[kBUFFER_MIN_SHARE])
+    parse_size(options[kBUFFER_MIN_SHARE].arg, budget_min_share);
   delete[] options;
   delete[] buffer;
 
+  if (config.buffer_min == 0 || config.buffer_min > config.buffer_max) {
+    ::std::cerr << "Error: buffer-min must be > 0 and <= buffer-max."
+                << ::std::endl;
+    return 1;
+  }
+  if (config.listen_backlog == 0) {
+    ::std::cerr << "Error: listen-backlog must be > 0." << ::std::endl;
+    return 1;
+  }
+  if (config.warm_pool_idle == 0) {
+    ::std::cerr << "Error: warm-pool-idle must be > 0." << ::std::endl;
+    return 1;
+  }
+  if (budget_min_share == 0) {
+    ::std::cerr << "Error: buffer-min-share must be > 0." << ::std::endl;
+    return 1;
+  }
+
+  // The budget must outlive all of the sessions
+  ::std::unique_ptr<BufferBudget> budget;
+  if (budget_limit > 0) {
+    budget.reset(new BufferBudget(budget_limit, budget_min_share));
+    config.budget = budget.get();
+  }
+
   while (wait_for_debugger)
     sleep(0);
 
@@ -300,17 +589,49 @@ int main(int argc, char* argv[]) {
   LOG(INFO) << "obfsclient " << PACKAGE_VERSION
             << " - Initialized (PID: " << ::getpid() << ")";
 
+#ifdef ENABLE_IO_URING
+  // The io_uring must outlive all of the sessions
+  ::std::unique_ptr<IoUring> io_uring;
+  if (use_io_uring && init_libevent()) {
+    io_uring.reset(new IoUring(ev_base, Socks5Server::Priority::kRELAY));
+    if (io_uring->init()) {
+      config.io_uring = io_uring.get();
+    } else {
+      LOG(WARNING) << "io_uring unavailable, falling back to libevent2";
+      io_uring.reset();
+    }
+  }
+#endif
+
+  /*
+   * The shaper must outlive all of the sessions.  It is always created, even
+   * if nothing is limited, so that rate limits in bridge lines are honored.
+   */
+  ::std::unique_ptr<Shaper> shaper;
+  if (init_libevent()) {
+    shaper.reset(new Shaper(ev_base, global_rate, bridge_rate, relay_quantum,
+                            Socks5Server::Priority::kRELAY));
+    if (shaper->init()) {
+      config.shaper = shaper.get();
+    } else {
+      LOG(ERROR) << "Failed to initialize the rate limits";
+      shaper.reset();
+    }
+  }
+
   // Attempt to initialize the supported PTs
   ::std::list< ::std::unique_ptr<Socks5Factory>> factories;
   ::std::list< ::std::unique_ptr<Socks5Server>> listeners;
   bool dispatch_loop = false;
   dispatch_loop |= init_pt<Obfs3Factory>(cfg, state_dir, kObfs3MethodName,
-                                         factories, listeners, scrub_ips);
+                                         factories, listeners, config,
+                                         scrub_ips);
   dispatch_loop |= init_pt<Obfs2Factory>(cfg, state_dir, kObfs2MethodName,
-                                         factories, listeners, scrub_ips);
+                                         factories, listeners, config,
+                                         scrub_ips);
   dispatch_loop |= init_pt<ScrambleSuitFactory>(cfg, state_dir,
                                                 kScrambleSuitMethodName,
-                                                factories, listeners,
+                                                factories, listeners, config,
                                                 scrub_ips);
 
   // Done with the config!
@@ -352,6 +673,34 @@ int main(int argc, char* argv[]) {
     struct event* ev_sigint = evsignal_new(ev_base, SIGINT, cb, &listeners);
     evsignal_add(ev_sigint, nullptr);
 
+    // Install a SIGUSR1 handler that dumps statistics
+    event_callback_fn stats_cb = [](evutil_socket_t sock,
+                                    short which,
+                                    void* arg) {
+      (void)sock;
+      (void)which;
+
+      ::std::list< ::std::unique_ptr<Socks5Server>>* servers =
+          reinterpret_cast< ::std::list< ::std::unique_ptr<Socks5Server>>*>(arg);
+      for (auto iter = servers->begin(); iter != servers->end(); ++iter) {
+        (*iter)->log_stats();
+        const BufferBudget* budget = (*iter)->config().budget;
+        if (budget != nullptr && iter == servers->begin())
+          LOG(INFO) << "Buffer budget: " << budget->to_string();
+        const Shaper* shaper = (*iter)->config().shaper;
+        if (shaper != nullptr && iter == servers->begin())
+          LOG(INFO) << "Shaper: " << shaper->to_string();
+#ifdef ENABLE_IO_URING
+        const IoUring* io_uring = (*iter)->config().io_uring;
+        if (io_uring != nullptr && iter == servers->begin())
+          LOG(INFO) << "io_uring: " << io_uring->to_string();
+#endif
+      }
+    };
+    struct event* ev_sigusr1 = evsignal_new(ev_base, SIGUSR1, stats_cb,
+                                            &listeners);
+    evsignal_add(ev_sigusr1, nullptr);
+
     // Mask off SIGPIPE
     ::signal(SIGPIPE, SIG_IGN);
 
@@ -0,0 +1,395 @@
+/**
+ * @file    obfsclient.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   libobfsclient embedding API
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _LOGGER "obfsclient"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "obfsclient.h"
+#include "schwanenlied/common.h"
+#include "schwanenlied/socks5_server.h"
+#include "schwanenlied/pt/obfs2/client.h"
+#include "schwanenlied/pt/obfs3/client.h"
+#include "schwanenlied/pt/scramblesuit/client.h"
+
+using Socks5Server = schwanenlied::Socks5Server;
+using Socks5Factory = schwanenlied::Socks5Server::SessionFactory;
+using Obfs2Factory = schwanenlied::pt::obfs2::Client::SessionFactory;
+using Obfs3Factory = schwanenlied::pt::obfs3::Client::SessionFactory;
+using ScrambleSuitFactory = schwanenlied::pt::scramblesuit::Client::SessionFactory;
+
+static_assert(OBFSCLIENT_NR_PRIORITIES == Socks5Server::kNrPriorities,
+              "OBFSCLIENT_NR_PRIORITIES out of sync with Socks5Server");
+
+namespace {
+
+/**
+ * A transport's SessionFactory and Socks5Server
+ *
+ * The Socks5Server is never bound, it just owns the embedded Sessions.
+ */
+struct Transport {
+  ::std::unique_ptr<Socks5Factory> factory;
+  ::std::unique_ptr<Socks5Server> server;
+};
+
+Socks5Factory* new_factory(const ::std::string& transport) {
+  if (transport.compare("obfs2") == 0)
+    return new Obfs2Factory;
+  else if (transport.compare("obfs3") == 0)
+    return new Obfs3Factory;
+  else if (transport.compare("scramblesuit") == 0)
+    return new ScrambleSuitFactory;
+  return nullptr;
+}
+
+} // namespace
+
+struct obfsclient_ctx {
+  struct event_base* base;
+  bool owns_base;
+  ::std::string state_dir;
+  ::std::map< ::std::string, ::std::unique_ptr<Transport>> transports;
+  ::std::list<obfsclient_session*> sessions;  /**< The live handles */
+};
+
+/**
+ * An embedded Session handle
+ *
+ * The Session reads/writes one end each of two bufferevent_pairs, and the
+ * application reads/writes the other ends.  Events are collected and
+ * delivered from notify_ev, so the application callback is never invoked
+ * from inside the Session.
+ */
+struct obfsclient_session : public Socks5Server::SessionObserver {
+  obfsclient_session(obfsclient_event_cb callback, void* arg) :
+      ctx(nullptr),
+      ctx_iter(),
+      server(nullptr),
+      session(nullptr),
+      closed(false),
+      plaintext(nullptr),
+      ciphertext(nullptr),
+      notify_ev(nullptr),
+      events(0),
+      cb(callback),
+      cb_arg(arg) {}
+
+  ~obfsclient_session() {
+    detach();
+  }
+
+  /**
+   * Tear down the Session and release everything tied to the event_base
+   *
+   * The handle itself stays valid (all I/O fails) till it is freed.
+   */
+  void detach() {
+    if (ctx != nullptr) {
+      ctx->sessions.erase(ctx_iter);
+      ctx = nullptr;
+    }
+    if (session != nullptr)
+      server->close_session(session);
+    server = nullptr;
+    if (plaintext != nullptr) {
+      ::bufferevent_free(plaintext);
+      plaintext = nullptr;
+    }
+    if (ciphertext != nullptr) {
+      ::bufferevent_free(ciphertext);
+      ciphertext = nullptr;
+    }
+    if (notify_ev != nullptr) {
+      ::event_free(notify_ev);
+      notify_ev = nullptr;
+    }
+  }
+
+  void on_session_established(Socks5Server::Session* s) override {
+    (void)s;
+
+    notify(OBFSCLIENT_EVENT_ESTABLISHED);
+  }
+
+  void on_session_failed(Socks5Server::Session* s) override {
+    (void)s;
+
+    notify(OBFSCLIENT_EVENT_FAILED);
+  }
+
+  void on_session_closed(Socks5Server::Session* s) override {
+    (void)s;
+
+    session = nullptr;
+    closed = true;
+    notify(OBFSCLIENT_EVENT_CLOSED);
+  }
+
+  void notify(const int ev) {
+    events |= ev;
+    if (cb != nullptr && notify_ev != nullptr)
+      ::event_active(notify_ev, EV_TIMEOUT, 0);
+  }
+
+  obfsclient_ctx* ctx;              /**< The context (nullptr if detached) */
+  ::std::list<obfsclient_session*>::iterator ctx_iter;  /**< ctx->sessions */
+  Socks5Server* server;             /**< The Socks5Server owning session */
+  Socks5Server::Session* session;   /**< The Session (nullptr if closed) */
+  bool closed;                      /**< The Session has been destroyed? */
+  struct bufferevent* plaintext;    /**< The application side of the Session */
+  struct bufferevent* ciphertext;   /**< The bridge side of the Session */
+  struct event* notify_ev;          /**< The callback delivery event */
+  int events;                       /**< The pending OBFSCLIENT_EVENT_* */
+  obfsclient_event_cb cb;           /**< The application callback */
+  void* cb_arg;                     /**< The application callback argument */
+};
+
+void obfsclient_set_logging(int enabled) {
+  ::el::Configurations conf;
+  conf.setToDefault();
+  conf.setGlobally(::el::ConfigurationType::ToFile, "false");
+  conf.setGlobally(::el::ConfigurationType::ToStandardOutput,
+                   enabled ? "true" : "false");
+  conf.setGlobally(::el::ConfigurationType::Enabled,
+                   enabled ? "true" : "false");
+  ::el::Loggers::setDefaultConfigurations(conf, true);
+}
+
+obfsclient_ctx* obfsclient_ctx_new(struct event_base* base,
+                                   const char* state_dir) {
+  if (state_dir == nullptr)
+    return nullptr;
+
+  obfsclient_ctx* ctx = new obfsclient_ctx;
+  ctx->owns_base = (base == nullptr);
+  if (ctx->owns_base) {
+    base = ::event_base_new();
+    if (base == nullptr ||
+        0 != ::event_base_priority_init(base, Socks5Server::kNrPriorities)) {
+      if (base != nullptr)
+        ::event_base_free(base);
+      delete ctx;
+      return nullptr;
+    }
+  }
+  ctx->base = base;
+
+  // Ticket files are appended to the state directory as is
+  ctx->state_dir.assign(state_dir);
+  if (!ctx->state_dir.empty() && ctx->state_dir.back() != '/')
+    ctx->state_dir += '/';
+
+  return ctx;
+}
+
+void obfsclient_ctx_free(obfsclient_ctx* ctx) {
+  if (ctx == nullptr)
+    return;
+
+  // Outstanding handles are closed, and freed by obfsclient_session_free()
+  while (!ctx->sessions.empty())
+    ctx->sessions.front()->detach();
+  ctx->transports.clear();
+  if (ctx->owns_base)
+    ::event_base_free(ctx->base);
+  delete ctx;
+}
+
+struct event_base* obfsclient_ctx_get_base(obfsclient_ctx* ctx) {
+  return (ctx != nullptr) ? ctx->base : nullptr;
+}
+
+int obfsclient_ctx_run(obfsclient_ctx* ctx) {
+  if (ctx == nullptr)
+    return -1;
+
+  return (::event_base_loop(ctx->base, EVLOOP_NONBLOCK) < 0) ? -1 : 0;
+}
+
+obfsclient_session* obfsclient_session_new(obfsclient_ctx* ctx,
+                                           const char* transport,
+                                           const struct sockaddr* bridge,
+                                           socklen_t bridge_len,
+                                           const char* args,
+                                           obfsclient_event_cb cb,
+                                           void* arg) {
+  if (ctx == nullptr || transport == nullptr || bridge == nullptr)
+    return nullptr;
+
+  // Lazily set up the transport
+  ::std::unique_ptr<Transport>& t = ctx->transports[transport];
+  if (t == nullptr) {
+    Socks5Factory* factory = new_factory(transport);
+    if (factory == nullptr) {
+      LOG(WARNING) << "Unsupported transport: " << transport;
+      ctx->transports.erase(transport);
+      return nullptr;
+    }
+    t = ::std::unique_ptr<Transport>(new Transport);
+    t->factory = ::std::unique_ptr<Socks5Factory>(factory);
+    t->server = ::std::unique_ptr<Socks5Server>(
+        new Socks5Server(ctx->state_dir, factory, ctx->base));
+  }
+
+  obfsclient_session* s = new obfsclient_session(cb, arg);
+  s->ctx = ctx;
+  s->ctx_iter = ctx->sessions.insert(ctx->sessions.end(), s);
+  s->server = t->server.get();
+
+  event_callback_fn notifycb = [](evutil_socket_t sock,
+                                  short which,
+                                  void* ptr) {
+    (void)sock;
+    (void)which;
+
+    obfsclient_session* session = reinterpret_cast<obfsclient_session*>(ptr);
+    const int ev = session->events;
+    session->events = 0;
+    if (ev != 0 && session->cb != nullptr)
+      session->cb(session, ev, session->cb_arg);
+  };
+  s->notify_ev = ::event_new(ctx->base, -1, 0, notifycb, s);
+  if (s->notify_ev == nullptr) {
+    delete s;
+    return nullptr;
+  }
+
+  // [0] is the Session's end, [1] is the application's end
+  struct bufferevent* plaintext[2] = { nullptr, nullptr };
+  struct bufferevent* ciphertext[2] = { nullptr, nullptr };
+  const int opts = BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS;
+  if (0 != ::bufferevent_pair_new(ctx->base, opts, plaintext)) {
+    delete s;
+    return nullptr;
+  }
+  s->plaintext = plaintext[1];
+  if (0 != ::bufferevent_pair_new(ctx->base, opts, ciphertext)) {
+    ::bufferevent_free(plaintext[0]);
+    delete s;
+    return nullptr;
+  }
+  s->ciphertext = ciphertext[1];
+
+  bufferevent_data_cb plaintextcb = [](struct bufferevent* bev,
+                                       void* ptr) {
+    (void)bev;
+
+    reinterpret_cast<obfsclient_session*>(ptr)->notify(OBFSCLIENT_EVENT_PLAINTEXT);
+  };
+  bufferevent_data_cb ciphertextcb = [](struct bufferevent* bev,
+                                        void* ptr) {
+    (void)bev;
+
+    reinterpret_cast<obfsclient_session*>(ptr)->notify(OBFSCLIENT_EVENT_CIPHERTEXT);
+  };
+  ::bufferevent_setcb(s->plaintext, plaintextcb, nullptr, nullptr, s);
+  ::bufferevent_setcb(s->ciphertext, ciphertextcb, nullptr, nullptr, s);
+  ::bufferevent_enable(s->plaintext, EV_READ | EV_WRITE);
+  ::bufferevent_enable(s->ciphertext, EV_READ | EV_WRITE);
+
+  // The Session takes ownership of its ends, even on failure
+  Socks5Server::Session* session =
+      s->server->create_embedded_session(*s, plaintext[0], ciphertext[0],
+                                         bridge, bridge_len,
+                                         (args != nullptr) ? args : "");
+  if (session == nullptr) {
+    delete s;
+    return nullptr;
+  }
+
+  // The handshake may already have failed and torn down the Session
+  if (!s->closed)
+    s->session = session;
+
+  return s;
+}
+
+void obfsclient_session_free(obfsclient_session* session) {
+  if (session == nullptr)
+    return;
+
+  delete session;
+}
+
+int obfsclient_session_events(obfsclient_session* session) {
+  if (session == nullptr)
+    return 0;
+
+  const int ev = session->events;
+  session->events = 0;
+
+  return ev;
+}
+
+int obfsclient_session_write_plaintext(obfsclient_session* session,
+                                       const void* buf,
+                                       size_t len) {
+  if (session == nullptr || session->session == nullptr)
+    return -1;
+
+  return ::bufferevent_write(session->plaintext, buf, len);
+}
+
+int obfsclient_session_write_ciphertext(obfsclient_session* session,
+                                        const void* buf,
+                                        size_t len) {
+  if (session == nullptr || session->session == nullptr)
+    return -1;
+
+  return ::bufferevent_write(session->ciphertext, buf, len);
+}
+
+size_t obfsclient_session_read_plaintext(obfsclient_session* session,
+                                         void* buf,
+                                         size_t len) {
+  if (session == nullptr || session->plaintext == nullptr)
+    return 0;
+
+  return ::bufferevent_read(session->plaintext, buf, len);
+}
+
+size_t obfsclient_session_read_ciphertext(obfsclient_session* session,
+                                          void* buf,
+                                          size_t len) {
+  if (session == nullptr || session->ciphertext == nullptr)
+    return 0;
+
+  return ::bufferevent_read(session->ciphertext, buf, len);
+}
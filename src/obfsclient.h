@@ -0,0 +1,219 @@
+/**
+ * @file    obfsclient.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   libobfsclient embedding API
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OBFSCLIENT_H__
+#define OBFSCLIENT_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+struct event_base;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The libobfsclient API version
+ *
+ * Bumped on incompatible changes to anything declared in this file.
+ */
+#define OBFSCLIENT_API_VERSION 1
+
+/**
+ * The number of event priorities Sessions use
+ *
+ * An application supplied event_base should be initialized with
+ * event_base_priority_init() to at least this many priorities.
+ */
+#define OBFSCLIENT_NR_PRIORITIES 3
+
+/** @{ */
+/** Session events */
+#define OBFSCLIENT_EVENT_ESTABLISHED  0x01  /**< The handshake completed */
+#define OBFSCLIENT_EVENT_FAILED       0x02  /**< The handshake failed */
+#define OBFSCLIENT_EVENT_CLOSED       0x04  /**< The Session was torn down */
+#define OBFSCLIENT_EVENT_PLAINTEXT    0x08  /**< Plaintext is available */
+#define OBFSCLIENT_EVENT_CIPHERTEXT   0x10  /**< Ciphertext is available */
+/** @} */
+
+/** An opaque transport context (One per event loop) */
+typedef struct obfsclient_ctx obfsclient_ctx;
+
+/** An opaque transport session (One per bridge connection) */
+typedef struct obfsclient_session obfsclient_session;
+
+/**
+ * Session event callback
+ *
+ * Invoked from the event loop with the OBFSCLIENT_EVENT_* that happened
+ * since the last time the events were collected.  It is safe to call any
+ * obfsclient_session_* function (including obfsclient_session_free()) from
+ * the callback.
+ */
+typedef void (*obfsclient_event_cb)(obfsclient_session* session,
+                                    int events,
+                                    void* arg);
+
+/**
+ * Enable or disable libobfsclient's logging to stdout
+ *
+ * @param[in] enabled Non-zero to enable logging
+ */
+void obfsclient_set_logging(int enabled);
+
+/** @{ */
+/**
+ * Create a transport context
+ *
+ * @param[in] base      The libevent2 event_base to run Sessions on, or NULL
+ *                      to allocate a private one (See obfsclient_ctx_run())
+ * @param[in] state_dir The directory to store persistent state in (Eg:
+ *                      ScrambleSuit Session Tickets)
+ *
+ * @returns A new context, or NULL on failure
+ */
+obfsclient_ctx* obfsclient_ctx_new(struct event_base* base,
+                                   const char* state_dir);
+
+/**
+ * Destroy a transport context
+ *
+ * Sessions created with the context that have not been freed yet are torn
+ * down.  Their handles remain valid but unusable (OBFSCLIENT_EVENT_CLOSED is
+ * reported, and all I/O fails), and must still be released with
+ * obfsclient_session_free().
+ */
+void obfsclient_ctx_free(obfsclient_ctx* ctx);
+
+/** Query the event_base that a context runs Sessions on */
+struct event_base* obfsclient_ctx_get_base(obfsclient_ctx* ctx);
+
+/**
+ * Process pending work without blocking
+ *
+ * Data handling, timers, and callbacks all happen from the event loop.  If
+ * the context owns its event_base, call this after feeding data and
+ * periodically (Eg: from the application's own poll loop).
+ *
+ * @returns 0 on success, -1 on failure
+ */
+int obfsclient_ctx_run(obfsclient_ctx* ctx);
+/** @} */
+
+/** @{ */
+/**
+ * Create a Session and start the transport handshake
+ *
+ * The handshake's first flight is available with
+ * obfsclient_session_read_ciphertext() once the event loop has run.
+ *
+ * @param[in] ctx         The transport context
+ * @param[in] transport   The transport ("obfs2", "obfs3", "scramblesuit")
+ * @param[in] bridge      The bridge address (Used for logging and to key
+ *                        persistent state)
+ * @param[in] bridge_len  The length of bridge
+ * @param[in] args        The transport arguments (Eg: "password=..."), or
+ *                        NULL
+ * @param[in] cb          The event callback, or NULL to poll with
+ *                        obfsclient_session_events()
+ * @param[in] arg         The argument passed to cb
+ *
+ * @returns A new Session, or NULL on failure
+ */
+obfsclient_session* obfsclient_session_new(obfsclient_ctx* ctx,
+                                           const char* transport,
+                                           const struct sockaddr* bridge,
+                                           socklen_t bridge_len,
+                                           const char* args,
+                                           obfsclient_event_cb cb,
+                                           void* arg);
+
+/**
+ * Destroy a Session
+ *
+ * Any unread plaintext/ciphertext is discarded.
+ */
+void obfsclient_session_free(obfsclient_session* session);
+
+/**
+ * Collect the OBFSCLIENT_EVENT_* that happened since the last call
+ *
+ * @returns The events, or 0 if nothing happened
+ */
+int obfsclient_session_events(obfsclient_session* session);
+
+/**
+ * Queue application data to be sent to the bridge
+ *
+ * The data is held till the handshake completes.
+ *
+ * @returns 0 on success, -1 on failure (Eg: The Session was closed)
+ */
+int obfsclient_session_write_plaintext(obfsclient_session* session,
+                                       const void* buf,
+                                       size_t len);
+
+/**
+ * Queue data that was received from the bridge
+ *
+ * @returns 0 on success, -1 on failure (Eg: The Session was closed)
+ */
+int obfsclient_session_write_ciphertext(obfsclient_session* session,
+                                        const void* buf,
+                                        size_t len);
+
+/**
+ * Collect application data received from the bridge
+ *
+ * @returns The number of bytes copied into buf
+ */
+size_t obfsclient_session_read_plaintext(obfsclient_session* session,
+                                         void* buf,
+                                         size_t len);
+
+/**
+ * Collect data to be sent to the bridge
+ *
+ * @returns The number of bytes copied into buf
+ */
+size_t obfsclient_session_read_ciphertext(obfsclient_session* session,
+                                          void* buf,
+                                          size_t len);
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OBFSCLIENT_H__ */
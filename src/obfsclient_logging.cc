@@ -0,0 +1,16 @@
+/**
+ * @file    obfsclient_logging.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   libobfsclient easylogging++ storage
+ */
+
+/*
+ * This lives in its own translation unit so that the linker only pulls it out
+ * of libobfsclient.a when nothing else defines the storage.  Applications that
+ * use easylogging++ themselves just initialize it as usual, and libobfsclient
+ * logs through their instance.
+ */
+
+#include "schwanenlied/common.h"
+
+_INITIALIZE_EASYLOGGINGPP
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "obfsclient.h"
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/rand_ctr_drbg.h"
+#include "schwanenlied/crypto/sha256.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+/*
+ * The tests drive an obfs2 Session purely through the C API, and play the
+ * bridge with an independent implementation of the responder side of the
+ * obfs2 spec (See pt/obfs2/codec_test.cc).
+ */
+class ObfsclientTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    static const uint8_t seed[] = { 'a', 'p', 'i' };
+    rng_.seed(seed, sizeof(seed));
+
+    obfsclient_set_logging(0);
+    ctx_ = obfsclient_ctx_new(nullptr, "/nonexistent");
+    ASSERT_TRUE(ctx_ != nullptr);
+    ASSERT_TRUE(obfsclient_ctx_get_base(ctx_) != nullptr);
+
+    ::std::memset(&bridge_, 0, sizeof(bridge_));
+    bridge_.sin_family = AF_INET;
+    bridge_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bridge_.sin_port = htons(443);
+    session_ = nullptr;
+    nr_callbacks_ = 0;
+    cb_events_ = 0;
+    free_from_cb_ = false;
+  }
+
+  virtual void TearDown() {
+    obfsclient_session_free(session_);
+    obfsclient_ctx_free(ctx_);
+  }
+
+  static void event_cb(obfsclient_session* session,
+                       int events,
+                       void* arg) {
+    ObfsclientTest* test = reinterpret_cast<ObfsclientTest*>(arg);
+    EXPECT_EQ(test->session_, session);
+    test->nr_callbacks_++;
+    test->cb_events_ |= events;
+    if (test->free_from_cb_ && (events & OBFSCLIENT_EVENT_ESTABLISHED)) {
+      obfsclient_session_free(session);
+      test->session_ = nullptr;
+    }
+  }
+
+  void new_session(const bool with_cb = false) {
+    session_ = obfsclient_session_new(ctx_, "obfs2",
+                                      reinterpret_cast<struct sockaddr*>(
+                                          &bridge_), sizeof(bridge_),
+                                      nullptr, with_cb ? event_cb : nullptr,
+                                      this);
+    ASSERT_TRUE(session_ != nullptr);
+  }
+
+  /** Run the event loop till the deferred callbacks settle */
+  void run() {
+    for (int i = 0; i < 8; i++)
+      ASSERT_EQ(0, obfsclient_ctx_run(ctx_));
+  }
+
+  /** Collect everything the Session wants sent to the bridge */
+  crypto::SecureBuffer read_ciphertext() {
+    crypto::SecureBuffer buf;
+    uint8_t tmp[4096];
+    size_t len;
+    while ((len = obfsclient_session_read_ciphertext(session_, tmp,
+                                                     sizeof(tmp))) > 0)
+      buf.append(tmp, len);
+    return buf;
+  }
+
+  /** Collect the plaintext the Session received from the bridge */
+  crypto::SecureBuffer read_plaintext() {
+    crypto::SecureBuffer buf;
+    uint8_t tmp[4096];
+    size_t len;
+    while ((len = obfsclient_session_read_plaintext(session_, tmp,
+                                                    sizeof(tmp))) > 0)
+      buf.append(tmp, len);
+    return buf;
+  }
+
+  /** MAC(s, x) = H(s | x | s) */
+  crypto::SecureBuffer mac(const char* s,
+                           const crypto::SecureBuffer& x) {
+    const size_t s_len = ::std::strlen(s);
+    crypto::SecureBuffer to_sha(reinterpret_cast<const uint8_t*>(s), s_len);
+    to_sha += x;
+    to_sha.append(reinterpret_cast<const uint8_t*>(s), s_len);
+
+    crypto::SecureBuffer digest(crypto::Sha256::kDigestLength, 0);
+    crypto::Sha256 sha;
+    EXPECT_TRUE(sha.digest(to_sha.data(), to_sha.size(), &digest[0],
+                           digest.size()));
+    return digest;
+  }
+
+  /** Key a AES-128-CTR instance with the first/second halves of sekrit */
+  void set_state(crypto::Aes128Ctr& aes,
+                 const crypto::SecureBuffer& sekrit) {
+    ASSERT_TRUE(aes.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                              nullptr, 0,
+                              sekrit.data() + crypto::kAes128KeyLength,
+                              sekrit.size() - crypto::kAes128KeyLength));
+  }
+
+  /**
+   * Consume the initiator handshake, and generate the responder's
+   *
+   * @param[in] wire        The initiator handshake
+   * @param[in] bad_magic   Corrupt the responder's MAGIC_VALUE?
+   * @param[out] response   The responder handshake
+   */
+  void bridge_handshake(crypto::SecureBuffer wire,
+                        const bool bad_magic,
+                        crypto::SecureBuffer& response) {
+    // INIT_SEED | E(INIT_PAD_KEY, MAGIC_VALUE | PADLEN | WR(PADLEN))
+    ASSERT_LE(24u, wire.size());
+    const crypto::SecureBuffer init_seed = wire.substr(0, 16);
+    crypto::Aes128Ctr init_pad_aes;
+    set_state(init_pad_aes, mac("Initiator obfuscation padding", init_seed));
+    ::std::array<uint32_t, 2> hdr;
+    ::std::memcpy(hdr.data(), wire.data() + 16, 8);
+    ASSERT_TRUE(init_pad_aes.process(reinterpret_cast<uint8_t*>(hdr.data()), 8,
+                                     reinterpret_cast<uint8_t*>(hdr.data())));
+    ASSERT_EQ(0x2BF5CA7Eu, ntohl(hdr.at(0)));
+    ASSERT_EQ(ntohl(hdr.at(1)), wire.size() - 24);
+
+    // RESP_SEED | E(RESP_PAD_KEY, MAGIC_VALUE | PADLEN | WR(PADLEN))
+    crypto::SecureBuffer resp_seed(16, 0);
+    ASSERT_TRUE(rng_.get_bytes(&resp_seed[0], resp_seed.size()));
+    crypto::Aes128Ctr resp_pad_aes;
+    set_state(resp_pad_aes, mac("Responder obfuscation padding", resp_seed));
+    hdr.at(0) = htonl(bad_magic ? 0xdeadbeef : 0x2BF5CA7E);
+    hdr.at(1) = htonl(100);
+    ASSERT_TRUE(resp_pad_aes.process(reinterpret_cast<uint8_t*>(hdr.data()), 8,
+                                     reinterpret_cast<uint8_t*>(hdr.data())));
+    response = resp_seed;
+    response.append(reinterpret_cast<const uint8_t*>(hdr.data()), 8);
+    response.append(100, 0x55);
+
+    // Derive the session keys
+    const crypto::SecureBuffer seeds = init_seed + resp_seed;
+    set_state(init_aes_, mac("Initiator obfuscated data", seeds));
+    set_state(resp_aes_, mac("Responder obfuscated data", seeds));
+  }
+
+  /** Complete the handshake, returning the initiator's handshake length */
+  void handshake(size_t& hs_len) {
+    run();
+    const crypto::SecureBuffer wire = read_ciphertext();
+    hs_len = wire.size();
+    crypto::SecureBuffer response;
+    bridge_handshake(wire, false, response);
+    ASSERT_EQ(0, obfsclient_session_write_ciphertext(session_, response.data(),
+                                                     response.size()));
+    run();
+  }
+
+  crypto::SecureBuffer random_data(const size_t len) {
+    crypto::SecureBuffer buf(len, 0);
+    for (size_t i = 0; i < len; i += 0x10000) {
+      const size_t n = ::std::min<size_t>(len - i, 0x10000);
+      EXPECT_TRUE(rng_.get_bytes(&buf[i], n));
+    }
+    return buf;
+  }
+
+  obfsclient_ctx* ctx_;
+  obfsclient_session* session_;
+  struct sockaddr_in bridge_;
+  crypto::RandCtrDrbg rng_;
+  crypto::Aes128Ctr init_aes_;
+  crypto::Aes128Ctr resp_aes_;
+  int nr_callbacks_;
+  int cb_events_;
+  bool free_from_cb_;   /**< Free the Session from event_cb() once up */
+};
+
+TEST_F(ObfsclientTest, InvalidArguments) {
+  ASSERT_TRUE(obfsclient_ctx_new(nullptr, nullptr) == nullptr);
+  ASSERT_TRUE(obfsclient_session_new(ctx_, "obfs9",
+                                     reinterpret_cast<struct sockaddr*>(
+                                         &bridge_), sizeof(bridge_),
+                                     nullptr, nullptr, nullptr) == nullptr);
+  ASSERT_TRUE(obfsclient_session_new(ctx_, "obfs2", nullptr, 0, nullptr,
+                                     nullptr, nullptr) == nullptr);
+  ASSERT_TRUE(obfsclient_session_new(ctx_, "obfs2",
+                                     reinterpret_cast<struct sockaddr*>(
+                                         &bridge_), 0,
+                                     nullptr, nullptr, nullptr) == nullptr);
+  ASSERT_EQ(-1, obfsclient_ctx_run(nullptr));
+}
+
+TEST_F(ObfsclientTest, Obfs2RoundTrip) {
+  new_session();
+
+  // Plaintext written early is held back till the handshake completes
+  const crypto::SecureBuffer early = random_data(1000);
+  ASSERT_EQ(0, obfsclient_session_write_plaintext(session_, early.data(),
+                                                  early.size()));
+  size_t hs_len;
+  handshake(hs_len);
+  ASSERT_LE(24u, hs_len);
+  ASSERT_GE(24u + 8192, hs_len);
+  const int events = obfsclient_session_events(session_);
+  ASSERT_TRUE(events & OBFSCLIENT_EVENT_ESTABLISHED);
+  ASSERT_FALSE(events & (OBFSCLIENT_EVENT_FAILED | OBFSCLIENT_EVENT_CLOSED));
+  ASSERT_TRUE(events & OBFSCLIENT_EVENT_CIPHERTEXT);
+  ASSERT_EQ(0, obfsclient_session_events(session_));
+
+  // Upstream
+  const crypto::SecureBuffer upstream = random_data(100000);
+  ASSERT_EQ(0, obfsclient_session_write_plaintext(session_, upstream.data(),
+                                                  upstream.size()));
+  run();
+  ASSERT_TRUE(obfsclient_session_events(session_) &
+              OBFSCLIENT_EVENT_CIPHERTEXT);
+  crypto::SecureBuffer wire = read_ciphertext();
+  ASSERT_TRUE(init_aes_.process(wire.data(), wire.size(), &wire[0]));
+  ASSERT_EQ(early + upstream, wire);
+
+  // Downstream, fed in pieces
+  const crypto::SecureBuffer downstream = random_data(70000);
+  wire.assign(downstream.size(), 0);
+  ASSERT_TRUE(resp_aes_.process(downstream.data(), downstream.size(),
+                                &wire[0]));
+  for (size_t i = 0; i < wire.size(); i += 1000) {
+    ASSERT_EQ(0, obfsclient_session_write_ciphertext(
+        session_, wire.data() + i, ::std::min<size_t>(1000, wire.size() - i)));
+  }
+  run();
+  ASSERT_TRUE(obfsclient_session_events(session_) &
+              OBFSCLIENT_EVENT_PLAINTEXT);
+  ASSERT_EQ(downstream, read_plaintext());
+}
+
+TEST_F(ObfsclientTest, EventCallback) {
+  new_session(true);
+
+  size_t hs_len;
+  handshake(hs_len);
+  ASSERT_LT(0, nr_callbacks_);
+  ASSERT_TRUE(cb_events_ & OBFSCLIENT_EVENT_ESTABLISHED);
+  ASSERT_FALSE(cb_events_ & OBFSCLIENT_EVENT_FAILED);
+
+  // Events delivered to the callback are not reported again
+  ASSERT_EQ(0, obfsclient_session_events(session_));
+
+  cb_events_ = 0;
+  const crypto::SecureBuffer downstream = random_data(10);
+  crypto::SecureBuffer wire(downstream.size(), 0);
+  ASSERT_TRUE(resp_aes_.process(downstream.data(), downstream.size(),
+                                &wire[0]));
+  ASSERT_EQ(0, obfsclient_session_write_ciphertext(session_, wire.data(),
+                                                   wire.size()));
+  run();
+  ASSERT_EQ(OBFSCLIENT_EVENT_PLAINTEXT, cb_events_);
+  ASSERT_EQ(downstream, read_plaintext());
+}
+
+TEST_F(ObfsclientTest, FreeFromCallback) {
+  new_session(true);
+  free_from_cb_ = true;
+
+  size_t hs_len;
+  handshake(hs_len);
+  ASSERT_TRUE(cb_events_ & OBFSCLIENT_EVENT_ESTABLISHED);
+  ASSERT_TRUE(session_ == nullptr);
+  const int nr_callbacks = nr_callbacks_;
+  run();
+  ASSERT_EQ(nr_callbacks, nr_callbacks_);
+}
+
+TEST_F(ObfsclientTest, HandshakeFailure) {
+  new_session();
+  run();
+  crypto::SecureBuffer response;
+  bridge_handshake(read_ciphertext(), true, response);
+  ASSERT_EQ(0, obfsclient_session_write_ciphertext(session_, response.data(),
+                                                   response.size()));
+  run();
+  const int events = obfsclient_session_events(session_);
+  ASSERT_TRUE(events & OBFSCLIENT_EVENT_FAILED);
+  ASSERT_TRUE(events & OBFSCLIENT_EVENT_CLOSED);
+  ASSERT_FALSE(events & OBFSCLIENT_EVENT_ESTABLISHED);
+  ASSERT_EQ(-1, obfsclient_session_write_plaintext(session_, "x", 1));
+  ASSERT_EQ(-1, obfsclient_session_write_ciphertext(session_, "x", 1));
+}
+
+TEST_F(ObfsclientTest, CtxFreeClosesSessions) {
+  new_session();
+  size_t hs_len;
+  handshake(hs_len);
+  ASSERT_TRUE(obfsclient_session_events(session_) &
+              OBFSCLIENT_EVENT_ESTABLISHED);
+
+  // The handle outlives the context, but is unusable
+  obfsclient_ctx_free(ctx_);
+  ctx_ = nullptr;
+  ASSERT_TRUE(obfsclient_session_events(session_) & OBFSCLIENT_EVENT_CLOSED);
+  ASSERT_EQ(-1, obfsclient_session_write_plaintext(session_, "x", 1));
+  ASSERT_EQ(-1, obfsclient_session_write_ciphertext(session_, "x", 1));
+  uint8_t buf[16];
+  ASSERT_EQ(0u, obfsclient_session_read_plaintext(session_, buf, sizeof(buf)));
+  ASSERT_EQ(0u, obfsclient_session_read_ciphertext(session_, buf,
+                                                   sizeof(buf)));
+}
+
+} // namespace schwanenlied
@@ -0,0 +1,152 @@
+/**
+ * @file    buffer_budget.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Process wide Session buffer budget (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include "schwanenlied/buffer_budget.h"
+
+namespace schwanenlied {
+
+constexpr time_t BufferBudget::kIdleThreshold;
+
+void BufferBudget::register_account(Account& account,
+                                    const struct timeval& now) {
+  SL_ASSERT(account.budget_ == nullptr);
+
+  account.budget_ = this;
+  account.charged_ = 0;
+  account.last_active_ = now;
+  account.shrunk_ = false;
+  account.iter_ = accounts_.insert(accounts_.end(), &account);
+}
+
+void BufferBudget::unregister_account(Account& account) {
+  SL_ASSERT(account.budget_ == this);
+
+  used_ -= account.charged_;
+  if (account.shrunk_)
+    nr_shrunk_--;
+  accounts_.erase(account.iter_);
+  account.budget_ = nullptr;
+  account.charged_ = 0;
+}
+
+void BufferBudget::update(Account& account,
+                          const size_t buffered,
+                          const struct timeval& now,
+                          const bool active) {
+  SL_ASSERT(account.budget_ == this);
+
+  used_ = used_ - account.charged_ + buffered;
+  account.charged_ = buffered;
+  peak_ = ::std::max(peak_, used_);
+
+  if (active) {
+    account.last_active_ = now;
+    if (account.shrunk_) {
+      account.shrunk_ = false;
+      nr_shrunk_--;
+    }
+
+    // Keep accounts_ sorted by activity, least recent first
+    accounts_.splice(accounts_.end(), accounts_, account.iter_);
+  }
+
+  if (limit_ != 0 && used_ > limit_)
+    reclaim(now);
+}
+
+size_t BufferBudget::credit(const Account& account) const {
+  if (limit_ == 0)
+    return ::std::numeric_limits<size_t>::max();
+  if (account.shrunk_)
+    return min_share_;
+
+  /*
+   * The fair share is whatever is left after the shrunk accounts got their
+   * minimum, divided evenly among the rest.
+   */
+  const size_t reserved = nr_shrunk_ * min_share_;
+  const size_t nr_accounts = accounts_.size() - nr_shrunk_;
+  const size_t share = (limit_ > reserved && nr_accounts > 0) ?
+      (limit_ - reserved) / nr_accounts : 0;
+
+  return ::std::max(share, min_share_);
+}
+
+const ::std::string BufferBudget::to_string() const {
+  ::std::ostringstream stream;
+
+  stream << "Buffered: " << used_ << " (Peak: " << peak_ << ") / ";
+  if (limit_ == 0)
+    stream << "Unlimited";
+  else
+    stream << limit_;
+  stream << " Sessions: " << accounts_.size()
+         << " (Shrunk: " << nr_shrunk_ << ", Total: " << nr_shrinks_ << ")";
+
+  return stream.str();
+}
+
+void BufferBudget::reclaim(const struct timeval& now) {
+  /*
+   * accounts_ is sorted by the last activity, so walk it from the front, and
+   * cut the credit of what has been idle for long enough till the usage is
+   * within the budget again.  The charges are only as fresh as each
+   * Account's last update, so the callback reports the current amount.
+   */
+  for (auto iter = accounts_.begin(); iter != accounts_.end(); ++iter) {
+    if (used_ <= limit_)
+      break;
+
+    Account* account = *iter;
+    if (now.tv_sec - account->last_active_.tv_sec < kIdleThreshold)
+      break;
+    if (account->shrunk_)
+      continue;
+
+    account->shrunk_ = true;
+    nr_shrunk_++;
+    nr_shrinks_++;
+    if (account->cb_ != nullptr) {
+      const size_t buffered = account->cb_(account->ctx_);
+      SL_ASSERT(account->budget_ == this);
+      used_ = used_ - account->charged_ + buffered;
+      account->charged_ = buffered;
+    }
+  }
+}
+
+} // namespace schwanenlied
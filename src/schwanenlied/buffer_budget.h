@@ -0,0 +1,208 @@
+/**
+ * @file    buffer_budget.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Process wide Session buffer budget
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHWANENLIED_BUFFER_BUDGET_H__
+#define SCHWANENLIED_BUFFER_BUDGET_H__
+
+#include <sys/time.h>
+
+#include <list>
+#include <string>
+
+#include "schwanenlied/common.h"
+
+namespace schwanenlied {
+
+/**
+ * A process wide buffer budget shared by all Sessions
+ *
+ * Each Session registers an Account, and reports the amount of data it
+ * currently has buffered whenever it applies backpressure.  In return it is
+ * granted a credit (the amount it may buffer) that is the fair share of the
+ * total budget, but never less than the configured minimum share.
+ *
+ * When the total amount of buffered data exceeds the budget, Accounts that
+ * have been idle the longest have their credit cut to the minimum share first,
+ * and are notified so that they can throttle immediately.  This stops as soon
+ * as the usage is back within the budget.
+ *
+ * @warning This is not and will never be thread safe
+ */
+class BufferBudget {
+ public:
+  /**
+   * The callback invoked when an Account's credit is reduced
+   *
+   * @warning The callback *MUST NOT* unregister the Account.
+   *
+   * @returns The amount of data the Account has buffered after it released
+   *          what it could
+   */
+  typedef size_t (*ShrinkCallback)(void* ctx);
+
+  /** A per-Session budget account */
+  class Account {
+   public:
+    /**
+     * Construct an Account
+     *
+     * @param[in] cb  The callback to invoke when the credit is reduced
+     * @param[in] ctx The opaque argument passed to cb
+     */
+    Account(ShrinkCallback cb,
+            void* ctx) :
+        budget_(nullptr),
+        cb_(cb),
+        ctx_(ctx),
+        charged_(0),
+        last_active_(),
+        shrunk_(false) {}
+
+    ~Account() {
+      if (budget_ != nullptr)
+        budget_->unregister_account(*this);
+    }
+
+    /** Is the account attached to a budget? */
+    bool registered() const { return budget_ != nullptr; }
+
+   private:
+    Account(const Account&) = delete;
+    void operator=(const Account&) = delete;
+
+    friend BufferBudget;
+
+    BufferBudget* budget_;  /**< The budget this account draws from */
+    ShrinkCallback cb_;     /**< The credit reduction callback */
+    void* ctx_;             /**< The credit reduction callback argument */
+    size_t charged_;        /**< The currently accounted buffered bytes */
+    struct timeval last_active_;  /**< The time the account was last active */
+    bool shrunk_;           /**< Credit reduced due to memory pressure? */
+    ::std::list<Account*>::iterator iter_;  /**< Position in accounts_ */
+  };
+
+  /**
+   * Construct a BufferBudget
+   *
+   * @param[in] limit     The total budget in bytes (0 = Unlimited)
+   * @param[in] min_share The minimum amount any Account is allowed to buffer
+   */
+  BufferBudget(const size_t limit,
+               const size_t min_share) :
+      limit_(limit),
+      min_share_(min_share),
+      used_(0),
+      peak_(0),
+      nr_shrunk_(0),
+      nr_shrinks_(0) {}
+
+  ~BufferBudget() = default;
+
+  /** @{ */
+  /**
+   * Attach an Account to the budget
+   *
+   * @param[in] account The Account to attach
+   * @param[in] now     The current time (New Accounts start out active)
+   */
+  void register_account(Account& account,
+                        const struct timeval& now);
+
+  /** Detach an Account from the budget, releasing all of it's charges */
+  void unregister_account(Account& account);
+
+  /**
+   * Update the amount of data an Account has buffered
+   *
+   * @param[in] account   The Account to update
+   * @param[in] buffered  The amount of data currently buffered
+   * @param[in] now       The current time
+   * @param[in] active    Was data transfered since the last update?
+   */
+  void update(Account& account,
+              const size_t buffered,
+              const struct timeval& now,
+              const bool active);
+
+  /**
+   * Query the amount of data an Account is allowed to buffer
+   *
+   * @param[in] account The Account to query
+   *
+   * @returns The Account's current credit in bytes
+   */
+  size_t credit(const Account& account) const;
+  /** @} */
+
+  /** @{ */
+  /** Query the total budget (0 = Unlimited) */
+  size_t limit() const { return limit_; }
+
+  /** Query the amount of data currently buffered */
+  size_t used() const { return used_; }
+
+  /** Query the current usage for logging */
+  const ::std::string to_string() const;
+  /** @} */
+
+ private:
+  BufferBudget(const BufferBudget&) = delete;
+  void operator=(const BufferBudget&) = delete;
+
+  /** The time after which an Account is considered idle in seconds */
+  static constexpr time_t kIdleThreshold = 10;
+
+  /**
+   * Reduce the credit of idle Accounts till usage is within the budget
+   *
+   * The Accounts are notified so that they can throttle, and release what
+   * memory they can.  Each Account's charge is updated to what it reports
+   * buffering after the callback, and no further Accounts are shrunk once
+   * usage is within the budget (or there are no more idle Accounts).
+   *
+   * @param[in] now The current time
+   */
+  void reclaim(const struct timeval& now);
+
+  const size_t limit_;      /**< The total budget */
+  const size_t min_share_;  /**< The minimum per-account credit */
+  size_t used_;             /**< The currently buffered data */
+  size_t peak_;             /**< The peak buffered data */
+  size_t nr_shrunk_;        /**< The number of accounts currently shrunk */
+  size_t nr_shrinks_;       /**< The number of credit reductions */
+  ::std::list<Account*> accounts_;  /**< The accounts, least recent first */
+};
+
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_BUFFER_BUDGET_H__
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "schwanenlied/buffer_budget.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+static constexpr size_t kLimit = 1000;
+static constexpr size_t kMinShare = 100;
+
+class BufferBudgetTest : public ::testing::Test {
+ protected:
+  /** An Account and what it's shrink callback saw */
+  struct Entry {
+    Entry() :
+        account([](void* ctx) {
+                  Entry* entry = reinterpret_cast<Entry*>(ctx);
+                  entry->nr_shrunk++;
+                  return entry->buffered;
+                }, this),
+        buffered(0),
+        nr_shrunk(0) {}
+
+    BufferBudget::Account account;
+    size_t buffered;    /**< Reported from the shrink callback */
+    int nr_shrunk;
+  };
+
+  virtual void SetUp() {
+    budget_.reset(new BufferBudget(kLimit, kMinShare));
+  }
+
+  virtual void TearDown() {
+    entries_.clear();
+    budget_.reset();
+  }
+
+  /** A time t seconds into the test */
+  static struct timeval at(const time_t t) {
+    struct timeval tv = { 1000 + t, 0 };
+    return tv;
+  }
+
+  Entry* add_entry(const time_t t = 0) {
+    entries_.emplace_back(new Entry());
+    Entry* entry = entries_.back().get();
+    budget_->register_account(entry->account, at(t));
+    return entry;
+  }
+
+  ::std::unique_ptr<BufferBudget> budget_;
+  ::std::vector< ::std::unique_ptr<Entry>> entries_;
+};
+
+TEST_F(BufferBudgetTest, Unlimited) {
+  BufferBudget budget(0, kMinShare);
+  Entry entry;
+  budget.register_account(entry.account, at(0));
+  ASSERT_TRUE(entry.account.registered());
+
+  budget.update(entry.account, 10 * kLimit, at(100), false);
+  ASSERT_EQ(10 * kLimit, budget.used());
+  ASSERT_EQ(::std::numeric_limits<size_t>::max(),
+            budget.credit(entry.account));
+  ASSERT_EQ(0, entry.nr_shrunk);
+
+  budget.unregister_account(entry.account);
+  ASSERT_FALSE(entry.account.registered());
+  ASSERT_EQ(0u, budget.used());
+}
+
+TEST_F(BufferBudgetTest, ChargeRelease) {
+  Entry* a = add_entry();
+  Entry* b = add_entry();
+
+  // Charges replace the previous amount, they do not accumulate
+  budget_->update(a->account, 300, at(1), true);
+  budget_->update(b->account, 200, at(1), true);
+  ASSERT_EQ(500u, budget_->used());
+  budget_->update(a->account, 100, at(2), true);
+  ASSERT_EQ(300u, budget_->used());
+
+  // Unregistering releases the charge
+  budget_->unregister_account(a->account);
+  ASSERT_FALSE(a->account.registered());
+  ASSERT_EQ(200u, budget_->used());
+
+  // As does destroying the Account
+  entries_.pop_back();
+  ASSERT_EQ(0u, budget_->used());
+}
+
+TEST_F(BufferBudgetTest, Credit) {
+  Entry* a = add_entry();
+  ASSERT_EQ(kLimit, budget_->credit(a->account));
+
+  // The fair share, but never less than the minimum
+  Entry* b = add_entry();
+  ASSERT_EQ(kLimit / 2, budget_->credit(a->account));
+  ASSERT_EQ(kLimit / 2, budget_->credit(b->account));
+  for (int i = 0; i < 20; i++)
+    add_entry();
+  ASSERT_EQ(kMinShare, budget_->credit(a->account));
+}
+
+TEST_F(BufferBudgetTest, ReclaimIdle) {
+  // Idle since the start, least recent first
+  Entry* idle_a = add_entry(0);
+  Entry* idle_b = add_entry(1);
+  Entry* active = add_entry(2);
+  budget_->update(idle_a->account, 400, at(0), true);
+  budget_->update(idle_b->account, 400, at(1), true);
+  idle_a->buffered = 400;
+  idle_b->buffered = 400;
+
+  // Within the budget, nothing is shrunk
+  budget_->update(active->account, 200, at(30), true);
+  ASSERT_EQ(1000u, budget_->used());
+  ASSERT_EQ(0, idle_a->nr_shrunk);
+
+  // Over it, both idle Accounts are shrunk as neither released anything
+  budget_->update(active->account, 300, at(30), true);
+  ASSERT_EQ(1, idle_a->nr_shrunk);
+  ASSERT_EQ(1, idle_b->nr_shrunk);
+  ASSERT_EQ(0, active->nr_shrunk);
+  ASSERT_EQ(kMinShare, budget_->credit(idle_a->account));
+  ASSERT_EQ(kMinShare, budget_->credit(idle_b->account));
+  ASSERT_EQ(kLimit - 2 * kMinShare, budget_->credit(active->account));
+
+  // Already shrunk Accounts are not notified again
+  budget_->update(active->account, 400, at(31), true);
+  ASSERT_EQ(1, idle_a->nr_shrunk);
+  ASSERT_EQ(1, idle_b->nr_shrunk);
+
+  // Activity restores the fair share of what the shrunk Accounts left
+  budget_->update(idle_a->account, 0, at(32), true);
+  ASSERT_EQ((kLimit - kMinShare) / 2, budget_->credit(idle_a->account));
+  ASSERT_EQ(kMinShare, budget_->credit(idle_b->account));
+}
+
+TEST_F(BufferBudgetTest, ReclaimStopsWithinBudget) {
+  Entry* idle_a = add_entry(0);
+  Entry* idle_b = add_entry(1);
+  Entry* active = add_entry(2);
+  budget_->update(idle_a->account, 400, at(0), true);
+  budget_->update(idle_b->account, 400, at(1), true);
+
+  // idle_a's charge is stale, and reports that most of it drained
+  idle_a->buffered = 50;
+  idle_b->buffered = 400;
+  budget_->update(active->account, 300, at(30), true);
+  ASSERT_EQ(1, idle_a->nr_shrunk);
+  ASSERT_EQ(0, idle_b->nr_shrunk);
+  ASSERT_EQ(750u, budget_->used());
+  ASSERT_EQ(kLimit / 2 - kMinShare / 2, budget_->credit(idle_b->account));
+}
+
+TEST_F(BufferBudgetTest, ReclaimSparesActive) {
+  Entry* idle = add_entry(0);
+  Entry* active = add_entry(0);
+  budget_->update(idle->account, 100, at(0), true);
+  idle->buffered = 100;
+
+  // Accounts that moved data recently are never shrunk
+  budget_->update(active->account, 2 * kLimit, at(5), true);
+  ASSERT_EQ(0, idle->nr_shrunk);
+  ASSERT_EQ(0, active->nr_shrunk);
+  budget_->update(active->account, 2 * kLimit, at(15), true);
+  ASSERT_EQ(1, idle->nr_shrunk);
+  ASSERT_EQ(0, active->nr_shrunk);
+  ASSERT_EQ(2 * kLimit + 100, budget_->used());
+}
+
+} // namespace schwanenlied
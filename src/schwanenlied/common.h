@@ -109,6 +109,9 @@ namespace crypto {}
 /** Tor Pluggable Transport modules */
 namespace pt {}
 
+/** Networking utilities */
+namespace net {}
+
 } // namespace schwanenlied
 #endif // DOXYGEN
 
@@ -56,10 +56,14 @@ class RandCtrDrbg {
   /** The PRNG output type */
   typedef uint32_t result_type;
 
-  /* Construct a new RandCtrDrbg instance with a random seed */
-  RandCtrDrbg() {
-    seed();
-  }
+  /**
+   * Construct a new RandCtrDrbg instance with a random seed
+   *
+   * The seed is obtained on the first request (by forcing a reseed), so
+   * instances that are never used never touch OpenSSL's PRNG.
+   */
+  RandCtrDrbg() :
+      request_ctr_(kReseedInterval + 1) {}
 
   /**
    * Construct a new RandCtrDrbg instance with a specific seed
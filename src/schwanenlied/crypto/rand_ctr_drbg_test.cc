@@ -58,5 +58,26 @@ TEST_F(RandCtrDrbgTest, SmokeTest) {
   ::std::cout << ::std::endl;
 }
 
+TEST_F(RandCtrDrbgTest, LazySeed) {
+  const uint8_t seed[] = { 'o', 'b', 'f', 's', 'c', 'l', 'i', 'e', 'n', 't' };
+  ::std::array<uint8_t, 32> a;
+  ::std::array<uint8_t, 32> b;
+
+  // Unseeded instances seed from OpenSSL on first use
+  RandCtrDrbg rng_a;
+  RandCtrDrbg rng_b;
+  ASSERT_TRUE(rng_a.get_bytes(a.data(), a.size()));
+  ASSERT_TRUE(rng_b.get_bytes(b.data(), b.size()));
+  EXPECT_NE(a, b);
+
+  // An explicit seed before the first use must not be replaced
+  RandCtrDrbg rng_c;
+  RandCtrDrbg rng_d(seed, sizeof(seed));
+  rng_c.seed(seed, sizeof(seed));
+  ASSERT_TRUE(rng_c.get_bytes(a.data(), a.size()));
+  ASSERT_TRUE(rng_d.get_bytes(b.data(), b.size()));
+  EXPECT_EQ(a, b);
+}
+
 } // namespace crypto
 } // namespace schwanenlied
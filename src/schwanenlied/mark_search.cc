@@ -0,0 +1,198 @@
+/**
+ * @file    mark_search.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Incremental handshake mark search (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "schwanenlied/mark_search.h"
+
+namespace schwanenlied {
+
+constexpr size_t MarkSearch::kMaxMarkLength;
+
+bool MarkSearch::reset(const uint8_t* mark,
+                       const size_t len,
+                       const size_t max_pos) {
+  if (mark == nullptr || len < 2 || len > mark_.size())
+    return false;
+
+  ::std::memcpy(mark_.data(), mark, len);
+  mark_len_ = len;
+  max_pos_ = max_pos;
+  scanned_ = 0;
+
+  return true;
+}
+
+bool MarkSearch::search(struct evbuffer* buf,
+                        ssize_t& pos) {
+  pos = -1;
+  if (buf == nullptr || mark_len_ == 0)
+    return false;
+
+  // Figure out which candidate positions can be checked, [scanned_, end)
+  const size_t len = ::evbuffer_get_length(buf);
+  if (len < mark_len_)
+    return true;
+  const size_t end = ::std::min(len - mark_len_ + 1, max_pos_ + 1);
+  if (end <= scanned_)
+    return true;
+
+  /*
+   * Walk the data backing the candidates, past what was checked by previous
+   * calls, kMaxExtents chains at a time.
+   */
+  struct evbuffer_ptr ptr;
+  if (::evbuffer_ptr_set(buf, &ptr, scanned_, EVBUFFER_PTR_SET) != 0)
+    return false;
+  while (scanned_ < end) {
+    ::std::array<struct evbuffer_iovec, kMaxExtents> vec;
+    const int ret = ::evbuffer_peek(buf, end - scanned_ + mark_len_ - 1, &ptr,
+                                    vec.data(), vec.size());
+    if (ret <= 0)
+      return false;
+    const size_t nr_vec = ::std::min<size_t>(ret, vec.size());
+
+    size_t base = scanned_;
+    for (size_t i = 0; i < nr_vec && base < end; i++) {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(vec[i].iov_base);
+      const size_t n = vec[i].iov_len;
+      if (n == 0)
+        continue;
+
+      // Candidates that start in this extent, and have a 2nd byte in it
+      const size_t lim = ::std::min(n, end - base);
+      const size_t filter_lim = ::std::min(lim, n - 1);
+      for (size_t off = 0; (off = filter(p, off, filter_lim)) < filter_lim;
+           off++) {
+        if (off + mark_len_ <= n ? ::std::memcmp(p + off, mark_.data(),
+                                                 mark_len_) == 0
+                                 : matches(buf, ptr, base + off - scanned_)) {
+          pos = base + off;
+          scanned_ = pos;
+          return true;
+        }
+      }
+
+      // The candidate that starts at the last byte of this extent
+      if (lim == n && p[n - 1] == mark_[0] &&
+          matches(buf, ptr, base + n - 1 - scanned_)) {
+        pos = base + n - 1;
+        scanned_ = pos;
+        return true;
+      }
+
+      base += n;
+    }
+
+    // Everything before base has been ruled out
+    if (base == scanned_)
+      return false;
+    base = ::std::min(base, end);
+    if (base < end && ::evbuffer_ptr_set(buf, &ptr, base - scanned_,
+                                         EVBUFFER_PTR_ADD) != 0)
+      return false;
+    scanned_ = base;
+  }
+
+  return scanned_ <= max_pos_;
+}
+
+bool MarkSearch::matches(struct evbuffer* buf,
+                         struct evbuffer_ptr ptr,
+                         const size_t off) const {
+  if (off > 0 && ::evbuffer_ptr_set(buf, &ptr, off, EVBUFFER_PTR_ADD) != 0)
+    return false;
+
+  size_t cmp_len = 0;
+  while (cmp_len < mark_len_) {
+    ::std::array<struct evbuffer_iovec, kMaxExtents> vec;
+    const int ret = ::evbuffer_peek(buf, mark_len_ - cmp_len, &ptr, vec.data(),
+                                    vec.size());
+    if (ret <= 0)
+      return false;
+    const size_t nr_vec = ::std::min<size_t>(ret, vec.size());
+
+    size_t consumed = 0;
+    for (size_t i = 0; i < nr_vec && cmp_len < mark_len_; i++) {
+      const size_t n = ::std::min(vec[i].iov_len, mark_len_ - cmp_len);
+      if (::std::memcmp(vec[i].iov_base, mark_.data() + cmp_len, n) != 0)
+        return false;
+      cmp_len += n;
+      consumed += n;
+    }
+    if (cmp_len < mark_len_ &&
+        ::evbuffer_ptr_set(buf, &ptr, consumed, EVBUFFER_PTR_ADD) != 0)
+      return false;
+  }
+
+  return true;
+}
+
+size_t MarkSearch::filter(const uint8_t* p,
+                          size_t off,
+                          const size_t lim) const {
+#ifdef __SSE2__
+  // Compare 16 positions at a time against the first 2 bytes of the mark
+  const __m128i first = ::_mm_set1_epi8(static_cast<char>(mark_[0]));
+  const __m128i second = ::_mm_set1_epi8(static_cast<char>(mark_[1]));
+  for (; off + 16 <= lim; off += 16) {
+    const __m128i a = ::_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off));
+    const __m128i b = ::_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off + 1));
+    const int mask = ::_mm_movemask_epi8(::_mm_and_si128(::_mm_cmpeq_epi8(a, first),
+                                                         ::_mm_cmpeq_epi8(b, second)));
+    if (mask != 0)
+      return off + __builtin_ctz(mask);
+  }
+#endif
+
+  // Handle the tail (or everything, without SSE2) with memchr()
+  while (off < lim) {
+    const void* q = ::std::memchr(p + off, mark_[0], lim - off);
+    if (q == nullptr)
+      return lim;
+    off = reinterpret_cast<const uint8_t*>(q) - p;
+    if (p[off + 1] == mark_[1])
+      return off;
+    off++;
+  }
+
+  return lim;
+}
+
+} // namespace schwanenlied
@@ -0,0 +1,165 @@
+/**
+ * @file    mark_search.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Incremental handshake mark search
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SCHWANENLIED_MARK_SEARCH_H__
+#define SCHWANENLIED_MARK_SEARCH_H__
+
+#include <sys/types.h>
+
+#include <array>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/common.h"
+
+namespace schwanenlied {
+
+/**
+ * An incremental search for a handshake mark in an evbuffer
+ *
+ * The obfs3 and ScrambleSuit handshakes delimit a random amount of padding
+ * with a mark, which arrives a bit at a time.  Instead of rescanning the
+ * buffer from the start on every read like evbuffer_search(), this remembers
+ * how far it has looked (Only the last mark length - 1 bytes are ever
+ * looked at again), and walks the chains directly with evbuffer_peek() so
+ * the buffer is never linearized.  Candidates are found with a vectorized
+ * filter on the first 2 bytes of the mark before being compared in full.
+ *
+ * The data being searched must not be drained till the mark is found, other
+ * than as reported to consume().
+ */
+class MarkSearch {
+ public:
+  /** The longest supported mark */
+  static constexpr size_t kMaxMarkLength = 32;
+
+  MarkSearch() :
+      mark_(),
+      mark_len_(0),
+      max_pos_(0),
+      scanned_(0) {}
+
+  ~MarkSearch() = default;
+
+  /**
+   * Set the mark to search for, and restart the search
+   *
+   * @param[in] mark    The mark
+   * @param[in] len     The length of the mark (2 - kMaxMarkLength bytes)
+   * @param[in] max_pos The furthest offset the mark may start at
+   *
+   * @returns true  - Success
+   * @returns false - Failure (Invalid mark length)
+   */
+  bool reset(const uint8_t* mark,
+             const size_t len,
+             const size_t max_pos);
+
+  /**
+   * Continue searching buf for the mark
+   *
+   * @param[in] buf   The evbuffer to search
+   * @param[out] pos  The offset of the mark, or -1 if it was not found yet
+   *
+   * @returns true  - Success (The mark may or may not have been found)
+   * @returns false - Failure (The mark does not start within max_pos bytes)
+   */
+  bool search(struct evbuffer* buf,
+              ssize_t& pos);
+
+  /**
+   * Return the number of leading bytes known not to start the mark
+   *
+   * These bytes are guaranteed to precede the mark, so the caller is free to
+   * process and drain them (See consume()).
+   */
+  size_t scanned() const { return scanned_; }
+
+  /**
+   * Account for the caller draining leading bytes from the buffer
+   *
+   * @param[in] len The number of bytes drained (<= scanned())
+   */
+  void consume(const size_t len) {
+    SL_ASSERT(len <= scanned_);
+    SL_ASSERT(len <= max_pos_);
+    scanned_ -= len;
+    max_pos_ -= len;
+  }
+
+ private:
+  MarkSearch(const MarkSearch&) = delete;
+  void operator=(const MarkSearch&) = delete;
+
+  /** The most chain extents examined per evbuffer_peek() */
+  static constexpr size_t kMaxExtents = 16;
+
+  /**
+   * Compare the mark against data that may span chains
+   *
+   * @param[in] buf The evbuffer being searched
+   * @param[in] ptr A position in buf at or before the candidate
+   * @param[in] off The offset of the candidate from ptr
+   *
+   * @returns true  - The mark is at the candidate position
+   * @returns false - The mark is not at the candidate position
+   */
+  bool matches(struct evbuffer* buf,
+               struct evbuffer_ptr ptr,
+               const size_t off) const;
+
+  /**
+   * Find the next candidate mark position within a single extent
+   *
+   * Candidates match the first 2 bytes of the mark, so p[lim] must be valid.
+   *
+   * @param[in] p   The extent
+   * @param[in] off The offset to start looking at
+   * @param[in] lim The offset to stop looking at
+   *
+   * @returns The offset of the candidate, or lim if there is none
+   */
+  size_t filter(const uint8_t* p,
+                size_t off,
+                const size_t lim) const;
+
+  ::std::array<uint8_t, kMaxMarkLength> mark_;  /**< The mark */
+  size_t mark_len_; /**< The length of the mark */
+  size_t max_pos_;  /**< The furthest offset the mark may start at */
+  size_t scanned_;  /**< The number of candidate positions ruled out */
+};
+
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_MARK_SEARCH_H__
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "schwanenlied/mark_search.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+static constexpr size_t kMaxMarkLength = MarkSearch::kMaxMarkLength;
+
+/*
+ * The padding limits of the handshakes that use MarkSearch (obfs3's
+ * MAX_PADDING, and ScrambleSuit's UniformDH padding).
+ */
+static constexpr size_t kObfs3MaxPadding = 8194;
+static constexpr size_t kScrambleSuitMaxPadding = 1308;
+
+class MarkSearchTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    rng_.seed(0x6d61726b);
+    buf_ = ::evbuffer_new();
+    ASSERT_TRUE(buf_ != nullptr);
+    restart();
+  }
+
+  virtual void TearDown() {
+    ::evbuffer_free(buf_);
+  }
+
+  /** Generate len bytes, drawn from the first alpha values */
+  ::std::vector<uint8_t> random_data(const size_t len,
+                                     const int alpha = 256) {
+    ::std::vector<uint8_t> data(len);
+    for (auto& b : data)
+      b = static_cast<uint8_t>(rng_() % alpha);
+    return data;
+  }
+
+  /** Empty buf_ to start a new search */
+  void restart() {
+    ASSERT_EQ(0, ::evbuffer_drain(buf_, ::evbuffer_get_length(buf_)));
+    fed_ = 0;
+    drained_ = 0;
+  }
+
+  /** Append data[fed_, fed_ + len) to buf_ as a separate chain */
+  void feed(const ::std::vector<uint8_t>& data,
+            const size_t len) {
+    ASSERT_GE(data.size(), fed_ + len);
+    if (len == 0)
+      return;
+    struct evbuffer* tmp = ::evbuffer_new();
+    ASSERT_TRUE(tmp != nullptr);
+    ASSERT_EQ(0, ::evbuffer_add(tmp, data.data() + fed_, len));
+    ASSERT_EQ(0, ::evbuffer_add_buffer(buf_, tmp));
+    ::evbuffer_free(tmp);
+    fed_ += len;
+  }
+
+  /** Drain len bytes that the search has ruled out */
+  void consume(const size_t len) {
+    ASSERT_LE(len, search_.scanned());
+    ASSERT_EQ(0, ::evbuffer_drain(buf_, len));
+    search_.consume(len);
+    drained_ += len;
+  }
+
+  /**
+   * Search for the mark in the first fed_ bytes of data by brute force
+   *
+   * @returns false if the mark can no longer start within max_pos bytes,
+   * with pos set to the offset of the mark, or -1 if it was not found yet
+   */
+  bool naive_search(const ::std::vector<uint8_t>& data,
+                    const ::std::vector<uint8_t>& mark,
+                    const size_t max_pos,
+                    ssize_t& pos) const {
+    pos = -1;
+    for (size_t i = 0; i + mark.size() <= fed_ && i <= max_pos; i++) {
+      if (::std::equal(mark.begin(), mark.end(), data.begin() + i)) {
+        pos = i;
+        return true;
+      }
+    }
+    return fed_ < max_pos + mark.size();
+  }
+
+  /** Run the search, and check it against naive_search() */
+  void check_search(const ::std::vector<uint8_t>& data,
+                    const ::std::vector<uint8_t>& mark,
+                    const size_t max_pos,
+                    bool& ok,
+                    ssize_t& pos) {
+    ssize_t expected_pos;
+    const bool expected_ok = naive_search(data, mark, max_pos, expected_pos);
+    ok = search_.search(buf_, pos);
+    ASSERT_EQ(expected_ok, ok) << "fed: " << fed_;
+    if (ok) {
+      if (pos != -1)
+        pos += drained_;
+      ASSERT_EQ(expected_pos, pos) << "fed: " << fed_;
+    }
+    ASSERT_LE(search_.scanned(), ::evbuffer_get_length(buf_));
+  }
+
+  ::std::mt19937 rng_;
+  MarkSearch search_;
+  struct evbuffer* buf_;
+  size_t fed_;      /**< Bytes of the data appended to buf_ */
+  size_t drained_;  /**< Bytes of the data drained from buf_ */
+};
+
+TEST_F(MarkSearchTest, Reset) {
+  const auto mark = random_data(kMaxMarkLength + 1);
+  ASSERT_FALSE(search_.reset(nullptr, 16, 100));
+  ASSERT_FALSE(search_.reset(mark.data(), 1, 100));
+  ASSERT_FALSE(search_.reset(mark.data(), kMaxMarkLength + 1, 100));
+  ASSERT_TRUE(search_.reset(mark.data(), 2, 100));
+  ASSERT_TRUE(search_.reset(mark.data(), kMaxMarkLength, 100));
+  ASSERT_EQ(0u, search_.scanned());
+
+  // Searching without a mark fails
+  MarkSearch unset;
+  ssize_t pos;
+  ASSERT_FALSE(unset.search(buf_, pos));
+  ASSERT_EQ(-1, pos);
+}
+
+TEST_F(MarkSearchTest, RandomFragmentation) {
+  /*
+   * Small alphabets so that partial matches are common, fed a few bytes at a
+   * time as separate chains, optionally draining what was ruled out.
+   */
+  for (int i = 0; i < 5000; i++) {
+    const size_t mark_len = 2 + rng_() % (kMaxMarkLength - 1);
+    const int alpha = 2 + rng_() % 4;
+    const auto mark = random_data(mark_len, alpha);
+    const size_t max_pos = rng_() % 300;
+    auto data = random_data(rng_() % 700, alpha);
+    if (rng_() % 2 && data.size() > mark_len) {
+      const size_t at = rng_() % (data.size() - mark_len);
+      ::std::copy(mark.begin(), mark.end(), data.begin() + at);
+    }
+    const bool drain = rng_() % 2;
+
+    restart();
+    ASSERT_TRUE(search_.reset(mark.data(), mark.size(), max_pos));
+    while (true) {
+      const size_t n = (rng_() % 4 == 0) ? rng_() % 200 : rng_() % 5;
+      feed(data, ::std::min(n, data.size() - fed_));
+
+      bool ok;
+      ssize_t pos;
+      check_search(data, mark, max_pos, ok, pos);
+      if (!ok || pos != -1 || fed_ == data.size())
+        break;
+      if (drain)
+        consume(rng_() % (search_.scanned() + 1));
+    }
+  }
+}
+
+TEST_F(MarkSearchTest, StraddlesChains) {
+  const auto mark = random_data(kMaxMarkLength);
+  for (size_t split = 0; split <= mark.size(); split++) {
+    // Padding, with the mark split across 2 chains at every position
+    auto data = random_data(100 + split);
+    data.insert(data.end(), mark.begin(), mark.end());
+    const size_t mark_pos = data.size() - mark.size();
+
+    restart();
+    ASSERT_TRUE(search_.reset(mark.data(), mark.size(), kObfs3MaxPadding));
+    bool ok;
+    ssize_t pos;
+    feed(data, mark_pos + split);
+    check_search(data, mark, kObfs3MaxPadding, ok, pos);
+    feed(data, data.size() - fed_);
+    check_search(data, mark, kObfs3MaxPadding, ok, pos);
+    ASSERT_EQ(static_cast<ssize_t>(mark_pos), pos);
+  }
+
+  // The mark spread over single byte chains, searched all at once
+  auto data = random_data(37);
+  data.insert(data.end(), mark.begin(), mark.end());
+  restart();
+  while (fed_ < data.size())
+    feed(data, 1);
+  ASSERT_TRUE(search_.reset(mark.data(), mark.size(), kObfs3MaxPadding));
+  bool ok;
+  ssize_t pos;
+  check_search(data, mark, kObfs3MaxPadding, ok, pos);
+  ASSERT_EQ(37, pos);
+}
+
+TEST_F(MarkSearchTest, PaddingWithMarkPrefixes) {
+  /*
+   * Padding made of prefixes of the mark, so that nearly every position
+   * passes the 2 byte candidate filter (Including runs longer than a
+   * vector's worth), and some overlap the real mark.
+   */
+  const auto mark = random_data(kMaxMarkLength);
+  ::std::vector<uint8_t> data;
+  while (data.size() < kScrambleSuitMaxPadding - mark.size()) {
+    const size_t len = 2 + rng_() % (mark.size() - 2);
+    data.insert(data.end(), mark.begin(), mark.begin() + len);
+  }
+  data.insert(data.end(), mark.begin(), mark.end());
+  const size_t mark_pos = data.size() - mark.size();
+  data.insert(data.end(), mark.begin(), mark.end());
+
+  // All at once, and in odd sized pieces
+  for (const size_t piece : { data.size(), size_t(1), size_t(7),
+                              size_t(31), size_t(33), size_t(100) }) {
+    restart();
+    ASSERT_TRUE(search_.reset(mark.data(), mark.size(),
+                              kScrambleSuitMaxPadding));
+    bool ok;
+    ssize_t pos = -1;
+    while (pos == -1) {
+      feed(data, ::std::min(piece, data.size() - fed_));
+      check_search(data, mark, kScrambleSuitMaxPadding, ok, pos);
+      ASSERT_TRUE(ok);
+    }
+    ASSERT_EQ(static_cast<ssize_t>(mark_pos), pos);
+  }
+}
+
+TEST_F(MarkSearchTest, PaddingLimit) {
+  const auto mark = random_data(kMaxMarkLength);
+  for (const size_t max_pos : { size_t(0), kScrambleSuitMaxPadding,
+                                kObfs3MaxPadding }) {
+    // Bytes that can't start the mark
+    const uint8_t filler = mark[0] ^ 0xff;
+
+    // The mark may start exactly at max_pos
+    ::std::vector<uint8_t> data(max_pos, filler);
+    data.insert(data.end(), mark.begin(), mark.end());
+    restart();
+    ASSERT_TRUE(search_.reset(mark.data(), mark.size(), max_pos));
+    bool ok;
+    ssize_t pos;
+    feed(data, data.size() - 1);
+    check_search(data, mark, max_pos, ok, pos);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(-1, pos);
+    feed(data, 1);
+    check_search(data, mark, max_pos, ok, pos);
+    ASSERT_EQ(static_cast<ssize_t>(max_pos), pos);
+
+    // But not a byte after, which fails once the mark could have arrived
+    data.insert(data.begin(), filler);
+    restart();
+    ASSERT_TRUE(search_.reset(mark.data(), mark.size(), max_pos));
+    feed(data, max_pos + mark.size() - 1);
+    check_search(data, mark, max_pos, ok, pos);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(-1, pos);
+    feed(data, 1);
+    check_search(data, mark, max_pos, ok, pos);
+    ASSERT_FALSE(ok);
+  }
+}
+
+} // namespace schwanenlied
@@ -0,0 +1,800 @@
+/**
+ * @file    io_uring.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   io_uring relay backend (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define IO_URING_IMPL
+
+#include "schwanenlied/net/io_uring.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include <event2/buffer.h>
+
+namespace schwanenlied {
+namespace net {
+
+constexpr unsigned IoUring::kQueueDepth;
+constexpr unsigned IoUring::kNrBuffers;
+constexpr size_t IoUring::kBufferSize;
+constexpr uint16_t IoUring::kBufferGroup;
+constexpr size_t IoUring::kMaxSendSize;
+constexpr size_t IoUring::kMaxRecvBuffered;
+constexpr unsigned IoUring::kMaxLentBuffers;
+constexpr int IoUring::Socket::kMaxSendIov;
+
+namespace {
+
+/*
+ * liburing is not a dependency, so the 3 system calls are done by hand.  The
+ * ring memory is shared with the kernel, so the head/tail accesses need
+ * acquire/release semantics.
+ */
+
+int io_uring_setup(const unsigned entries,
+                   struct io_uring_params* p) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(const int fd,
+                   const unsigned to_submit,
+                   const unsigned min_complete,
+                   const unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(const int fd,
+                      const unsigned opcode,
+                      void* arg,
+                      const unsigned nr_args) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg,
+                                    nr_args));
+}
+
+inline unsigned load_acquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+inline void store_release(T* p, const T v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+} // namespace
+
+IoUring::~IoUring() {
+  // Anything still attached is torn down without being flushed
+  // (Returning the buffers they hold)
+  for (auto iter = sockets_.begin(); iter != sockets_.end(); ) {
+    Socket* sock = *iter++;
+    delete sock;
+  }
+
+  if (completion_ev_ != nullptr)
+    ::event_free(completion_ev_);
+  if (submit_ev_ != nullptr)
+    ::event_free(submit_ev_);
+
+  // Closing the ring cancels everything that is in flight
+  if (ring_fd_ >= 0)
+    ::close(ring_fd_);
+  if (event_fd_ >= 0)
+    ::close(event_fd_);
+  if (sqes_ != nullptr)
+    ::munmap(sqes_, sqes_sz_);
+  if (cq_ring_ != nullptr && cq_ring_sz_ != 0)
+    ::munmap(cq_ring_, cq_ring_sz_);
+  if (sq_ring_ != nullptr)
+    ::munmap(sq_ring_, sq_ring_sz_);
+  if (pool_ != nullptr) {
+    // The last buffer to be returned frees the pool if any are still lent out
+    pool_->ring = nullptr;
+    if (pool_->nr_lent == 0) {
+      ::munmap(pool_->bufs, kNrBuffers * kBufferSize);
+      delete pool_;
+    }
+  }
+}
+
+bool IoUring::init() {
+  SL_ASSERT(ring_fd_ < 0);
+
+  struct io_uring_params p;
+  ::std::memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = kQueueDepth * 8;
+  ring_fd_ = io_uring_setup(kQueueDepth, &p);
+  if (ring_fd_ < 0) {
+    PLOG(WARNING) << "Failed to create the io_uring";
+    return false;
+  }
+
+  // Map the submission/completion queues
+  sq_ring_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_sz_ = ::std::max(sq_ring_sz_, cq_ring_sz_);
+  sq_ring_ = ::mmap(nullptr, sq_ring_sz_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    PLOG(WARNING) << "Failed to map the io_uring SQ";
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+    cq_ring_sz_ = 0;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_sz_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      PLOG(WARNING) << "Failed to map the io_uring CQ";
+      return false;
+    }
+  }
+  sqes_sz_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = ::mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map the io_uring SQEs";
+    return false;
+  }
+  sqes_ = reinterpret_cast<struct io_uring_sqe*>(sqes);
+
+  uint8_t* sq = reinterpret_cast<uint8_t*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; i++)
+    sq_array_[i] = i;
+
+  uint8_t* cq = reinterpret_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  /*
+   * Allocate the provided receive buffers.  Multishot receives pick a buffer
+   * for each completion, so no memory is tied up in sockets that have
+   * nothing to read.  The buffers are handed to the kernel with the first
+   * submission.
+   */
+  void* bufs = ::mmap(nullptr, kNrBuffers * kBufferSize,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  if (bufs == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to allocate the io_uring buffers";
+    return false;
+  }
+  bufs_ = reinterpret_cast<uint8_t*>(bufs);
+  pool_ = new BufferPool;
+  pool_->ring = this;
+  pool_->bufs = bufs_;
+  pool_->nr_lent = 0;
+  recycled_.reserve(kNrBuffers);
+  recycled_.push_back(::std::make_pair(0U, kNrBuffers));
+
+  // Completions are signaled to the libevent2 loop via an eventfd
+  event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    PLOG(WARNING) << "Failed to create the io_uring eventfd";
+    return false;
+  }
+  if (0 != io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd_,
+                             1)) {
+    PLOG(WARNING) << "Failed to register the io_uring eventfd";
+    return false;
+  }
+
+  event_callback_fn completion_cb = [](evutil_socket_t sock,
+                                       short which,
+                                       void* arg) {
+    (void)which;
+
+    uint64_t count;
+    while (::read(sock, &count, sizeof(count)) > 0);
+    reinterpret_cast<IoUring*>(arg)->reap();
+  };
+  completion_ev_ = ::event_new(base_, event_fd_, EV_READ | EV_PERSIST,
+                               completion_cb, this);
+  event_callback_fn submit_cb = [](evutil_socket_t sock,
+                                   short which,
+                                   void* arg) {
+    (void)sock;
+    (void)which;
+
+    reinterpret_cast<IoUring*>(arg)->submit();
+  };
+  submit_ev_ = ::event_new(base_, -1, 0, submit_cb, this);
+  if (completion_ev_ == nullptr || submit_ev_ == nullptr) {
+    LOG(WARNING) << "Failed to allocate the io_uring events";
+    return false;
+  }
+  ::event_priority_set(completion_ev_, priority_);
+  ::event_priority_set(submit_ev_, priority_);
+  ::event_add(completion_ev_, nullptr);
+  ::event_active(submit_ev_, EV_TIMEOUT, 0);
+
+  LOG(INFO) << "io_uring initialized (SQ: " << p.sq_entries << ", CQ: "
+            << p.cq_entries << ", Buffers: " << kNrBuffers << "x"
+            << kBufferSize << ")";
+
+  return true;
+}
+
+IoUring::Socket* IoUring::attach(struct bufferevent* bev) {
+  SL_ASSERT(bev != nullptr);
+
+  if (completion_ev_ == nullptr || dead_)
+    return nullptr;
+
+  const evutil_socket_t fd = ::bufferevent_getfd(bev);
+  if (fd < 0)
+    return nullptr;
+
+  // bev owns fd and closes it when freed, so keep a duplicate around
+  const int sock_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (sock_fd < 0) {
+    PLOG(WARNING) << "Failed to dup() socket: " << fd;
+    return nullptr;
+  }
+
+  struct bufferevent* pair[2];
+  if (0 != ::bufferevent_pair_new(base_, BEV_OPT_DEFER_CALLBACKS, pair)) {
+    LOG(WARNING) << "Failed to allocate a bufferevent pair";
+    ::close(sock_fd);
+    return nullptr;
+  }
+  struct evbuffer* send_buf = ::evbuffer_new();
+  if (send_buf == nullptr) {
+    LOG(WARNING) << "Failed to allocate a send buffer";
+    ::bufferevent_free(pair[0]);
+    ::bufferevent_free(pair[1]);
+    ::close(sock_fd);
+    return nullptr;
+  }
+
+  Socket* sock = new Socket(*this, sock_fd);
+  sock->bev_ = pair[0];
+  sock->partner_ = pair[1];
+  sock->send_buf_ = send_buf;
+  sock->iter_ = sockets_.insert(sockets_.end(), sock);
+
+  /*
+   * The partner end is ours: Data to be sent shows up in its input, and
+   * received data is written to its output.  The high read watermark keeps
+   * unsent data in bev's output, where the owner's backpressure logic
+   * expects it, and the low write watermark is when receiving resumes.
+   */
+  bufferevent_data_cb readcb = [](struct bufferevent* bev,
+                                  void* ctx) {
+    (void)bev;
+
+    reinterpret_cast<Socket*>(ctx)->on_partner_read();
+  };
+  bufferevent_data_cb writecb = [](struct bufferevent* bev,
+                                   void* ctx) {
+    (void)bev;
+
+    reinterpret_cast<Socket*>(ctx)->on_partner_write();
+  };
+  ::bufferevent_setcb(sock->partner_, readcb, writecb, nullptr, sock);
+  ::bufferevent_setwatermark(sock->partner_, EV_READ, 0, kMaxSendSize);
+  ::bufferevent_setwatermark(sock->partner_, EV_WRITE,
+                             kMaxRecvBuffered / 2, 0);
+  ::bufferevent_priority_set(sock->partner_, priority_);
+  ::bufferevent_enable(sock->partner_, EV_READ | EV_WRITE);
+  ::bufferevent_enable(sock->bev_, ::bufferevent_get_enabled(bev));
+
+  /*
+   * Carry over anything that was buffered, and retire bev.  Socket
+   * bufferevents only let libevent2 drain their output, but bev is about to
+   * be freed anyway.
+   */
+  struct evbuffer* bev_output = ::bufferevent_get_output(bev);
+  ::evbuffer_unfreeze(bev_output, 1);
+  ::evbuffer_add_buffer(::bufferevent_get_output(sock->partner_),
+                        ::bufferevent_get_input(bev));
+  ::evbuffer_add_buffer(::bufferevent_get_output(sock->bev_), bev_output);
+  ::bufferevent_free(bev);
+
+  sock->recv_arm();
+
+  return sock;
+}
+
+const ::std::string IoUring::to_string() const {
+  ::std::ostringstream stream;
+
+  stream << "Sockets: " << sockets_.size()
+         << " Submits: " << nr_enters_ << " SQEs: " << nr_sqes_
+         << " CQEs: " << nr_cqes_ << " RX: " << nr_rx_bytes_
+         << " (Copied: " << nr_rx_copied_ << ") TX: " << nr_tx_bytes_
+         << " Lent: " << (pool_ != nullptr ? pool_->nr_lent : 0);
+  if (dead_)
+    stream << " (Aborted)";
+
+  return stream.str();
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+  if (dead_)
+    return nullptr;
+  if (sq_pending_ == sq_entries_) {
+    enter();
+    if (dead_ || sq_pending_ == sq_entries_)
+      return nullptr;
+  }
+
+  const unsigned tail = *sq_tail_;
+  struct io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+  ::std::memset(sqe, 0, sizeof(*sqe));
+  store_release(sq_tail_, tail + 1);
+  sq_pending_++;
+  schedule_submit();
+
+  return sqe;
+}
+
+void IoUring::schedule_submit() {
+  /*
+   * Everything queued while processing this loop iteration's callbacks is
+   * submitted with one io_uring_enter().  The submit event has the same
+   * priority as the relay I/O, so it runs after the callbacks that are
+   * already pending.
+   */
+  ::event_active(submit_ev_, EV_TIMEOUT, 0);
+}
+
+void IoUring::submit() {
+  if (dead_) {
+    // Destroy the released Sockets that abort() could not destroy in place
+    for (auto iter = sockets_.begin(); iter != sockets_.end(); ) {
+      Socket* sock = *iter++;
+      sock->maybe_destroy();
+    }
+    return;
+  }
+
+  do {
+    provide_buffers();
+    enter();
+  } while (!recycled_.empty() && sq_pending_ < sq_entries_);
+}
+
+void IoUring::enter() {
+  while (sq_pending_ > 0) {
+    const int ret = io_uring_enter(ring_fd_, sq_pending_, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EBUSY || errno == ENOMEM) {
+        // Out of completion queue space or memory, retry later
+        schedule_submit();
+        return;
+      }
+      abort(errno);
+      return;
+    }
+
+    nr_enters_++;
+    nr_sqes_ += ret;
+    sq_pending_ -= ret;
+  }
+}
+
+void IoUring::abort(const int err) {
+  SL_ASSERT(!dead_);
+
+  LOG(ERROR) << "Failed to submit to the io_uring, giving up on it: "
+             << ::std::strerror(err);
+
+  /*
+   * Nothing that is in flight is going to be completed, so close the ring
+   * (Which cancels all of it), and fail every Socket.  The owners see an
+   * error on their bufferevents, and close the Sockets as usual.  This can
+   * be called from within a Socket, so destroying the Sockets that are
+   * already released is deferred to submit().
+   */
+  dead_ = true;
+  ::event_del(completion_ev_);
+  ::close(ring_fd_);
+  ring_fd_ = -1;
+  sq_pending_ = 0;
+  recycled_.clear();
+
+  for (auto sock : sockets_)
+    sock->on_abort(err);
+  ::event_active(submit_ev_, EV_TIMEOUT, 0);
+}
+
+void IoUring::reap() {
+  /*
+   * Only handle what has completed so far, as the multishot receives keep
+   * posting completions for as long as the peers keep sending, and the
+   * owners need to get a chance to apply backpressure.
+   */
+  const unsigned tail = load_acquire(cq_tail_);
+  unsigned head = *cq_head_;
+  while (head != tail && !dead_) {
+    // Copy the completion out so the slot can be released right away
+    const struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+    const uint64_t user_data = cqe->user_data;
+    const int32_t res = cqe->res;
+    const uint32_t flags = cqe->flags;
+    store_release(cq_head_, ++head);
+    nr_cqes_++;
+
+    Socket* sock = reinterpret_cast<Socket*>(user_data & ~3ULL);
+    switch (user_data & 3) {
+    case Op::kPROVIDE:
+      if (res < 0)
+        LOG(ERROR) << "Failed to provide io_uring buffers: "
+                   << ::std::strerror(-res);
+      break;
+    case Op::kRECV:
+      sock->on_recv(res, flags);
+      break;
+    case Op::kSEND:
+      sock->on_send(res);
+      break;
+    case Op::kCANCEL:
+      sock->on_cancel();
+      break;
+    default:
+      LOG(FATAL) << "Invalid io_uring completion: " << user_data;
+    }
+  }
+}
+
+void IoUring::recycle_buffer(const uint16_t bid) {
+  if (dead_)
+    return;
+
+  // Buffers tend to complete in order, so they are returned in runs
+  if (!recycled_.empty()) {
+    auto& run = recycled_.back();
+    if (bid == run.first + run.second) {
+      run.second++;
+      return;
+    }
+  }
+
+  recycled_.push_back(::std::make_pair(static_cast<unsigned>(bid), 1U));
+  schedule_submit();
+}
+
+void IoUring::provide_buffers() {
+  auto iter = recycled_.begin();
+  for (; iter != recycled_.end() && sq_pending_ < sq_entries_; ++iter) {
+    const unsigned tail = *sq_tail_;
+    struct io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+    ::std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int32_t>(iter->second);
+    sqe->addr = reinterpret_cast<uintptr_t>(bufs_ + iter->first * kBufferSize);
+    sqe->len = kBufferSize;
+    sqe->off = iter->first;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = Op::kPROVIDE;
+    store_release(sq_tail_, tail + 1);
+    sq_pending_++;
+  }
+  recycled_.erase(recycled_.begin(), iter);
+}
+
+void IoUring::on_buffer_returned(const void* data,
+                                 size_t len,
+                                 void* arg) {
+  (void)len;
+
+  BufferPool* pool = reinterpret_cast<BufferPool*>(arg);
+  const size_t off = reinterpret_cast<const uint8_t*>(data) - pool->bufs;
+  SL_ASSERT(off % kBufferSize == 0 && off < kNrBuffers * kBufferSize);
+  SL_ASSERT(pool->nr_lent > 0);
+
+  pool->nr_lent--;
+  if (pool->ring != nullptr) {
+    pool->ring->recycle_buffer(static_cast<uint16_t>(off / kBufferSize));
+  } else if (pool->nr_lent == 0) {
+    ::munmap(pool->bufs, kNrBuffers * kBufferSize);
+    delete pool;
+  }
+}
+
+IoUring::Socket::~Socket() {
+  ring_.sockets_.erase(iter_);
+  if (bev_ != nullptr)
+    ::bufferevent_free(bev_);
+  if (partner_ != nullptr)
+    ::bufferevent_free(partner_);
+  if (send_buf_ != nullptr)
+    ::evbuffer_free(send_buf_);
+  ::close(fd_);
+}
+
+void IoUring::Socket::release() {
+  SL_ASSERT(!released_);
+
+  released_ = true;
+
+  // Hand over whatever is still queued, and drop what was received
+  ::bufferevent_flush(bev_, EV_WRITE, BEV_FLUSH);
+  ::bufferevent_free(bev_);
+  bev_ = nullptr;
+  ::evbuffer_drain(::bufferevent_get_output(partner_),
+                   ::evbuffer_get_length(::bufferevent_get_output(partner_)));
+
+  recv_cancel();
+  send_kick();
+  maybe_destroy();
+}
+
+void IoUring::Socket::recv_arm() {
+  if (recv_armed_ || recv_paused_ || recv_eof_ || failed_ || released_)
+    return;
+
+  struct io_uring_sqe* sqe = ring_.get_sqe();
+  if (sqe == nullptr) {
+    fail(EBUSY);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd_;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = reinterpret_cast<uintptr_t>(this) | Op::kRECV;
+  recv_armed_ = true;
+  nr_inflight_++;
+}
+
+void IoUring::Socket::recv_cancel() {
+  if (!recv_armed_ || cancel_inflight_)
+    return;
+
+  struct io_uring_sqe* sqe = ring_.get_sqe();
+  if (sqe == nullptr)
+    return; // The socket getting closed will cancel the receive
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uintptr_t>(this) | Op::kRECV;
+  sqe->user_data = reinterpret_cast<uintptr_t>(this) | Op::kCANCEL;
+  cancel_inflight_ = true;
+  nr_inflight_++;
+}
+
+void IoUring::Socket::send_kick() {
+  if (send_inflight_)
+    return;
+
+  struct evbuffer* buf = ::bufferevent_get_input(partner_);
+  if (failed_) {
+    ::evbuffer_drain(buf, ::evbuffer_get_length(buf));
+    ::evbuffer_drain(send_buf_, ::evbuffer_get_length(send_buf_));
+    return;
+  }
+
+  /*
+   * The kernel reads from the evbuffer's memory till the send completes, so
+   * the data is moved somewhere that nothing else appends to (evbuffer_add()
+   * is free to realign chains).
+   */
+  if (::evbuffer_get_length(send_buf_) == 0)
+    ::evbuffer_remove_buffer(buf, send_buf_, kMaxSendSize);
+  if (::evbuffer_get_length(send_buf_) == 0)
+    return;
+
+  struct evbuffer_iovec vecs[kMaxSendIov];
+  int n = ::evbuffer_peek(send_buf_, -1, nullptr, vecs, kMaxSendIov);
+  if (n > kMaxSendIov)
+    n = kMaxSendIov;
+  for (int i = 0; i < n; i++) {
+    iov_[i].iov_base = vecs[i].iov_base;
+    iov_[i].iov_len = vecs[i].iov_len;
+  }
+  ::std::memset(&msg_, 0, sizeof(msg_));
+  msg_.msg_iov = iov_;
+  msg_.msg_iovlen = n;
+
+  struct io_uring_sqe* sqe = ring_.get_sqe();
+  if (sqe == nullptr) {
+    fail(EBUSY);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd_;
+  sqe->addr = reinterpret_cast<uintptr_t>(&msg_);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = reinterpret_cast<uintptr_t>(this) | Op::kSEND;
+  send_inflight_ = true;
+  nr_inflight_++;
+}
+
+void IoUring::Socket::maybe_deliver_eof() {
+  if (eof_delivered_ || released_ || !(recv_eof_ || failed_))
+    return;
+
+  // The EOF is reported once the owner has read everything
+  if (::evbuffer_get_length(::bufferevent_get_output(partner_)) > 0)
+    return;
+
+  eof_delivered_ = true;
+  ::bufferevent_flush(partner_, EV_WRITE, BEV_FINISHED);
+}
+
+void IoUring::Socket::fail(const int err) {
+  if (failed_)
+    return;
+
+  LOG(DEBUG) << "Socket " << fd_ << ": I/O error: " << ::std::strerror(err);
+
+  failed_ = true;
+  recv_cancel();
+  send_kick();
+  maybe_deliver_eof();
+}
+
+void IoUring::Socket::maybe_destroy() {
+  if (!released_ || nr_inflight_ > 0)
+    return;
+  if (!failed_ &&
+      (::evbuffer_get_length(send_buf_) > 0 ||
+       ::evbuffer_get_length(::bufferevent_get_input(partner_)) > 0))
+    return;
+
+  delete this;
+}
+
+void IoUring::Socket::on_recv(const int32_t res,
+                              const uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    recv_armed_ = false;
+    nr_inflight_--;
+  }
+
+  if (res > 0) {
+    SL_ASSERT(flags & IORING_CQE_F_BUFFER);
+
+    /*
+     * Lend the buffer to the evbuffer, so that the owner processes (decrypts)
+     * the data in place where the kernel put it, and the buffer is recycled
+     * once the data is consumed.  Each Socket holds at most
+     * kMaxRecvBuffered worth of buffers, and if too many are lent out
+     * overall the data is copied and the buffer is recycled immediately, so
+     * that a few slow readers never starve the other sockets of buffers.
+     */
+    const uint16_t bid = static_cast<uint16_t>(flags >>
+                                               IORING_CQE_BUFFER_SHIFT);
+    uint8_t* data = ring_.bufs_ + bid * kBufferSize;
+    ring_.nr_rx_bytes_ += res;
+    struct evbuffer* buf = ::bufferevent_get_output(partner_);
+    if (released_) {
+      ring_.recycle_buffer(bid);
+    } else if (ring_.pool_->nr_lent < kMaxLentBuffers &&
+               ::evbuffer_add_reference(buf, data, res, on_buffer_returned,
+                                        ring_.pool_) == 0) {
+      ring_.pool_->nr_lent++;
+    } else {
+      ring_.nr_rx_copied_ += res;
+      ::evbuffer_add(buf, data, res);
+      ring_.recycle_buffer(bid);
+    }
+
+    if (!recv_paused_ &&
+        ::evbuffer_get_length(buf) >= kMaxRecvBuffered) {
+      recv_paused_ = true;
+      recv_cancel();
+    }
+  } else if (res == 0) {
+    recv_eof_ = true;
+    maybe_deliver_eof();
+  } else if (res != -ENOBUFS && res != -ECANCELED) {
+    fail(-res);
+  }
+
+  if (released_)
+    maybe_destroy();
+  else if (!recv_armed_)
+    recv_arm();
+}
+
+void IoUring::Socket::on_send(const int32_t res) {
+  send_inflight_ = false;
+  nr_inflight_--;
+
+  if (res >= 0) {
+    ring_.nr_tx_bytes_ += res;
+    ::evbuffer_drain(send_buf_, res);
+  } else if (res != -EINTR && res != -EAGAIN) {
+    fail(-res);
+  }
+
+  send_kick();
+  maybe_destroy();
+}
+
+void IoUring::Socket::on_cancel() {
+  cancel_inflight_ = false;
+  nr_inflight_--;
+
+  maybe_destroy();
+}
+
+void IoUring::Socket::on_abort(const int err) {
+  nr_inflight_ = 0;
+  recv_armed_ = false;
+  cancel_inflight_ = false;
+  send_inflight_ = false;
+
+  fail(err);
+}
+
+void IoUring::Socket::on_partner_read() {
+  send_kick();
+}
+
+void IoUring::Socket::on_partner_write() {
+  if (recv_paused_ &&
+      ::evbuffer_get_length(::bufferevent_get_output(partner_)) <
+      kMaxRecvBuffered / 2) {
+    recv_paused_ = false;
+    recv_arm();
+  }
+
+  maybe_deliver_eof();
+}
+
+} // namespace net
+} // namespace schwanenlied
+
+#endif // ENABLE_IO_URING
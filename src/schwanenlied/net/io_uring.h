@@ -0,0 +1,427 @@
+/**
+ * @file    io_uring.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   io_uring relay backend
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SCHWANENLIED_NET_IO_URING_H__
+#define SCHWANENLIED_NET_IO_URING_H__
+
+#define IO_URING_LOGGER "io_uring"
+#ifdef IO_URING_IMPL
+#define _LOGGER IO_URING_LOGGER
+#endif
+
+// Pulls in config.h, which decides if the rest of this file is used
+#include "schwanenlied/common.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct evbuffer;
+
+namespace schwanenlied {
+namespace net {
+
+/**
+ * An io_uring based I/O backend for relaying data over connected sockets
+ *
+ * Sockets are handed over once they are connected, and from then on all of
+ * their I/O is done with io_uring: a multishot receive per socket into a
+ * shared pool of provided buffers, and a sendmsg() of up to kMaxSendSize
+ * bytes of the pending data.  Submissions are batched, and are all handed to
+ * the kernel with a single io_uring_enter() once per event loop iteration.
+ *
+ * Received data is not copied out of the provided buffers, they are lent to
+ * the evbuffers as reference chains, and are returned to the kernel once
+ * the data has been consumed (Even if that is after the IoUring is
+ * destroyed).
+ *
+ * If the ring fails in an unexpected way, the attached Sockets are failed,
+ * and attach() fails from then on so that new sockets stay with libevent2.
+ *
+ * The ring's completions are signaled through an eventfd that is registered
+ * with the libevent2 event_base, so everything else (SOCKS negotiation,
+ * handshakes, timers) keeps running on the libevent2 loop as before.
+ *
+ * To the rest of the code a Socket looks like a socket bufferevent (It is one
+ * end of a bufferevent_pair), so reading, writing, watermarks, backpressure
+ * and EOF handling work unchanged.
+ *
+ * @warning This is not and will never be thread safe
+ */
+class IoUring {
+ public:
+  /** A socket whose I/O is done by an IoUring */
+  class Socket {
+   public:
+    /**
+     * Query the bufferevent that replaced the socket bufferevent
+     *
+     * Data written to it is sent, received data can be read from it, and EOF
+     * or errors are reported via the event callback.
+     */
+    struct bufferevent* bev() const { return bev_; }
+
+    /** Query the underlying socket */
+    evutil_socket_t fd() const { return fd_; }
+
+    /**
+     * Free bev(), and close the socket once everything written to it has
+     * been sent
+     *
+     * @warning The Socket *MUST NOT* be used after this is called.
+     */
+    void release();
+
+   private:
+    Socket(IoUring& ring,
+           const evutil_socket_t fd) :
+        ring_(ring),
+        fd_(fd),
+        bev_(nullptr),
+        partner_(nullptr),
+        send_buf_(nullptr),
+        msg_(),
+        nr_inflight_(0),
+        recv_armed_(false),
+        recv_paused_(false),
+        recv_eof_(false),
+        cancel_inflight_(false),
+        send_inflight_(false),
+        failed_(false),
+        eof_delivered_(false),
+        released_(false) {}
+
+    ~Socket();
+
+    Socket(const Socket&) = delete;
+    void operator=(const Socket&) = delete;
+
+    friend IoUring;
+
+    /** The most buffers that are sent with one sendmsg() */
+    static constexpr int kMaxSendIov = 16;
+
+    /** Arm the multishot receive if it is not armed and not paused */
+    void recv_arm();
+
+    /** Cancel the multishot receive */
+    void recv_cancel();
+
+    /** Send as much of the pending data as possible */
+    void send_kick();
+
+    /** Report EOF to bev() once all received data has been handed over */
+    void maybe_deliver_eof();
+
+    /**
+     * Handle an I/O failure
+     *
+     * @param[in] err The errno value
+     */
+    void fail(const int err);
+
+    /** Close the socket once released and everything completed */
+    void maybe_destroy();
+
+    /** @{ */
+    /** Handle a receive completion */
+    void on_recv(const int32_t res,
+                 const uint32_t flags);
+
+    /** Handle a sendmsg() completion */
+    void on_send(const int32_t res);
+
+    /** Handle a cancelation completion */
+    void on_cancel();
+
+    /**
+     * Handle the IoUring being aborted (Nothing in flight will complete)
+     *
+     * @param[in] err The errno value
+     */
+    void on_abort(const int err);
+
+    /** The partner's read callback (Data to send) */
+    void on_partner_read();
+
+    /** The partner's write callback (Received data was consumed) */
+    void on_partner_write();
+    /** @} */
+
+    IoUring& ring_;                 /**< The IoUring doing the I/O */
+    evutil_socket_t fd_;            /**< The socket */
+    struct bufferevent* bev_;       /**< The owner's end of the pair */
+    struct bufferevent* partner_;   /**< The IoUring's end of the pair */
+    struct evbuffer* send_buf_;     /**< The data being sent */
+    struct msghdr msg_;             /**< The in-flight sendmsg() header */
+    struct iovec iov_[kMaxSendIov]; /**< The in-flight sendmsg() buffers */
+    unsigned nr_inflight_;          /**< Operations the kernel still owns */
+    bool recv_armed_;               /**< Multishot receive armed? */
+    bool recv_paused_;              /**< Receive paused for backpressure? */
+    bool recv_eof_;                 /**< Received EOF? */
+    bool cancel_inflight_;          /**< Receive cancelation in flight? */
+    bool send_inflight_;            /**< sendmsg() in flight? */
+    bool failed_;                   /**< Had an I/O error? */
+    bool eof_delivered_;            /**< Reported EOF to bev()? */
+    bool released_;                 /**< release() called? */
+    ::std::list<Socket*>::iterator iter_; /**< Position in sockets_ */
+  };
+
+  /**
+   * Construct an IoUring
+   *
+   * @param[in] base      The libevent2 event_base to integrate with
+   * @param[in] priority  The priority of the completion/submission events
+   */
+  IoUring(struct event_base* base,
+          const int priority) :
+      base_(base),
+      priority_(priority),
+      logger_(::el::Loggers::getLogger(IO_URING_LOGGER)),
+      ring_fd_(-1),
+      event_fd_(-1),
+      sq_ring_(nullptr),
+      sq_ring_sz_(0),
+      cq_ring_(nullptr),
+      cq_ring_sz_(0),
+      sqes_(nullptr),
+      sqes_sz_(0),
+      sq_head_(nullptr),
+      sq_tail_(nullptr),
+      sq_mask_(0),
+      sq_entries_(0),
+      sq_array_(nullptr),
+      cq_head_(nullptr),
+      cq_tail_(nullptr),
+      cq_mask_(0),
+      cqes_(nullptr),
+      sq_pending_(0),
+      dead_(false),
+      bufs_(nullptr),
+      pool_(nullptr),
+      recycled_(),
+      completion_ev_(nullptr),
+      submit_ev_(nullptr),
+      nr_enters_(0),
+      nr_sqes_(0),
+      nr_cqes_(0),
+      nr_rx_bytes_(0),
+      nr_rx_copied_(0),
+      nr_tx_bytes_(0) {}
+
+  ~IoUring();
+
+  /**
+   * Create the ring, the provided buffers and the completion event
+   *
+   * @returns true  - Success
+   * @returns false - Failure (io_uring is unsupported or not permitted)
+   */
+  bool init();
+
+  /**
+   * Take over the I/O on a connected socket bufferevent
+   *
+   * Any data buffered in bev is carried over, and bev is freed (The socket
+   * is kept open).  Callbacks, watermarks and the priority need to be set
+   * on the returned Socket's bev(), which starts out with the same events
+   * enabled as bev.
+   *
+   * @param[in] bev The socket bufferevent
+   *
+   * @returns A pointer to the Socket
+   * @returns nullptr - Failure (bev is left untouched)
+   */
+  Socket* attach(struct bufferevent* bev);
+
+  /** Query the statistics for logging */
+  const ::std::string to_string() const;
+
+ private:
+  IoUring(const IoUring&) = delete;
+  void operator=(const IoUring&) = delete;
+
+  /** @{ */
+  /** The number of submission queue entries */
+  static constexpr unsigned kQueueDepth = 256;
+  /** The number of provided receive buffers (Power of 2) */
+  static constexpr unsigned kNrBuffers = 256;
+  /** The size of each provided receive buffer */
+  static constexpr size_t kBufferSize = 16384;
+  /** The provided buffer group ID */
+  static constexpr uint16_t kBufferGroup = 0;
+  /** The most data that is queued for one sendmsg() */
+  static constexpr size_t kMaxSendSize = 256 * 1024;
+  /** Received data buffered before receiving is paused */
+  static constexpr size_t kMaxRecvBuffered = 256 * 1024;
+  /**
+   * The most provided buffers that are lent out to evbuffers at once, past
+   * this received data is copied so that slow readers can not starve the
+   * other sockets of buffers
+   */
+  static constexpr unsigned kMaxLentBuffers = kNrBuffers * 3 / 4;
+  /** @} */
+
+  /** The operation a completion belongs to (Low bits of the user_data) */
+  enum Op {
+    kPROVIDE = 0,
+    kRECV = 1,
+    kSEND = 2,
+    kCANCEL = 3
+  };
+
+  /** @{ */
+  /**
+   * Obtain a submission queue entry, submitting pending entries if full
+   *
+   * @returns A pointer to a zeroed SQE
+   * @returns nullptr - The submission queue is full
+   */
+  struct io_uring_sqe* get_sqe();
+
+  /** Schedule submission of the queued entries at the end of the loop */
+  void schedule_submit();
+
+  /** Submit all queued entries and recycled buffers to the kernel */
+  void submit();
+
+  /** Submit all queued entries to the kernel */
+  void enter();
+
+  /**
+   * Stop using the ring after an unexpected error, and fail all Sockets
+   *
+   * @param[in] err The errno value
+   */
+  void abort(const int err);
+
+  /** Reap and dispatch all available completions */
+  void reap();
+
+  /**
+   * Return a provided buffer to the kernel
+   *
+   * @param[in] bid The buffer ID
+   */
+  void recycle_buffer(const uint16_t bid);
+
+  /** Queue as many recycled buffers for submission as possible */
+  void provide_buffers();
+
+  /**
+   * The evbuffer cleanup callback for lent out provided buffers
+   *
+   * @param[in] data    The data in the provided buffer
+   * @param[in] len     The length of data
+   * @param[in] arg     The BufferPool
+   */
+  static void on_buffer_returned(const void* data,
+                                 size_t len,
+                                 void* arg);
+  /** @} */
+
+  struct event_base* base_;   /**< The libevent2 event_base */
+  const int priority_;        /**< The event priority */
+  ::el::Logger* logger_;      /**< The io_uring logger */
+
+  /** @{ */
+  int ring_fd_;               /**< The io_uring */
+  int event_fd_;              /**< The completion eventfd */
+  void* sq_ring_;             /**< The mmap()ed submission queue ring */
+  size_t sq_ring_sz_;         /**< The size of sq_ring_ */
+  void* cq_ring_;             /**< The mmap()ed completion queue ring */
+  size_t cq_ring_sz_;         /**< The size of cq_ring_ (0 = shared) */
+  struct io_uring_sqe* sqes_; /**< The mmap()ed submission queue entries */
+  size_t sqes_sz_;            /**< The size of sqes_ */
+  unsigned* sq_head_;         /**< The SQ head (Kernel owned) */
+  unsigned* sq_tail_;         /**< The SQ tail */
+  unsigned sq_mask_;          /**< The SQ index mask */
+  unsigned sq_entries_;       /**< The SQ size */
+  unsigned* sq_array_;        /**< The SQ index array */
+  unsigned* cq_head_;         /**< The CQ head */
+  unsigned* cq_tail_;         /**< The CQ tail (Kernel owned) */
+  unsigned cq_mask_;          /**< The CQ index mask */
+  struct io_uring_cqe* cqes_; /**< The CQEs */
+  unsigned sq_pending_;       /**< Queued but not submitted SQEs */
+  bool dead_;                 /**< The ring failed and is not used anymore */
+  /** @} */
+
+  /** @{ */
+  /**
+   * The provided buffers, which outlive the IoUring if any of them are still
+   * lent out when it is destroyed (libevent2 finalizes bufferevents lazily)
+   */
+  struct BufferPool {
+    IoUring* ring;            /**< The IoUring (nullptr once destroyed) */
+    uint8_t* bufs;            /**< The buffers */
+    unsigned nr_lent;         /**< Buffers lent out to evbuffers */
+  };
+
+  uint8_t* bufs_;             /**< The provided buffers */
+  BufferPool* pool_;          /**< The provided buffer pool */
+  /** Runs of buffers (First ID, Count) to return to the kernel */
+  ::std::vector< ::std::pair<unsigned, unsigned>> recycled_;
+  /** @} */
+
+  struct event* completion_ev_; /**< The eventfd read event */
+  struct event* submit_ev_;     /**< The deferred submission event */
+  ::std::list<Socket*> sockets_;  /**< All Sockets, including released ones */
+
+  /** @{ */
+  uint64_t nr_enters_;        /**< Total io_uring_enter() calls */
+  uint64_t nr_sqes_;          /**< Total SQEs submitted */
+  uint64_t nr_cqes_;          /**< Total CQEs reaped */
+  uint64_t nr_rx_bytes_;      /**< Total bytes received */
+  uint64_t nr_rx_copied_;     /**< Received bytes that had to be copied */
+  uint64_t nr_tx_bytes_;      /**< Total bytes sent */
+  /** @} */
+};
+
+} // namespace net
+} // namespace schwanenlied
+
+#endif // ENABLE_IO_URING
+
+#endif // SCHWANENLIED_NET_IO_URING_H__
@@ -0,0 +1,172 @@
+/**
+ * @file    utils.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Socket related utility routines (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+/*
+ * glibc's <netinet/tcp.h> has a truncated struct tcp_info that lacks the
+ * delivery rate, so use the kernel header instead.
+ */
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+
+#include "schwanenlied/net/utils.h"
+
+namespace schwanenlied {
+namespace net {
+
+bool get_tcp_bdp(const evutil_socket_t sock,
+                 size_t& tx_bdp,
+                 size_t& rx_bdp) {
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info info = {};
+  socklen_t len = sizeof(info);
+  if (::getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    return false;
+  if (len < offsetof(struct tcp_info, tcpi_rcv_space) +
+      sizeof(info.tcpi_rcv_space))
+    return false;
+
+  // No RTT sample yet means nothing useful can be said
+  if (info.tcpi_rtt == 0)
+    return false;
+
+  tx_bdp = static_cast<size_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+
+  // Older kernels return a shorter struct without the delivery rate
+  if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+      sizeof(info.tcpi_delivery_rate)) {
+    // tcpi_delivery_rate is in bytes/sec, tcpi_rtt is in usec
+    const uint64_t rate_bdp = info.tcpi_delivery_rate * info.tcpi_rtt /
+        1000000;
+    tx_bdp = ::std::max<size_t>(tx_bdp, rate_bdp);
+  }
+
+  rx_bdp = info.tcpi_rcv_space;
+
+  return true;
+#else
+  (void)sock;
+  (void)tx_bdp;
+  (void)rx_bdp;
+
+  return false;
+#endif
+}
+
+bool set_defer_accept(const evutil_socket_t sock,
+                      const int timeout) {
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout,
+                      sizeof(timeout)) == 0;
+#else
+  (void)sock;
+  (void)timeout;
+
+  return false;
+#endif
+}
+
+bool set_tcp_cork(const evutil_socket_t sock,
+                  const bool cork) {
+  const int val = cork ? 1 : 0;
+#if defined(TCP_CORK)
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) == 0;
+#elif defined(TCP_NOPUSH)
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_NOPUSH, &val, sizeof(val)) == 0;
+#else
+  (void)sock;
+  (void)val;
+
+  return false;
+#endif
+}
+
+bool set_tcp_fastopen_connect(const evutil_socket_t sock) {
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+  const int val = 1;
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val,
+                      sizeof(val)) == 0;
+#else
+  (void)sock;
+
+  return false;
+#endif
+}
+
+bool set_tcp_keepalive(const evutil_socket_t sock,
+                       const int idle,
+                       const int interval,
+                       const int count) {
+  const int val = 1;
+  if (::setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) != 0)
+    return false;
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+                      sizeof(idle)) == 0 &&
+      ::setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                   sizeof(interval)) == 0 &&
+      ::setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count,
+                   sizeof(count)) == 0;
+#else
+  (void)idle;
+  (void)interval;
+  (void)count;
+
+  return true;
+#endif
+}
+
+bool set_tcp_user_timeout(const evutil_socket_t sock,
+                          const unsigned int timeout) {
+#if defined(__linux__) && defined(TCP_USER_TIMEOUT)
+  return ::setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout,
+                      sizeof(timeout)) == 0;
+#else
+  (void)sock;
+  (void)timeout;
+
+  return false;
+#endif
+}
+
+} // namespace net
+} // namespace schwanenlied
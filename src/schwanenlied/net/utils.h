@@ -0,0 +1,165 @@
+/**
+ * @file    utils.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Socket related utility routines
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHWANENLIED_NET_UTILS_H__
+#define SCHWANENLIED_NET_UTILS_H__
+
+#include <event2/util.h>
+
+#include "schwanenlied/common.h"
+
+namespace schwanenlied {
+namespace net {
+
+/**
+ * Estimate the bandwidth-delay product of a connected TCP/IP socket
+ *
+ * The transmit side estimate is the larger of the congestion window
+ * (snd_cwnd * snd_mss) and the measured delivery rate multiplied by the
+ * smoothed RTT.  The receive side estimate is the kernel's receive space
+ * (the amount of data received per RTT, as used for receive buffer
+ * autotuning).
+ *
+ * @note This is only supported on Linux (TCP_INFO), other platforms will
+ * always return false.
+ *
+ * @param[in]  sock    The socket to query
+ * @param[out] tx_bdp  The transmit side bandwidth-delay product in bytes
+ * @param[out] rx_bdp  The receive side bandwidth-delay product in bytes
+ *
+ * @returns true  - Success
+ * @returns false - Failure (Estimate unavailable)
+ */
+bool get_tcp_bdp(const evutil_socket_t sock,
+                 size_t& tx_bdp,
+                 size_t& rx_bdp);
+
+/**
+ * Only complete accept() on a listening socket once data has arrived
+ *
+ * @note This is only supported on Linux (TCP_DEFER_ACCEPT), other platforms
+ * will always return false.
+ *
+ * @param[in] sock    The listening socket
+ * @param[in] timeout The maximum time to wait for data in seconds
+ *
+ * @returns true  - Success
+ * @returns false - Failure
+ */
+bool set_defer_accept(const evutil_socket_t sock,
+                      const int timeout);
+
+/**
+ * Cork/uncork a TCP/IP socket
+ *
+ * While corked, partial segments are held back, so that a message written in
+ * several pieces goes out in as few segments as possible.  Uncorking sends
+ * whatever is pending immediately.
+ *
+ * @note This is only supported on platforms with TCP_CORK (Linux) or
+ * TCP_NOPUSH (*BSD, Darwin), other platforms will always return false.
+ *
+ * @param[in] sock  The socket to cork/uncork
+ * @param[in] cork  true - Cork, false - Uncork
+ *
+ * @returns true  - Success
+ * @returns false - Failure
+ */
+bool set_tcp_cork(const evutil_socket_t sock,
+                  const bool cork);
+
+/**
+ * Enable TCP Fast Open for a not yet connected TCP/IP socket
+ *
+ * With this set, connect() returns immediately without sending anything, and
+ * the SYN is sent along with the data of the first write.  If a Fast Open
+ * cookie for the peer is cached the data is carried in the SYN, otherwise the
+ * kernel requests a cookie and sends the data after the 3-way handshake.
+ *
+ * @note This is only supported on Linux 4.11 or later (TCP_FASTOPEN_CONNECT),
+ * other platforms will always return false.
+ *
+ * @param[in] sock  The socket to enable TCP Fast Open on
+ *
+ * @returns true  - Success
+ * @returns false - Failure
+ */
+bool set_tcp_fastopen_connect(const evutil_socket_t sock);
+
+/**
+ * Enable TCP keepalive probes on a TCP/IP socket
+ *
+ * Once the connection has been idle for idle seconds, a probe is sent every
+ * interval seconds, and the connection is reset after count unanswered
+ * probes.
+ *
+ * @note Setting the timing is only supported on platforms with TCP_KEEPIDLE,
+ * TCP_KEEPINTVL and TCP_KEEPCNT (Linux, FreeBSD), other platforms will
+ * use the system defaults.
+ *
+ * @param[in] sock      The socket to enable keepalive on
+ * @param[in] idle      The idle time before the first probe in seconds
+ * @param[in] interval  The time between probes in seconds
+ * @param[in] count     The number of unanswered probes before giving up
+ *
+ * @returns true  - Success
+ * @returns false - Failure
+ */
+bool set_tcp_keepalive(const evutil_socket_t sock,
+                       const int idle,
+                       const int interval,
+                       const int count);
+
+/**
+ * Limit how long transmitted data may remain unacknowledged
+ *
+ * The connection is reset if data is left unacknowledged (or the peer keeps
+ * advertising a zero window) for longer than the timeout, which bounds the
+ * time it takes to notice a peer that vanished with data in flight.
+ *
+ * @note This is only supported on Linux (TCP_USER_TIMEOUT), other platforms
+ * will always return false.
+ *
+ * @param[in] sock    The socket to set the timeout on
+ * @param[in] timeout The timeout in milliseconds
+ *
+ * @returns true  - Success
+ * @returns false - Failure
+ */
+bool set_tcp_user_timeout(const evutil_socket_t sock,
+                          const unsigned int timeout);
+
+} // namespace net
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_NET_UTILS_H__
@@ -34,18 +34,9 @@
 #ifndef SCHWANENLIED_PT_OBFS2_CLIENT_H__
 #define SCHWANENLIED_PT_OBFS2_CLIENT_H__
 
-#define OBFS2_LOGGER "obfs2"
-#ifdef OBFS2_CLIENT_IMPL
-#define _LOGGER OBFS2_LOGGER
-#endif
-
-#include <random>
-
 #include "schwanenlied/common.h"
 #include "schwanenlied/socks5_server.h"
-#include "schwanenlied/crypto/aes.h"
-#include "schwanenlied/crypto/rand_openssl.h"
-#include "schwanenlied/crypto/sha256.h"
+#include "schwanenlied/pt/obfs2/codec.h"
 
 namespace schwanenlied {
 namespace pt {
@@ -58,10 +49,10 @@ namespace obfs2 {
  *
  * This implements a wire compatibile obfs2 client using Socks5Server.
  *
- * @todo Investigate using evbuffer_peek()/evbuffer_add_buffer() for better
- * performance (current code is more obviously correct).
+ * All of the protocol logic lives in Codec, this class just shuffles data
+ * between the Session's bufferevents and the Codec.
  */
-class Client : public Socks5Server::Session {
+class Client : public Socks5Server::TransportSession<Client> {
  public:
   /** Client factory */
   class SessionFactory : public Socks5Server::SessionFactory {
@@ -70,8 +61,7 @@ class Client : public Socks5Server::Session {
                                           const evutil_socket_t sock,
                                           const ::std::string& addr,
                                           const bool scrub_addrs) override {
-      return static_cast<Socks5Server::Session*>(new Client(server, base, sock,
-                                                            addr, scrub_addrs));
+      return new_session<Client>(0, server, base, sock, addr, scrub_addrs);
     }
   };
 
@@ -80,13 +70,8 @@ class Client : public Socks5Server::Session {
          const evutil_socket_t sock,
          const ::std::string& addr,
          const bool scrub_addrs) :
-      Session(server, base, sock, addr, false, scrub_addrs),
-      logger_(::el::Loggers::getLogger(OBFS2_LOGGER)),
-      received_seed_hdr_(false),
-      resp_pad_len_(0),
-      init_seed_(kSeedLength, 0),
-      resp_seed_(kSeedLength, 0),
-      pad_dist_(0, kMaxPadding) {}
+      TransportSession(server, base, sock, addr, false, scrub_addrs),
+      logger_(::el::Loggers::getLogger(OBFS2_LOGGER)) {}
 
   ~Client() = default;
 
@@ -103,56 +88,10 @@ class Client : public Socks5Server::Session {
   Client(const Client&) = delete;
   void operator=(const Client&) = delete;
 
-  /** @{ */
-  static constexpr uint32_t kMagicValue = 0x2BF5CA7E; /**< obfs2 MAGIC_VALUE */
-  static constexpr size_t kSeedLength = 16;           /**< obfs2 SEED_LENGTH */
-  static constexpr size_t kMaxPadding = 8192;         /**< obfs2 MAX_PADDING */
-  /** @} */
-
-  /** @{ */
-  /**
-   * Implement MAC(s, x) per the obfs2 spec
-   *
-   * @param[in] key     The key for the MAC ("s")
-   * @param[in] key_len The length of the key
-   * @param[in] buf     The buffer to be MACed ("x")
-   * @param[in] len     The length of the buffer to be MACed
-   * @param[out] digest A crypto::SecureBuffer where the digest should be stored
-   *
-   * @returns true - Success
-   * @returns false - Failure
-   */
-  bool mac(const uint8_t* key,
-           const size_t key_len,
-           const uint8_t* buf,
-           const size_t len,
-           crypto::SecureBuffer& digest);
-
-  /**
-   * Given init_seed_ and resp_seed_, derive the AES-CTR-128 keys per the obfs2
-   * spec
-   *
-   * @returns true  - Success
-   * @returns false - Failure
-   */
-  bool kdf_obfs2();
-  /** @} */
-
-  ::el::Logger* logger_;            /**< The obfs2 session logger */
-
-  /** @{ */
-  crypto::Aes128Ctr initiator_aes_; /**< Initiator->Responder E(K,s) */
-  crypto::Aes128Ctr responder_aes_; /**< Responder->Initiator E(K,s) */
-  crypto::RandOpenSSL rand_;        /**< CSPRNG */
-  /** @} */
-
-  /** @{ */
-  bool received_seed_hdr_;          /**< Recived the peer's seed, magic, padlen? */
-  size_t resp_pad_len_;             /**< Amount of padding to discard */
-  crypto::SecureBuffer init_seed_;  /**< obfs2 INIT_SEED */
-  crypto::SecureBuffer resp_seed_;  /**< obfs2 RESP_SEED */
-  ::std::uniform_int_distribution<uint32_t> pad_dist_;  /** Padding distribution */
-  /** @} */
+  friend Socks5Server::TransportSession<Client>;
+
+  Codec codec_;           /**< The obfs2 codec (relay path, kept first) */
+  ::el::Logger* logger_;  /**< The obfs2 session logger */
 };
 
 } // namespace obfs2
@@ -0,0 +1,321 @@
+/**
+ * @file    obfs2/codec.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   obfs2 (The Twobfuscator) Codec (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define OBFS2_CLIENT_IMPL
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "schwanenlied/pt/obfs2/codec.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs2 {
+
+bool Codec::send_handshake_msg(struct evbuffer* out) {
+  static constexpr ::std::array<uint8_t, 29> init_mac_key = { {
+    'I', 'n', 'i', 't', 'i', 'a', 't', 'o', 'r', ' ',
+    'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'i', 'o', 'n', ' ',
+    'p', 'a', 'd', 'd', 'i', 'n', 'g'
+  } };
+
+  if (out == nullptr)
+    return false;
+
+  // Derive INIT_SEED
+  init_seed_.assign(kSeedLength, 0);
+  if (!rand_.get_bytes(&init_seed_[0], init_seed_.size())) {
+    LOG(ERROR) << "Failed to derive INIT_SEED";
+    return false;
+  }
+
+  /*
+   * Derive INIT_PAD_KEY
+   *
+   * Note:
+   * The obfs2 spec neglects to specify that the IV used here is also taken
+   * from the MAC operation.
+   */
+  crypto::SecureBuffer init_pad_key(crypto::Sha256::kDigestLength, 0);
+  if (!mac(init_mac_key.data(), init_mac_key.size(), init_seed_.data(),
+           init_seed_.size(), init_pad_key)) {
+    LOG(ERROR) << "Failed to derive INIT_PAD_KEY";
+    return false;
+  }
+  if (!initiator_aes_.set_state(init_pad_key.substr(0, crypto::kAes128KeyLength),
+                                nullptr, 0,
+                                init_pad_key.data() + crypto::kAes128KeyLength,
+                                init_pad_key.size() - crypto::kAes128KeyLength)) {
+    LOG(ERROR) << "Failed to set INIT_PAD_KEY";
+    return false;
+  }
+
+  /*
+   * The spec says I send:
+   *  * INIT_SEED
+   *  * E(INIT_PAD_KEY, UINT32(MAGIC_VALUE) | UINT32(PADLEN) | WR(PADLEN))
+   */
+
+  // Generate the encrypted data
+  const auto padlen = pad_dist_(rand_);
+  ::std::array<uint32_t, 2> pad_hdr;
+  constexpr size_t pad_hdr_sz = pad_hdr.size() * sizeof(uint32_t);
+  pad_hdr.at(0) = htonl(kMagicValue);
+  pad_hdr.at(1) = htonl(padlen);
+
+  // Encrypt
+  if (!initiator_aes_.process(reinterpret_cast<uint8_t*>(pad_hdr.data()),
+                              pad_hdr_sz,
+                              reinterpret_cast<uint8_t*>(pad_hdr.data()))) {
+    LOG(ERROR) << "Failed to encrypt header";
+    return false;
+  }
+
+  // Send INIT_SEED and the header
+  if (::evbuffer_add(out, init_seed_.data(), init_seed_.size()) != 0)
+    return false;
+  if (::evbuffer_add(out, pad_hdr.data(), pad_hdr_sz) != 0)
+    return false;
+
+  // Generate and send the random data
+  if (padlen > 0) {
+    uint8_t padding[kMaxPadding];
+    if (!rand_.get_bytes(padding, padlen)) {
+      LOG(ERROR) << "Failed to generate padding";
+      return false;
+    }
+
+    if (!initiator_aes_.process(padding, padlen, padding)) {
+      LOG(ERROR) << "Failed to encrypt padding";
+      return false;
+    }
+
+    if (::evbuffer_add(out, padding, padlen) != 0)
+      return false;
+  }
+
+  return true;
+}
+
+bool Codec::recv_handshake_msg(struct evbuffer* in,
+                               bool& is_finished) {
+  is_finished = false;
+  if (in == nullptr)
+    return false;
+
+  // Read the resp_seed, magic value and padlen
+  if (!received_seed_hdr_) {
+    static constexpr ::std::array<uint8_t, 29> resp_mac_key = { {
+      'R', 'e', 's', 'p', 'o', 'n', 'd', 'e', 'r', ' ',
+      'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'i', 'o', 'n', ' ',
+      'p', 'a', 'd', 'd', 'i', 'n', 'g'
+    } };
+    const size_t len = ::evbuffer_get_length(in);
+    if (len < kSeedLength + sizeof(uint32_t) * 2)
+      return true;
+
+    // Obtain RESP_SEED, and derive RESP_PAD_KEY
+    resp_seed_.assign(kSeedLength, 0);
+    if (static_cast<int>(kSeedLength) != ::evbuffer_remove(in, &resp_seed_[0],
+                                                           resp_seed_.size())) {
+      LOG(ERROR) << "Failed to read RESP_SEED";
+      return false;
+    }
+    crypto::SecureBuffer resp_pad_key(crypto::Sha256::kDigestLength, 0);
+    if (!mac(resp_mac_key.data(), resp_mac_key.size(), resp_seed_.data(),
+           resp_seed_.size(), resp_pad_key)) {
+      LOG(ERROR) << "Failed to derive RESP_PAD_KEY";
+      return false;
+    }
+    if (!responder_aes_.set_state(resp_pad_key.substr(0, crypto::kAes128KeyLength),
+                                  nullptr, 0,
+                                  resp_pad_key.data() + crypto::kAes128KeyLength,
+                                  resp_pad_key.size() - crypto::kAes128KeyLength)) {
+      LOG(ERROR) << "Failed to set RESP_PAD_KEY";
+      return false;
+    }
+
+    // Validate the header and obtain padlen
+    ::std::array<uint32_t, 2> pad_hdr;
+    constexpr size_t pad_hdr_sz = pad_hdr.size() * sizeof(uint32_t);
+    if (sizeof(uint32_t) * 2 != ::evbuffer_remove(in, pad_hdr.data(),
+                                                  pad_hdr_sz))
+      return false;
+    if (!responder_aes_.process(reinterpret_cast<uint8_t*>(pad_hdr.data()),
+                                pad_hdr_sz,
+                                reinterpret_cast<uint8_t*>(pad_hdr.data()))) {
+      LOG(ERROR) << "Failed to decrypt header";
+      return false;
+    }
+    if (ntohl(pad_hdr.at(0)) != kMagicValue) {
+      LOG(WARNING) << "Received invalid magic value from peer";
+      return false;
+    }
+    resp_pad_len_ = ntohl(pad_hdr.at(1));
+    if (resp_pad_len_ > kMaxPadding) {
+      LOG(WARNING) << "Peer claims to have sent too much padding: "
+                   << resp_pad_len_;
+      return false;
+    }
+
+    // Derive the actual keys
+    if (!kdf_obfs2()) {
+      LOG(ERROR) << "Failed to derive session keys";
+      return false;
+    }
+
+    received_seed_hdr_ = true;
+  }
+
+  // Skip the responder padding
+  if (resp_pad_len_ > 0) {
+    const size_t len = ::evbuffer_get_length(in);
+    const size_t to_drain = ::std::min(resp_pad_len_, len);
+    ::evbuffer_drain(in, to_drain);
+    resp_pad_len_ -= to_drain;
+    if (resp_pad_len_ > 0)
+      return true;
+  }
+
+  is_finished = true;
+
+  return true;
+}
+
+bool Codec::encode(struct evbuffer* in,
+                   struct evbuffer* out) {
+  return process(initiator_aes_, in, out);
+}
+
+bool Codec::decode(struct evbuffer* in,
+                   struct evbuffer* out) {
+  SL_ASSERT(received_seed_hdr_ && resp_pad_len_ == 0);
+
+  return process(responder_aes_, in, out);
+}
+
+bool Codec::mac(const uint8_t* key,
+                 const size_t key_len,
+                 const uint8_t* buf,
+                 const size_t len,
+                 crypto::SecureBuffer& digest) {
+  if (key == nullptr)
+    return false;
+  if (key_len == 0)
+    return false;
+  if (buf == nullptr)
+    return false;
+  if (len == 0)
+    return false;
+  if (digest.size() != crypto::Sha256::kDigestLength)
+    return false;
+
+  crypto::SecureBuffer to_sha(key_len *2 + len, 0);
+  ::std::memcpy(&to_sha[0], key, key_len);
+  ::std::memcpy(&to_sha[key_len], buf, len);
+  ::std::memcpy(&to_sha[key_len + len], key, key_len);
+
+  crypto::Sha256 sha;
+  return sha.digest(to_sha.data(), to_sha.size(), &digest[0], digest.size());
+}
+
+bool Codec::kdf_obfs2() {
+  static constexpr ::std::array<uint8_t, 25> init_data = { {
+    'I', 'n', 'i', 't', 'i', 'a', 't', 'o', 'r', ' ',
+    'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'e', 'd', ' ',
+    'd', 'a', 't', 'a'
+  } };
+  static constexpr ::std::array<uint8_t, 25> resp_data = { {
+    'R', 'e', 's', 'p', 'o', 'n', 'd', 'e', 'r', ' ',
+    'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'e', 'd', ' ',
+    'd', 'a', 't', 'a'
+  } };
+
+  const crypto::SecureBuffer to_mac = init_seed_ + resp_seed_;
+  crypto::SecureBuffer sekrit(crypto::Sha256::kDigestLength, 0);
+
+  /*
+   * INIT_SECRET = MAC("Initiator obfuscated data", INIT_SEED|RESP_SEED)
+   * INIT_KEY = INIT_SECRET[:KEYLEN]
+   * INIT_IV = INIT_SECRET[KEYLEN:]
+   */
+  if (!mac(init_data.data(), init_data.size(), to_mac.data(), to_mac.size(),
+           sekrit))
+    return false;
+  if (!initiator_aes_.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                                nullptr, 0,
+                                sekrit.data() + crypto::kAes128KeyLength,
+                                sekrit.size() - crypto::kAes128KeyLength))
+    return false;
+
+  /*
+   * RESP_SECRET = MAC("Responder obfuscated data", INIT_SEED|RESP_SEED)
+   * RESP_KEY = RESP_SECRET[:KEYLEN]
+   * RESP_IV = RESP_SECRET[KEYLEN:]
+   */
+  if (!mac(resp_data.data(), resp_data.size(), to_mac.data(), to_mac.size(),
+           sekrit))
+    return false;
+  if (!responder_aes_.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                                nullptr, 0,
+                                sekrit.data() + crypto::kAes128KeyLength,
+                                sekrit.size() - crypto::kAes128KeyLength))
+    return false;
+
+  return true;
+}
+
+bool Codec::process(crypto::Aes128Ctr& aes,
+                    struct evbuffer* in,
+                    struct evbuffer* out) {
+  if (in == nullptr || out == nullptr)
+    return false;
+
+  const size_t len = ::evbuffer_get_length(in);
+  if (len == 0)
+    return true;
+
+  // AES-CTR in place, then move the chains over to out without copying
+  uint8_t* p = ::evbuffer_pullup(in, len);
+  if (p == nullptr)
+    return false;
+  if (!aes.process(p, len, p))
+    return false;
+
+  return ::evbuffer_add_buffer(out, in) == 0;
+}
+
+} // namespace obfs2
+} // namespace pt
+} // namespace schwanenlied
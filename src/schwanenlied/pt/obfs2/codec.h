@@ -0,0 +1,198 @@
+/**
+ * @file    obfs2/codec.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   obfs2 (The Twobfuscator) Codec
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SCHWANENLIED_PT_OBFS2_CODEC_H__
+#define SCHWANENLIED_PT_OBFS2_CODEC_H__
+
+#define OBFS2_LOGGER "obfs2"
+#ifdef OBFS2_CLIENT_IMPL
+#define _LOGGER OBFS2_LOGGER
+#endif
+
+#include <random>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/rand_openssl.h"
+#include "schwanenlied/crypto/sha256.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs2 {
+
+/**
+ * obfs2 (The Twobfuscator) Codec
+ *
+ * The initiator side of the obfs2 handshake and data framing as a buffer in,
+ * buffer out state machine.  It knows nothing about sockets or Sessions, the
+ * caller is responsible for moving the data between the network and the
+ * evbuffers passed to each routine.
+ *
+ * All routines consume the data they process from the input evbuffer, and
+ * append the result to the output evbuffer.
+ */
+class Codec {
+ public:
+  Codec() :
+      received_seed_hdr_(false),
+      resp_pad_len_(0),
+      init_seed_(),
+      resp_seed_(),
+      pad_dist_(0, kMaxPadding) {}
+
+  ~Codec() = default;
+
+  /**
+   * Generate the initiator handshake message
+   *
+   * @param[out] out The evbuffer to write the handshake to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool send_handshake_msg(struct evbuffer* out);
+
+  /**
+   * Consume the responder handshake message
+   *
+   * @param[in] in            The evbuffer containing data from the peer
+   * @param[out] is_finished  Set to true if the handshake has completed, and
+   *                          data that remains in in should be passed to
+   *                          decode()
+   *
+   * @returns true  - Success (Handshake may or may not be complete)
+   * @returns false - Failure
+   */
+  bool recv_handshake_msg(struct evbuffer* in,
+                          bool& is_finished);
+
+  /**
+   * Encrypt all of the plaintext in in
+   *
+   * @param[in] in    The plaintext to encrypt (Modified in place and drained)
+   * @param[out] out  The evbuffer to append the ciphertext to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool encode(struct evbuffer* in,
+              struct evbuffer* out);
+
+  /**
+   * Decrypt all of the ciphertext in in
+   *
+   * @param[in] in    The ciphertext to decrypt (Modified in place and drained)
+   * @param[out] out  The evbuffer to append the plaintext to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool decode(struct evbuffer* in,
+              struct evbuffer* out);
+
+ private:
+  Codec(const Codec&) = delete;
+  void operator=(const Codec&) = delete;
+
+  /** @{ */
+  static constexpr uint32_t kMagicValue = 0x2BF5CA7E; /**< obfs2 MAGIC_VALUE */
+  static constexpr size_t kSeedLength = 16;           /**< obfs2 SEED_LENGTH */
+  static constexpr size_t kMaxPadding = 8192;         /**< obfs2 MAX_PADDING */
+  /** @} */
+
+  /** @{ */
+  /**
+   * Implement MAC(s, x) per the obfs2 spec
+   *
+   * @param[in] key     The key for the MAC ("s")
+   * @param[in] key_len The length of the key
+   * @param[in] buf     The buffer to be MACed ("x")
+   * @param[in] len     The length of the buffer to be MACed
+   * @param[out] digest A crypto::SecureBuffer where the digest should be stored
+   *
+   * @returns true - Success
+   * @returns false - Failure
+   */
+  bool mac(const uint8_t* key,
+           const size_t key_len,
+           const uint8_t* buf,
+           const size_t len,
+           crypto::SecureBuffer& digest);
+
+  /**
+   * Given init_seed_ and resp_seed_, derive the AES-CTR-128 keys per the obfs2
+   * spec
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool kdf_obfs2();
+
+  /**
+   * AES-CTR all of in with aes, and move it to out
+   *
+   * @param[in] aes   The keystream to use
+   * @param[in] in    The source evbuffer
+   * @param[out] out  The destination evbuffer
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool process(crypto::Aes128Ctr& aes,
+               struct evbuffer* in,
+               struct evbuffer* out);
+  /** @} */
+
+  /** @{ */
+  crypto::Aes128Ctr initiator_aes_; /**< Initiator->Responder E(K,s) */
+  crypto::Aes128Ctr responder_aes_; /**< Responder->Initiator E(K,s) */
+  crypto::RandOpenSSL rand_;        /**< CSPRNG */
+  /** @} */
+
+  /** @{ */
+  bool received_seed_hdr_;          /**< Recived the peer's seed, magic, padlen? */
+  size_t resp_pad_len_;             /**< Amount of padding to discard */
+  crypto::SecureBuffer init_seed_;  /**< obfs2 INIT_SEED */
+  crypto::SecureBuffer resp_seed_;  /**< obfs2 RESP_SEED */
+  ::std::uniform_int_distribution<uint32_t> pad_dist_;  /** Padding distribution */
+  /** @} */
+};
+
+} // namespace obfs2
+} // namespace pt
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_PT_OBFS2_CODEC_H__
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/rand_ctr_drbg.h"
+#include "schwanenlied/crypto/sha256.h"
+#include "schwanenlied/pt/obfs2/codec.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs2 {
+
+/*
+ * The tests play the bridge with an independent implementation of the
+ * responder side of the obfs2 spec.
+ */
+class Obfs2CodecTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    static const uint8_t seed[] = { 'o', 'b', 'f', 's', '2' };
+    rng_.seed(seed, sizeof(seed));
+
+    to_bridge_ = ::evbuffer_new();
+    from_bridge_ = ::evbuffer_new();
+    tmp_ = ::evbuffer_new();
+    ASSERT_TRUE(to_bridge_ != nullptr);
+    ASSERT_TRUE(from_bridge_ != nullptr);
+    ASSERT_TRUE(tmp_ != nullptr);
+  }
+
+  virtual void TearDown() {
+    ::evbuffer_free(to_bridge_);
+    ::evbuffer_free(from_bridge_);
+    ::evbuffer_free(tmp_);
+  }
+
+  /** MAC(s, x) = H(s | x | s) */
+  crypto::SecureBuffer mac(const char* s,
+                           const crypto::SecureBuffer& x) {
+    const size_t s_len = ::std::strlen(s);
+    crypto::SecureBuffer to_sha(reinterpret_cast<const uint8_t*>(s), s_len);
+    to_sha += x;
+    to_sha.append(reinterpret_cast<const uint8_t*>(s), s_len);
+
+    crypto::SecureBuffer digest(crypto::Sha256::kDigestLength, 0);
+    crypto::Sha256 sha;
+    EXPECT_TRUE(sha.digest(to_sha.data(), to_sha.size(), &digest[0],
+                           digest.size()));
+    return digest;
+  }
+
+  /** Key a AES-128-CTR instance with the first/second halves of sekrit */
+  void set_state(crypto::Aes128Ctr& aes,
+                 const crypto::SecureBuffer& sekrit) {
+    ASSERT_TRUE(aes.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                              nullptr, 0,
+                              sekrit.data() + crypto::kAes128KeyLength,
+                              sekrit.size() - crypto::kAes128KeyLength));
+  }
+
+  /** Consume the initiator handshake, and generate the responder's */
+  void bridge_handshake(const uint32_t resp_pad_len) {
+    // INIT_SEED | E(INIT_PAD_KEY, MAGIC_VALUE | PADLEN | WR(PADLEN))
+    ASSERT_LE(24u, ::evbuffer_get_length(to_bridge_));
+    init_seed_.assign(16, 0);
+    ASSERT_EQ(16, ::evbuffer_remove(to_bridge_, &init_seed_[0], 16));
+    crypto::Aes128Ctr init_pad_aes;
+    set_state(init_pad_aes, mac("Initiator obfuscation padding", init_seed_));
+    ::std::array<uint32_t, 2> hdr;
+    ASSERT_EQ(8, ::evbuffer_remove(to_bridge_, hdr.data(), 8));
+    ASSERT_TRUE(init_pad_aes.process(reinterpret_cast<uint8_t*>(hdr.data()), 8,
+                                     reinterpret_cast<uint8_t*>(hdr.data())));
+    ASSERT_EQ(0x2BF5CA7Eu, ntohl(hdr.at(0)));
+    const size_t init_pad_len = ntohl(hdr.at(1));
+    ASSERT_GE(8192u, init_pad_len);
+    ASSERT_EQ(init_pad_len, ::evbuffer_get_length(to_bridge_));
+    ::evbuffer_drain(to_bridge_, init_pad_len);
+
+    // RESP_SEED | E(RESP_PAD_KEY, MAGIC_VALUE | PADLEN | WR(PADLEN))
+    resp_seed_.assign(16, 0);
+    ASSERT_TRUE(rng_.get_bytes(&resp_seed_[0], resp_seed_.size()));
+    crypto::Aes128Ctr resp_pad_aes;
+    set_state(resp_pad_aes, mac("Responder obfuscation padding", resp_seed_));
+    hdr.at(0) = htonl(0x2BF5CA7E);
+    hdr.at(1) = htonl(resp_pad_len);
+    ASSERT_TRUE(resp_pad_aes.process(reinterpret_cast<uint8_t*>(hdr.data()), 8,
+                                     reinterpret_cast<uint8_t*>(hdr.data())));
+    ::evbuffer_add(from_bridge_, resp_seed_.data(), resp_seed_.size());
+    ::evbuffer_add(from_bridge_, hdr.data(), 8);
+    const crypto::SecureBuffer padding = random_data(resp_pad_len);
+    ::evbuffer_add(from_bridge_, padding.data(), padding.size());
+
+    // Derive the session keys
+    const crypto::SecureBuffer seeds = init_seed_ + resp_seed_;
+    set_state(init_aes_, mac("Initiator obfuscated data", seeds));
+    set_state(resp_aes_, mac("Responder obfuscated data", seeds));
+  }
+
+  /** Feed from_bridge_ to the Codec in len sized pieces */
+  void client_handshake(const size_t len) {
+    bool is_finished = false;
+    while (!is_finished) {
+      const size_t n = ::std::min(len, ::evbuffer_get_length(from_bridge_));
+      ASSERT_LT(0u, n);
+      ::evbuffer_remove_buffer(from_bridge_, tmp_, n);
+      ASSERT_TRUE(codec_.recv_handshake_msg(tmp_, is_finished));
+    }
+  }
+
+  crypto::SecureBuffer random_data(const size_t len) {
+    crypto::SecureBuffer buf(len, 0);
+    for (size_t i = 0; i < len; i += 0x10000) {
+      const size_t n = ::std::min<size_t>(len - i, 0x10000);
+      EXPECT_TRUE(rng_.get_bytes(&buf[i], n));
+    }
+    return buf;
+  }
+
+  Codec codec_;
+  crypto::RandCtrDrbg rng_;
+  crypto::SecureBuffer init_seed_;
+  crypto::SecureBuffer resp_seed_;
+  crypto::Aes128Ctr init_aes_;
+  crypto::Aes128Ctr resp_aes_;
+  struct evbuffer* to_bridge_;
+  struct evbuffer* from_bridge_;
+  struct evbuffer* tmp_;
+};
+
+TEST_F(Obfs2CodecTest, RoundTrip) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(1234);
+
+  // The responder handshake trickles in a byte at a time
+  client_handshake(1);
+  ASSERT_EQ(0u, ::evbuffer_get_length(tmp_));
+
+  // Initiator -> Responder
+  const crypto::SecureBuffer upstream = random_data(100000);
+  struct evbuffer* plaintext = ::evbuffer_new();
+  ::evbuffer_add(plaintext, upstream.data(), upstream.size());
+  ASSERT_TRUE(codec_.encode(plaintext, to_bridge_));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext));
+  crypto::SecureBuffer wire(::evbuffer_get_length(to_bridge_), 0);
+  ::evbuffer_remove(to_bridge_, &wire[0], wire.size());
+  ASSERT_TRUE(init_aes_.process(wire.data(), wire.size(), &wire[0]));
+  ASSERT_EQ(upstream, wire);
+
+  // Responder -> Initiator
+  const crypto::SecureBuffer downstream = random_data(70000);
+  wire.assign(downstream.size(), 0);
+  ASSERT_TRUE(resp_aes_.process(downstream.data(), downstream.size(), &wire[0]));
+  for (size_t i = 0; i < wire.size(); i += 1000)
+    ::evbuffer_add(tmp_, wire.data() + i, ::std::min<size_t>(1000, wire.size() - i));
+  ASSERT_TRUE(codec_.decode(tmp_, plaintext));
+  ASSERT_EQ(0u, ::evbuffer_get_length(tmp_));
+  crypto::SecureBuffer decoded(::evbuffer_get_length(plaintext), 0);
+  ::evbuffer_remove(plaintext, &decoded[0], decoded.size());
+  ASSERT_EQ(downstream, decoded);
+
+  ::evbuffer_free(plaintext);
+}
+
+TEST_F(Obfs2CodecTest, DataBehindHandshake) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(0);
+
+  // Data sent right behind the (unpadded) handshake is left for decode()
+  const crypto::SecureBuffer downstream = random_data(64);
+  crypto::SecureBuffer wire(downstream.size(), 0);
+  ASSERT_TRUE(resp_aes_.process(downstream.data(), downstream.size(), &wire[0]));
+  ::evbuffer_add(from_bridge_, wire.data(), wire.size());
+  client_handshake(::evbuffer_get_length(from_bridge_));
+
+  struct evbuffer* plaintext = ::evbuffer_new();
+  ASSERT_TRUE(codec_.decode(tmp_, plaintext));
+  crypto::SecureBuffer decoded(::evbuffer_get_length(plaintext), 0);
+  ::evbuffer_remove(plaintext, &decoded[0], decoded.size());
+  ASSERT_EQ(downstream, decoded);
+
+  ::evbuffer_free(plaintext);
+}
+
+TEST_F(Obfs2CodecTest, BadMagic) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(0);
+
+  // Corrupt the (encrypted) magic value
+  uint8_t* p = ::evbuffer_pullup(from_bridge_, -1);
+  p[16] ^= 0x01;
+  bool is_finished = false;
+  ASSERT_FALSE(codec_.recv_handshake_msg(from_bridge_, is_finished));
+  ASSERT_FALSE(is_finished);
+}
+
+} // namespace obfs2
+} // namespace pt
+} // namespace schwanenlied
@@ -34,19 +34,9 @@
 #ifndef SCHWANENLIED_PT_OBFS3_CLIENT_H__
 #define SCHWANENLIED_PT_OBFS3_CLIENT_H__
 
-#define OBFS3_LOGGER "obfs3"
-#ifdef OBFS3_CLIENT_IMPL
-#define _LOGGER OBFS3_LOGGER
-#endif
-
-#include <random>
-
 #include "schwanenlied/common.h"
 #include "schwanenlied/socks5_server.h"
-#include "schwanenlied/crypto/aes.h"
-#include "schwanenlied/crypto/hmac_sha256.h"
-#include "schwanenlied/crypto/rand_openssl.h"
-#include "schwanenlied/crypto/uniform_dh.h"
+#include "schwanenlied/pt/obfs3/codec.h"
 
 namespace schwanenlied {
 namespace pt {
@@ -59,10 +49,10 @@ namespace obfs3 {
  *
  * This implements a wire compatible obfs3 client using Socks5Server.
  *
- * @todo Investigate using evbuffer_peek()/evbuffer_add_buffer() for better
- * performance (current code is more obviously correct).
+ * All of the protocol logic lives in Codec, this class just shuffles data
+ * between the Session's bufferevents and the Codec.
  */
-class Client : public Socks5Server::Session {
+class Client : public Socks5Server::TransportSession<Client> {
  public:
   /** Client factory */
   class SessionFactory : public Socks5Server::SessionFactory {
@@ -72,8 +62,7 @@ class Client : public Socks5Server::Session {
                                           const evutil_socket_t sock,
                                           const ::std::string& addr,
                                           const bool scrub_addrs) override {
-      return static_cast<Socks5Server::Session*>(new Client(server, base, sock,
-                                                            addr, scrub_addrs));
+      return new_session<Client>(0, server, base, sock, addr, scrub_addrs);
     }
   };
 
@@ -82,13 +71,8 @@ class Client : public Socks5Server::Session {
          const evutil_socket_t sock,
          const ::std::string& addr,
          const bool scrub_addrs) :
-      Session(server, base, sock, addr, false, scrub_addrs),
-      logger_(::el::Loggers::getLogger(OBFS3_LOGGER)),
-      sent_magic_(false),
-      received_magic_(false),
-      initiator_magic_(crypto::HmacSha256::kDigestLength, 0),
-      responder_magic_(crypto::HmacSha256::kDigestLength, 0),
-      pad_dist_(0, kMaxPadding / 2) {}
+      TransportSession(server, base, sock, addr, false, scrub_addrs),
+      logger_(::el::Loggers::getLogger(OBFS3_LOGGER)) {}
 
   ~Client() = default;
 
@@ -105,38 +89,10 @@ class Client : public Socks5Server::Session {
   Client(const Client&) = delete;
   void operator=(const Client&) = delete;
 
-  static constexpr uint16_t kMaxPadding = 8194; /** obfs3 MAX_PADDING */
-
-  /** @{ */
-  /**
-   * Given a shared secret, derive the AES-CTR-128 keys per the obfs3 spec
-   *
-   * @param[in] shared_secret The shared secret to use as the key material
-   *
-   * @returns true  - Success
-   * @returns false - Failure
-   */
-  bool kdf_obfs3(const crypto::SecureBuffer& shared_secret);
-  /** @} */
-
-  /** @{ */
-  ::el::Logger* logger_;    /**< The obfs3 session logger_ */
-  /** @} */
-
-  /** @{ */
-  crypto::UniformDH uniform_dh_;    /**< The UniformDH keypair */
-  crypto::Aes128Ctr initiator_aes_; /**< E(INIT_KEY, DATA) */
-  crypto::Aes128Ctr responder_aes_; /**< E(RESP_KEY, DATA) */
-  crypto::RandOpenSSL rand_;        /**< CSPRNG */
-  /** @} */
-
-  /** @{ */
-  bool sent_magic_;     /**< Sent initator_magic_ to the peer? */
-  bool received_magic_; /**< Received responder_magic_ from the peer? */
-  crypto::SecureBuffer initiator_magic_; /**< HMAC(SHARED_SECRET, "Initiator magic") */
-  crypto::SecureBuffer responder_magic_; /**< HMAC(SHARED_SECRET, "Responder magic") */
-  ::std::uniform_int_distribution<uint32_t> pad_dist_;  /** Padding distribution */
-  /** @} */
+  friend Socks5Server::TransportSession<Client>;
+
+  Codec codec_;           /**< The obfs3 codec (relay path, kept first) */
+  ::el::Logger* logger_;  /**< The obfs3 session logger_ */
 };
 
 } // namespace obfs3
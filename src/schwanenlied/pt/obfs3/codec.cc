@@ -0,0 +1,245 @@
+/**
+ * @file    obfs3/codec.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   obfs3 (The Threebfuscator) Codec (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define OBFS3_CLIENT_IMPL
+
+#include <array>
+
+#include "schwanenlied/pt/obfs3/codec.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs3 {
+
+bool Codec::send_handshake_msg(struct evbuffer* out) {
+  if (out == nullptr)
+    return false;
+
+  // Generate the keypair on first use, so that aborted sessions never do
+  if (uniform_dh_ == nullptr) {
+    uniform_dh_ = ::std::unique_ptr<crypto::UniformDH>(new crypto::UniformDH);
+    if (uniform_dh_ == nullptr)
+      return false;
+  }
+
+  // Send the public key
+  const auto public_key = uniform_dh_->public_key();
+  if (::evbuffer_add(out, public_key.data(), public_key.size()) != 0)
+    return false;
+
+  // Send the appropriate amount of random padding
+  return add_padding(out);
+}
+
+bool Codec::recv_handshake_msg(struct evbuffer* in,
+                               bool& is_finished) {
+  is_finished = false;
+  if (in == nullptr || uniform_dh_ == nullptr)
+    return false;
+
+  // Read the peer's public key
+  const size_t len = ::evbuffer_get_length(in);
+  if (len < crypto::UniformDH::kKeyLength)
+    return true;
+
+  const uint8_t *p = ::evbuffer_pullup(in, crypto::UniformDH::kKeyLength);
+  if (p == nullptr) {
+    LOG(ERROR) << "Failed to pullup public key";
+    return false;
+  }
+  if (!uniform_dh_->compute_key(p, crypto::UniformDH::kKeyLength)) {
+    LOG(WARNING) << "UniformDH key exchange failed";
+    return false;
+  }
+
+  // Apply the KDF and initialize the crypto
+  if (!kdf_obfs3(uniform_dh_->shared_secret())) {
+    LOG(ERROR) << "Failed to derive session keys";
+    return false;
+  }
+  ::evbuffer_drain(in, crypto::UniformDH::kKeyLength);
+
+  // The keypair is no longer needed
+  uniform_dh_.reset(nullptr);
+
+  is_finished = true;
+
+  return true;
+}
+
+bool Codec::encode(struct evbuffer* in,
+                   struct evbuffer* out) {
+  if (out == nullptr)
+    return false;
+
+  if (!sent_magic_) {
+    // Send random padding followed by initiator_magic_
+    if (!add_padding(out))
+      return false;
+    if (::evbuffer_add(out, initiator_magic_.data(),
+                       initiator_magic_.size()) != 0)
+      return false;
+    sent_magic_ = true;
+  }
+
+  return process(initiator_aes_, in, out);
+}
+
+bool Codec::decode(struct evbuffer* in,
+                   struct evbuffer* out) {
+  if (in == nullptr)
+    return false;
+
+  if (!received_magic_) {
+    // Resume looking for the responder magic where the last call left off
+    ssize_t pos = -1;
+    if (!magic_search_.search(in, pos)) {
+      LOG(WARNING) << "Did not find mark within allowable limits";
+      return false;
+    }
+    if (pos == -1)
+      return true;
+    ::evbuffer_drain(in, pos + crypto::HmacSha256::kDigestLength);
+    received_magic_ = true;
+  }
+
+  return process(responder_aes_, in, out);
+}
+
+bool Codec::add_padding(struct evbuffer* out) {
+  const auto padlen = pad_dist_(rand_);
+  if (padlen == 0)
+    return true;
+
+  uint8_t padding[kMaxPadding / 2];
+  if (!rand_.get_bytes(padding, padlen)) {
+    LOG(ERROR) << "Failed to generate padding";
+    return false;
+  }
+
+  return ::evbuffer_add(out, padding, padlen) == 0;
+}
+
+bool Codec::process(crypto::Aes128Ctr& aes,
+                    struct evbuffer* in,
+                    struct evbuffer* out) {
+  if (in == nullptr || out == nullptr)
+    return false;
+
+  const size_t len = ::evbuffer_get_length(in);
+  if (len == 0)
+    return true;
+
+  // AES-CTR in place, then move the chains over to out without copying
+  uint8_t* p = ::evbuffer_pullup(in, len);
+  if (p == nullptr)
+    return false;
+  if (!aes.process(p, len, p))
+    return false;
+
+  return ::evbuffer_add_buffer(out, in) == 0;
+}
+
+bool Codec::kdf_obfs3(const crypto::SecureBuffer& shared_secret) {
+  static constexpr ::std::array<uint8_t, 25> init_data = { {
+    'I', 'n', 'i', 't', 'i', 'a', 't', 'o', 'r', ' ',
+    'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'e', 'd', ' ',
+    'd', 'a', 't', 'a'
+  } };
+  static constexpr ::std::array<uint8_t, 25> resp_data = { {
+    'R', 'e', 's', 'p', 'o', 'n', 'd', 'e', 'r', ' ',
+    'o', 'b', 'f', 'u', 's', 'c', 'a', 't', 'e', 'd', ' ',
+    'd', 'a', 't', 'a'
+  } };
+  static constexpr ::std::array<uint8_t, 15> init_magic = { {
+    'I', 'n', 'i', 't', 'i', 'a', 't', 'o', 'r', ' ',
+    'm', 'a', 'g', 'i', 'c'
+  } };
+  static constexpr ::std::array<uint8_t, 15> resp_magic = { {
+    'R', 'e', 's', 'p', 'o', 'n', 'd', 'e', 'r', ' ',
+    'm', 'a', 'g', 'i', 'c'
+  } };
+
+  crypto::HmacSha256 hmac(shared_secret);
+  crypto::SecureBuffer sekrit(crypto::HmacSha256::kDigestLength, 0);
+
+  /*
+   * INIT_SECRET = HMAC(SHARED_SECRET, "Initiator obfuscated data")
+   * INIT_KEY = INIT_SECRET[:KEYLEN]
+   * INIT_COUNTER = INIT_SECRET[KEYLEN:]
+   */
+  if (!hmac.digest(init_data.data(), init_data.size(), &sekrit[0],
+                   sekrit.size()))
+    return false;
+  if (!initiator_aes_.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                                nullptr, 0,
+                                sekrit.data() + crypto::kAes128KeyLength,
+                                sekrit.size() - crypto::kAes128KeyLength))
+    return false;
+
+  /*
+   * RESP_SECRET = HMAC(SHARED_SECRET, "Responder obfuscated data")
+   * RESP_KEY = RESP_SECRET[:KEYLEN]
+   * RESP_COUNTER = RESP_SECRET[KEYLEN:]
+   */
+  if (!hmac.digest(resp_data.data(), resp_data.size(), &sekrit[0],
+                   sekrit.size()))
+    return false;
+  if (!responder_aes_.set_state(sekrit.substr(0, crypto::kAes128KeyLength),
+                                nullptr, 0,
+                                sekrit.data() + crypto::kAes128KeyLength,
+                                sekrit.size() - crypto::kAes128KeyLength))
+    return false;
+
+  /*
+   * HMAC(SHARED_SECRET, "Initiator magic")
+   * HMAC(SHARED_SECRET, "Responder magic") 
+   */
+  initiator_magic_.assign(crypto::HmacSha256::kDigestLength, 0);
+  crypto::SecureBuffer responder_magic(crypto::HmacSha256::kDigestLength, 0);
+  if (!hmac.digest(init_magic.data(), init_magic.size(), &initiator_magic_[0],
+                   initiator_magic_.size()))
+    return false;
+  if (!hmac.digest(resp_magic.data(), resp_magic.size(), &responder_magic[0],
+                   responder_magic.size()))
+    return false;
+  if (!magic_search_.reset(responder_magic.data(), responder_magic.size(),
+                           kMaxPadding))
+    return false;
+
+  return true;
+}
+
+} // namespace obfs3
+} // namespace pt
+} // namespace schwanenlied
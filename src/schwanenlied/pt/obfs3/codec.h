@@ -0,0 +1,197 @@
+/**
+ * @file    obfs3/codec.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   obfs3 (The Threebfuscator) Codec
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SCHWANENLIED_PT_OBFS3_CODEC_H__
+#define SCHWANENLIED_PT_OBFS3_CODEC_H__
+
+#define OBFS3_LOGGER "obfs3"
+#ifdef OBFS3_CLIENT_IMPL
+#define _LOGGER OBFS3_LOGGER
+#endif
+
+#include <memory>
+#include <random>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/crypto/rand_openssl.h"
+#include "schwanenlied/crypto/uniform_dh.h"
+#include "schwanenlied/mark_search.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs3 {
+
+/**
+ * obfs3 (The Threebfuscator) Codec
+ *
+ * The initiator side of the obfs3 handshake and data framing as a buffer in,
+ * buffer out state machine.  It knows nothing about sockets or Sessions, the
+ * caller is responsible for moving the data between the network and the
+ * evbuffers passed to each routine.
+ *
+ * All routines consume the data they process from the input evbuffer, and
+ * append the result to the output evbuffer.
+ */
+class Codec {
+ public:
+  Codec() :
+      sent_magic_(false),
+      received_magic_(false),
+      initiator_magic_(),
+      magic_search_(),
+      pad_dist_(0, kMaxPadding / 2) {}
+
+  ~Codec() = default;
+
+  /**
+   * Generate the initiator handshake message (The public key and padding)
+   *
+   * @param[out] out The evbuffer to write the handshake to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool send_handshake_msg(struct evbuffer* out);
+
+  /**
+   * Consume the responder public key and derive the session keys
+   *
+   * @param[in] in            The evbuffer containing data from the peer
+   * @param[out] is_finished  Set to true if the key exchange has completed
+   *
+   * @returns true  - Success (Handshake may or may not be complete)
+   * @returns false - Failure
+   */
+  bool recv_handshake_msg(struct evbuffer* in,
+                          bool& is_finished);
+
+  /**
+   * Encrypt all of the plaintext in in
+   *
+   * The first call also emits the post-key padding and the initiator magic,
+   * even if in is empty.
+   *
+   * @param[in] in    The plaintext to encrypt (Modified in place and drained)
+   * @param[out] out  The evbuffer to append the ciphertext to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool encode(struct evbuffer* in,
+              struct evbuffer* out);
+
+  /**
+   * Decrypt all of the ciphertext in in
+   *
+   * Till the responder magic is found, data is left in in and nothing is
+   * appended to out.  The search for the magic is incremental, so only the
+   * newly received data is scanned on each call.
+   *
+   * @param[in] in    The ciphertext to decrypt (Modified in place and drained)
+   * @param[out] out  The evbuffer to append the plaintext to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool decode(struct evbuffer* in,
+              struct evbuffer* out);
+
+ private:
+  Codec(const Codec&) = delete;
+  void operator=(const Codec&) = delete;
+
+  static constexpr uint16_t kMaxPadding = 8194; /** obfs3 MAX_PADDING */
+
+  /** @{ */
+  /**
+   * Given a shared secret, derive the AES-CTR-128 keys per the obfs3 spec
+   *
+   * @param[in] shared_secret The shared secret to use as the key material
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool kdf_obfs3(const crypto::SecureBuffer& shared_secret);
+
+  /**
+   * Append up to kMaxPadding / 2 bytes of random padding to out
+   *
+   * @param[out] out  The destination evbuffer
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool add_padding(struct evbuffer* out);
+
+  /**
+   * AES-CTR all of in with aes, and move it to out
+   *
+   * @param[in] aes   The keystream to use
+   * @param[in] in    The source evbuffer
+   * @param[out] out  The destination evbuffer
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool process(crypto::Aes128Ctr& aes,
+               struct evbuffer* in,
+               struct evbuffer* out);
+  /** @} */
+
+  /** @{ */
+  crypto::Aes128Ctr initiator_aes_; /**< E(INIT_KEY, DATA) */
+  crypto::Aes128Ctr responder_aes_; /**< E(RESP_KEY, DATA) */
+  crypto::RandOpenSSL rand_;        /**< CSPRNG */
+  /** The UniformDH keypair (Created by send_handshake_msg(), freed once keyed) */
+  ::std::unique_ptr<crypto::UniformDH> uniform_dh_;
+  /** @} */
+
+  /** @{ */
+  bool sent_magic_;     /**< Sent initator_magic_ to the peer? */
+  bool received_magic_; /**< Received the responder magic from the peer? */
+  crypto::SecureBuffer initiator_magic_; /**< HMAC(SHARED_SECRET, "Initiator magic") */
+  MarkSearch magic_search_; /**< Search for HMAC(SHARED_SECRET, "Responder magic") */
+  ::std::uniform_int_distribution<uint32_t> pad_dist_;  /** Padding distribution */
+  /** @} */
+};
+
+} // namespace obfs3
+} // namespace pt
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_PT_OBFS3_CODEC_H__
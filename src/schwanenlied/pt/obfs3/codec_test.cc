@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/crypto/rand_ctr_drbg.h"
+#include "schwanenlied/crypto/uniform_dh.h"
+#include "schwanenlied/pt/obfs3/codec.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace obfs3 {
+
+/*
+ * The tests play the bridge with an independent implementation of the
+ * responder side of the obfs3 spec.
+ */
+class Obfs3CodecTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    static const uint8_t seed[] = { 'o', 'b', 'f', 's', '3' };
+    rng_.seed(seed, sizeof(seed));
+
+    to_bridge_ = ::evbuffer_new();
+    from_bridge_ = ::evbuffer_new();
+    plaintext_ = ::evbuffer_new();
+    ASSERT_TRUE(to_bridge_ != nullptr);
+    ASSERT_TRUE(from_bridge_ != nullptr);
+    ASSERT_TRUE(plaintext_ != nullptr);
+  }
+
+  virtual void TearDown() {
+    ::evbuffer_free(to_bridge_);
+    ::evbuffer_free(from_bridge_);
+    ::evbuffer_free(plaintext_);
+  }
+
+  /** HMAC(SHARED_SECRET, s) */
+  crypto::SecureBuffer derive(const char* s) {
+    crypto::SecureBuffer digest(crypto::HmacSha256::kDigestLength, 0);
+    EXPECT_TRUE(hmac_->digest(reinterpret_cast<const uint8_t*>(s),
+                              ::std::strlen(s), &digest[0], digest.size()));
+    return digest;
+  }
+
+  /** Consume the initiator public key, and send ours with padding */
+  void bridge_handshake(const size_t pad_len) {
+    ASSERT_LE(static_cast<size_t>(crypto::UniformDH::kKeyLength),
+              ::evbuffer_get_length(to_bridge_));
+    const uint8_t* x = ::evbuffer_pullup(to_bridge_,
+                                         crypto::UniformDH::kKeyLength);
+    ASSERT_TRUE(uniform_dh_.compute_key(x, crypto::UniformDH::kKeyLength));
+    ::evbuffer_drain(to_bridge_, crypto::UniformDH::kKeyLength);
+
+    // The initiator padding is only delimited by the initiator magic
+    init_pad_len_ = ::evbuffer_get_length(to_bridge_);
+
+    const auto y = uniform_dh_.public_key();
+    ::evbuffer_add(from_bridge_, y.data(), y.size());
+    ::evbuffer_add(from_bridge_, random_data(pad_len).data(), pad_len);
+
+    hmac_ = ::std::unique_ptr<crypto::HmacSha256>(
+        new crypto::HmacSha256(uniform_dh_.shared_secret()));
+    const auto init_secret = derive("Initiator obfuscated data");
+    const auto resp_secret = derive("Responder obfuscated data");
+    ASSERT_TRUE(init_aes_.set_state(init_secret.substr(0, 16), nullptr, 0,
+                                    init_secret.data() + 16, 16));
+    ASSERT_TRUE(resp_aes_.set_state(resp_secret.substr(0, 16), nullptr, 0,
+                                    resp_secret.data() + 16, 16));
+    init_magic_ = derive("Initiator magic");
+    resp_magic_ = derive("Responder magic");
+  }
+
+  /** Strip the initiator padding and magic from to_bridge_ */
+  void bridge_find_magic() {
+    const size_t len = ::evbuffer_get_length(to_bridge_);
+    ASSERT_LE(init_pad_len_ + init_magic_.size(), len);
+    const uint8_t* p = ::evbuffer_pullup(to_bridge_, -1);
+    const uint8_t* magic = ::std::search(p, p + len, init_magic_.begin(),
+                                         init_magic_.end());
+    ASSERT_TRUE(magic != p + len);
+    ASSERT_GE(static_cast<size_t>(magic - p), init_pad_len_);
+    ASSERT_GE(init_pad_len_ + 8194u / 2, static_cast<size_t>(magic - p));
+    ::evbuffer_drain(to_bridge_, (magic - p) + init_magic_.size());
+  }
+
+  crypto::SecureBuffer random_data(const size_t len) {
+    crypto::SecureBuffer buf(len, 0);
+    for (size_t i = 0; i < len; i += 0x10000) {
+      const size_t n = ::std::min<size_t>(len - i, 0x10000);
+      EXPECT_TRUE(rng_.get_bytes(&buf[i], n));
+    }
+    return buf;
+  }
+
+  crypto::SecureBuffer drain(struct evbuffer* buf) {
+    crypto::SecureBuffer ret(::evbuffer_get_length(buf), 0);
+    if (!ret.empty())
+      ::evbuffer_remove(buf, &ret[0], ret.size());
+    return ret;
+  }
+
+  Codec codec_;
+  crypto::RandCtrDrbg rng_;
+  crypto::UniformDH uniform_dh_;
+  ::std::unique_ptr<crypto::HmacSha256> hmac_;
+  crypto::Aes128Ctr init_aes_;
+  crypto::Aes128Ctr resp_aes_;
+  crypto::SecureBuffer init_magic_;
+  crypto::SecureBuffer resp_magic_;
+  size_t init_pad_len_;
+  struct evbuffer* to_bridge_;
+  struct evbuffer* from_bridge_;
+  struct evbuffer* plaintext_;
+};
+
+TEST_F(Obfs3CodecTest, RoundTrip) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(3000);
+
+  bool is_finished = false;
+  ASSERT_TRUE(codec_.recv_handshake_msg(from_bridge_, is_finished));
+  ASSERT_TRUE(is_finished);
+
+  // Initiator -> Responder (Padding, magic, then the payload)
+  const crypto::SecureBuffer upstream = random_data(100000);
+  ::evbuffer_add(plaintext_, upstream.data(), upstream.size());
+  ASSERT_TRUE(codec_.encode(plaintext_, to_bridge_));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+  bridge_find_magic();
+  crypto::SecureBuffer wire = drain(to_bridge_);
+  ASSERT_TRUE(init_aes_.process(wire.data(), wire.size(), &wire[0]));
+  ASSERT_EQ(upstream, wire);
+
+  // Responder -> Initiator, with the magic split across reads
+  const crypto::SecureBuffer downstream = random_data(70000);
+  wire.assign(downstream.size(), 0);
+  ASSERT_TRUE(resp_aes_.process(downstream.data(), downstream.size(), &wire[0]));
+  ::evbuffer_add(from_bridge_, resp_magic_.data(), resp_magic_.size());
+  ::evbuffer_add(from_bridge_, wire.data(), wire.size());
+  struct evbuffer* in = ::evbuffer_new();
+  while (::evbuffer_get_length(from_bridge_) > 0) {
+    ::evbuffer_remove_buffer(from_bridge_, in, 777);
+    ASSERT_TRUE(codec_.decode(in, plaintext_));
+  }
+  ASSERT_EQ(0u, ::evbuffer_get_length(in));
+  ASSERT_EQ(downstream, drain(plaintext_));
+
+  ::evbuffer_free(in);
+}
+
+TEST_F(Obfs3CodecTest, MagicFirstEncode) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(0);
+
+  bool is_finished = false;
+  ASSERT_TRUE(codec_.recv_handshake_msg(from_bridge_, is_finished));
+  ASSERT_TRUE(is_finished);
+
+  // The padding and magic go out on the first call, even with no payload
+  ASSERT_TRUE(codec_.encode(plaintext_, to_bridge_));
+  bridge_find_magic();
+  ASSERT_EQ(0u, ::evbuffer_get_length(to_bridge_));
+
+  // ... and only once
+  ::evbuffer_add(plaintext_, "x", 1);
+  ASSERT_TRUE(codec_.encode(plaintext_, to_bridge_));
+  ASSERT_EQ(1u, ::evbuffer_get_length(to_bridge_));
+}
+
+TEST_F(Obfs3CodecTest, MissingMagic) {
+  ASSERT_TRUE(codec_.send_handshake_msg(to_bridge_));
+  bridge_handshake(0);
+
+  bool is_finished = false;
+  ASSERT_TRUE(codec_.recv_handshake_msg(from_bridge_, is_finished));
+  ASSERT_TRUE(is_finished);
+
+  // A responder that never sends the magic is cut off after MAX_PADDING
+  const crypto::SecureBuffer junk = random_data(8194 + 32);
+  ::evbuffer_add(from_bridge_, junk.data(), junk.size());
+  ASSERT_FALSE(codec_.decode(from_bridge_, plaintext_));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+}
+
+} // namespace obfs3
+} // namespace pt
+} // namespace schwanenlied
@@ -34,19 +34,11 @@
 #ifndef SCHWANENLIED_PT_SCRAMBLESUIT_CLIENT_H__
 #define SCHWANENLIED_PT_SCRAMBLESUIT_CLIENT_H__
 
-#define SCRAMBLESUIT_LOGGER "scramblesuit"
-#ifdef SCRAMBLESUIT_CLIENT_IMPL
-#define _LOGGER SCRAMBLESUIT_LOGGER
-#endif
-
-#include <array>
-
 #include <event2/event.h>
 
 #include "schwanenlied/common.h"
 #include "schwanenlied/socks5_server.h"
-#include "schwanenlied/crypto/aes.h"
-#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
 #include "schwanenlied/pt/scramblesuit/prob_dist.h"
 #include "schwanenlied/pt/scramblesuit/session_ticket_handshake.h"
 #include "schwanenlied/pt/scramblesuit/uniform_dh_handshake.h"
@@ -61,8 +53,13 @@ namespace scramblesuit {
  * ScrambleSuit Client
  *
  * This implements a wire compatible ScrambleSuit client using Socks5Server.
+ *
+ * The framing lives in FrameCodec and the handshakes write to/read from
+ * evbuffers, this class handles the bridge password, the Session Tickets,
+ * IAT obfuscation, and moving data between the Session's bufferevents and
+ * the codec.
  */
-class Client : public Socks5Server::Session {
+class Client : public Socks5Server::TransportSession<Client> {
  public:
   /** Client factory */
   class SessionFactory : public Socks5Server::SessionFactory {
@@ -72,8 +69,8 @@ class Client : public Socks5Server::Session {
                                           const evutil_socket_t sock,
                                           const ::std::string& addr,
                                           const bool scrub_addrs) override {
-      return static_cast<Socks5Server::Session*>(new Client(server, base, sock,
-                                                            addr, scrub_addrs));
+      return new_session<Client>(kArenaLen, server, base, sock, addr,
+                                 scrub_addrs);
     }
   };
 
@@ -82,25 +79,14 @@ class Client : public Socks5Server::Session {
          const evutil_socket_t sock,
          const ::std::string& addr,
          const bool scrub_addrs) :
-      Session(server, base, sock, addr, true, scrub_addrs),
-      logger_(::el::Loggers::getLogger(SCRAMBLESUIT_LOGGER)),
-      handshake_(HandshakeMethod::kINVALID),
-      packet_len_rng_(kHeaderLength, kMaxFrameLength),
+      TransportSession(server, base, sock, addr, true, scrub_addrs),
+      codec_(),
 #ifdef ENABLE_SCRAMBLESUIT_IAT
       packet_int_rng_(0, kMaxPacketDelay),
-      iat_timer_ev_(nullptr),
-#endif
-      decode_state_(FrameDecodeState::kREAD_HEADER),
-      decode_buf_len_(0),
-      decode_total_len_(0),
-      decode_payload_len_(0) {}
-
-  ~Client() {
-#ifdef ENABLE_SCRAMBLESUIT_IAT
-    if (iat_timer_ev_ != nullptr)
-      ::event_free(iat_timer_ev_);
+      iat_timer_(on_iat_timer, this),
 #endif
-  }
+      logger_(::el::Loggers::getLogger(SCRAMBLESUIT_LOGGER)),
+      handshake_(HandshakeMethod::kINVALID) {}
 
  protected:
   bool on_client_authenticate(const uint8_t* uname,
@@ -120,27 +106,25 @@ class Client : public Socks5Server::Session {
   bool on_outgoing_flush() override;
 #endif
 
+  size_t on_idle() override;
+
  private:
   Client(const Client&) = delete;
   void operator=(const Client&) = delete;
 
+  friend Socks5Server::TransportSession<Client>;
+
   /** @{ */
   /** k_B length */
   static constexpr size_t kSharedSecretLength = 20;
-  /** HMAC-SHA256-128 digest length */
-  static constexpr size_t kDigestLength = 16;
-  /** ScrambleSuit frame header length */
-  static constexpr size_t kHeaderLength = 21;
-  /** ScrambleSuit PRNG seed length */
-  static constexpr size_t kPrngSeedLength = 32;
-  /** ScrambleSuit frame max frame length */
-  static constexpr size_t kMaxFrameLength = 1448;
-  /** ScrambleSuit frame max payload length */
-  static constexpr size_t kMaxPayloadLength = kMaxFrameLength - kHeaderLength;
 #ifdef ENABLE_SCRAMBLESUIT_IAT
   /** ScrambleSuit max IAT obfsucation delay (multiples of 100 usec) */
   static constexpr uint32_t kMaxPacketDelay = 100;
 #endif
+  /** The Arena size (enough for both handshakes) */
+  static constexpr size_t kArenaLen = sizeof(SessionTicketHandshake) +
+                                      sizeof(UniformDHHandshake) +
+                                      2 * Arena::kAlignment;
   /** @} */
 
   /** ScrambleSuit Handshake methods */
@@ -150,23 +134,6 @@ class Client : public Socks5Server::Session {
     kSESSION_TICKET     /**< Session Ticket */
   };
 
-  /** ScrambleSuit Packet Flag bitfield */
-  enum PacketFlags {
-    kPAYLOAD = 0x1,     /**< Payload packet */
-    kNEW_TICKET = 0x2,  /**< Session ticket packet */
-    kPRNG_SEED = 0x4    /**< Protocol Polymorphism PRNG seed packet */
-  };
-
-  /**
-   * Given a shared secret, derive the session keys per the ScrambleSuit spec
-   *
-   * @param[in] k_t The shared secret to use as the key material
-   *
-   * @returns true  - Success
-   * @returns false - Failure
-   */
-  bool kdf_scramblesuit(const crypto::SecureBuffer& k_t);
-
 #ifdef ENABLE_SCRAMBLESUIT_IAT
   /**
    * Schedule the Inter-Arrival Time obfuscation TX timer
@@ -175,6 +142,9 @@ class Client : public Socks5Server::Session {
    * @returns false - Failure
    */
   bool schedule_iat_transmit();
+
+  /** The IAT obfuscation TX TimerWheel::Timer callback */
+  static void on_iat_timer(void* arg);
 #endif
 
   /**
@@ -187,67 +157,30 @@ class Client : public Socks5Server::Session {
    */
   bool on_iat_transmit(const bool send_all=false);
 
-  /**
-   * Encode and send an outgoing ScrambleSuit frame
-   *
-   * @param[in] buf     The buffer to send as payload
-   * @param[in] len     The length of the payload
-   * @param[in] pad_len The length of the padding to append
-   *
-   * @returns true  - Success
-   * @returns false - Failure
+  /*
+   * The relay path state is declared first so that it directly follows the
+   * Session's own hot state, the handshake only state comes after it.
    */
-  bool send_outgoing_frame(const uint8_t* buf,
-                           const size_t len,
-                           const size_t pad_len);
+  FrameCodec codec_;            /**< The ScrambleSuit frame codec */
+
+#ifdef ENABLE_SCRAMBLESUIT_IAT
+  /** @{ */
+  ProbDist packet_int_rng_;     /**< Packet interval morpher */
+  TimerWheel::Timer iat_timer_; /**< Packet interval TX timer */
+  /** @} */
+#endif
 
   ::el::Logger* logger_;  /**< The scramblesuit logger */
 
   /** @{ */
-  /** The 160 bit bridge secret (k_B) */
+  /** The 160 bit bridge secret (k_B, released after the handshake) */
   crypto::SecureBuffer shared_secret_;
   /** The handshake type used */
   HandshakeMethod handshake_;
   /** The UniformDHHandshake instance */
-  ::std::unique_ptr<UniformDHHandshake> uniformdh_handshake_;
+  Arena::Ptr<UniformDHHandshake> uniformdh_handshake_;
   /** The SessionTicketHandshake instance */
-  ::std::unique_ptr<SessionTicketHandshake> session_ticket_handshake_;
-  /** @} */
-
-  /** @{ */
-  crypto::HmacSha256 initiator_hmac_; /**< Outgoing (to Bridge) HMAC */
-  crypto::HmacSha256 responder_hmac_; /**< Incoming (from Bridge) HMAC */
-  crypto::Aes256Ctr initiator_aes_;   /**< Outgoing (to Bridge) AES-256-CTR */
-  crypto::Aes256Ctr responder_aes_;   /**< Incoming (from Bridge) AES-256-CTR */
-  /** @} */
-
-  /** @{ */
-  ProbDist packet_len_rng_;     /**< Packet length morpher */
-#ifdef ENABLE_SCRAMBLESUIT_IAT
-  ProbDist packet_int_rng_;     /**< Packet interval morpher */
-  struct event* iat_timer_ev_;  /**< Packet interval TX event */
-#endif
-  /** @} */
-
-  /** @{ */
-  /** Frame decode state */
-  enum class FrameDecodeState {
-    kREAD_HEADER,   /**< Reading the header */
-    kREAD_PAYLOAD,  /**< Reading the payload */
-  } decode_state_;  /**< The frame decoder state */
-  /** Frame decode buffer */
-  ::std::array<uint8_t, kHeaderLength + kMaxPayloadLength> decode_buf_;
-  /** The amount of data in decode_buf_ */
-  size_t decode_buf_len_;
-  /** The total non-header data in frame being decoded */
-  uint16_t decode_total_len_;
-  /** The total payload in the frame being decoded */
-  uint16_t decode_payload_len_;
-  /** @} */
-
-  /** @{ */
-  friend SessionTicketHandshake;
-  friend UniformDHHandshake;
+  Arena::Ptr<SessionTicketHandshake> session_ticket_handshake_;
   /** @} */
 };
 
@@ -0,0 +1,593 @@
+/**
+ * @file    scramblesuit/frame_codec.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   ScrambleSuit Frame Codec (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define SCRAMBLESUIT_CLIENT_IMPL
+
+#include <algorithm>
+#include <cstring>
+
+#include "schwanenlied/crypto/hkdf_sha256.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace scramblesuit {
+
+constexpr size_t FrameCodec::kPrngSeedLength;
+constexpr size_t FrameCodec::kMaxFrameLength;
+constexpr size_t FrameCodec::kMaxPayloadLength;
+
+bool FrameCodec::set_session_key(const crypto::SecureBuffer& k_t) {
+  /*
+   * HKDF-SHA256-Expand(shared_secret, "", 144)
+   *
+   * Bytes 000:031 - 256-bit AES-CTR session key to send data.
+   * Bytes 032:039 - 64-bit AES-CTR IV to send data.
+   * Bytes 040:071 - 256-bit AES-CTR session key to receive data.
+   * Bytes 072:079 - 64-bit AES-CTR IV to receive data.
+   * Bytes 080:111 - 256-bit HMAC-SHA256-128 key to send data.
+   * Bytes 112:143 - 256-bit HMAC-SHA256-128 key to receive data.
+   *
+   * The actual counter component is initialized to 1.
+   */
+
+  static constexpr ::std::array<uint8_t, 8> initial_ctr = { {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+  } };
+
+  if (k_t.size() != 32)
+    return false;
+
+  const auto prk = crypto::HkdfSha256::expand(k_t, nullptr, 0, 144);
+  SL_ASSERT(prk.size() == 144);
+
+  if (!initiator_aes_.set_state(prk.substr(0, 32),
+                                prk.data() + 32, 8,
+                                initial_ctr.data(),
+                                initial_ctr.size()))
+    return false;
+  if (!responder_aes_.set_state(prk.substr(40, 32),
+                                prk.data() + 72 , 8,
+                                initial_ctr.data(),
+                                initial_ctr.size()))
+    return false;
+  if (!initiator_hmac_.set_key(prk.substr(80, 32)))
+    return false;
+  if (!responder_hmac_.set_key(prk.substr(112, 32)))
+    return false;
+
+  return true;
+}
+
+bool FrameCodec::encode(struct evbuffer* in,
+                        struct evbuffer* out,
+                        const bool send_all) {
+  if (in == nullptr || out == nullptr)
+    return false;
+
+  size_t len = ::evbuffer_get_length(in);
+  while (len > 0) {
+    /*
+     * Lay out a burst of frames first, so that the ciphertext can be written
+     * into a single contiguous reservation in out.  Each pass of the loop
+     * below adds a payload frame, and at most 2 padding frames.
+     */
+    ::std::array<FrameSpec, kMaxBurstFrames> frames;
+    size_t nr_frames = 0;
+    size_t burst_len = 0;
+    auto add_frame = [&](const size_t frame_len, const size_t frame_pad_len) {
+      if (frame_len + frame_pad_len + kHeaderLength > kMaxFrameLength)
+        return false;
+      SL_ASSERT(nr_frames < frames.size());
+      frames[nr_frames].len = static_cast<uint16_t>(frame_len);
+      frames[nr_frames].pad_len = static_cast<uint16_t>(frame_pad_len);
+      nr_frames++;
+      burst_len += kHeaderLength + frame_len + frame_pad_len;
+      return true;
+    };
+
+    size_t to_frame = len;
+    while (to_frame > 0 && nr_frames + 3 <= frames.size()) {
+      const size_t frame_payload_len = ::std::min(to_frame, kMaxPayloadLength);
+
+      size_t pad_len = 0;
+      if (frame_payload_len < kMaxPayloadLength ||
+          to_frame == kMaxPayloadLength) {
+        /*
+         * Only append padding if the transmitted frame is not full sized,
+         * unless sending a full sized frame will completely drain the IAT
+         * buffer.
+         *
+         * I don't *think* that sending full frames without padding in the
+         * case of sustained data transfer is something that's fingerprintable
+         * and it would look more suspicious if "sustained" bursts had random
+         * padding.
+         */
+        const size_t burst_tail_len = frame_payload_len % kMaxFrameLength;
+        const uint32_t sample_len = packet_len_rng_();
+        if (sample_len >= burst_tail_len)
+          pad_len = sample_len - burst_tail_len;
+        else
+          pad_len = (kMaxFrameLength - burst_tail_len) + sample_len;
+      }
+
+      if (pad_len >= kHeaderLength &&
+          pad_len + frame_payload_len <= kMaxPayloadLength) {
+        // XXX: In theory, it's possible to incrementally send padding as well?
+        if (!add_frame(frame_payload_len, pad_len - kHeaderLength))
+          return false;
+        pad_len = 0;
+      } else if (!add_frame(frame_payload_len, 0))
+        return false;
+      to_frame -= frame_payload_len;
+
+      // Send remaining padding if any exists
+      if (pad_len > kHeaderLength) {
+        if (!add_frame(0, pad_len - kHeaderLength))
+          return false;
+      } else if (pad_len > 0) {
+        if (!add_frame(0, kMaxPayloadLength - kHeaderLength))
+          return false;
+        if (!add_frame(0, pad_len))
+          return false;
+      }
+
+      if (!send_all)
+        break;
+    }
+
+    // Encrypt and MAC the burst in place, and hand it to out in one go
+    struct evbuffer_iovec v;
+    if (::evbuffer_reserve_space(out, burst_len, &v, 1) != 1) {
+      LOG(ERROR) << "Failed to reserve space for frames";
+      return false;
+    }
+    SL_ASSERT(v.iov_len >= burst_len);
+    uint8_t* p = reinterpret_cast<uint8_t*>(v.iov_base);
+    for (size_t i = 0; i < nr_frames; i++) {
+      if (!encode_frame(in, p, frames[i].len, frames[i].pad_len))
+        return false;
+      p += kHeaderLength + frames[i].len + frames[i].pad_len;
+    }
+    v.iov_len = burst_len;
+    if (::evbuffer_commit_space(out, &v, 1) != 0) {
+      LOG(ERROR) << "Failed to append frames";
+      return false;
+    }
+
+    len = ::evbuffer_get_length(in);
+    if (!send_all)
+      break;
+  }
+
+  return true;
+}
+
+bool FrameCodec::decode(struct evbuffer* in,
+                        struct evbuffer* out) {
+  if (in == nullptr || out == nullptr)
+    return false;
+
+  size_t len = ::evbuffer_get_length(in);
+  while (true) {
+    // If we are waiting on reading a header:
+    if (decode_state_ == FrameDecodeState::kREAD_HEADER) {
+      // Attempt to read said header
+      SL_ASSERT(decode_buf_len_ == 0);
+      if (len < kHeaderLength)
+        return true;
+
+      // Copy the header out, it's tiny and gets decrypted in place
+      if (static_cast<int>(kHeaderLength) != ::evbuffer_remove(in,
+                                                               decode_hdr_.data(),
+                                                               kHeaderLength)) {
+        LOG(ERROR) << "Failed to read frame header";
+        return false;
+      }
+      len -= kHeaderLength;
+
+      // MAC the header
+      if (!responder_hmac_.init()) {
+        LOG(ERROR) << "Failed to init RX frame MAC";
+        return false;
+      }
+      if (!responder_hmac_.update(decode_hdr_.data() + kDigestLength,
+                                  kHeaderLength - kDigestLength)) {
+        LOG(ERROR) << "Failed to MAC RX frame header";
+        return false;
+      }
+
+      // Decrypt the header
+      if (!responder_aes_.process(decode_hdr_.data() + kDigestLength,
+                                  kHeaderLength - kDigestLength,
+                                  decode_hdr_.data() + kDigestLength)) {
+        LOG(ERROR) << "Failed to decrypt frame header";
+        return false;
+      }
+
+      // Validate that the lengths are sane
+      decode_total_len_ = (decode_hdr_.at(16) << 8) | decode_hdr_.at(17);
+      decode_payload_len_ = (decode_hdr_.at(18) << 8) | decode_hdr_.at(19);
+      if (decode_total_len_ > kMaxPayloadLength) {
+        LOG(WARNING) << "Total length oversized: " << decode_total_len_;
+        return false;
+      }
+      if (decode_payload_len_ > kMaxPayloadLength) {
+        LOG(WARNING) << "Payload length oversized: " << decode_payload_len_;
+        return false;
+      }
+      if (decode_total_len_ < decode_payload_len_) {
+        LOG(WARNING) << "Payload longer than frame: "
+                     << decode_total_len_ << " < " << decode_payload_len_;
+        return false;
+      }
+
+      decode_state_ = FrameDecodeState::kREAD_PAYLOAD;
+    }
+
+    SL_ASSERT(decode_state_ == FrameDecodeState::kREAD_PAYLOAD);
+
+    /*
+     * Payload frames that are already completely buffered are authenticated
+     * and decrypted straight out of in into out, everything else (frames
+     * that straddle reads, and the rare control frames) is staged in
+     * decode_buf_.
+     */
+    if (decode_buf_len_ == 0 && len >= decode_total_len_ &&
+        decode_payload_len_ > 0 && decode_hdr_.at(20) == PacketFlags::kPAYLOAD) {
+      bool decoded = false;
+      if (!decode_in_place(in, out, decoded))
+        return false;
+      if (decoded) {
+        len -= decode_total_len_;
+        decode_state_ = FrameDecodeState::kREAD_HEADER;
+        continue;
+      }
+    }
+
+    const size_t to_process = ::std::min<size_t>(decode_total_len_ -
+                                                 decode_buf_len_, len);
+    if (to_process > 0) {
+      // Lazy allocation, idle Sessions release the buffer via reclaim()
+      if (decode_buf_ == nullptr) {
+        decode_buf_ = ::std::unique_ptr<DecodeBuffer>(new DecodeBuffer);
+        if (decode_buf_ == nullptr) {
+          LOG(ERROR) << "Failed to allocate the frame decode buffer";
+          return false;
+        }
+      }
+      SL_ASSERT(to_process + decode_buf_len_ <= decode_buf_->size());
+
+      // Copy the data into the decode buffer
+      if (static_cast<int>(to_process) !=
+          ::evbuffer_remove(in, decode_buf_->data() + decode_buf_len_,
+                            to_process)) {
+        LOG(ERROR) << "Failed to read frame payload";
+        return false;
+      }
+
+      // MAC the encrypted payload
+      if (!responder_hmac_.update(decode_buf_->data() + decode_buf_len_,
+                                  to_process)) {
+        LOG(ERROR) << "Failed to MAC RX frame payload";
+        return false;
+      }
+      decode_buf_len_ += to_process;
+      len -= to_process;
+    }
+
+    // Wait for the rest of the frame
+    if (decode_buf_len_ < decode_total_len_)
+      return true;
+
+    // Validate the MAC
+    if (!verify_mac())
+      return false;
+
+    // Decrypt
+    if (decode_buf_len_ > 0 &&
+        !responder_aes_.process(decode_buf_->data(), decode_buf_len_,
+                                decode_buf_->data())) {
+      LOG(ERROR) << "Failed to decrypt frame payload";
+      return false;
+    }
+
+    if (!on_frame(out))
+      return false;
+
+    decode_state_ = FrameDecodeState::kREAD_HEADER;
+    decode_buf_len_ = 0;
+  }
+}
+
+bool FrameCodec::decode_in_place(struct evbuffer* in,
+                                 struct evbuffer* out,
+                                 bool& decoded) {
+  decoded = false;
+
+  // Locate the frame body (still at the head of in)
+  ::std::array<struct evbuffer_iovec, kMaxDecodeExtents> src;
+  const int nr_src = ::evbuffer_peek(in, decode_total_len_, nullptr,
+                                     src.data(), src.size());
+  if (nr_src <= 0 || static_cast<size_t>(nr_src) > src.size())
+    return true;  // Too fragmented, stage it instead
+
+  // Reserve room for the plaintext (padding included, it is not committed)
+  ::std::array<struct evbuffer_iovec, 2> dst;
+  const int nr_dst = ::evbuffer_reserve_space(out, decode_total_len_,
+                                              dst.data(), dst.size());
+  if (nr_dst <= 0) {
+    LOG(ERROR) << "Failed to reserve space for payload";
+    return false;
+  }
+
+  // MAC the ciphertext where it is
+  size_t remaining = decode_total_len_;
+  for (int i = 0; i < nr_src && remaining > 0; i++) {
+    const size_t n = ::std::min(src[i].iov_len, remaining);
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src[i].iov_base);
+    if (!responder_hmac_.update(s, n)) {
+      LOG(ERROR) << "Failed to MAC RX frame payload";
+      return false;
+    }
+    remaining -= n;
+  }
+  if (!verify_mac())
+    return false;
+
+  // Decrypt from in's chains into out's reserved space
+  size_t si = 0, s_off = 0, di = 0, d_off = 0;
+  remaining = decode_total_len_;
+  while (remaining > 0) {
+    SL_ASSERT(si < static_cast<size_t>(nr_src));
+    SL_ASSERT(di < static_cast<size_t>(nr_dst));
+    const size_t n = ::std::min(remaining,
+                                ::std::min(src[si].iov_len - s_off,
+                                           dst[di].iov_len - d_off));
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src[si].iov_base);
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst[di].iov_base);
+    if (!responder_aes_.process(s + s_off, n, d + d_off)) {
+      LOG(ERROR) << "Failed to decrypt frame payload";
+      return false;
+    }
+    remaining -= n;
+    if ((s_off += n) == src[si].iov_len) {
+      si++;
+      s_off = 0;
+    }
+    if ((d_off += n) == dst[di].iov_len) {
+      di++;
+      d_off = 0;
+    }
+  }
+
+  // Commit only the payload
+  int nr_commit = 0;
+  remaining = decode_payload_len_;
+  while (remaining > 0) {
+    dst[nr_commit].iov_len = ::std::min(dst[nr_commit].iov_len, remaining);
+    remaining -= dst[nr_commit].iov_len;
+    nr_commit++;
+  }
+  if (::evbuffer_commit_space(out, dst.data(), nr_commit) != 0) {
+    LOG(ERROR) << "Failed to append payload";
+    return false;
+  }
+  ::evbuffer_drain(in, decode_total_len_);
+
+  LOG(DEBUG) << "Decoded " << kHeaderLength << " + "
+             << decode_payload_len_ << " + "
+             << (decode_total_len_ - decode_payload_len_) << " bytes";
+
+  decoded = true;
+  return true;
+}
+
+bool FrameCodec::verify_mac() {
+  ::std::array<uint8_t, kDigestLength> digest;
+  if (!responder_hmac_.final(digest.data(), digest.size())) {
+    LOG(ERROR) << "Failed to finalize RX frame MAC";
+    return false;
+  }
+  if (!crypto::memequals(decode_hdr_.data(), digest.data(), digest.size())) {
+    LOG(ERROR) << "RX frame MAC mismatch";
+    return false;
+  }
+
+  return true;
+}
+
+bool FrameCodec::take_prng_seed(crypto::SecureBuffer& seed) {
+  if (prng_seed_.empty())
+    return false;
+
+  seed.swap(prng_seed_);
+  prng_seed_.clear();
+
+  return true;
+}
+
+bool FrameCodec::take_new_ticket(crypto::SecureBuffer& ticket) {
+  if (new_ticket_.empty())
+    return false;
+
+  ticket.swap(new_ticket_);
+  new_ticket_.clear();
+
+  return true;
+}
+
+size_t FrameCodec::reclaim() {
+  if (decode_buf_ == nullptr || decode_buf_len_ != 0)
+    return 0;
+
+  // The buffer holds the plaintext of the last frame
+  crypto::memwipe(decode_buf_->data(), decode_buf_->size());
+  decode_buf_.reset(nullptr);
+
+  return sizeof(DecodeBuffer);
+}
+
+bool FrameCodec::encode_frame(struct evbuffer* in,
+                              uint8_t* dst,
+                              const size_t len,
+                              const size_t pad_len) {
+  SL_ASSERT(len + pad_len + kHeaderLength <= kMaxFrameLength);
+
+  // Create a header
+  const size_t frame_payload_len = len + pad_len;
+  uint8_t* hdr = dst;
+  hdr[16] = (frame_payload_len & 0xffff) >> 8;
+  hdr[17] = (frame_payload_len & 0xff);
+  hdr[18] = (len & 0xffff) >> 8;
+  hdr[19] = (len & 0xff);
+  hdr[20] = PacketFlags::kPAYLOAD;
+
+  // Encrypt the header
+  if (!initiator_aes_.process(hdr + kDigestLength,
+                              kHeaderLength - kDigestLength,
+                              hdr + kDigestLength)) {
+    LOG(ERROR) << "Failed to encrypt frame header";
+    return false;
+  }
+
+  // Encrypt the payload straight out of in's chains
+  uint8_t* payload = dst + kHeaderLength;
+  uint8_t* d = payload;
+  size_t remaining = len;
+  while (remaining > 0) {
+    ::std::array<struct evbuffer_iovec, kMaxEncodeExtents> src;
+    const int nr_src = ::std::min<int>(::evbuffer_peek(in, remaining, nullptr,
+                                                       src.data(),
+                                                       src.size()),
+                                       src.size());
+    if (nr_src <= 0) {
+      LOG(ERROR) << "Failed to peek frame payload";
+      return false;
+    }
+
+    size_t consumed = 0;
+    for (int i = 0; i < nr_src && consumed < remaining; i++) {
+      const size_t n = ::std::min(src[i].iov_len, remaining - consumed);
+      if (!initiator_aes_.process(reinterpret_cast<const uint8_t*>(src[i].iov_base),
+                                  n, d)) {
+        LOG(ERROR) << "Failed to encrypt frame payload";
+        return false;
+      }
+      d += n;
+      consumed += n;
+    }
+    ::evbuffer_drain(in, consumed);
+    remaining -= consumed;
+  }
+
+  // Generate the padding
+  if (pad_len > 0) {
+    ::std::memset(d, 0, pad_len);
+    if (!initiator_aes_.process(d, pad_len, d)) {
+      LOG(ERROR) << "Failed to encrypt frame padding";
+      return false;
+    }
+  }
+
+  // MAC the frame
+  if (!initiator_hmac_.init()) {
+    LOG(ERROR) << "Failed to init TX frame MAC";
+    return false;
+  }
+  if (!initiator_hmac_.update(hdr + kDigestLength,
+                              kHeaderLength - kDigestLength)) {
+    LOG(ERROR) << "Failed to MAC TX frame header";
+    return false;
+  }
+  if (!initiator_hmac_.update(payload, frame_payload_len)) {
+    LOG(ERROR) << "Failed to MAC TX frame payload";
+    return false;
+  }
+  if (!initiator_hmac_.final(hdr, kDigestLength)) {
+    LOG(ERROR) << "Failed to finalize TX frame MAC";
+    return false;
+  }
+
+  LOG(DEBUG) << "Encoded " << kHeaderLength << " + " << len << " + "
+             << pad_len << " bytes";
+
+  return true;
+}
+
+bool FrameCodec::on_frame(struct evbuffer* out) {
+  LOG(DEBUG) << "Decoded " << kHeaderLength << " + "
+             << decode_payload_len_ << " + "
+             << (decode_total_len_ - decode_payload_len_) << " bytes";
+
+  if (decode_payload_len_ == 0)
+    return true;
+
+  const uint8_t* payload = decode_buf_->data();
+  switch (decode_hdr_.at(20)) {
+  case PacketFlags::kPAYLOAD:
+    // If the frame is payload, relay the payload
+    if (::evbuffer_add(out, payload, decode_payload_len_) != 0) {
+      LOG(ERROR) << "Failed to append payload";
+      return false;
+    }
+    break;
+  case PacketFlags::kPRNG_SEED:
+    if (decode_payload_len_ != kPrngSeedLength) {
+      LOG(WARNING) << "Received invalid PRNG seed, ignoring";
+      break;
+    }
+    LOG(INFO) << "Received new PRNG seed, morphing";
+    packet_len_rng_.reset(payload, decode_payload_len_, kHeaderLength,
+                          kMaxFrameLength);
+    LOG(DEBUG) << "Packet length probabilities: "
+               << packet_len_rng_.to_string();
+    prng_seed_.assign(payload, decode_payload_len_);
+    break;
+  case PacketFlags::kNEW_TICKET:
+    // The TicketStore keeps the most recent ticket per peer, so do the same
+    new_ticket_.assign(payload, decode_payload_len_);
+    break;
+  default:
+    // Just ignore unknown/unsupported frame types
+    LOG(WARNING) << "Received unsupported frame type: "
+                 << static_cast<int>(decode_hdr_.at(20));
+    break;
+  }
+
+  return true;
+}
+
+} // namespace scramblesuit
+} // namespace pt
+} // namespace schwanenlied
@@ -0,0 +1,298 @@
+/**
+ * @file    scramblesuit/frame_codec.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   ScrambleSuit Frame Codec
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SCHWANENLIED_PT_SCRAMBLESUIT_FRAME_CODEC_H__
+#define SCHWANENLIED_PT_SCRAMBLESUIT_FRAME_CODEC_H__
+
+#define SCRAMBLESUIT_LOGGER "scramblesuit"
+#ifdef SCRAMBLESUIT_CLIENT_IMPL
+#define _LOGGER SCRAMBLESUIT_LOGGER
+#endif
+
+#include <array>
+#include <memory>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/crypto/utils.h"
+#include "schwanenlied/pt/scramblesuit/prob_dist.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace scramblesuit {
+
+class SessionTicketHandshake;
+
+/**
+ * ScrambleSuit Frame Codec
+ *
+ * The ScrambleSuit framing (Encryption, MACing, and packet length morphing)
+ * as a buffer in, buffer out state machine.  It knows nothing about sockets,
+ * timers or Sessions, the caller is responsible for moving the data between
+ * the network and the evbuffers passed to each routine.
+ *
+ * The session keys are established by one of the handshakes via
+ * set_session_key().
+ */
+class FrameCodec {
+ public:
+  /** @{ */
+  /** HMAC-SHA256-128 digest length */
+  static constexpr size_t kDigestLength = 16;
+  /** ScrambleSuit frame header length */
+  static constexpr size_t kHeaderLength = 21;
+  /** ScrambleSuit PRNG seed length */
+  static constexpr size_t kPrngSeedLength = 32;
+  /** ScrambleSuit frame max frame length */
+  static constexpr size_t kMaxFrameLength = 1448;
+  /** ScrambleSuit frame max payload length */
+  static constexpr size_t kMaxPayloadLength = kMaxFrameLength - kHeaderLength;
+  /** @} */
+
+  /** ScrambleSuit Packet Flag bitfield */
+  enum PacketFlags {
+    kPAYLOAD = 0x1,     /**< Payload packet */
+    kNEW_TICKET = 0x2,  /**< Session ticket packet */
+    kPRNG_SEED = 0x4    /**< Protocol Polymorphism PRNG seed packet */
+  };
+
+  FrameCodec() :
+      packet_len_rng_(kHeaderLength, kMaxFrameLength),
+      decode_state_(FrameDecodeState::kREAD_HEADER),
+      decode_hdr_(),
+      decode_buf_(),
+      decode_buf_len_(0),
+      decode_total_len_(0),
+      decode_payload_len_(0) {}
+
+  ~FrameCodec() = default;
+
+  /**
+   * Given a shared secret, derive the session keys per the ScrambleSuit spec
+   *
+   * @param[in] k_t The shared secret to use as the key material
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool set_session_key(const crypto::SecureBuffer& k_t);
+
+  /**
+   * Encode plaintext into ScrambleSuit frames
+   *
+   * Each call consumes either a single burst (Up to kMaxPayloadLength bytes
+   * with padding as dictated by the packet length distribution), or all of
+   * in.  Frames are encrypted from in's chains into space reserved in out,
+   * which is committed once per run of up to kMaxBurstFrames frames.
+   *
+   * @param[in] in        The plaintext to encode (Drained as it is framed)
+   * @param[out] out      The evbuffer to append the frames to
+   * @param[in] send_all  Encode all of in instead of a single burst
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool encode(struct evbuffer* in,
+              struct evbuffer* out,
+              const bool send_all = true);
+
+  /**
+   * Decode ScrambleSuit frames
+   *
+   * Payload is appended to out, partial frames are buffered internally, and
+   * PRNG_SEED/NEW_TICKET frames are held for take_prng_seed() and
+   * take_new_ticket().  A received PRNG seed is also applied to the packet
+   * length distribution.
+   *
+   * @param[in] in    The ciphertext to decode (Drained as it is processed)
+   * @param[out] out  The evbuffer to append the payload to
+   *
+   * @returns true  - Success
+   * @returns false - Failure (Bad MAC, malformed frame etc)
+   */
+  bool decode(struct evbuffer* in,
+              struct evbuffer* out);
+
+  /** @{ */
+  /**
+   * Obtain the PRNG seed received by decode(), if any
+   *
+   * @param[out] seed The seed
+   *
+   * @returns true  - A seed was received since the last call
+   * @returns false - No seed was received
+   */
+  bool take_prng_seed(crypto::SecureBuffer& seed);
+
+  /**
+   * Obtain the key + ticket received by decode(), if any
+   *
+   * If several tickets were received since the last call, only the most
+   * recent one is returned.
+   *
+   * @param[out] ticket The new key + ticket
+   *
+   * @returns true  - A ticket was received since the last call
+   * @returns false - No ticket was received
+   */
+  bool take_new_ticket(crypto::SecureBuffer& ticket);
+  /** @} */
+
+  /** Return the packet length distribution */
+  const ProbDist& packet_len_rng() const { return packet_len_rng_; }
+
+  /**
+   * Release the frame decode buffer if no frame is partially decoded
+   *
+   * The buffer is reallocated by the next decode().
+   *
+   * @returns The number of bytes released
+   */
+  size_t reclaim();
+
+ private:
+  FrameCodec(const FrameCodec&) = delete;
+  void operator=(const FrameCodec&) = delete;
+
+  /** A frame laid out by encode() */
+  struct FrameSpec {
+    uint16_t len;     /**< The length of the payload */
+    uint16_t pad_len; /**< The length of the padding */
+  };
+
+  /** The most frames encode() writes per evbuffer_reserve_space() */
+  static constexpr size_t kMaxBurstFrames = 32;
+  /** The most chain extents encode_frame() encrypts per evbuffer_peek() */
+  static constexpr size_t kMaxEncodeExtents = 8;
+
+  /**
+   * Encode a single outgoing ScrambleSuit frame in place
+   *
+   * The payload is encrypted directly out of in's chains into dst, and
+   * drained from in.
+   *
+   * @param[in] in      The evbuffer to take the payload from
+   * @param[out] dst    Where to write the frame (kHeaderLength + len +
+   *                    pad_len bytes)
+   * @param[in] len     The length of the payload
+   * @param[in] pad_len The length of the padding to append
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool encode_frame(struct evbuffer* in,
+                    uint8_t* dst,
+                    const size_t len,
+                    const size_t pad_len);
+
+  /**
+   * Decode a fully buffered payload frame without staging it
+   *
+   * The frame body is authenticated over in's chains via evbuffer_peek(), and
+   * decrypted directly into space reserved in out, so each payload byte is
+   * copied exactly once.
+   *
+   * @param[in] in        The ciphertext, starting with the frame body
+   * @param[out] out      The evbuffer to append the payload to
+   * @param[out] decoded  Set if the frame was consumed (false = in is too
+   *                      fragmented, stage the frame instead)
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool decode_in_place(struct evbuffer* in,
+                       struct evbuffer* out,
+                       bool& decoded);
+
+  /** Finalize the RX frame MAC and compare it against the header */
+  bool verify_mac();
+
+  /**
+   * Handle a fully received and decrypted frame in decode_buf_
+   *
+   * @param[out] out  The evbuffer to append the payload to
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool on_frame(struct evbuffer* out);
+
+  /** @{ */
+  crypto::HmacSha256 initiator_hmac_; /**< Outgoing (to Bridge) HMAC */
+  crypto::HmacSha256 responder_hmac_; /**< Incoming (from Bridge) HMAC */
+  crypto::Aes256Ctr initiator_aes_;   /**< Outgoing (to Bridge) AES-256-CTR */
+  crypto::Aes256Ctr responder_aes_;   /**< Incoming (from Bridge) AES-256-CTR */
+  /** @} */
+
+  ProbDist packet_len_rng_;     /**< Packet length morpher */
+
+  /** @{ */
+  /** Frame decode state */
+  enum class FrameDecodeState {
+    kREAD_HEADER,   /**< Reading the header */
+    kREAD_PAYLOAD,  /**< Reading the payload */
+  } decode_state_;  /**< The frame decoder state */
+  /** The most chain extents decode_in_place() will walk */
+  static constexpr size_t kMaxDecodeExtents = 4;
+  /** The header of the frame being decoded (decrypted) */
+  ::std::array<uint8_t, kHeaderLength> decode_hdr_;
+  /** Frame decode buffer type (body only) */
+  typedef ::std::array<uint8_t, kMaxPayloadLength> DecodeBuffer;
+  /** Frame body staging buffer (Allocated on demand) */
+  ::std::unique_ptr<DecodeBuffer> decode_buf_;
+  /** The amount of data in decode_buf_ */
+  size_t decode_buf_len_;
+  /** The total non-header data in frame being decoded */
+  uint16_t decode_total_len_;
+  /** The total payload in the frame being decoded */
+  uint16_t decode_payload_len_;
+  /** @} */
+
+  /** @{ */
+  crypto::SecureBuffer prng_seed_;  /**< Pending PRNG_SEED payload */
+  crypto::SecureBuffer new_ticket_; /**< Pending NEW_TICKET payload */
+  /** @} */
+
+  /** The Session Ticket MAC is keyed with the derived initiator HMAC key */
+  friend SessionTicketHandshake;
+};
+
+} // namespace scramblesuit
+} // namespace pt
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_PT_SCRAMBLESUIT_FRAME_CODEC_H__
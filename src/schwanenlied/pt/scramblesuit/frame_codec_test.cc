@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/hkdf_sha256.h"
+#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/crypto/rand_ctr_drbg.h"
+#include "schwanenlied/crypto/utils.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
+#include "schwanenlied/pt/scramblesuit/prob_dist.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace scramblesuit {
+
+static constexpr size_t kDigestLength = FrameCodec::kDigestLength;
+static constexpr size_t kHeaderLength = FrameCodec::kHeaderLength;
+static constexpr size_t kMaxFrameLength = FrameCodec::kMaxFrameLength;
+static constexpr size_t kMaxPayloadLength = FrameCodec::kMaxPayloadLength;
+static constexpr size_t kPrngSeedLength = FrameCodec::kPrngSeedLength;
+
+/*
+ * The tests play the bridge, which frames and deframes data with an
+ * independent implementation of the ScrambleSuit message format keyed from
+ * the same k_t.
+ */
+class FrameCodecTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    static const uint8_t seed[] = { 's', 'c', 'r', 'a', 'm', 'b', 'l', 'e' };
+    rng_.seed(seed, sizeof(seed));
+
+    to_bridge_ = ::evbuffer_new();
+    from_bridge_ = ::evbuffer_new();
+    plaintext_ = ::evbuffer_new();
+    ASSERT_TRUE(to_bridge_ != nullptr);
+    ASSERT_TRUE(from_bridge_ != nullptr);
+    ASSERT_TRUE(plaintext_ != nullptr);
+    rekey();
+  }
+
+  /** Start over with a new Codec, and fresh session keys */
+  void rekey() {
+    const crypto::SecureBuffer k_t = random_data(32);
+    codec_.reset(new FrameCodec);
+    ASSERT_TRUE(codec_->set_session_key(k_t));
+
+    // The bridge sends with the responder keys, and receives with the
+    // initiator keys
+    static constexpr ::std::array<uint8_t, 8> initial_ctr = { {
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+    } };
+    const auto prk = crypto::HkdfSha256::expand(k_t, nullptr, 0, 144);
+    ASSERT_TRUE(tx_aes_.set_state(prk.substr(40, 32), prk.data() + 72, 8,
+                                  initial_ctr.data(), initial_ctr.size()));
+    ASSERT_TRUE(rx_aes_.set_state(prk.substr(0, 32), prk.data() + 32, 8,
+                                  initial_ctr.data(), initial_ctr.size()));
+    ASSERT_TRUE(tx_hmac_.set_key(prk.substr(112, 32)));
+    ASSERT_TRUE(rx_hmac_.set_key(prk.substr(80, 32)));
+
+    // The reference encoder sends with the initiator keys
+    ASSERT_TRUE(ref_aes_.set_state(prk.substr(0, 32), prk.data() + 32, 8,
+                                   initial_ctr.data(), initial_ctr.size()));
+    ASSERT_TRUE(ref_hmac_.set_key(prk.substr(80, 32)));
+
+    ::evbuffer_drain(to_bridge_, ::evbuffer_get_length(to_bridge_));
+    ::evbuffer_drain(from_bridge_, ::evbuffer_get_length(from_bridge_));
+    ::evbuffer_drain(plaintext_, ::evbuffer_get_length(plaintext_));
+    nr_frames_ = 0;
+    nr_padding_frames_ = 0;
+  }
+
+  virtual void TearDown() {
+    ::evbuffer_free(to_bridge_);
+    ::evbuffer_free(from_bridge_);
+    ::evbuffer_free(plaintext_);
+  }
+
+  /** Frame payload as the bridge, and append it to wire */
+  void bridge_frame(crypto::SecureBuffer& wire,
+                    const uint8_t flags,
+                    const crypto::SecureBuffer& payload,
+                    const size_t pad_len) {
+    frame(tx_aes_, tx_hmac_, wire, flags, payload, pad_len);
+  }
+
+  /** Frame payload with the given keys, and append it to wire */
+  void frame(crypto::Aes256Ctr& aes,
+             crypto::HmacSha256& hmac,
+             crypto::SecureBuffer& wire,
+             const uint8_t flags,
+             const crypto::SecureBuffer& payload,
+             const size_t pad_len) {
+    const size_t total_len = payload.size() + pad_len;
+    ASSERT_GE(kMaxPayloadLength, total_len);
+
+    crypto::SecureBuffer frame(kHeaderLength + total_len, 0);
+    frame[16] = static_cast<uint8_t>(total_len >> 8);
+    frame[17] = static_cast<uint8_t>(total_len);
+    frame[18] = static_cast<uint8_t>(payload.size() >> 8);
+    frame[19] = static_cast<uint8_t>(payload.size());
+    frame[20] = flags;
+    ::std::copy(payload.begin(), payload.end(),
+                frame.begin() + kHeaderLength);
+
+    // E(k_B, hdr[16:] | payload | pad), HMAC-SHA256-128(k_S, ciphertext)
+    uint8_t* p = &frame[kDigestLength];
+    const size_t len = frame.size() - kDigestLength;
+    ASSERT_TRUE(aes.process(p, len, p));
+    ASSERT_TRUE(hmac.digest(p, len, &frame[0], kDigestLength));
+    wire += frame;
+  }
+
+  /**
+   * Encode data as the frame at a time encoder that FrameCodec::encode()
+   * replaced did, sampling the padding from dist
+   */
+  void reference_encode(crypto::SecureBuffer& wire,
+                        const crypto::SecureBuffer& data,
+                        ProbDist& dist,
+                        const bool send_all) {
+    const crypto::SecureBuffer none;
+    for (size_t off = 0; off < data.size(); ) {
+      const size_t len = data.size() - off;
+      const size_t payload_len = ::std::min(len, kMaxPayloadLength);
+      const crypto::SecureBuffer payload = data.substr(off, payload_len);
+
+      size_t pad_len = 0;
+      if (payload_len < kMaxPayloadLength || len == kMaxPayloadLength) {
+        const size_t burst_tail_len = payload_len % kMaxFrameLength;
+        const uint32_t sample_len = dist();
+        if (sample_len >= burst_tail_len)
+          pad_len = sample_len - burst_tail_len;
+        else
+          pad_len = (kMaxFrameLength - burst_tail_len) + sample_len;
+      }
+
+      if (pad_len >= kHeaderLength &&
+          pad_len + payload_len <= kMaxPayloadLength) {
+        frame(ref_aes_, ref_hmac_, wire, FrameCodec::PacketFlags::kPAYLOAD,
+              payload, pad_len - kHeaderLength);
+        pad_len = 0;
+      } else
+        frame(ref_aes_, ref_hmac_, wire, FrameCodec::PacketFlags::kPAYLOAD,
+              payload, 0);
+      off += payload_len;
+
+      if (pad_len > kHeaderLength)
+        frame(ref_aes_, ref_hmac_, wire, FrameCodec::PacketFlags::kPAYLOAD,
+              none, pad_len - kHeaderLength);
+      else if (pad_len > 0) {
+        frame(ref_aes_, ref_hmac_, wire, FrameCodec::PacketFlags::kPAYLOAD,
+              none, kMaxPayloadLength - kHeaderLength);
+        frame(ref_aes_, ref_hmac_, wire, FrameCodec::PacketFlags::kPAYLOAD,
+              none, pad_len);
+      }
+
+      if (!send_all)
+        break;
+    }
+  }
+
+  /**
+   * Find a PRNG seed that results in a single possible packet length, and
+   * reset dist with it
+   *
+   * ProbDist only uses the seed to build the table, and samples it with a
+   * randomly seeded PRNG, so this is the only way for the reference encoder
+   * to pad exactly like the FrameCodec under test.
+   */
+  crypto::SecureBuffer fixed_prng_seed(ProbDist& dist) {
+    while (true) {
+      const crypto::SecureBuffer seed = random_data(kPrngSeedLength);
+      dist.reset(seed.data(), seed.size(), kHeaderLength, kMaxFrameLength);
+      ::std::ostringstream expected;
+      expected << ' ' << dist() << ": 1 ";
+      if (dist.to_string() == expected.str())
+        return seed;
+    }
+  }
+
+  /**
+   * Deframe everything in to_bridge_ as the bridge, and append the payload
+   * to data
+   */
+  void bridge_deframe(crypto::SecureBuffer& data) {
+    size_t len = ::evbuffer_get_length(to_bridge_);
+    while (len > 0) {
+      ASSERT_LE(kHeaderLength, len);
+      crypto::SecureBuffer frame(kHeaderLength, 0);
+      ASSERT_EQ(static_cast<int>(frame.size()),
+                ::evbuffer_copyout(to_bridge_, &frame[0], frame.size()));
+      crypto::SecureBuffer hdr(frame.substr(kDigestLength));
+      ASSERT_TRUE(rx_aes_.process(hdr.data(), hdr.size(), &hdr[0]));
+      const size_t total_len = (hdr[0] << 8) | hdr[1];
+      const size_t payload_len = (hdr[2] << 8) | hdr[3];
+      ASSERT_GE(kMaxPayloadLength, total_len);
+      ASSERT_GE(total_len, payload_len);
+      ASSERT_EQ(FrameCodec::PacketFlags::kPAYLOAD, static_cast<int>(hdr[4]));
+      ASSERT_LE(kHeaderLength + total_len, len);
+
+      frame.resize(kHeaderLength + total_len);
+      ::evbuffer_remove(to_bridge_, &frame[0], frame.size());
+      len -= frame.size();
+
+      ::std::array<uint8_t, kDigestLength> digest;
+      uint8_t* p = &frame[kDigestLength];
+      ASSERT_TRUE(rx_hmac_.digest(p, frame.size() - kDigestLength,
+                                  digest.data(), digest.size()));
+      ASSERT_TRUE(crypto::memequals(frame.data(), digest.data(),
+                                    digest.size()));
+
+      p = &frame[kHeaderLength];
+      ASSERT_TRUE(rx_aes_.process(p, total_len, p));
+      data.append(p, payload_len);
+
+      nr_frames_++;
+      if (payload_len == 0)
+        nr_padding_frames_++;
+    }
+  }
+
+  /** Feed wire to the Codec in len sized pieces */
+  void client_decode(const crypto::SecureBuffer& wire,
+                     const size_t len) {
+    for (size_t i = 0; i < wire.size(); i += len) {
+      ::evbuffer_add(from_bridge_, wire.data() + i,
+                     ::std::min(len, wire.size() - i));
+      ASSERT_TRUE(codec_->decode(from_bridge_, plaintext_));
+    }
+  }
+
+  /** Feed wire to the Codec in len sized pieces, till decoding fails */
+  bool client_decode_fails(const crypto::SecureBuffer& wire,
+                           const size_t len) {
+    for (size_t i = 0; i < wire.size(); i += len) {
+      ::evbuffer_add(from_bridge_, wire.data() + i,
+                     ::std::min(len, wire.size() - i));
+      if (!codec_->decode(from_bridge_, plaintext_))
+        return true;
+    }
+    return false;
+  }
+
+  /** Append wire to from_bridge_ as one evbuffer chain per piece */
+  void add_chains(const crypto::SecureBuffer& wire,
+                  const ::std::vector<size_t>& pieces) {
+    size_t off = 0;
+    for (size_t i = 0; off < wire.size(); i++) {
+      const size_t n = ::std::min(pieces[i % pieces.size()],
+                                  wire.size() - off);
+      ASSERT_EQ(0, ::evbuffer_add_reference(from_bridge_, wire.data() + off,
+                                            n, nullptr, nullptr));
+      off += n;
+    }
+  }
+
+  /** Count the evbuffer chains holding len bytes of buf at off */
+  static int nr_chains(struct evbuffer* buf,
+                       const size_t off,
+                       const size_t len) {
+    struct evbuffer_ptr pos;
+    if (::evbuffer_ptr_set(buf, &pos, off, EVBUFFER_PTR_SET) != 0)
+      return -1;
+    return ::evbuffer_peek(buf, len, &pos, nullptr, 0);
+  }
+
+  crypto::SecureBuffer take_plaintext() {
+    crypto::SecureBuffer buf(::evbuffer_get_length(plaintext_), 0);
+    if (!buf.empty())
+      ::evbuffer_remove(plaintext_, &buf[0], buf.size());
+    return buf;
+  }
+
+  crypto::SecureBuffer random_data(const size_t len) {
+    crypto::SecureBuffer buf(len, 0);
+    for (size_t i = 0; i < len; i += 0x10000) {
+      const size_t n = ::std::min<size_t>(len - i, 0x10000);
+      EXPECT_TRUE(rng_.get_bytes(&buf[i], n));
+    }
+    return buf;
+  }
+
+  ::std::unique_ptr<FrameCodec> codec_;
+  crypto::RandCtrDrbg rng_;
+  crypto::Aes256Ctr tx_aes_;
+  crypto::Aes256Ctr rx_aes_;
+  crypto::Aes256Ctr ref_aes_;
+  crypto::HmacSha256 tx_hmac_;
+  crypto::HmacSha256 rx_hmac_;
+  crypto::HmacSha256 ref_hmac_;
+  struct evbuffer* to_bridge_;
+  struct evbuffer* from_bridge_;
+  struct evbuffer* plaintext_;
+  size_t nr_frames_;
+  size_t nr_padding_frames_;
+};
+
+TEST_F(FrameCodecTest, RoundTrip) {
+  // Initiator -> Responder
+  const crypto::SecureBuffer upstream = random_data(100000);
+  ::evbuffer_add(plaintext_, upstream.data(), upstream.size());
+  ASSERT_TRUE(codec_->encode(plaintext_, to_bridge_, true));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+  crypto::SecureBuffer deframed;
+  bridge_deframe(deframed);
+  ASSERT_EQ(upstream, deframed);
+
+  // Responder -> Initiator
+  const crypto::SecureBuffer downstream = random_data(70000);
+  crypto::SecureBuffer wire;
+  for (size_t i = 0; i < downstream.size();
+       i += kMaxPayloadLength) {
+    const size_t n = ::std::min(kMaxPayloadLength,
+                                downstream.size() - i);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 downstream.substr(i, n), kMaxPayloadLength - n);
+  }
+  client_decode(wire, wire.size());
+  ASSERT_EQ(0u, ::evbuffer_get_length(from_bridge_));
+  ASSERT_EQ(downstream, take_plaintext());
+}
+
+TEST_F(FrameCodecTest, NewTicketKeepsLast) {
+  const crypto::SecureBuffer ticket_1 = random_data(112 + 32);
+  const crypto::SecureBuffer ticket_2 = random_data(112 + 32);
+  const crypto::SecureBuffer payload = random_data(100);
+
+  crypto::SecureBuffer wire;
+  bridge_frame(wire, FrameCodec::PacketFlags::kNEW_TICKET, ticket_1, 0);
+  bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 10);
+  bridge_frame(wire, FrameCodec::PacketFlags::kNEW_TICKET, ticket_2, 0);
+  client_decode(wire, wire.size());
+  ASSERT_EQ(payload, take_plaintext());
+
+  // Only the most recent ticket is handed out
+  crypto::SecureBuffer ticket;
+  ASSERT_TRUE(codec_->take_new_ticket(ticket));
+  ASSERT_EQ(ticket_2, ticket);
+  ASSERT_FALSE(codec_->take_new_ticket(ticket));
+}
+
+TEST_F(FrameCodecTest, DecodeFragmented) {
+  // Whole, chunked, header sized, odd sized and byte at a time delivery
+  const size_t chunk_lens[] = { 0, 4096, 1000, kHeaderLength, 7, 1 };
+  for (auto chunk_len : chunk_lens) {
+    rekey();
+
+    // Full, short, padded, padding only and control frames, back to back
+    const crypto::SecureBuffer data = random_data(8000);
+    const crypto::SecureBuffer seed = random_data(kPrngSeedLength);
+    const crypto::SecureBuffer ticket = random_data(112 + 32);
+    const crypto::SecureBuffer none;
+    crypto::SecureBuffer wire;
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 data.substr(0, kMaxPayloadLength), 0);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPRNG_SEED, seed, 100);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 data.substr(kMaxPayloadLength, 1), 0);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, none,
+                 kMaxPayloadLength);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 data.substr(kMaxPayloadLength + 1, 500), 900);
+    bridge_frame(wire, FrameCodec::PacketFlags::kNEW_TICKET, ticket, 0);
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, none, 0);
+    for (size_t i = kMaxPayloadLength + 501; i < data.size();
+         i += kMaxPayloadLength) {
+      const size_t n = ::std::min(kMaxPayloadLength, data.size() - i);
+      bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                   data.substr(i, n), kMaxPayloadLength - n);
+    }
+
+    client_decode(wire, chunk_len > 0 ? chunk_len : wire.size());
+    ASSERT_EQ(0u, ::evbuffer_get_length(from_bridge_));
+    ASSERT_EQ(data, take_plaintext());
+
+    crypto::SecureBuffer tmp;
+    ASSERT_TRUE(codec_->take_prng_seed(tmp));
+    ASSERT_EQ(seed, tmp);
+    ASSERT_TRUE(codec_->take_new_ticket(tmp));
+    ASSERT_EQ(ticket, tmp);
+  }
+}
+
+TEST_F(FrameCodecTest, DecodeAcrossChains) {
+  // Frame bodies spread over 1 to well past kMaxDecodeExtents (4) chains
+  const crypto::SecureBuffer data = random_data(20 * kMaxPayloadLength);
+  crypto::SecureBuffer wire;
+  for (size_t i = 0; i < data.size(); i += kMaxPayloadLength)
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 data.substr(i, kMaxPayloadLength), 0);
+
+  const ::std::vector<size_t> pieces = {
+    kHeaderLength + kMaxPayloadLength, 3000, 500, 300, 200, 64, 1, 333, 97
+  };
+  add_chains(wire, pieces);
+  int min_chains = 1000, max_chains = 0;
+  for (size_t i = 0; i < wire.size(); i += kHeaderLength + kMaxPayloadLength) {
+    const int n = nr_chains(from_bridge_, i + kHeaderLength,
+                            kMaxPayloadLength);
+    min_chains = ::std::min(min_chains, n);
+    max_chains = ::std::max(max_chains, n);
+  }
+  ASSERT_EQ(1, min_chains);
+  ASSERT_LT(4, max_chains);
+
+  ASSERT_TRUE(codec_->decode(from_bridge_, plaintext_));
+  ASSERT_EQ(0u, ::evbuffer_get_length(from_bridge_));
+  ASSERT_EQ(data, take_plaintext());
+
+  // Chains holding the tail of one frame and the head of the next
+  rekey();
+  wire.clear();
+  for (size_t i = 0; i < data.size(); i += 1000)
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD,
+                 data.substr(i, ::std::min<size_t>(1000, data.size() - i)),
+                 200);
+  add_chains(wire, { 1777, 5, 1300 });
+  ASSERT_TRUE(codec_->decode(from_bridge_, plaintext_));
+  ASSERT_EQ(0u, ::evbuffer_get_length(from_bridge_));
+  ASSERT_EQ(data, take_plaintext());
+}
+
+TEST_F(FrameCodecTest, DecodeControlFrames) {
+  const crypto::SecureBuffer seed = random_data(kPrngSeedLength);
+  const crypto::SecureBuffer bad_seed = random_data(kPrngSeedLength - 1);
+  const crypto::SecureBuffer payload = random_data(100);
+
+  // Malformed and unknown control frames are ignored
+  crypto::SecureBuffer wire;
+  bridge_frame(wire, FrameCodec::PacketFlags::kPRNG_SEED, bad_seed, 0);
+  bridge_frame(wire, 0x80, payload, 10);
+  bridge_frame(wire, FrameCodec::PacketFlags::kNEW_TICKET,
+               crypto::SecureBuffer(), 10);
+  client_decode(wire, wire.size());
+  crypto::SecureBuffer tmp;
+  ASSERT_FALSE(codec_->take_prng_seed(tmp));
+  ASSERT_FALSE(codec_->take_new_ticket(tmp));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+
+  // The PRNG seed reseeds the packet length distribution
+  wire.clear();
+  bridge_frame(wire, FrameCodec::PacketFlags::kPRNG_SEED, seed, 0);
+  bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 0);
+  client_decode(wire, 5);
+  ASSERT_EQ(payload, take_plaintext());
+  ASSERT_TRUE(codec_->take_prng_seed(tmp));
+  ASSERT_EQ(seed, tmp);
+  ASSERT_FALSE(codec_->take_prng_seed(tmp));
+
+  ProbDist expected(kHeaderLength, kMaxFrameLength);
+  expected.reset(seed.data(), seed.size(), kHeaderLength, kMaxFrameLength);
+  ASSERT_EQ(expected.to_string(), codec_->packet_len_rng().to_string());
+}
+
+TEST_F(FrameCodecTest, DecodeBadMac) {
+  const crypto::SecureBuffer payload = random_data(1000);
+
+  // The body of a buffered frame (decoded in place), and of a staged one
+  const size_t chunk_lens[] = { 0, 1 };
+  for (auto chunk_len : chunk_lens) {
+    rekey();
+    crypto::SecureBuffer wire;
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 0);
+    const size_t good_len = wire.size();
+    bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 50);
+    wire[good_len + kHeaderLength + 500] ^= 0x01;
+
+    ASSERT_TRUE(client_decode_fails(wire, chunk_len > 0 ? chunk_len :
+                                                          wire.size()));
+
+    // Nothing from the forged frame was released
+    ASSERT_EQ(payload, take_plaintext());
+  }
+
+  // The padding is authenticated too
+  rekey();
+  crypto::SecureBuffer wire;
+  bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 50);
+  wire[wire.size() - 1] ^= 0x80;
+  ASSERT_TRUE(client_decode_fails(wire, wire.size()));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+
+  // As is the header
+  rekey();
+  wire.clear();
+  bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 0);
+  wire[kDigestLength + 4] ^= 0x01;
+  ASSERT_TRUE(client_decode_fails(wire, wire.size()));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+
+  // And the MAC itself
+  rekey();
+  wire.clear();
+  bridge_frame(wire, FrameCodec::PacketFlags::kPAYLOAD, payload, 0);
+  wire[0] ^= 0x01;
+  ASSERT_TRUE(client_decode_fails(wire, 3));
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+}
+
+TEST_F(FrameCodecTest, EncodeMatchesReference) {
+  // Seed the packet length distribution, and a copy to lay out the reference
+  ProbDist dist(kHeaderLength, kMaxFrameLength);
+  const crypto::SecureBuffer seed = fixed_prng_seed(dist);
+  crypto::SecureBuffer wire;
+  bridge_frame(wire, FrameCodec::PacketFlags::kPRNG_SEED, seed, 0);
+  client_decode(wire, wire.size());
+
+  /*
+   * Around a single frame and the kMaxBurstFrames (32) frame burst limit, with
+   * the plaintext spread over chains that do not line up with the frames.
+   */
+  const size_t burst_len = 32 * kMaxPayloadLength;
+  const size_t lens[] = {
+    1, 100, kMaxPayloadLength - 1, kMaxPayloadLength, kMaxPayloadLength + 1,
+    burst_len - 1, burst_len, burst_len + 1, 3 * burst_len + 17
+  };
+  const ::std::vector<size_t> pieces = { 700, 1, 4000, 13, 1427 };
+  for (auto len : lens) {
+    const crypto::SecureBuffer data = random_data(len);
+    for (size_t off = 0; off < data.size(); ) {
+      for (auto n : pieces) {
+        n = ::std::min(n, data.size() - off);
+        ASSERT_EQ(0, ::evbuffer_add_reference(plaintext_, data.data() + off,
+                                              n, nullptr, nullptr));
+        if ((off += n) == data.size())
+          break;
+      }
+    }
+
+    ASSERT_TRUE(codec_->encode(plaintext_, to_bridge_, true));
+    ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+
+    // Byte identical to the frame at a time encoder
+    crypto::SecureBuffer expected;
+    reference_encode(expected, data, dist, true);
+    crypto::SecureBuffer encoded(::evbuffer_get_length(to_bridge_), 0);
+    ASSERT_EQ(static_cast<int>(encoded.size()),
+              ::evbuffer_copyout(to_bridge_, &encoded[0], encoded.size()));
+    ASSERT_EQ(expected, encoded) << "len: " << len;
+
+    // And decodable
+    crypto::SecureBuffer deframed;
+    bridge_deframe(deframed);
+    ASSERT_EQ(data, deframed);
+  }
+
+  // A full frame that drains the buffer is followed by padding only frames
+  ASSERT_LT(0u, nr_padding_frames_);
+}
+
+TEST_F(FrameCodecTest, EncodeBurst) {
+  ProbDist dist(kHeaderLength, kMaxFrameLength);
+  const crypto::SecureBuffer seed = fixed_prng_seed(dist);
+  crypto::SecureBuffer wire;
+  bridge_frame(wire, FrameCodec::PacketFlags::kPRNG_SEED, seed, 0);
+  client_decode(wire, wire.size());
+
+  // Without send_all, each call frames a single payload frame
+  const crypto::SecureBuffer data = random_data(2 * kMaxPayloadLength + 5);
+  ::evbuffer_add(plaintext_, data.data(), data.size());
+  crypto::SecureBuffer expected;
+  for (size_t off = 0; off < data.size(); off += kMaxPayloadLength) {
+    const size_t before = ::evbuffer_get_length(plaintext_);
+    ASSERT_TRUE(codec_->encode(plaintext_, to_bridge_, false));
+    ASSERT_EQ(::std::min(before, kMaxPayloadLength),
+              before - ::evbuffer_get_length(plaintext_));
+    reference_encode(expected, data.substr(off), dist, false);
+  }
+  ASSERT_EQ(0u, ::evbuffer_get_length(plaintext_));
+
+  crypto::SecureBuffer encoded(::evbuffer_get_length(to_bridge_), 0);
+  ::evbuffer_copyout(to_bridge_, &encoded[0], encoded.size());
+  ASSERT_EQ(expected, encoded);
+  crypto::SecureBuffer deframed;
+  bridge_deframe(deframed);
+  ASSERT_EQ(data, deframed);
+}
+
+} // namespace scramblesuit
+} // namespace pt
+} // namespace schwanenlied
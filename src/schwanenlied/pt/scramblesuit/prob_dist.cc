@@ -45,6 +45,8 @@ void ProbDist::reset(const uint8_t* seed,
                      const uint32_t sample_min,
                      const uint32_t sample_max) {
   SL_ASSERT(sample_max - sample_min > 0);
+  sample_min_ = sample_min;
+  sample_max_ = sample_max;
 
   // Optionally reseed the PRNG
   if (seed != nullptr && seed_len > 0) {
@@ -86,6 +88,9 @@ void ProbDist::reset(const uint8_t* seed,
 }
 
 const ::std::string ProbDist::to_string() const {
+  if (values_.empty())
+    return " [Not yet generated]";
+
   const auto probs = prob_dist_.probabilities();
   ::std::ostringstream stream;
 
@@ -55,13 +55,18 @@ class ProbDist {
   /**
    * Construct a new ProbDist instance
    *
+   * The (random) distribution is generated when it is first sampled, unless
+   * reset() is called before that.
+   *
    * @param[in] sample_min  The mimimum value that sampling should return
    * @param[in] sample_max  The maximum value that sampling should return
    */
   ProbDist(const uint32_t sample_min,
            const uint32_t sample_max) :
+      sample_min_(sample_min),
+      sample_max_(sample_max),
       bucket_dist_(kMinBuckets, kMaxBuckets) {
-    reset(nullptr, 0, sample_min, sample_max);
+    SL_ASSERT(sample_max - sample_min > 0);
   }
 
   ~ProbDist() = default;
@@ -89,6 +94,8 @@ class ProbDist {
    * constructor/reset()
    */
   uint32_t operator()() {
+    if (values_.empty())
+      reset(nullptr, 0, sample_min_, sample_max_);
     return values_.at(prob_dist_(rng_));
   }
 
@@ -105,6 +112,9 @@ class ProbDist {
   /** The maximum number of buckets */
   static constexpr size_t kMaxBuckets = 100;
 
+  uint32_t sample_min_; /**< The minimum sampled value */
+  uint32_t sample_max_; /**< The maximum sampled value */
+
   /** The uniform distribution for generating the number of buckets */
   ::std::uniform_int_distribution<int> bucket_dist_;
 
@@ -45,7 +45,6 @@
 
 #include "schwanenlied/socks5_server.h"
 #include "schwanenlied/crypto/base32.h"
-#include "schwanenlied/pt/scramblesuit/client.h"
 #include "schwanenlied/pt/scramblesuit/session_ticket_handshake.h"
 
 namespace schwanenlied {
@@ -57,14 +56,15 @@ using Ticket = SessionTicketHandshake::Ticket;
 
 constexpr char TicketStore::kTicketFileName[];
 
-bool SessionTicketHandshake::send_handshake_msg(bool& is_done) {
-  if (client_.outgoing_ == nullptr)
+bool SessionTicketHandshake::send_handshake_msg(struct evbuffer* out,
+                                                bool& is_done) {
+  if (out == nullptr)
     return false;
-  struct bufferevent* sink = client_.outgoing_;
   is_done = false;
 
   // Query the store for a ticket associated with the address
-  ::std::unique_ptr<Ticket> ticket(store_.get(addr_, addr_len_));
+  ::std::unique_ptr<Ticket> ticket(store_.get(
+      reinterpret_cast<const struct sockaddr*>(&addr_), addr_len_));
   if (ticket == nullptr)
     return true;
 
@@ -84,18 +84,18 @@ bool SessionTicketHandshake::send_handshake_msg(bool& is_done) {
 
   auto t = ticket->ticket();
 
-  if (!client_.kdf_scramblesuit(ticket->key()))
+  if (!codec_.set_session_key(ticket->key()))
     return false;
 
-  if (!client_.initiator_hmac_.init())
+  if (!codec_.initiator_hmac_.init())
     return false;
 
-  if (!client_.initiator_hmac_.update(t.data(), t.size()))
+  if (!codec_.initiator_hmac_.update(t.data(), t.size()))
     return false;
 
   // Generate M_C
   ::std::array<uint8_t, kDigestLength> m_c;
-  if (!client_.initiator_hmac_.digest(t.data(), t.size(), m_c.data(), m_c.size()))
+  if (!codec_.initiator_hmac_.digest(t.data(), t.size(), m_c.data(), m_c.size()))
     return false;
 
   // Generate P_C
@@ -105,33 +105,32 @@ bool SessionTicketHandshake::send_handshake_msg(bool& is_done) {
   if (padlen > 0) {
     if (!rand_.get_bytes(p_c.data(), padlen))
       return false;
-    if (!client_.initiator_hmac_.update(p_c.data(), padlen))
+    if (!codec_.initiator_hmac_.update(p_c.data(), padlen))
       return false;
   }
 
   // The spec doesn't include M_C in the mac, but the code does
-  if (!client_.initiator_hmac_.update(m_c.data(), m_c.size()))
+  if (!codec_.initiator_hmac_.update(m_c.data(), m_c.size()))
       return false;
 
   // Generate the MAC
   const auto epoch_hour = to_string(::std::time(nullptr) / 3600);
-  if (!client_.initiator_hmac_.update(
+  if (!codec_.initiator_hmac_.update(
           reinterpret_cast<const uint8_t*>(epoch_hour.data()),
           epoch_hour.size()))
     return false;
   ::std::array<uint8_t, kDigestLength> mac_c;
-  if (!client_.initiator_hmac_.final(mac_c.data(), mac_c.size()))
+  if (!codec_.initiator_hmac_.final(mac_c.data(), mac_c.size()))
     return false;
 
   // Send the message out
-  if (0 != ::bufferevent_write(sink, t.data(), t.size()))
+  if (::evbuffer_add(out, t.data(), t.size()) != 0)
     return false;
-  if (padlen > 0)
-    if (0 != ::bufferevent_write(sink, p_c.data(), padlen))
-      return false;
-  if (0 != ::bufferevent_write(sink, m_c.data(), m_c.size()))
+  if (::evbuffer_add(out, p_c.data(), padlen) != 0)
+    return false;
+  if (::evbuffer_add(out, m_c.data(), m_c.size()) != 0)
     return false;
-  if (0 != ::bufferevent_write(sink, mac_c.data(), mac_c.size()))
+  if (::evbuffer_add(out, mac_c.data(), mac_c.size()) != 0)
     return false;
 
   // All done.  (KDF done early because the MAC uses the derived key)
@@ -36,21 +36,24 @@
 
 #include <netinet/in.h>
 
+#include <algorithm>
+#include <cstring>
 #include <ctime>
 #include <map>
 #include <random>
 #include <string>
 
+#include <event2/buffer.h>
+
 #include "schwanenlied/common.h"
 #include "schwanenlied/crypto/rand_openssl.h"
 #include "schwanenlied/crypto/utils.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
 
 namespace schwanenlied {
 namespace pt {
 namespace scramblesuit {
 
-class Client;
-
 /**
  * Implement the client side of the ScrambleSuit Session Ticket Handshake
  */
@@ -194,32 +197,37 @@ class SessionTicketHandshake {
   /**
    * Construct a new SessionTicketHandshake instance
    *
-   * @param[in] client    The Client instance
+   * @param[in] codec     The FrameCodec to key with the ticket's k_t
    * @param[in] state_dir Directory where the TicketStore should keep files
    * @param[in] addr      The address/port of the remote peer
    * @param[in] addr_len  The length of addr
    */
-  SessionTicketHandshake(Client& client,
+  SessionTicketHandshake(FrameCodec& codec,
                          const ::std::string& state_dir,
                          const struct sockaddr* addr,
                          const socklen_t addr_len) :
-      client_(client),
+      codec_(codec),
       store_(TicketStore::get_instance(state_dir)),
-      addr_(addr),
-      addr_len_(addr_len),
-      pad_dist_(0, kMaxPadding) {}
+      addr_(),
+      addr_len_(::std::min<socklen_t>(addr_len, sizeof(addr_))),
+      pad_dist_(0, kMaxPadding) {
+    // The Session releases it's copy once established (NEW_TICKET comes later)
+    ::std::memcpy(&addr_, addr, addr_len_);
+  }
 
   ~SessionTicketHandshake() = default;
 
   /**
    * Send the outgoing side of the handshake
    *
+   * @param[out] out      The evbuffer to write the handshake message to
    * @param[out] is_done  The handshake completed?
    *
    * @returns true  - Success (Check is_done)
    * @returns false - Failure (MUST CLOSE CONNECTION)
    */
-  bool send_handshake_msg(bool& is_done);
+  bool send_handshake_msg(struct evbuffer* out,
+                          bool& is_done);
 
   /**
    * Handle tickets received from the peer
@@ -229,7 +237,8 @@ class SessionTicketHandshake {
    */
   void on_new_ticket(const uint8_t* buf,
                      const size_t len) {
-    store_.set(addr_, addr_len_, ::std::time(nullptr), buf, len);
+    store_.set(reinterpret_cast<const struct sockaddr*>(&addr_), addr_len_,
+               ::std::time(nullptr), buf, len);
   }
 
  private:
@@ -244,9 +253,9 @@ class SessionTicketHandshake {
   /** @} */
 
   /** @{ */
-  Client& client_; /**< The Client instance the handshake is for */
+  FrameCodec& codec_;               /**< The FrameCodec the handshake is for */
   TicketStore& store_;              /**< Ticket store */
-  const struct sockaddr* addr_;     /**< Remote peer address */
+  struct sockaddr_storage addr_;    /**< Remote peer address */
   const socklen_t addr_len_;        /**< Length of addr_ */
   crypto::RandOpenSSL rand_;        /**< CSPRNG */
   ::std::uniform_int_distribution<uint32_t> pad_dist_; /**< Padding distribution */
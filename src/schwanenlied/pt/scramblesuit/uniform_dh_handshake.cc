@@ -31,22 +31,19 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <array>
 #include <ctime>
 
-#include <event2/buffer.h>
-
-#include "schwanenlied/pt/scramblesuit/client.h"
 #include "schwanenlied/pt/scramblesuit/uniform_dh_handshake.h"
 
 namespace schwanenlied {
 namespace pt {
 namespace scramblesuit {
 
-bool UniformDHHandshake::send_handshake_msg() {
-  if (client_.outgoing_ == nullptr)
+bool UniformDHHandshake::send_handshake_msg(struct evbuffer* out) {
+  if (out == nullptr)
     return false;
-  struct bufferevent* sink = client_.outgoing_;
 
   /*
    * UniformDH handshake:
@@ -97,24 +94,22 @@ bool UniformDHHandshake::send_handshake_msg() {
     return false;
 
   // Send the message out
-  if (0 != ::bufferevent_write(sink, public_key.data(), public_key.size()))
+  if (::evbuffer_add(out, public_key.data(), public_key.size()) != 0)
     return false;
-  if (padlen > 0)
-    if (0 != ::bufferevent_write(sink, p_c.data(), padlen))
-      return false;
-  if (0 != ::bufferevent_write(sink, m_c.data(), m_c.size()))
+  if (::evbuffer_add(out, p_c.data(), padlen) != 0)
     return false;
-  if (0 != ::bufferevent_write(sink, mac_c.data(), mac_c.size()))
+  if (::evbuffer_add(out, m_c.data(), m_c.size()) != 0)
+    return false;
+  if (::evbuffer_add(out, mac_c.data(), mac_c.size()) != 0)
     return false;
 
   return true;
 }
 
-bool UniformDHHandshake::recv_handshake_msg(bool& is_finished) {
-  if (client_.outgoing_ == nullptr)
+bool UniformDHHandshake::recv_handshake_msg(struct evbuffer* buf,
+                                            bool& is_finished) {
+  if (buf == nullptr)
     return false;
-  struct bufferevent* source = client_.outgoing_;
-  struct evbuffer* buf = ::bufferevent_get_input(source);
 
   is_finished = false;
 
@@ -143,51 +138,46 @@ bool UniformDHHandshake::recv_handshake_msg(bool& is_finished) {
     if (!hmac_.init())
       return false;
 
-    const uint8_t* p = ::evbuffer_pullup(buf, kKeyLength);
-    if (p == nullptr)
-      return false;
-
     remote_public_key_ = ::std::unique_ptr<crypto::SecureBuffer>(
-        new crypto::SecureBuffer(p, kKeyLength));
+        new crypto::SecureBuffer(kKeyLength, 0));
+    if (::evbuffer_remove(buf, &(*remote_public_key_)[0], kKeyLength) !=
+        static_cast<int>(kKeyLength))
+      return false;
 
     uint8_t digest[kDigestLength];
-    if (!hmac_.update(p, kKeyLength))
+    if (!hmac_.update(remote_public_key_->data(), kKeyLength))
       return false;
-    if (!hmac_.digest(p, kKeyLength, digest, sizeof(digest)))
+    if (!hmac_.digest(remote_public_key_->data(), kKeyLength, digest,
+                      sizeof(digest)))
       return false;
 
-    remote_mark_ = ::std::unique_ptr<crypto::SecureBuffer>(
-        new crypto::SecureBuffer(digest, sizeof(digest)));
-
-    ::evbuffer_drain(buf, kKeyLength);
+    // Look for M_S in the data that follows
+    if (!mark_search_.reset(digest, sizeof(digest), kMaxPadding))
+      return false;
   }
 
   SL_ASSERT(remote_public_key_ != nullptr);
-  SL_ASSERT(remote_mark_ != nullptr);
 
   if (remote_mac_ == nullptr) {
-    // Attempt to find M_S
-    const size_t len = ::evbuffer_get_length(buf);
-    if (len < remote_mark_->size())
-      return true;
-
-    auto found = ::evbuffer_search(buf, reinterpret_cast<const char*>(remote_mark_->data()),
-                                   remote_mark_->size(), nullptr);
-    if (found.pos > static_cast<ssize_t>(kMaxPadding))
-      return false;
-    if (found.pos == -1 && len > kMaxPadding + remote_mark_->size())
+    // Resume looking for M_S where the last call left off
+    ssize_t pos = -1;
+    if (!mark_search_.search(buf, pos))
       return false;
-    if (found.pos == -1)
-      return true;
 
-    SL_ASSERT(found.pos >= 0);
+    /*
+     * MAC the padding as it is ruled out as being the start of M_S, so that
+     * each byte is only ever touched by the search and the MAC once.
+     */
+    if (pos == -1) {
+      const size_t to_mac = mark_search_.scanned();
+      if (!mac_and_drain(buf, to_mac))
+        return false;
+      mark_search_.consume(to_mac);
+      return true;
+    }
 
-    // MAC the padding + Mark
-    const size_t to_mac = found.pos + remote_mark_->size();
-    const uint8_t* p = ::evbuffer_pullup(buf, to_mac);
-    if (p == nullptr)
-      return false;
-    if (!hmac_.update(p, to_mac))
+    // MAC the rest of the padding + Mark
+    if (!mac_and_drain(buf, pos + kDigestLength))
       return false;
 
     // MAC the epoch hour
@@ -202,8 +192,6 @@ bool UniformDHHandshake::recv_handshake_msg(bool& is_finished) {
 
     remote_mac_ = ::std::unique_ptr<crypto::SecureBuffer>(
         new crypto::SecureBuffer(digest, sizeof(digest)));
-
-    ::evbuffer_drain(buf, found.pos + remote_mark_->size());
   }
 
   SL_ASSERT(remote_mac_ != nullptr);
@@ -213,15 +201,14 @@ bool UniformDHHandshake::recv_handshake_msg(bool& is_finished) {
   if (len < remote_mac_->size())
     return true;
 
-  uint8_t* p = ::evbuffer_pullup(buf, remote_mac_->size());
-  if (p == nullptr)
+  uint8_t mac_s[kDigestLength];
+  if (::evbuffer_remove(buf, mac_s, sizeof(mac_s)) !=
+      static_cast<int>(sizeof(mac_s)))
     return false;
 
-  if (!crypto::memequals(remote_mac_->data(), p, remote_mac_->size()))
+  if (!crypto::memequals(remote_mac_->data(), mac_s, sizeof(mac_s)))
     return false;
 
-  ::evbuffer_drain(buf, remote_mac_->size());
-
   // Actually do the Diffie-Hellman handshake
   if (!uniform_dh_.compute_key(remote_public_key_->data(),
                                remote_public_key_->size()))
@@ -235,9 +222,36 @@ bool UniformDHHandshake::recv_handshake_msg(bool& is_finished) {
                   k_t.size()))
     return false;
 
+  if (!codec_.set_session_key(k_t))
+    return false;
+
   // The the the that's all folks!
   is_finished = true;
-  return client_.kdf_scramblesuit(k_t);
+  return true;
+}
+
+bool UniformDHHandshake::mac_and_drain(struct evbuffer* buf,
+                                       size_t len) {
+  while (len > 0) {
+    ::std::array<struct evbuffer_iovec, 8> vec;
+    const int ret = ::evbuffer_peek(buf, len, nullptr, vec.data(), vec.size());
+    if (ret <= 0)
+      return false;
+    const size_t nr_vec = ::std::min<size_t>(ret, vec.size());
+
+    size_t consumed = 0;
+    for (size_t i = 0; i < nr_vec && consumed < len; i++) {
+      const size_t n = ::std::min(vec[i].iov_len, len - consumed);
+      if (!hmac_.update(reinterpret_cast<const uint8_t*>(vec[i].iov_base), n))
+        return false;
+      consumed += n;
+    }
+    if (::evbuffer_drain(buf, consumed) != 0)
+      return false;
+    len -= consumed;
+  }
+
+  return true;
 }
 
 } // namespace scramblesuit
@@ -36,19 +36,21 @@
 
 #include <random>
 
+#include <event2/buffer.h>
+
 #include "schwanenlied/common.h"
 #include "schwanenlied/crypto/hmac_sha256.h"
 #include "schwanenlied/crypto/rand_openssl.h"
 #include "schwanenlied/crypto/sha256.h"
 #include "schwanenlied/crypto/uniform_dh.h"
 #include "schwanenlied/crypto/utils.h"
+#include "schwanenlied/mark_search.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
 
 namespace schwanenlied {
 namespace pt {
 namespace scramblesuit {
 
-class Client;
-
 /**
  * Implement the client side of the ScrambleSuit UniformDH Handshake
  */
@@ -57,12 +59,12 @@ class UniformDHHandshake {
   /**
    * Construct a new UniformDHHandshake instance
    *
-   * @param[in] client        The Client instance
+   * @param[in] codec         The FrameCodec to key on completion
    * @param[in] shared_secret The bridge secret (k_B)
    */
-  UniformDHHandshake(Client& client,
+  UniformDHHandshake(FrameCodec& codec,
                      const crypto::SecureBuffer& shared_secret) :
-      client_(client),
+      codec_(codec),
       pad_dist_(0, kMaxPadding),
       hmac_(shared_secret) {}
 
@@ -72,10 +74,12 @@ class UniformDHHandshake {
   /**
    * Send the outgoing side of the handshake
    *
+   * @param[out] out  The evbuffer to write the handshake message to
+   *
    * @returns true  - Success
    * @returns false - Failure
    */
-  bool send_handshake_msg();
+  bool send_handshake_msg(struct evbuffer* out);
 
   /**
    * Recieve the handshake response from a bridge
@@ -83,14 +87,16 @@ class UniformDHHandshake {
    * In addition to checking the return value, applications must examine
    * is_finished to see if the handshake process is actually done.  A shared
    * secret is available only when this routine returns true *and* is_finished
-   * is true. 
+   * is true, at which point the FrameCodec has been keyed.
    *
+   * @param[in] in            The evbuffer containing data from the peer
    * @param[out] is_finished  Did the handshake complete?
    *
    * @returns true  - Success
    * @returns false - Failure
    */
-  bool recv_handshake_msg(bool& is_finished);
+  bool recv_handshake_msg(struct evbuffer* in,
+                          bool& is_finished);
   /** @} */
 
  private:
@@ -112,13 +118,25 @@ class UniformDHHandshake {
       kDigestLength * 2;
   /** @} */
 
+  /**
+   * MAC and drain data from the start of buf without linearizing it
+   *
+   * @param[in] buf The evbuffer containing data from the peer
+   * @param[in] len The number of bytes to MAC and drain
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool mac_and_drain(struct evbuffer* buf,
+                     size_t len);
+
   /** @{ */
-  /** The Client instance that the handshake is for */
-  Client& client_;
+  /** The FrameCodec that the handshake is for */
+  FrameCodec& codec_;
   /** The remote peer's public UniformDH key */
   ::std::unique_ptr<crypto::SecureBuffer> remote_public_key_;
-  /** The derived M_S */
-  ::std::unique_ptr<crypto::SecureBuffer> remote_mark_;
+  /** The search for the derived M_S */
+  MarkSearch mark_search_;
   /** The derived MAC(Y | P_S | M_S | E) */
   ::std::unique_ptr<crypto::SecureBuffer> remote_mac_;
   /** The number of hours since the epoch */
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <ctime>
+#include <memory>
+
+#include <event2/buffer.h>
+
+#include "schwanenlied/crypto/aes.h"
+#include "schwanenlied/crypto/hkdf_sha256.h"
+#include "schwanenlied/crypto/hmac_sha256.h"
+#include "schwanenlied/crypto/rand_ctr_drbg.h"
+#include "schwanenlied/crypto/sha256.h"
+#include "schwanenlied/crypto/uniform_dh.h"
+#include "schwanenlied/pt/scramblesuit/frame_codec.h"
+#include "schwanenlied/pt/scramblesuit/uniform_dh_handshake.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+namespace pt {
+namespace scramblesuit {
+
+static constexpr size_t kKeyLength = crypto::UniformDH::kKeyLength;
+static constexpr size_t kDigestLength = 16;
+static constexpr size_t kMaxPadding = 1308;
+static constexpr size_t kHeaderLength = FrameCodec::kHeaderLength;
+
+/*
+ * The tests play the bridge, and build the server handshake message
+ * (Y | P_S | M_S | MAC) from scratch, delivering it to the client in
+ * arbitrary pieces.
+ */
+class UniformDHHandshakeTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    static const uint8_t seed[] = { 'u', 'n', 'i', 'f', 'o', 'r', 'm' };
+    rng_.seed(seed, sizeof(seed));
+
+    k_b_ = random_data(32);
+    handshake_.reset(new UniformDHHandshake(codec_, k_b_));
+    from_client_ = ::evbuffer_new();
+    from_bridge_ = ::evbuffer_new();
+    ASSERT_TRUE(from_client_ != nullptr);
+    ASSERT_TRUE(from_bridge_ != nullptr);
+
+    ASSERT_TRUE(handshake_->send_handshake_msg(from_client_));
+    epoch_hour_ = to_string(::std::time(nullptr) / 3600);
+    ASSERT_LE(kKeyLength + kDigestLength * 2,
+              ::evbuffer_get_length(from_client_));
+  }
+
+  virtual void TearDown() {
+    ::evbuffer_free(from_client_);
+    ::evbuffer_free(from_bridge_);
+  }
+
+  crypto::SecureBuffer random_data(const size_t len) {
+    crypto::SecureBuffer buf(len, 0);
+    if (len > 0) {
+      EXPECT_TRUE(rng_.get_bytes(&buf[0], buf.size()));
+    }
+    return buf;
+  }
+
+  /**
+   * Build the bridge's handshake message with pad_len bytes of padding
+   *
+   * The padding is littered with prefixes of M_S so that the client's search
+   * for M_S has plenty of false starts.
+   */
+  crypto::SecureBuffer bridge_msg(const size_t pad_len) {
+    crypto::HmacSha256 hmac(k_b_);
+    const auto y = bridge_dh_.public_key();
+    crypto::SecureBuffer msg(reinterpret_cast<const uint8_t*>(y.data()),
+                             y.size());
+
+    // M_S = HMAC-SHA256-128(k_B, Y)
+    ::std::array<uint8_t, kDigestLength> m_s;
+    EXPECT_TRUE(hmac.digest(msg.data(), msg.size(), m_s.data(), m_s.size()));
+
+    // P_S
+    crypto::SecureBuffer pad = random_data(pad_len);
+    for (size_t i = 0; i + kDigestLength < pad_len; i += 1 + rng_() % 60) {
+      const size_t len = rng_() % kDigestLength;
+      ::std::copy(m_s.begin(), m_s.begin() + len, pad.begin() + i);
+    }
+    msg += pad;
+    msg.append(m_s.data(), m_s.size());
+
+    // MAC = HMAC-SHA256-128(k_B, Y | P_S | M_S | E)
+    ::std::array<uint8_t, kDigestLength> mac;
+    EXPECT_TRUE(hmac.init());
+    EXPECT_TRUE(hmac.update(msg.data(), msg.size()));
+    EXPECT_TRUE(hmac.update(reinterpret_cast<const uint8_t*>(
+        epoch_hour_.data()), epoch_hour_.size()));
+    EXPECT_TRUE(hmac.final(mac.data(), mac.size()));
+    msg.append(mac.data(), mac.size());
+
+    return msg;
+  }
+
+  /**
+   * Feed msg to the client in random sized chains, calling
+   * recv_handshake_msg() after most of them
+   *
+   * @returns The result of the last recv_handshake_msg() call
+   */
+  bool deliver(const crypto::SecureBuffer& msg,
+               const size_t max_piece,
+               bool& is_finished) {
+    is_finished = false;
+    size_t off = 0;
+    while (off < msg.size()) {
+      const size_t n = ::std::min<size_t>(msg.size() - off,
+                                          1 + rng_() % max_piece);
+      struct evbuffer* tmp = ::evbuffer_new();
+      EXPECT_TRUE(tmp != nullptr);
+      EXPECT_EQ(0, ::evbuffer_add(tmp, msg.data() + off, n));
+      EXPECT_EQ(0, ::evbuffer_add_buffer(from_bridge_, tmp));
+      ::evbuffer_free(tmp);
+      off += n;
+      if (off < msg.size() && rng_() % 3 == 0)
+        continue;
+
+      if (!handshake_->recv_handshake_msg(from_bridge_, is_finished))
+        return false;
+      if (is_finished)
+        break;
+    }
+    return true;
+  }
+
+  /**
+   * Check that the FrameCodec was keyed with the k_t that the bridge derives
+   * from X, by decoding a frame framed with the bridge's keys
+   */
+  void check_session_key() {
+    crypto::SecureBuffer x(kKeyLength, 0);
+    ASSERT_EQ(static_cast<int>(kKeyLength),
+              ::evbuffer_remove(from_client_, &x[0], x.size()));
+    ASSERT_TRUE(bridge_dh_.compute_key(x.data(), x.size()));
+    crypto::Sha256 sha;
+    const auto sekrit = bridge_dh_.shared_secret();
+    crypto::SecureBuffer k_t(32, 0);
+    ASSERT_TRUE(sha.digest(sekrit.data(), sekrit.size(), &k_t[0],
+                           k_t.size()));
+
+    // The bridge sends with the responder keys
+    static constexpr ::std::array<uint8_t, 8> initial_ctr = { {
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+    } };
+    const auto prk = crypto::HkdfSha256::expand(k_t, nullptr, 0, 144);
+    crypto::Aes256Ctr aes;
+    crypto::HmacSha256 hmac;
+    ASSERT_TRUE(aes.set_state(prk.substr(40, 32), prk.data() + 72, 8,
+                              initial_ctr.data(), initial_ctr.size()));
+    ASSERT_TRUE(hmac.set_key(prk.substr(112, 32)));
+
+    const crypto::SecureBuffer payload = random_data(100);
+    crypto::SecureBuffer frame(kHeaderLength + payload.size(), 0);
+    frame[17] = static_cast<uint8_t>(payload.size());
+    frame[19] = static_cast<uint8_t>(payload.size());
+    frame[20] = FrameCodec::PacketFlags::kPAYLOAD;
+    ::std::copy(payload.begin(), payload.end(), frame.begin() + kHeaderLength);
+    uint8_t* p = &frame[kDigestLength];
+    ASSERT_TRUE(aes.process(p, frame.size() - kDigestLength, p));
+    ASSERT_TRUE(hmac.digest(p, frame.size() - kDigestLength, &frame[0],
+                            kDigestLength));
+
+    struct evbuffer* in = ::evbuffer_new();
+    struct evbuffer* out = ::evbuffer_new();
+    ASSERT_EQ(0, ::evbuffer_add(in, frame.data(), frame.size()));
+    ASSERT_TRUE(codec_.decode(in, out));
+    crypto::SecureBuffer decoded(::evbuffer_get_length(out), 0);
+    if (!decoded.empty())
+      ::evbuffer_remove(out, &decoded[0], decoded.size());
+    ::evbuffer_free(in);
+    ::evbuffer_free(out);
+    ASSERT_EQ(payload, decoded);
+  }
+
+  crypto::RandCtrDrbg rng_;
+  crypto::SecureBuffer k_b_;
+  ::std::string epoch_hour_;
+  crypto::UniformDH bridge_dh_;
+  FrameCodec codec_;
+  ::std::unique_ptr<UniformDHHandshake> handshake_;
+  struct evbuffer* from_client_;
+  struct evbuffer* from_bridge_;
+};
+
+TEST_F(UniformDHHandshakeTest, Handshake) {
+  // Whatever follows the handshake message is left for the FrameCodec
+  const crypto::SecureBuffer trailer = random_data(100);
+  crypto::SecureBuffer msg = bridge_msg(rng_() % (kMaxPadding + 1));
+  msg += trailer;
+
+  bool is_finished;
+  ASSERT_TRUE(deliver(msg, 500, is_finished));
+  ASSERT_TRUE(is_finished);
+  const size_t len = ::evbuffer_get_length(from_bridge_);
+  ASSERT_GE(trailer.size(), len);
+  crypto::SecureBuffer left(len, 0);
+  if (len > 0)
+    ::evbuffer_remove(from_bridge_, &left[0], len);
+  ASSERT_EQ(trailer.substr(0, len), left);
+  check_session_key();
+}
+
+TEST_F(UniformDHHandshakeTest, HandshakeFragmented) {
+  // A byte or few at a time, so M_S straddles the calls
+  bool is_finished;
+  ASSERT_TRUE(deliver(bridge_msg(rng_() % (kMaxPadding + 1)), 3,
+                      is_finished));
+  ASSERT_TRUE(is_finished);
+  ASSERT_EQ(0u, ::evbuffer_get_length(from_bridge_));
+  check_session_key();
+}
+
+TEST_F(UniformDHHandshakeTest, HandshakeMaxPadding) {
+  bool is_finished;
+  ASSERT_TRUE(deliver(bridge_msg(kMaxPadding), 200, is_finished));
+  ASSERT_TRUE(is_finished);
+  check_session_key();
+}
+
+TEST_F(UniformDHHandshakeTest, HandshakeNoPadding) {
+  bool is_finished;
+  ASSERT_TRUE(deliver(bridge_msg(0), 200, is_finished));
+  ASSERT_TRUE(is_finished);
+  check_session_key();
+}
+
+TEST_F(UniformDHHandshakeTest, TamperedMac) {
+  crypto::SecureBuffer msg = bridge_msg(rng_() % (kMaxPadding + 1));
+  msg[msg.size() - 5] ^= 0x01;
+
+  bool is_finished;
+  ASSERT_FALSE(deliver(msg, 500, is_finished));
+  ASSERT_FALSE(is_finished);
+}
+
+TEST_F(UniformDHHandshakeTest, TamperedMark) {
+  // Without M_S, the search gives up once it can't start within kMaxPadding
+  crypto::SecureBuffer msg = bridge_msg(kMaxPadding);
+  msg[msg.size() - kDigestLength * 2] ^= 0x01;
+
+  bool is_finished;
+  ASSERT_FALSE(deliver(msg, 500, is_finished));
+  ASSERT_FALSE(is_finished);
+}
+
+TEST_F(UniformDHHandshakeTest, PaddingTooLong) {
+  bool is_finished;
+  ASSERT_FALSE(deliver(bridge_msg(kMaxPadding + 1), 500, is_finished));
+  ASSERT_FALSE(is_finished);
+}
+
+} // namespace scramblesuit
+} // namespace pt
+} // namespace schwanenlied
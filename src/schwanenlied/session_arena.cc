@@ -0,0 +1,176 @@
+/**
+ * @file    session_arena.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Per-Session arenas recycled through a size class slab (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <sstream>
+
+#include "schwanenlied/session_arena.h"
+
+namespace schwanenlied {
+
+void* Arena::allocate(const size_t len) {
+  const size_t aligned_len = (len + kAlignment - 1) & ~(kAlignment - 1);
+  if (aligned_len < len || aligned_len > len_ - used_)
+    return nullptr;
+
+  void* p = base_ + used_;
+  used_ += aligned_len;
+  return p;
+}
+
+SessionSlab::~SessionSlab() {
+  // The Sessions hold pointers back into the slab
+  SL_ASSERT(nr_outstanding_ == 0);
+
+  for (auto& head : free_) {
+    while (head != nullptr) {
+      FreeBlock* block = head;
+      head = block->next;
+      ::std::free(block);
+    }
+  }
+}
+
+void* SessionSlab::allocate_object(SessionSlab* slab,
+                                   const size_t len,
+                                   const size_t arena_len) {
+  const size_t obj_len = (len + Arena::kAlignment - 1) &
+                         ~(Arena::kAlignment - 1);
+  size_t block_len = kHeaderLen + obj_len + arena_len;
+  uint8_t* p = reinterpret_cast<uint8_t*>((slab != nullptr) ?
+                                          slab->allocate(block_len) :
+                                          ::std::malloc(block_len));
+  if (p == nullptr)
+    return nullptr;
+
+  // Whatever is left over after rounding up to the size class goes to the Arena
+  const size_t arena_off = kHeaderLen + obj_len;
+  new(p) Header(slab, block_len, p, arena_off);
+  return p + kHeaderLen;
+}
+
+void SessionSlab::release_object(void* p) {
+  if (p == nullptr)
+    return;
+
+  Header* hdr = reinterpret_cast<Header*>(reinterpret_cast<uint8_t*>(p) -
+                                          kHeaderLen);
+  SessionSlab* slab = hdr->slab;
+  const size_t block_len = hdr->block_len;
+  const size_t wipe_len = hdr->arena_off + hdr->arena.used();
+  hdr->~Header();
+  if (slab != nullptr)
+    slab->release(hdr, block_len, wipe_len);
+  else {
+    crypto::memwipe(hdr, wipe_len);
+    ::std::free(hdr);
+  }
+}
+
+Arena* SessionSlab::object_arena(void* p) {
+  Header* hdr = reinterpret_cast<Header*>(reinterpret_cast<uint8_t*>(p) -
+                                          kHeaderLen);
+  return &hdr->arena;
+}
+
+size_t SessionSlab::nr_free() const {
+  size_t nr_free = 0;
+  for (auto n : nr_free_)
+    nr_free += n;
+  return nr_free;
+}
+
+::std::string SessionSlab::to_string() const {
+  size_t free_len = 0;
+  for (size_t i = 0; i < kNrClasses; i++)
+    free_len += nr_free_[i] << (kMinBlockShift + i);
+
+  ::std::stringstream ss;
+  ss << "Blocks: " << nr_outstanding_
+     << " Allocs: " << nr_allocs_
+     << " Recycled: " << nr_recycled_
+     << " Free: " << nr_free() << " (" << free_len << " bytes)";
+  return ss.str();
+}
+
+size_t SessionSlab::size_class(const size_t len) {
+  for (size_t i = 0; i < kNrClasses; i++) {
+    if (len <= (static_cast<size_t>(1) << (kMinBlockShift + i)))
+      return i;
+  }
+  return kNrClasses;
+}
+
+void* SessionSlab::allocate(size_t& len) {
+  const size_t cls = size_class(len);
+  void* p = nullptr;
+  if (cls < kNrClasses) {
+    len = static_cast<size_t>(1) << (kMinBlockShift + cls);
+    if (free_[cls] != nullptr) {
+      FreeBlock* block = free_[cls];
+      free_[cls] = block->next;
+      nr_free_[cls]--;
+      block->next = nullptr;
+      p = block;
+      nr_recycled_++;
+    }
+  }
+  if (p == nullptr)
+    p = ::std::malloc(len);
+  if (p == nullptr)
+    return nullptr;
+
+  nr_allocs_++;
+  nr_outstanding_++;
+  return p;
+}
+
+void SessionSlab::release(void* p,
+                          const size_t len,
+                          const size_t wipe_len) {
+  SL_ASSERT(nr_outstanding_ > 0);
+
+  crypto::memwipe(p, wipe_len);
+  nr_outstanding_--;
+
+  const size_t cls = size_class(len);
+  if (cls < kNrClasses && nr_free_[cls] < kMaxFreeBlocks) {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(p);
+    block->next = free_[cls];
+    free_[cls] = block;
+    nr_free_[cls]++;
+  } else
+    ::std::free(p);
+}
+
+} // namespace schwanenlied
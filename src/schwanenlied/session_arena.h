@@ -0,0 +1,292 @@
+/**
+ * @file    session_arena.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Per-Session arenas recycled through a size class slab
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHWANENLIED_SESSION_ARENA_H__
+#define SCHWANENLIED_SESSION_ARENA_H__
+
+#include <array>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+
+#include "schwanenlied/common.h"
+#include "schwanenlied/crypto/utils.h"
+
+namespace schwanenlied {
+
+/**
+ * A bump allocator over the tail of a Session's memory block
+ *
+ * Fixed size per-Session state (eg: handshake objects) is carved from the
+ * Arena instead of the general heap, so that it shares the Session's cache
+ * lines and is returned along with the Session in one go.  Space is never
+ * reused until the Arena itself goes away.
+ *
+ * @warning This is not and will never be thread safe
+ */
+class Arena {
+ public:
+  /** The alignment of every allocation */
+  static constexpr size_t kAlignment = 16;
+
+  /**
+   * Deleter for objects created with create()
+   *
+   * Objects carved from the Arena are destroyed and wiped in place, anything
+   * that fell back to the heap is deleted.
+   */
+  class Deleter {
+   public:
+    Deleter() : arena_(nullptr) {}
+    explicit Deleter(const Arena* arena) : arena_(arena) {}
+
+    template<class T>
+    void operator()(T* p) const {
+      if (arena_ != nullptr && arena_->owns(p)) {
+        p->~T();
+        crypto::memwipe(p, sizeof(T));
+      } else
+        delete p;
+    }
+
+   private:
+    const Arena* arena_;  /**< The Arena the object may belong to */
+  };
+
+  /** A unique_ptr to an object created with create() */
+  template<class T>
+  using Ptr = ::std::unique_ptr<T, Deleter>;
+
+  Arena() :
+      base_(nullptr),
+      len_(0),
+      used_(0) {}
+
+  /**
+   * Construct an Arena instance
+   *
+   * @param[in] base  The start of the region to allocate from (kAlignment
+   *                  aligned)
+   * @param[in] len   The length of the region
+   */
+  Arena(void* base,
+        const size_t len) :
+      base_(reinterpret_cast<uint8_t*>(base)),
+      len_(len),
+      used_(0) {}
+
+  /**
+   * Allocate memory from the Arena
+   *
+   * @param[in] len The amount of memory to allocate
+   *
+   * @returns A pointer to len bytes of memory
+   * @returns nullptr - The Arena is exhausted
+   */
+  void* allocate(const size_t len);
+
+  /** Query if p was allocated from the Arena */
+  bool owns(const void* p) const {
+    const uint8_t* q = reinterpret_cast<const uint8_t*>(p);
+    return q >= base_ && q < base_ + used_;
+  }
+
+  /** @{ */
+  /** Return the size of the Arena */
+  size_t size() const { return len_; }
+
+  /** Return the amount of the Arena that was allocated */
+  size_t used() const { return used_; }
+  /** @} */
+
+  /**
+   * Construct an object, from the Arena if possible
+   *
+   * @param[in] arena The Arena to allocate from (may be nullptr)
+   * @param[in] args  The arguments to T's constructor
+   *
+   * @returns A Ptr to the new object, allocated from the general heap when
+   *          arena is nullptr or exhausted
+   */
+  template<class T, typename... Args>
+  static Ptr<T> create(Arena* arena,
+                       Args&&... args) {
+    void* p = (arena != nullptr) ? arena->allocate(sizeof(T)) : nullptr;
+    if (p != nullptr)
+      return Ptr<T>(new(p) T(::std::forward<Args>(args)...), Deleter(arena));
+    return Ptr<T>(new T(::std::forward<Args>(args)...), Deleter(arena));
+  }
+
+ private:
+  Arena(const Arena&) = delete;
+  void operator=(const Arena&) = delete;
+
+  uint8_t* base_; /**< The start of the region */
+  size_t len_;    /**< The length of the region */
+  size_t used_;   /**< The amount of the region allocated */
+};
+
+/**
+ * A size class slab that recycles Session memory blocks
+ *
+ * Each block holds a Session and it's Arena.  Released blocks are wiped (up
+ * to the end of the Arena allocations, the rest was never written to) and
+ * kept on a per size class free list (up to kMaxFreeBlocks per class), so
+ * that at high connection churn Session creation does not touch the general
+ * heap.  Blocks larger than the largest size class bypass the slab.
+ *
+ * Every SessionFactory owns a SessionSlab, which *MUST* outlive all of the
+ * Sessions allocated from it.
+ *
+ * @warning This is not and will never be thread safe
+ */
+class SessionSlab {
+ public:
+  /** The smallest size class (1 KiB) */
+  static constexpr size_t kMinBlockShift = 10;
+  /** The number of size classes (1 KiB - 64 KiB) */
+  static constexpr size_t kNrClasses = 7;
+  /** The maximum number of free blocks kept per size class */
+  static constexpr size_t kMaxFreeBlocks = 64;
+
+  SessionSlab() :
+      nr_outstanding_(0),
+      nr_allocs_(0),
+      nr_recycled_(0) {
+    free_.fill(nullptr);
+    nr_free_.fill(0);
+  }
+
+  ~SessionSlab();
+
+  /**
+   * Allocate memory for an object and it's Arena
+   *
+   * @param[in] slab      The SessionSlab to allocate from (nullptr = general
+   *                      heap)
+   * @param[in] len       The size of the object
+   * @param[in] arena_len The minimum size of the object's Arena
+   *
+   * @returns A pointer to the storage for the object
+   * @returns nullptr - Allocation failed
+   */
+  static void* allocate_object(SessionSlab* slab,
+                               const size_t len,
+                               const size_t arena_len);
+
+  /**
+   * Release memory obtained from allocate_object()
+   *
+   * @param[in] p The pointer returned by allocate_object() (may be nullptr)
+   */
+  static void release_object(void* p);
+
+  /**
+   * Return the Arena of an object allocated with allocate_object()
+   *
+   * @param[in] p The pointer returned by allocate_object()
+   */
+  static Arena* object_arena(void* p);
+
+  /** @{ */
+  /** Query the number of blocks in use */
+  size_t nr_outstanding() const { return nr_outstanding_; }
+
+  /** Query the total number of allocations */
+  uint64_t nr_allocs() const { return nr_allocs_; }
+
+  /** Query the number of allocations that were served from a free list */
+  uint64_t nr_recycled() const { return nr_recycled_; }
+
+  /** Query the number of blocks on the free lists */
+  size_t nr_free() const;
+  /** @} */
+
+  /** Return a string representation of the slab's statistics */
+  ::std::string to_string() const;
+
+ private:
+  SessionSlab(const SessionSlab&) = delete;
+  void operator=(const SessionSlab&) = delete;
+
+  /** The per-block bookkeeping that precedes the object */
+  struct Header {
+    Header(SessionSlab* s,
+           const size_t len,
+           uint8_t* block,
+           const size_t off) :
+        slab(s),
+        block_len(len),
+        arena_off(off),
+        arena(block + off, len - off) {}
+
+    SessionSlab* slab;  /**< The owning slab (nullptr = general heap) */
+    size_t block_len;   /**< The total size of the block */
+    size_t arena_off;   /**< The offset of the Arena into the block */
+    Arena arena;        /**< The object's Arena */
+  };
+
+  /** A block on a free list */
+  struct FreeBlock {
+    FreeBlock* next;    /**< The next free block */
+  };
+
+  /** The size of the Header, rounded up to the Arena alignment */
+  static constexpr size_t kHeaderLen = (sizeof(Header) + Arena::kAlignment - 1) &
+                                       ~(Arena::kAlignment - 1);
+
+  /** Return the size class for a block of len bytes (kNrClasses = none) */
+  static size_t size_class(const size_t len);
+
+  /** Allocate a block of at least len bytes, updating len */
+  void* allocate(size_t& len);
+
+  /**
+   * Wipe the first wipe_len bytes of a block, and return it to the free list
+   * or the heap
+   */
+  void release(void* p,
+               const size_t len,
+               const size_t wipe_len);
+
+  ::std::array<FreeBlock*, kNrClasses> free_;  /**< The free lists */
+  ::std::array<size_t, kNrClasses> nr_free_;   /**< The free list lengths */
+  size_t nr_outstanding_;                      /**< Blocks in use */
+  uint64_t nr_allocs_;                         /**< Total allocations */
+  uint64_t nr_recycled_;                       /**< Allocations from a free list */
+};
+
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_SESSION_ARENA_H__
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "schwanenlied/session_arena.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+static constexpr size_t kAlignment = Arena::kAlignment;
+static constexpr size_t kMaxFreeBlocks = SessionSlab::kMaxFreeBlocks;
+
+class SessionArenaTest : public ::testing::Test {
+ protected:
+  /** Something to carve from an Arena */
+  struct Object {
+    Object(int* nr_live, uint8_t fill) : nr_live(nr_live) {
+      ::std::memset(data, fill, sizeof(data));
+      (*nr_live)++;
+    }
+    ~Object() { (*nr_live)--; }
+
+    int* nr_live;
+    uint8_t data[40];
+  };
+
+  /** Check that the block holding p was wiped */
+  static bool is_wiped(const void* p,
+                       const size_t len) {
+    const uint8_t* q = reinterpret_cast<const uint8_t*>(p);
+    for (size_t i = 0; i < len; i++) {
+      if (q[i] != 0)
+        return false;
+    }
+    return true;
+  }
+};
+
+TEST_F(SessionArenaTest, ArenaExhaustion) {
+  alignas(16) uint8_t region[4 * 16];
+  Arena arena(region, sizeof(region));
+
+  // Allocations are aligned, and fail once the region is used up
+  ASSERT_EQ(region, arena.allocate(1));
+  ASSERT_EQ(region + kAlignment, arena.allocate(kAlignment));
+  ASSERT_EQ(region + 2 * kAlignment, arena.allocate(kAlignment + 1));
+  ASSERT_EQ(sizeof(region), arena.used());
+  ASSERT_EQ(nullptr, arena.allocate(1));
+  ASSERT_TRUE(arena.owns(region + sizeof(region) - 1));
+  ASSERT_FALSE(arena.owns(region + sizeof(region)));
+
+  // Absurd lengths do not wrap around
+  Arena empty(region, sizeof(region));
+  ASSERT_EQ(nullptr, empty.allocate(static_cast<size_t>(-1)));
+  ASSERT_EQ(0u, empty.used());
+}
+
+TEST_F(SessionArenaTest, CreateFallsBackToHeap) {
+  alignas(16) uint8_t region[64];
+  Arena arena(region, sizeof(region));
+  int nr_live = 0;
+
+  {
+    auto a = Arena::create<Object>(&arena, &nr_live, 0xaa);
+    ASSERT_TRUE(arena.owns(a.get()));
+
+    // The next one does not fit, and comes from the heap
+    auto b = Arena::create<Object>(&arena, &nr_live, 0xbb);
+    ASSERT_FALSE(arena.owns(b.get()));
+    ASSERT_EQ(0xbb, b->data[0]);
+
+    auto c = Arena::create<Object>(nullptr, &nr_live, 0xcc);
+    ASSERT_FALSE(arena.owns(c.get()));
+    ASSERT_EQ(3, nr_live);
+
+    // Destroying an object in the Arena wipes it in place
+    Object* p = a.get();
+    a.reset();
+    ASSERT_TRUE(is_wiped(p, sizeof(Object)));
+  }
+  ASSERT_EQ(0, nr_live);
+}
+
+TEST_F(SessionArenaTest, SlabReuse) {
+  SessionSlab slab;
+
+  // The Arena gets whatever is left over in the size class
+  void* p = SessionSlab::allocate_object(&slab, 100, 200);
+  ASSERT_TRUE(p != nullptr);
+  ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(p) % kAlignment);
+  Arena* arena = SessionSlab::object_arena(p);
+  ASSERT_GE(arena->size(), 200u);
+  void* scratch = arena->allocate(arena->size());
+  ASSERT_TRUE(scratch != nullptr);
+  ::std::memset(scratch, 0xff, arena->size());
+  ::std::memset(p, 0xff, 100);
+  SessionSlab::release_object(p);
+  ASSERT_EQ(0u, slab.nr_outstanding());
+  ASSERT_EQ(1u, slab.nr_free());
+
+  // The next allocation in the same size class gets the same (wiped) block
+  void* q = SessionSlab::allocate_object(&slab, 120, 100);
+  ASSERT_EQ(p, q);
+  ASSERT_TRUE(is_wiped(q, 120));
+  arena = SessionSlab::object_arena(q);
+  ASSERT_EQ(0u, arena->used());
+  scratch = arena->allocate(arena->size());
+  ASSERT_TRUE(is_wiped(scratch, arena->size()));
+  ASSERT_EQ(1u, slab.nr_recycled());
+  ASSERT_EQ(0u, slab.nr_free());
+
+  // A different size class does not
+  void* r = SessionSlab::allocate_object(&slab, 4000, 100);
+  ASSERT_NE(q, r);
+  ASSERT_EQ(1u, slab.nr_recycled());
+  ASSERT_EQ(2u, slab.nr_outstanding());
+  ASSERT_EQ(3u, slab.nr_allocs());
+
+  SessionSlab::release_object(q);
+  SessionSlab::release_object(r);
+  ASSERT_EQ(0u, slab.nr_outstanding());
+  ASSERT_EQ(2u, slab.nr_free());
+}
+
+TEST_F(SessionArenaTest, SlabExhaustion) {
+  SessionSlab slab;
+  ::std::vector<void*> objs;
+
+  // Only kMaxFreeBlocks per size class are kept around
+  for (size_t i = 0; i < kMaxFreeBlocks + 8; i++) {
+    objs.push_back(SessionSlab::allocate_object(&slab, 64, 64));
+    ASSERT_TRUE(objs.back() != nullptr);
+  }
+  ASSERT_EQ(objs.size(), slab.nr_outstanding());
+  for (auto p : objs)
+    SessionSlab::release_object(p);
+  ASSERT_EQ(0u, slab.nr_outstanding());
+  ASSERT_EQ(kMaxFreeBlocks, slab.nr_free());
+
+  // Draining the free list goes back to the heap
+  objs.clear();
+  for (size_t i = 0; i < kMaxFreeBlocks + 1; i++)
+    objs.push_back(SessionSlab::allocate_object(&slab, 64, 64));
+  ASSERT_EQ(kMaxFreeBlocks, slab.nr_recycled());
+  ASSERT_EQ(0u, slab.nr_free());
+  for (auto p : objs)
+    SessionSlab::release_object(p);
+
+  // Blocks bigger than the largest size class bypass the slab
+  const size_t huge = static_cast<size_t>(1) <<
+      (SessionSlab::kMinBlockShift + SessionSlab::kNrClasses);
+  void* p = SessionSlab::allocate_object(&slab, huge, 0);
+  ASSERT_TRUE(p != nullptr);
+  SessionSlab::release_object(p);
+  ASSERT_EQ(0u, slab.nr_outstanding());
+  ASSERT_EQ(kMaxFreeBlocks, slab.nr_free());
+
+  // As does everything without a slab
+  p = SessionSlab::allocate_object(nullptr, 64, 64);
+  ASSERT_TRUE(p != nullptr);
+  ASSERT_GE(SessionSlab::object_arena(p)->size(), 64u);
+  SessionSlab::release_object(p);
+  SessionSlab::release_object(nullptr);
+}
+
+} // namespace schwanenlied
@@ -0,0 +1,350 @@
+/**
+ * @file    shaper.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Process wide bandwidth shaping and relay scheduling (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <sstream>
+
+#include "schwanenlied/shaper.h"
+
+namespace schwanenlied {
+
+constexpr size_t Shaper::kBacklogQuanta;
+constexpr size_t Shaper::kMinBacklog;
+constexpr size_t Shaper::kMinQuantum;
+constexpr size_t Shaper::kMaxDeficitQuanta;
+
+Shaper::Flow::~Flow() {
+  if (queued_)
+    shaper_->flows_.erase(iter_);
+  if (held_ != nullptr)
+    ::evbuffer_free(held_);
+}
+
+bool Shaper::Flow::begin(struct bufferevent* bev) {
+  if (shaper_ == nullptr)
+    return true;
+  if (queued_)
+    return false;
+  parked_ = false;
+
+  // Newly active Flows start with a quantum, backlogged ones carry over
+  deficit_ = ::std::max(deficit_, shaper_->quantum_);
+  struct evbuffer* buf = ::bufferevent_get_input(bev);
+  const size_t len = ::evbuffer_get_length(buf);
+  offered_ = len;
+  if (len <= deficit_)
+    return true;
+
+  if (held_ == nullptr) {
+    held_ = ::evbuffer_new();
+    if (held_ == nullptr)
+      return true;
+  }
+
+  /*
+   * Draining the input can synchronously pull in more data if the
+   * bufferevent was suspended by the read high watermark, which would be
+   * processed out of order.
+   */
+  read_disabled_ = (::bufferevent_get_enabled(bev) & EV_READ) != 0;
+  if (read_disabled_)
+    ::bufferevent_disable(bev, EV_READ);
+
+  /*
+   * Split off everything past the credit.  The bufferevent owns the tail
+   * of buf (it is frozen), so move the head aside, take the tail, and put
+   * the head back.  Only chains are moved, nothing is copied.
+   */
+  struct evbuffer* head = shaper_->scratch_;
+  if (::evbuffer_remove_buffer(buf, head, deficit_) < 0 ||
+      ::evbuffer_add_buffer(held_, buf) != 0 ||
+      ::evbuffer_prepend_buffer(buf, head) != 0) {
+    // Should never happen, but don't lose data if it does
+    ::evbuffer_prepend_buffer(buf, head);
+    ::evbuffer_prepend_buffer(held_, buf);
+    ::evbuffer_prepend_buffer(buf, held_);
+    if (read_disabled_)
+      ::bufferevent_enable(bev, EV_READ);
+    read_disabled_ = false;
+    return true;
+  }
+  offered_ = deficit_;
+  shaper_->nr_deferrals_++;
+
+  return true;
+}
+
+void Shaper::Flow::end(struct bufferevent* bev) {
+  if (shaper_ == nullptr)
+    return;
+
+  struct evbuffer* buf = ::bufferevent_get_input(bev);
+  const size_t left = ::evbuffer_get_length(buf);
+  const size_t consumed = offered_ > left ? offered_ - left : 0;
+  deficit_ -= ::std::min(consumed, deficit_);
+  offered_ = 0;
+
+  if (held_ == nullptr || ::evbuffer_get_length(held_) == 0) {
+    // Not backlogged anymore, so the credit is forfeit
+    deficit_ = 0;
+    return;
+  }
+
+  // Whatever was not consumed goes before the held back data
+  ::evbuffer_prepend_buffer(held_, buf);
+  ::evbuffer_prepend_buffer(buf, held_);
+  if (read_disabled_) {
+    ::bufferevent_enable(bev, EV_READ);
+    read_disabled_ = false;
+  }
+
+  /*
+   * Requeueing a Flow whose transport did not consume anything would just
+   * spin the scheduler every round till the transport is ready, so park it
+   * till wake(), idle like a Flow that is not backlogged.
+   */
+  if (consumed == 0) {
+    deficit_ = 0;
+    parked_ = true;
+    shaper_->nr_parks_++;
+    return;
+  }
+  shaper_->schedule(*this);
+}
+
+void Shaper::Flow::wake() {
+  if (!parked_ || shaper_ == nullptr)
+    return;
+
+  parked_ = false;
+  shaper_->schedule(*this);
+}
+
+void Shaper::Flow::detach() {
+  if (queued_) {
+    shaper_->flows_.erase(iter_);
+    queued_ = false;
+  }
+  shaper_ = nullptr;
+  deficit_ = 0;
+  parked_ = false;
+}
+
+void Shaper::Flow::reclaim() {
+  if (queued_ || held_ == nullptr || ::evbuffer_get_length(held_) > 0)
+    return;
+
+  // Reallocated by begin() if the Flow is ever backlogged again
+  ::evbuffer_free(held_);
+  held_ = nullptr;
+}
+
+Shaper::~Shaper() {
+  SL_ASSERT(flows_.empty());
+
+  for (auto& iter : bridges_)
+    ::bufferevent_rate_limit_group_free(iter.second.group);
+  if (global_ != nullptr)
+    ::bufferevent_rate_limit_group_free(global_);
+  if (round_ev_ != nullptr)
+    ::event_free(round_ev_);
+  if (scratch_ != nullptr)
+    ::evbuffer_free(scratch_);
+}
+
+bool Shaper::init() {
+  SL_ASSERT(round_ev_ == nullptr);
+
+  if (global_rate_.rate > 0) {
+    global_ = group_new(global_rate_);
+    if (global_ == nullptr)
+      return false;
+  }
+
+  if (quantum_ > 0) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+      reinterpret_cast<Shaper*>(arg)->on_round();
+    };
+    round_ev_ = ::event_new(base_, -1, 0, cb, this);
+    if (round_ev_ == nullptr)
+      return false;
+    ::event_priority_set(round_ev_, priority_);
+
+    scratch_ = ::evbuffer_new();
+    if (scratch_ == nullptr)
+      return false;
+  }
+
+  return true;
+}
+
+bool Shaper::add_client(struct bufferevent* bev) {
+  if (global_ == nullptr)
+    return true;
+
+  return ::bufferevent_add_to_rate_limit_group(bev, global_) == 0;
+}
+
+bool Shaper::add_bridge(struct bufferevent* bev,
+                        const ::std::string& bridge,
+                        const Rate& rate) {
+  const Rate& want = rate.rate > 0 ? rate : bridge_rate_;
+
+  auto iter = bridges_.find(bridge);
+  if (iter == bridges_.end()) {
+    if (want.rate == 0)
+      return true;
+
+    Bridge entry;
+    entry.rate = want;
+    entry.group = group_new(want);
+    if (entry.group == nullptr)
+      return false;
+    iter = bridges_.insert(::std::make_pair(bridge, entry)).first;
+  } else if (rate.rate > 0 && (rate.rate != iter->second.rate.rate ||
+                               rate.burst != iter->second.rate.burst)) {
+    struct ev_token_bucket_cfg* cfg = ::ev_token_bucket_cfg_new(
+        rate.rate, ::std::max(rate.burst, rate.rate),
+        rate.rate, ::std::max(rate.burst, rate.rate), nullptr);
+    if (cfg == nullptr)
+      return false;
+    const int ret = ::bufferevent_rate_limit_group_set_cfg(iter->second.group,
+                                                           cfg);
+    ::ev_token_bucket_cfg_free(cfg);
+    if (ret != 0)
+      return false;
+    iter->second.rate = rate;
+  }
+
+  return ::bufferevent_add_to_rate_limit_group(bev, iter->second.group) == 0;
+}
+
+void Shaper::remove(struct bufferevent* bev) {
+  ::bufferevent_remove_from_rate_limit_group(bev);
+}
+
+void Shaper::attach(Flow& flow) {
+  SL_ASSERT(flow.shaper_ == nullptr);
+
+  if (quantum_ > 0)
+    flow.shaper_ = this;
+}
+
+size_t Shaper::backlog_limit() const {
+  if (quantum_ == 0)
+    return 0;
+
+  return ::std::max(quantum_ * kBacklogQuanta, kMinBacklog);
+}
+
+const ::std::string Shaper::to_string() const {
+  ::std::ostringstream stream;
+  ev_uint64_t nr_read = 0;
+  ev_uint64_t nr_written = 0;
+
+  stream << "Global: ";
+  if (global_ != nullptr) {
+    ::bufferevent_rate_limit_group_get_totals(global_, &nr_read, &nr_written);
+    stream << global_rate_.rate << " B/s (Read: " << nr_read << " Written: "
+           << nr_written << ")";
+  } else
+    stream << "Unlimited";
+  stream << " Bridges: " << bridges_.size();
+  if (quantum_ > 0)
+    stream << " Quantum: " << quantum_ << " Backlogged: " << flows_.size()
+           << " Rounds: " << nr_rounds_ << " Deferrals: " << nr_deferrals_
+           << " Parks: " << nr_parks_;
+
+  return stream.str();
+}
+
+struct bufferevent_rate_limit_group* Shaper::group_new(const Rate& rate) {
+  SL_ASSERT(rate.rate > 0);
+
+  // libevent2 rejects buckets that can not hold a tick's worth of tokens
+  const size_t burst = ::std::max(rate.burst, rate.rate);
+  struct ev_token_bucket_cfg* cfg = ::ev_token_bucket_cfg_new(rate.rate, burst,
+                                                              rate.rate, burst,
+                                                              nullptr);
+  if (cfg == nullptr)
+    return nullptr;
+
+  // The group keeps a copy of the configuration
+  struct bufferevent_rate_limit_group* group =
+      ::bufferevent_rate_limit_group_new(base_, cfg);
+  ::ev_token_bucket_cfg_free(cfg);
+
+  return group;
+}
+
+void Shaper::schedule(Flow& flow) {
+  SL_ASSERT(!flow.queued_);
+
+  flow.queued_ = true;
+  flow.iter_ = flows_.insert(flows_.end(), &flow);
+
+  // Rounds run once per event loop iteration, after I/O has been polled
+  if (!evtimer_pending(round_ev_, nullptr)) {
+    const struct timeval tv = { 0, 0 };
+    evtimer_add(round_ev_, &tv);
+  }
+}
+
+void Shaper::on_round() {
+  nr_rounds_++;
+
+  /*
+   * Only service the Flows that were backlogged when the round started, the
+   * ones that are still backlogged afterwards get requeued at the tail by
+   * Flow::end().  The callback may well destroy the Flow, so it must be
+   * unlinked before the callback is invoked.
+   *
+   * Unused credit carries over so that frames larger than the quantum make
+   * progress, but it is capped so that a Flow that consumes less than it is
+   * offered can not save up for a burst that defeats the fairness bound.
+   */
+  for (size_t n = flows_.size(); n > 0 && !flows_.empty(); n--) {
+    Flow* flow = flows_.front();
+    flows_.pop_front();
+    flow->queued_ = false;
+    flow->deficit_ = ::std::min(flow->deficit_ + quantum_,
+                                quantum_ * kMaxDeficitQuanta);
+    flow->cb_(flow->ctx_);
+  }
+}
+
+} // namespace schwanenlied
@@ -0,0 +1,335 @@
+/**
+ * @file    shaper.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Process wide bandwidth shaping and relay scheduling
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHWANENLIED_SHAPER_H__
+#define SCHWANENLIED_SHAPER_H__
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "schwanenlied/common.h"
+
+namespace schwanenlied {
+
+/**
+ * Process wide bandwidth shaping and relay scheduling
+ *
+ * Relayed traffic can be limited by libevent2 token buckets at two levels,
+ * each shared via a bufferevent_rate_limit_group:
+ *  * A global limit on all of the Client to SOCKS server connections (ie: the
+ *    aggregate plaintext relayed by every Session).
+ *  * A per-bridge limit on the SOCKS server to Remote peer connections that
+ *    go to the same bridge.
+ *
+ * Independently of the rate limits, a deficit round robin scheduler bounds
+ * how much buffered data each direction of a Session (a Flow) may process per
+ * event loop iteration.  A Flow that has more data than it has credit for
+ * has the excess held back, and is serviced again in the next round with
+ * another quantum of credit, so a single bulk transfer can not monopolize the
+ * event loop while other Sessions wait.  A Flow that made no progress at all
+ * (Eg: its transport is waiting on a timer, or on backpressure) is parked
+ * instead, till its Session calls Flow::wake().
+ *
+ * @warning This is not and will never be thread safe
+ */
+class Shaper {
+ public:
+  /** A token bucket configuration */
+  struct Rate {
+    Rate() : rate(0), burst(0) {}
+
+    size_t rate;  /**< The sustained rate in bytes/sec (0 = Unlimited) */
+    size_t burst; /**< The maximum burst in bytes (0 = The same as rate) */
+  };
+
+  /** The callback invoked when it is a Flow's turn to be serviced */
+  typedef void (*FlowCallback)(void* ctx);
+
+  /** A per-Session, per-direction scheduler entry */
+  class Flow {
+   public:
+    /**
+     * Construct a Flow
+     *
+     * @param[in] cb  The callback to invoke when the Flow is serviced
+     * @param[in] ctx The opaque argument passed to cb
+     */
+    Flow(FlowCallback cb,
+         void* ctx) :
+        shaper_(nullptr),
+        cb_(cb),
+        ctx_(ctx),
+        deficit_(0),
+        offered_(0),
+        held_(nullptr),
+        read_disabled_(false),
+        queued_(false),
+        parked_(false) {}
+
+    ~Flow();
+
+    /**
+     * Limit a bufferevent's input to what the Flow may process right now
+     *
+     * Data past the Flow's credit is removed from the input buffer, and held
+     * back till end() is called.  Reading is disabled in the meantime, so
+     * that nothing (Eg: a bufferevent_pair transfer) can append data that
+     * would end up ahead of the held back data.  Unattached Flows are never
+     * limited.
+     *
+     * @param[in] bev The bufferevent whose input is about to be processed
+     *
+     * @returns true  - Process the input, then call end()
+     * @returns false - The Flow is waiting for its turn, do not process
+     */
+    bool begin(struct bufferevent* bev);
+
+    /**
+     * Charge the data processed since begin(), and restore held back data
+     *
+     * If data was held back, the Flow is queued to be serviced in the next
+     * round, unless nothing was processed at all, in which case the Flow is
+     * parked, and its credit is forfeit.
+     *
+     * @param[in] bev The bufferevent that was passed to begin()
+     */
+    void end(struct bufferevent* bev);
+
+    /**
+     * Queue a parked Flow to be serviced in the next round
+     *
+     * This should be called when whatever the Flow's data is relayed to can
+     * make progress again (Eg: the output was written out).
+     */
+    void wake();
+
+    /** Query if the Flow has data waiting for a round, or is parked */
+    bool backlogged() const { return queued_ || parked_; }
+
+    /** Stop scheduling the Flow, so that its backlog can be drained */
+    void detach();
+
+    /** Release the held back data buffer if the Flow is not backlogged */
+    void reclaim();
+
+   private:
+    Flow(const Flow&) = delete;
+    void operator=(const Flow&) = delete;
+
+    friend Shaper;
+
+    Shaper* shaper_;        /**< The Shaper scheduling this Flow */
+    FlowCallback cb_;       /**< The service callback */
+    void* ctx_;             /**< The service callback argument */
+    size_t deficit_;        /**< The credit in bytes */
+    size_t offered_;        /**< The bytes passed through by begin() */
+    struct evbuffer* held_; /**< The held back data */
+    bool read_disabled_;    /**< Reading disabled by begin()? */
+    bool queued_;           /**< Waiting for a round? */
+    bool parked_;           /**< Made no progress, waiting for wake()? */
+    ::std::list<Flow*>::iterator iter_; /**< Position in flows_ */
+  };
+
+  /**
+   * Construct a Shaper
+   *
+   * @param[in] base      The libevent2 event_base to use
+   * @param[in] global    The global rate limit
+   * @param[in] bridge    The default per-bridge rate limit
+   * @param[in] quantum   The bytes a Flow may process per round (0 =
+   *                      Unscheduled, at least kMinQuantum otherwise)
+   * @param[in] priority  The priority of the scheduler event
+   */
+  Shaper(struct event_base* base,
+         const Rate& global,
+         const Rate& bridge,
+         const size_t quantum,
+         const int priority) :
+      base_(base),
+      global_rate_(global),
+      bridge_rate_(bridge),
+      quantum_(quantum > 0 ? ::std::max(quantum, kMinQuantum) : 0),
+      priority_(priority),
+      global_(nullptr),
+      round_ev_(nullptr),
+      scratch_(nullptr),
+      nr_rounds_(0),
+      nr_deferrals_(0),
+      nr_parks_(0) {}
+
+  ~Shaper();
+
+  /**
+   * Initialize the rate limit groups and the scheduler
+   *
+   * @returns true  - Success
+   * @returns false - Failure
+   */
+  bool init();
+
+  /** @{ */
+  /**
+   * Query if a Session's connections need to be added to rate limit groups
+   *
+   * @param[in] bridge  The Session's per-bridge rate limit override
+   */
+  bool is_limited(const Rate& bridge) const {
+    return global_rate_.rate > 0 || bridge_rate_.rate > 0 || bridge.rate > 0;
+  }
+
+  /**
+   * Subject a Client to SOCKS server connection to the global limit
+   *
+   * @param[in] bev The bufferevent to limit
+   *
+   * @returns true  - Success (Or there is no global limit)
+   * @returns false - Failure
+   */
+  bool add_client(struct bufferevent* bev);
+
+  /**
+   * Subject a SOCKS server to Remote peer connection to a bridge's limit
+   *
+   * The first connection to a bridge creates the bridge's rate limit group,
+   * with the rate from the bridge line if any, or the default otherwise.  A
+   * later connection with a different rate from the bridge line reconfigures
+   * the group.
+   *
+   * @param[in] bev     The bufferevent to limit
+   * @param[in] bridge  The bridge address
+   * @param[in] rate    The rate limit from the bridge line (rate == 0 = Use
+   *                    the default)
+   *
+   * @returns true  - Success (Or there is no limit for the bridge)
+   * @returns false - Failure
+   */
+  bool add_bridge(struct bufferevent* bev,
+                  const ::std::string& bridge,
+                  const Rate& rate);
+
+  /**
+   * Remove a bufferevent from its rate limit group
+   *
+   * This must be called before freeing any bufferevent that was passed to
+   * add_client() or add_bridge().
+   *
+   * @param[in] bev The bufferevent
+   */
+  void remove(struct bufferevent* bev);
+  /** @} */
+
+  /** @{ */
+  /**
+   * Attach a Flow to the scheduler
+   *
+   * This is a no-op if the quantum is 0.
+   */
+  void attach(Flow& flow);
+
+  /**
+   * Query the read high watermark for connections with attached Flows
+   *
+   * Held back data stays in the input buffer, so this bounds how far a
+   * backlogged Flow's input can grow.
+   *
+   * @returns The read high watermark (0 = Unlimited)
+   */
+  size_t backlog_limit() const;
+  /** @} */
+
+  /** Query the current state for logging */
+  const ::std::string to_string() const;
+
+ private:
+  Shaper(const Shaper&) = delete;
+  void operator=(const Shaper&) = delete;
+
+  /** The backlog_limit() in quanta */
+  static constexpr size_t kBacklogQuanta = 4;
+  /** The minimum backlog_limit(), so that whole frames always fit */
+  static constexpr size_t kMinBacklog = 65536;
+  /**
+   * The smallest quantum, so that a Flow can always make progress with one
+   * (It is larger than a ScrambleSuit frame)
+   */
+  static constexpr size_t kMinQuantum = 2048;
+  /** The most credit a backlogged Flow can build up, in quanta */
+  static constexpr size_t kMaxDeficitQuanta = 2;
+
+  /** A bridge's rate limit group */
+  struct Bridge {
+    Bridge() : rate(), group(nullptr) {}
+
+    Rate rate;  /**< The current rate */
+    struct bufferevent_rate_limit_group* group; /**< The group */
+  };
+
+  /**
+   * Create a rate limit group
+   *
+   * @param[in] rate  The rate (rate.rate > 0)
+   *
+   * @returns A pointer to the group, nullptr on failure
+   */
+  struct bufferevent_rate_limit_group* group_new(const Rate& rate);
+
+  /** Queue a Flow for the next round */
+  void schedule(Flow& flow);
+
+  /** Service every Flow that was queued before the round started */
+  void on_round();
+
+  struct event_base* base_;   /**< The libevent2 event_base */
+  const Rate global_rate_;    /**< The global rate limit */
+  const Rate bridge_rate_;    /**< The default per-bridge rate limit */
+  const size_t quantum_;      /**< The per-round Flow quantum */
+  const int priority_;        /**< The scheduler event priority */
+  struct bufferevent_rate_limit_group* global_; /**< The global group */
+  ::std::map< ::std::string, Bridge> bridges_;  /**< The per-bridge groups */
+  ::std::list<Flow*> flows_;  /**< The backlogged Flows, in service order */
+  struct event* round_ev_;    /**< The scheduler event */
+  struct evbuffer* scratch_;  /**< Scratch space for splitting buffers */
+  size_t nr_rounds_;          /**< Total scheduler rounds */
+  size_t nr_deferrals_;       /**< Total times data was held back */
+  size_t nr_parks_;           /**< Total times a Flow was parked */
+};
+
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_SHAPER_H__
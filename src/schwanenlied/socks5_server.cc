@@ -33,19 +33,80 @@
 
 #define SOCKS5_SERVER_IMPL
 
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <limits>
 #include <random>
 
 #include <event2/buffer.h>
 
 #include "schwanenlied/socks5_server.h"
 #include "schwanenlied/crypto/rand_openssl.h"
+#include "schwanenlied/crypto/utils.h"
+#include "schwanenlied/net/utils.h"
 
 namespace schwanenlied {
 
+constexpr int Socks5Server::kNrPriorities;
+constexpr size_t Socks5Server::kDefaultBufferMin;
+constexpr size_t Socks5Server::kDefaultBufferMax;
+constexpr int Socks5Server::kDefaultWarmPoolIdle;
+constexpr size_t Socks5Server::Session::kMaxBufferSize;
+constexpr size_t Socks5Server::Session::kMaxEarlyDataSize;
+
+namespace {
+
+/**
+ * Match a bridge line argument ("key=value") and parse the value as a size
+ *
+ * @param[in]   arg   The argument
+ * @param[in]   len   The length of arg
+ * @param[in]   key   The key to match, including the '='
+ * @param[out]  value The parsed value
+ *
+ * @returns 1   - Matched
+ * @returns 0   - Not matched
+ * @returns -1  - Matched, but the value is invalid
+ */
+int parse_size_arg(const uint8_t* arg,
+                   const size_t len,
+                   const char* key,
+                   size_t& value) {
+  const size_t key_len = ::std::strlen(key);
+  if (len < key_len || ::std::memcmp(arg, key, key_len) != 0)
+    return 0;
+  if (len == key_len)
+    return -1;
+
+  size_t tmp = 0;
+  for (size_t i = key_len; i < len; i++) {
+    if (arg[i] < '0' || arg[i] > '9')
+      return -1;
+    if (tmp > (::std::numeric_limits<size_t>::max() - 9) / 10)
+      return -1;
+    tmp = tmp * 10 + (arg[i] - '0');
+  }
+
+  value = tmp;
+  return 1;
+}
+
+/** The idle detection interval, the shorter of the idle limits */
+int idle_interval(const Socks5Server::Config& config) {
+  if (config.idle_timeout <= 0 ||
+      (config.idle_reap > 0 && config.idle_reap < config.idle_timeout))
+    return config.idle_reap;
+  return config.idle_timeout;
+}
+
+} // (Anonymous) namespace
+
 Socks5Server::~Socks5Server() {
   close();
   close_sessions();
+  if (admission_ev_ != nullptr)
+    ::event_free(admission_ev_);
 }
 
 bool Socks5Server::addr(struct sockaddr_in& addr) const {
@@ -57,6 +118,26 @@ bool Socks5Server::addr(struct sockaddr_in& addr) const {
   return true;
 }
 
+const struct timeval* Socks5Server::common_timeout(const uint64_t msec) {
+  auto iter = common_timeouts_.find(msec);
+  if (iter != common_timeouts_.end())
+    return &iter->second;
+
+  /*
+   * libevent2 only supports a limited number of common timeouts per
+   * event_base, so fall back to a regular timeout if they are exhausted.
+   */
+  struct timeval tv;
+  tv.tv_sec = msec / 1000;
+  tv.tv_usec = (msec % 1000) * 1000;
+  const struct timeval* common_tv = ::event_base_init_common_timeout(base_,
+                                                                     &tv);
+  if (common_tv != nullptr)
+    tv = *common_tv;
+
+  return &(common_timeouts_[msec] = tv);
+}
+
 bool Socks5Server::bind() {
   if (listener_ != nullptr)
     return false;
@@ -77,9 +158,21 @@ bool Socks5Server::bind() {
     reinterpret_cast<Socks5Server*>(ptr)->on_new_connection(sock, addr, len);
   };
 
-  listener_ = ::evconnlistener_new_bind(base_, cb, this,
-                                        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
-                                        -1, reinterpret_cast<struct sockaddr*>(&listener_addr_),
+  /*
+   * SOCKS clients always talk first, so with deferred accept, no Session is
+   * allocated (and no handshake keypair generated) till there is something
+   * to read.  evconnlistener already accepts till the backlog is drained
+   * each time the listener becomes readable.
+   */
+  unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+#ifdef LEV_OPT_DEFERRED_ACCEPT
+  if (config_.defer_accept)
+    flags |= LEV_OPT_DEFERRED_ACCEPT;
+#endif
+
+  listener_ = ::evconnlistener_new_bind(base_, cb, this, flags,
+                                        config_.listen_backlog,
+                                        reinterpret_cast<struct sockaddr*>(&listener_addr_),
                                         sizeof(listener_addr_));
   if (listener_ == nullptr) {
     LOG(ERROR) << this << ": Failed to create an evconnlistener";
@@ -88,6 +181,10 @@ bool Socks5Server::bind() {
 
   // Query the port that end up bound
   const evutil_socket_t sock = ::evconnlistener_get_fd(listener_);
+#ifndef LEV_OPT_DEFERRED_ACCEPT
+  if (config_.defer_accept && !net::set_defer_accept(sock, 1))
+    LOG(WARNING) << this << ": Failed to enable deferred accept";
+#endif
   socklen_t len = sizeof(listener_addr_);
   int ret = ::getsockname(sock, reinterpret_cast<struct sockaddr*>(&listener_addr_),
                            &len);
@@ -130,6 +227,328 @@ void Socks5Server::close_sessions() {
   }
 }
 
+void Socks5Server::log_stats() const {
+  LOG(INFO) << this << ": " << listener_addr_str_ << " - Sessions: "
+            << sessions_.size();
+  LOG(INFO) << this << ": Session slab: " << factory_->slab().to_string();
+
+  const uint64_t avg_wait_usec = nr_queued_ > 0 ?
+      total_wait_usec_ / nr_queued_ : 0;
+  LOG(INFO) << this << ": Handshakes: " << nr_handshakes_ << "/"
+            << config_.handshake_limit << " Queued: "
+            << handshake_queue_.size() << " (Peak: " << peak_queue_depth_
+            << ") Admitted: " << nr_admitted_ << " Waited: " << nr_queued_
+            << " Rejected: " << nr_rejected_ << " Expired: "
+            << nr_queue_expired_ << " Wait (Avg/Max ms): "
+            << avg_wait_usec / 1000 << "/" << max_wait_usec_ / 1000;
+
+  if (config_.handshake_race_delay > 0)
+    LOG(INFO) << this << ": Fallback handshakes: " << nr_races_
+              << " Won: " << nr_race_fallback_wins_;
+
+  if (config_.idle_timeout > 0 || config_.idle_reap > 0 ||
+      config_.tcp_keepalive > 0 || config_.tcp_user_timeout > 0)
+    LOG(INFO) << this << ": Idle: " << nr_idle_ << " Reaped: "
+              << nr_idle_reaped_ << " Reclaimed: " << idle_reclaimed_
+              << " bytes Compacted: " << idle_compacted_
+              << " bytes Dead peers: " << nr_dead_peers_;
+
+  if (config_.warm_pool_size > 0) {
+    size_t nr_idle = 0;
+    size_t nr_warming = 0;
+    for (const auto& iter : warm_pools_) {
+      nr_idle += iter.second.idle.size();
+      nr_warming += iter.second.nr_warming;
+    }
+    const size_t nr_requests = nr_pool_hits_ + nr_pool_misses_;
+    const size_t hit_rate = nr_requests > 0 ?
+        nr_pool_hits_ * 100 / nr_requests : 0;
+    LOG(INFO) << this << ": Warm pool: " << warm_pools_.size()
+              << " peers Idle: " << nr_idle << " Warming: " << nr_warming
+              << " Hits: " << nr_pool_hits_ << " Misses: " << nr_pool_misses_
+              << " (" << hit_rate << "%) Warmed: " << nr_pool_warmed_
+              << " Failed: " << nr_pool_failed_ << " Expired: "
+              << nr_pool_expired_;
+  }
+}
+
+bool Socks5Server::admit_handshake(Session* session) {
+  SL_ASSERT(session->handshake_slot_ == Session::HandshakeSlot::kNONE);
+
+  // Fast path, there is a free slot and nothing is waiting for it
+  if (config_.handshake_limit == 0 ||
+      (nr_handshakes_ < config_.handshake_limit && handshake_queue_.empty())) {
+    session->handshake_slot_ = Session::HandshakeSlot::kACTIVE;
+    nr_handshakes_++;
+    nr_admitted_++;
+    return true;
+  }
+
+  if (config_.handshake_queue_limit != 0 &&
+      handshake_queue_.size() >= config_.handshake_queue_limit) {
+    nr_rejected_++;
+    return false;
+  }
+
+  if (admission_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+
+      reinterpret_cast<Socks5Server*>(arg)->on_admission();
+    };
+    admission_ev_ = ::event_new(base_, -1, 0, cb, this);
+    if (admission_ev_ == nullptr) {
+      LOG(ERROR) << this << ": Failed to allocate admission event";
+      nr_rejected_++;
+      return false;
+    }
+    ::event_priority_set(admission_ev_, Priority::kHANDSHAKE);
+  }
+
+  ::event_base_gettimeofday_cached(base_, &session->queued_tv_);
+  session->queue_iter_ = handshake_queue_.insert(handshake_queue_.end(),
+                                                 session);
+  session->handshake_slot_ = Session::HandshakeSlot::kQUEUED;
+  nr_queued_++;
+  peak_queue_depth_ = ::std::max(peak_queue_depth_, handshake_queue_.size());
+
+  // The queue is FIFO, so only the head's deadline needs a timer
+  if (handshake_queue_.size() == 1) {
+    const struct timeval tv = { kHandshakeQueueTimeout, 0 };
+    ::event_add(admission_ev_, &tv);
+  }
+
+  LOG(DEBUG) << session << ": Queued for admission (Depth: "
+             << handshake_queue_.size() << ")";
+
+  return true;
+}
+
+void Socks5Server::release_handshake(Session* session) {
+  switch (session->handshake_slot_) {
+  case Session::HandshakeSlot::kNONE:
+    return;
+  case Session::HandshakeSlot::kQUEUED:
+    handshake_queue_.erase(session->queue_iter_);
+    break;
+  case Session::HandshakeSlot::kACTIVE:
+    SL_ASSERT(nr_handshakes_ > 0);
+    nr_handshakes_--;
+
+    /*
+     * Admitting the next Session is deferred, because this may be called from
+     * deep inside the Session being torn down.
+     */
+    if (!handshake_queue_.empty())
+      ::event_active(admission_ev_, EV_TIMEOUT, 0);
+    break;
+  }
+
+  session->handshake_slot_ = Session::HandshakeSlot::kNONE;
+}
+
+void Socks5Server::on_admission() {
+  struct timeval now;
+  ::event_base_gettimeofday_cached(base_, &now);
+
+  // Fail the Sessions that have waited for too long
+  while (!handshake_queue_.empty()) {
+    Session* session = handshake_queue_.front();
+    const struct timeval& queued = session->queued_tv_;
+    if (now.tv_sec - queued.tv_sec < kHandshakeQueueTimeout ||
+        (now.tv_sec - queued.tv_sec == kHandshakeQueueTimeout &&
+         now.tv_usec < queued.tv_usec))
+      break;
+
+    handshake_queue_.pop_front();
+    session->handshake_slot_ = Session::HandshakeSlot::kNONE;
+    nr_queue_expired_++;
+
+    LOG(WARNING) << session << ": Handshake admission timeout";
+    ::bufferevent_disable(session->incoming_, EV_READ);
+
+    // This can tear down the Session, but it was already dequeued
+    session->send_socks5_response(Session::Reply::kTTL_EXPIRED);
+  }
+
+  while (!handshake_queue_.empty() &&
+         nr_handshakes_ < config_.handshake_limit) {
+    Session* session = handshake_queue_.front();
+    handshake_queue_.pop_front();
+    session->handshake_slot_ = Session::HandshakeSlot::kACTIVE;
+    nr_handshakes_++;
+    nr_admitted_++;
+
+    const struct timeval& queued = session->queued_tv_;
+    const int64_t wait_usec = (now.tv_sec - queued.tv_sec) * 1000000LL +
+        (now.tv_usec - queued.tv_usec);
+    if (wait_usec > 0) {
+      total_wait_usec_ += wait_usec;
+      max_wait_usec_ = ::std::max(max_wait_usec_,
+                                  static_cast<uint64_t>(wait_usec));
+    }
+
+    LOG(DEBUG) << session << ": Admitted after " << wait_usec / 1000 << " ms";
+
+    // This can tear down the Session, but it was already dequeued
+    session->start_connect();
+  }
+
+  // Rearm the timer for the new head of the queue
+  if (handshake_queue_.empty()) {
+    ::event_del(admission_ev_);
+  } else {
+    const struct timeval& queued = handshake_queue_.front()->queued_tv_;
+    const int64_t left_usec = kHandshakeQueueTimeout * 1000000LL -
+        ((now.tv_sec - queued.tv_sec) * 1000000LL +
+         (now.tv_usec - queued.tv_usec));
+    struct timeval tv = { 0, 0 };
+    if (left_usec > 0) {
+      tv.tv_sec = left_usec / 1000000;
+      tv.tv_usec = left_usec % 1000000;
+    }
+    ::event_add(admission_ev_, &tv);
+  }
+}
+
+Socks5Server::Session* Socks5Server::create_clientless_session(const char* addr) {
+  Session* session = factory_->create_session(*this, base_, -1, addr,
+                                              scrub_addrs_);
+  if (session != nullptr)
+    sessions_.push_back(::std::unique_ptr<Session>(session));
+
+  return session;
+}
+
+Socks5Server::Session* Socks5Server::create_embedded_session(SessionObserver& observer,
+                                                            struct bufferevent* plaintext,
+                                                            struct bufferevent* ciphertext,
+                                                            const struct sockaddr* addr,
+                                                            const socklen_t addr_len,
+                                                            const ::std::string& args) {
+  Session* session = create_clientless_session("[Embedded]");
+  if (session == nullptr) {
+    ::bufferevent_free(plaintext);
+    ::bufferevent_free(ciphertext);
+    return nullptr;
+  }
+
+  if (!session->embed_connect(observer, plaintext, ciphertext, addr, addr_len,
+                              args)) {
+    LOG(WARNING) << session << ": Failed to start embedded session";
+    close_session(session);
+    return nullptr;
+  }
+
+  return session;
+}
+
+Socks5Server::Session* Socks5Server::pool_take(const ::std::string& key) {
+  auto iter = warm_pools_.find(key);
+  if (iter == warm_pools_.end() || iter->second.idle.empty()) {
+    nr_pool_misses_++;
+    return nullptr;
+  }
+
+  // The most recently handshaked connection is the most likely to be alive
+  Session* session = iter->second.idle.back();
+  pool_release(session);
+  ::evtimer_del(session->pool_ev_);
+  nr_pool_hits_++;
+
+  return session;
+}
+
+void Socks5Server::pool_refill(const Session& origin,
+                               const ::std::string& key) {
+  WarmPool& pool = warm_pools_[key];
+  while (pool.idle.size() + pool.nr_warming < config_.warm_pool_size) {
+    Session* session = create_clientless_session("[Warm pool]");
+    if (session == nullptr)
+      break;
+
+    session->pool_key_ = key;
+    session->pool_slot_ = Session::PoolSlot::kWARMING;
+    pool.nr_warming++;
+    if (!session->warm_connect(origin)) {
+      LOG(WARNING) << session << ": Failed to start warm connection";
+      pool_discard(session);
+      close_session(session);
+      break;
+    }
+  }
+
+  // Don't leave an empty entry behind if nothing could be started
+  if (pool.idle.empty() && pool.nr_warming == 0)
+    warm_pools_.erase(key);
+}
+
+void Socks5Server::pool_park(Session* session) {
+  SL_ASSERT(session->pool_slot_ == Session::PoolSlot::kWARMING);
+
+  WarmPool& pool = warm_pools_[session->pool_key_];
+  SL_ASSERT(pool.nr_warming > 0);
+  pool.nr_warming--;
+  session->pool_iter_ = pool.idle.insert(pool.idle.end(), session);
+  session->pool_slot_ = Session::PoolSlot::kIDLE;
+  session->state_ = Session::State::kPOOLED;
+  nr_pool_warmed_++;
+
+  // Bound what the peer can make us buffer while idle
+  ::bufferevent_setwatermark(session->outgoing_, EV_READ, 0,
+                             Session::kMaxBufferSize);
+  ::bufferevent_enable(session->outgoing_, EV_READ);
+
+  ::evtimer_add(session->pool_ev_, common_timeout(
+      static_cast<uint64_t>(config_.warm_pool_idle) * 1000));
+
+  LOG(INFO) << session << ": Warm connection ready (Idle: "
+            << pool.idle.size() << ")";
+}
+
+void Socks5Server::pool_discard(Session* session) {
+  if (session->pool_slot_ == Session::PoolSlot::kNONE)
+    return;
+
+  LOG(INFO) << session << ": Warm connection lost";
+  pool_release(session);
+  nr_pool_failed_++;
+}
+
+void Socks5Server::pool_release(Session* session) {
+  if (session->pool_slot_ == Session::PoolSlot::kNONE)
+    return;
+
+  auto iter = warm_pools_.find(session->pool_key_);
+  SL_ASSERT(iter != warm_pools_.end());
+  WarmPool& pool = iter->second;
+  if (session->pool_slot_ == Session::PoolSlot::kWARMING) {
+    SL_ASSERT(pool.nr_warming > 0);
+    pool.nr_warming--;
+  } else
+    pool.idle.erase(session->pool_iter_);
+  if (pool.idle.empty() && pool.nr_warming == 0)
+    warm_pools_.erase(iter);
+
+  session->pool_slot_ = Session::PoolSlot::kNONE;
+}
+
+void Socks5Server::on_pool_event(Session* session) {
+  // Idle timeout, as opposed to a deferred teardown after a failure
+  if (session->pool_slot_ == Session::PoolSlot::kIDLE) {
+    LOG(INFO) << session << ": Warm connection expired";
+    pool_release(session);
+    nr_pool_expired_++;
+    if (config_.warm_pool_refill == WarmPoolRefill::kEAGER)
+      pool_refill(*session, session->pool_key_);
+  }
+
+  close_session(session);
+}
+
 void Socks5Server::on_new_connection(evutil_socket_t sock,
                                      struct sockaddr* addr,
                                      int addr_len) {
@@ -159,53 +578,468 @@ Socks5Server::Session::Session(Socks5Server& server,
     base_(base),
     incoming_(nullptr),
     outgoing_(nullptr),
-    remote_addr_(),
-    remote_addr_len_(0),
     state_(State::kREAD_METHODS),
-    client_addr_str_(client_addr),
-    remote_addr_str_("[Not yet specified]"),
+    incoming_relay_cb_(nullptr),
+    outgoing_relay_cb_(nullptr),
+    flight_(nullptr),
+#ifdef ENABLE_IO_URING
+    incoming_uring_(nullptr),
+    outgoing_uring_(nullptr),
+#endif
+    outgoing_buffer_limit_(kMaxBufferSize),
+    incoming_buffer_limit_(kMaxBufferSize),
+    outgoing_bdp_limit_(kMaxBufferSize),
+    incoming_bdp_limit_(kMaxBufferSize),
+    buffer_limit_tv_(),
+    last_active_tv_(),
+    incoming_valid_(false),
+    outgoing_valid_(false),
+    idle_(false),
+    rate_limited_(false),
+    incoming_flow_([](void* ctx) {
+                     reinterpret_cast<Session*>(ctx)->incoming_flow_cb();
+                   }, this),
+    outgoing_flow_([](void* ctx) {
+                     reinterpret_cast<Session*>(ctx)->outgoing_flow_cb();
+                   }, this),
+    budget_account_([](void* ctx) {
+                      return reinterpret_cast<Session*>(ctx)->
+                          budget_shrink_cb();
+                    }, this),
+    addrs_(new Addresses(client_addr)),
+    arena_(nullptr),
     auth_required_(require_auth),
     scrub_addrs_(scrub_addrs),
     auth_method_(AuthMethod::kNO_ACCEPTABLE),
-    incoming_valid_(false),
-    outgoing_valid_(false),
-    connect_timer_ev_(nullptr) {
-  incoming_ = ::bufferevent_socket_new(base_, sock, BEV_OPT_CLOSE_ON_FREE |
-                                       BEV_OPT_DEFER_CALLBACKS);
-  CHECK_NOTNULL(incoming_);
+    outgoing_corked_(false),
+    outgoing_fastopen_(false),
+    early_response_sent_(false),
+    race_fallback_(false),
+    handshake_slot_(HandshakeSlot::kNONE),
+    pool_slot_(PoolSlot::kNONE),
+    connect_timer_([](void* arg) {
+      reinterpret_cast<Session*>(arg)->connect_timeout_cb();
+    }, this),
+    incoming_kick_ev_(nullptr),
+    outgoing_kick_ev_(nullptr),
+    idle_ev_(nullptr),
+    buffer_limit_ev_(nullptr),
+    queued_tv_(),
+    queue_iter_(),
+    auth_creds_(),
+    observer_(nullptr),
+    pool_key_(),
+    pool_ev_(nullptr),
+    pool_iter_(),
+    race_partner_(nullptr),
+    race_ev_(nullptr),
+    bridge_rate_() {
+  const Config& config = server_.config();
+  if (config.buffer_mode == BufferMode::kADAPTIVE) {
+    // Start out at the historical default till there is a BDP estimate
+    outgoing_bdp_limit_ = ::std::min(::std::max(kMaxBufferSize,
+                                                config.buffer_min),
+                                     config.buffer_max);
+    incoming_bdp_limit_ = outgoing_bdp_limit_;
+  }
+  if (config.budget != nullptr) {
+    struct timeval now;
+    ::event_base_gettimeofday_cached(base_, &now);
+    config.budget->register_account(budget_account_, now);
+  }
 
-  // Initialize the callbacks for the incoming socket
-  bufferevent_data_cb readcb = [](struct bufferevent *bev,
-                                  void *ctx) {
-    (void)bev;
+  // Warm pool/embedded connections get bufferevents attached later
+  if (sock < 0)
+    return;
 
-    reinterpret_cast<Session*>(ctx)->incoming_read_cb();
-  };
-  bufferevent_data_cb writecb = [](struct bufferevent *bev,
-                                   void *ctx) {
+  struct bufferevent* bev = ::bufferevent_socket_new(base_, sock,
+                                                     BEV_OPT_CLOSE_ON_FREE |
+                                                     BEV_OPT_DEFER_CALLBACKS);
+  CHECK_NOTNULL(bev);
+  ::bufferevent_priority_set(bev, Priority::kHANDSHAKE);
+  incoming_attach(bev);
+}
+
+Socks5Server::Session::~Session() {
+  if (observer_ != nullptr)
+    observer_->on_session_closed(this);
+  server_.release_handshake(this);
+  server_.pool_release(this);
+  if (race_partner_ != nullptr) {
+    Session* partner = race_partner_;
+    race_unlink();
+
+    // A fallback has nobody to hand the connection to anymore
+    if (partner->race_fallback_)
+      partner->close_deferred();
+  }
+#ifdef ENABLE_IO_URING
+  // The io_uring owns the bufferevents, and closes the sockets once flushed
+  if (outgoing_uring_ != nullptr) {
+    outgoing_uring_->release();
+    outgoing_ = nullptr;
+  }
+  if (incoming_uring_ != nullptr) {
+    incoming_uring_->release();
+    incoming_ = nullptr;
+  }
+#endif
+  if (rate_limited_) {
+    Shaper* shaper = server_.config().shaper;
+    if (outgoing_ != nullptr)
+      shaper->remove(outgoing_);
+    if (incoming_ != nullptr)
+      shaper->remove(incoming_);
+  }
+  if (outgoing_ != nullptr)
+    bufferevent_free(outgoing_);
+  if (incoming_ != nullptr)
+    bufferevent_free(incoming_);
+  if (incoming_kick_ev_ != nullptr)
+    ::event_free(incoming_kick_ev_);
+  if (outgoing_kick_ev_ != nullptr)
+    ::event_free(outgoing_kick_ev_);
+  if (pool_ev_ != nullptr)
+    ::event_free(pool_ev_);
+  if (race_ev_ != nullptr)
+    ::event_free(race_ev_);
+  if (idle_ev_ != nullptr)
+    ::event_free(idle_ev_);
+  if (buffer_limit_ev_ != nullptr)
+    ::event_free(buffer_limit_ev_);
+  if (flight_ != nullptr)
+    ::evbuffer_free(flight_);
+}
+
+void Socks5Server::Session::incoming_attach(struct bufferevent* bev) {
+  SL_ASSERT(incoming_ == nullptr);
+
+  incoming_ = bev;
+  incoming_setcb(nullptr);
+  ::bufferevent_enable(incoming_, EV_READ | EV_WRITE);
+  incoming_valid_ = true;
+}
+
+void Socks5Server::Session::incoming_setcb(bufferevent_data_cb readcb) {
+  if (readcb == nullptr) {
+    readcb = [](struct bufferevent* bev,
+                void* ctx) {
+      (void)bev;
+
+      reinterpret_cast<Session*>(ctx)->incoming_read_cb();
+    };
+  }
+  bufferevent_data_cb writecb = [](struct bufferevent* bev,
+                                   void* ctx) {
     (void)bev;
 
     reinterpret_cast<Session*>(ctx)->incoming_write_cb();
   };
-  bufferevent_event_cb eventcb = [](struct bufferevent *bev,
+  bufferevent_event_cb eventcb = [](struct bufferevent* bev,
                                     short events,
-                                    void *ctx) {
+                                    void* ctx) {
     (void)bev;
 
     reinterpret_cast<Session*>(ctx)->incoming_event_cb(events);
   };
   ::bufferevent_setcb(incoming_, readcb, writecb, eventcb, this);
-  ::bufferevent_enable(incoming_, EV_READ | EV_WRITE);
-  incoming_valid_ = true;
 }
 
-Socks5Server::Session::~Session() {
-  if (outgoing_ != nullptr)
-    bufferevent_free(outgoing_);
-  if (incoming_ != nullptr)
-    bufferevent_free(incoming_);
-  if (connect_timer_ev_ != nullptr)
-    ::event_free(connect_timer_ev_);
+void Socks5Server::Session::outgoing_setcb(bufferevent_data_cb readcb) {
+  if (readcb == nullptr) {
+    readcb = [](struct bufferevent* bev,
+                void* ctx) {
+      (void)bev;
+
+      reinterpret_cast<Session*>(ctx)->outgoing_read_cb();
+    };
+  }
+  bufferevent_data_cb writecb = [](struct bufferevent* bev,
+                                   void* ctx) {
+    (void)bev;
+
+    reinterpret_cast<Session*>(ctx)->outgoing_write_cb();
+  };
+  bufferevent_event_cb eventcb = [](struct bufferevent* bev,
+                                    short events,
+                                    void* ctx) {
+    (void)bev;
+
+    reinterpret_cast<Session*>(ctx)->outgoing_event_cb(events);
+  };
+  ::bufferevent_setcb(outgoing_, readcb, writecb, eventcb, this);
+}
+
+evutil_socket_t Socks5Server::Session::outgoing_fd() const {
+#ifdef ENABLE_IO_URING
+  if (outgoing_uring_ != nullptr)
+    return outgoing_uring_->fd();
+#endif
+  return ::bufferevent_getfd(outgoing_);
+}
+
+#ifdef ENABLE_IO_URING
+void Socks5Server::Session::io_uring_attach() {
+  net::IoUring* ring = server_.config().io_uring;
+
+  // Embedded sessions talk to the embedder over a bufferevent pair
+  if (ring == nullptr || observer_ != nullptr)
+    return;
+
+  // The rate limit groups only apply to socket bufferevents
+  const Shaper* shaper = server_.config().shaper;
+  if (shaper != nullptr && shaper->is_limited(bridge_rate_))
+    return;
+
+  SL_ASSERT(incoming_uring_ == nullptr && outgoing_uring_ == nullptr);
+
+  incoming_uring_ = ring->attach(incoming_);
+  if (incoming_uring_ != nullptr)
+    incoming_ = incoming_uring_->bev();
+  outgoing_uring_ = ring->attach(outgoing_);
+  if (outgoing_uring_ != nullptr)
+    outgoing_ = outgoing_uring_->bev();
+  if (incoming_uring_ == nullptr || outgoing_uring_ == nullptr)
+    LOG(WARNING) << this << ": Failed to attach to the io_uring";
+}
+#endif
+
+void Socks5Server::Session::shaper_attach() {
+  Shaper* shaper = server_.config().shaper;
+  if (shaper == nullptr)
+    return;
+
+  shaper->attach(incoming_flow_);
+  shaper->attach(outgoing_flow_);
+  const size_t backlog = shaper->backlog_limit();
+  if (backlog > 0) {
+    ::bufferevent_setwatermark(incoming_, EV_READ, 0, backlog);
+    ::bufferevent_setwatermark(outgoing_, EV_READ, 0, backlog);
+  }
+
+  // Embedded sessions are up to the embedder to rate limit
+  if (observer_ != nullptr || !shaper->is_limited(bridge_rate_))
+    return;
+
+  rate_limited_ = true;
+  if (!shaper->add_client(incoming_) ||
+      !shaper->add_bridge(outgoing_,
+                          addr_to_string(reinterpret_cast<struct sockaddr*>(
+                              &addrs_->remote_addr), false),
+                          bridge_rate_))
+    LOG(WARNING) << this << ": Failed to apply the rate limits";
+}
+
+void Socks5Server::Session::set_dead_peer_detection() {
+  const Config& config = server_.config();
+  const evutil_socket_t sock = outgoing_fd();
+  if (sock < 0)
+    return;
+
+  if (config.tcp_keepalive > 0) {
+    const int interval = ::std::max(config.tcp_keepalive / kKeepaliveProbes,
+                                    1);
+    if (!net::set_tcp_keepalive(sock, config.tcp_keepalive, interval,
+                                kKeepaliveProbes))
+      LOG(DEBUG) << this << ": Failed to enable TCP keepalive";
+  }
+  if (config.tcp_user_timeout > 0 &&
+      !net::set_tcp_user_timeout(sock, config.tcp_user_timeout))
+    LOG(DEBUG) << this << ": Failed to set TCP_USER_TIMEOUT";
+}
+
+void Socks5Server::Session::idle_arm() {
+  const Config& config = server_.config();
+  if (config.idle_timeout <= 0 && config.idle_reap <= 0)
+    return;
+
+  if (idle_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+
+      reinterpret_cast<Session*>(arg)->idle_cb();
+    };
+    idle_ev_ = evtimer_new(base_, cb, this);
+    if (idle_ev_ == nullptr) {
+      LOG(WARNING) << this << ": Failed to allocate idle timer";
+      return;
+    }
+    ::event_priority_set(idle_ev_, Priority::kTIMER);
+  }
+
+  /*
+   * Instead of rearming a timer on every read and write, the timer fires
+   * periodically and compares against the time data was last relayed, so a
+   * Session is noticed to be idle within one interval of the limit.
+   */
+  const int interval = idle_interval(config);
+  ::event_base_gettimeofday_cached(base_, &last_active_tv_);
+  evtimer_add(idle_ev_,
+              server_.common_timeout(static_cast<uint64_t>(interval) * 1000));
+}
+
+void Socks5Server::Session::idle_cb() {
+  if (state_ != State::kESTABLISHED)
+    return;
+
+  const Config& config = server_.config();
+  struct timeval now;
+  ::event_base_gettimeofday_cached(base_, &now);
+  const time_t idle_for = now.tv_sec - last_active_tv_.tv_sec;
+
+  if (config.idle_reap > 0 && idle_for >= config.idle_reap) {
+    LOG(INFO) << this << ": Session idle for " << idle_for << " sec, closing";
+    server_.nr_idle_reaped_++;
+    server_.close_session(this);
+    return;
+  }
+
+  if (config.idle_timeout > 0 && idle_for >= config.idle_timeout && !idle_) {
+    size_t reclaimed = 0;
+    size_t compacted = 0;
+    if (!idle_reclaim(reclaimed, compacted)) {
+      LOG(ERROR) << this << ": Failed to compact idle buffers, closing";
+      server_.close_session(this);
+      return;
+    }
+    idle_ = true;
+    server_.nr_idle_++;
+    server_.idle_reclaimed_ += reclaimed;
+    server_.idle_compacted_ += compacted;
+    LOG(DEBUG) << this << ": Session idle, released " << reclaimed
+               << " bytes, compacted " << compacted << " bytes";
+  }
+
+  const int interval = idle_interval(config);
+  evtimer_add(idle_ev_,
+              server_.common_timeout(static_cast<uint64_t>(interval) * 1000));
+}
+
+void Socks5Server::Session::buffer_limit_arm() {
+  // The kFIXED thresholds only ever change with the credit
+  const Config& config = server_.config();
+  if (config.buffer_mode != BufferMode::kADAPTIVE && config.budget == nullptr)
+    return;
+
+  if (buffer_limit_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+
+      reinterpret_cast<Session*>(arg)->buffer_limit_cb();
+    };
+    buffer_limit_ev_ = evtimer_new(base_, cb, this);
+    if (buffer_limit_ev_ == nullptr) {
+      LOG(WARNING) << this << ": Failed to allocate buffer limit timer";
+      return;
+    }
+    ::event_priority_set(buffer_limit_ev_, Priority::kTIMER);
+  }
+
+  evtimer_add(buffer_limit_ev_,
+              server_.common_timeout(kBufferLimitInterval * 1000));
+}
+
+void Socks5Server::Session::buffer_limit_cb() {
+  if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
+    return;
+
+  /*
+   * The relay path only updates the thresholds when data moves, which a
+   * throttled Session (or one that the peer stopped reading from) will not
+   * do, so the new BDP estimate/credit would otherwise never take effect.
+   */
+  const size_t outgoing_limit = outgoing_buffer_limit_;
+  const size_t incoming_limit = incoming_buffer_limit_;
+  update_buffer_limits(false);
+  incoming_enforce_limit(outgoing_buffer_limit_ != outgoing_limit);
+  outgoing_enforce_limit(incoming_buffer_limit_ != incoming_limit);
+
+  evtimer_add(buffer_limit_ev_,
+              server_.common_timeout(kBufferLimitInterval * 1000));
+}
+
+size_t Socks5Server::Session::release_idle_buffers() {
+  const size_t reclaimed = on_idle();
+
+  // Both are reallocated on demand
+  if (flight_ != nullptr && ::evbuffer_get_length(flight_) == 0) {
+    ::evbuffer_free(flight_);
+    flight_ = nullptr;
+  }
+  incoming_flow_.reclaim();
+  outgoing_flow_.reclaim();
+
+  return reclaimed;
+}
+
+bool Socks5Server::Session::idle_reclaim(size_t& reclaimed,
+                                         size_t& compacted) {
+  reclaimed = release_idle_buffers();
+
+  /*
+   * A partial frame left behind in a read buffer pins a chain that was sized
+   * for a full read, so copy small leftovers into a right sized chain.  Only
+   * the front of a socket bufferevent's input can be modified, hence the
+   * prepend.
+   */
+  compacted = 0;
+  struct bufferevent* bevs[] = { incoming_, outgoing_ };
+  for (auto bev : bevs) {
+    struct evbuffer* buf = ::bufferevent_get_input(bev);
+    const size_t len = ::evbuffer_get_length(buf);
+    if (len == 0 || len > kMaxIdleCompactSize)
+      continue;
+
+    uint8_t tmp[kMaxIdleCompactSize];
+    if (static_cast<int>(len) != ::evbuffer_remove(buf, tmp, len))
+      return false;
+    const bool ok = ::evbuffer_prepend(buf, tmp, len) == 0;
+    crypto::memwipe(tmp, len);
+    if (!ok)
+      return false;
+    compacted += len;
+  }
+
+  return true;
+}
+
+void Socks5Server::Session::incoming_flow_cb() {
+  // Backlogged Flows can outlive State::kESTABLISHED
+  if (state_ != State::kESTABLISHED)
+    return;
+
+  if (incoming_relay_cb_ != nullptr)
+    incoming_relay_cb_(incoming_, this);
+  else
+    incoming_read_established();
+}
+
+void Socks5Server::Session::outgoing_flow_cb() {
+  if (state_ != State::kESTABLISHED)
+    return;
+
+  if (outgoing_relay_cb_ != nullptr)
+    outgoing_relay_cb_(outgoing_, this);
+  else
+    outgoing_read_cb();
+}
+
+bool Socks5Server::Session::drain_flow(Shaper::Flow& flow,
+                                       bool (Session::*relay)()) {
+  if (!flow.backlogged())
+    return true;
+
+  flow.detach();
+  if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
+    return true;
+
+  return (this->*relay)();
 }
 
 bool Socks5Server::Session::send_socks5_response(const Reply reply) {
@@ -213,9 +1047,89 @@ bool Socks5Server::Session::send_socks5_response(const Reply reply) {
   size_t resp_len = 0;
 
   // Disarm the timer
-  if (connect_timer_ev_ != nullptr)
-    if (evtimer_pending(connect_timer_ev_, nullptr))
-      evtimer_del(connect_timer_ev_);
+  connect_timer_.cancel();
+
+  if (race_ev_ != nullptr)
+    evtimer_del(race_ev_);
+
+  // The handshake is over one way or another
+  server_.release_handshake(this);
+
+  // Warm pool and race fallback connections have no client to respond to
+  if (incoming_ == nullptr) {
+    if (race_partner_ != nullptr) {
+      Session* origin = race_partner_;
+      if (reply == Reply::kSUCCEDED && origin->state_ == State::kCONNECTING) {
+        LOG(INFO) << this << ": Fallback handshake won the race";
+        race_unlink();
+        Socks5Server& server = server_;
+        server.nr_race_fallback_wins_++;
+        state_ = State::kPOOLED;
+
+        /*
+         * origin's client is spliced onto this Session, which may be torn
+         * down if sending the SOCKS response fails.  origin is closed either
+         * way, without going through this.
+         */
+        const bool adopted = adopt_client(*origin);
+        server.close_session(origin);
+        return adopted;
+      }
+      race_fallback_failed();
+    } else if (reply == Reply::kSUCCEDED &&
+               pool_slot_ == PoolSlot::kWARMING) {
+      server_.pool_park(this);
+      return false;
+    }
+
+    // Callers may still touch the Session, so tear it down later
+    server_.pool_discard(this);
+    close_deferred();
+    return false;
+  }
+
+  // The race is over, the fallback is no longer needed
+  if (race_partner_ != nullptr) {
+    Session* fallback = race_partner_;
+    race_unlink();
+    server_.close_session(fallback);
+  }
+
+  // Embedded sessions report the result instead of sending a SOCKS reply
+  if (observer_ != nullptr) {
+    if (reply != Reply::kSUCCEDED) {
+      LOG(DEBUG) << this << ": Embedded handshake failed: "
+                 << static_cast<int>(reply);
+      ::bufferevent_disable(incoming_, EV_READ);
+      observer_->on_session_failed(this);
+      close_deferred();
+      return false;
+    }
+
+    state_ = State::kESTABLISHED;
+    on_established();
+    observer_->on_session_established(this);
+    return true;
+  }
+
+  if (early_response_sent_) {
+    if (reply != Reply::kSUCCEDED) {
+      /*
+       * The client was optimistically told that the connection succeeded, so
+       * there is no way to report the failure.  Just close the session.
+       */
+      LOG(WARNING) << this << ": Handshake failed after optimistic SOCKS "
+                   << "response, closing";
+      server_.close_session(this);
+      return false;
+    }
+
+    // Lift the cap on the data queued during the handshake
+    state_ = State::kESTABLISHED;
+    ::bufferevent_setwatermark(incoming_, EV_READ, 0, 0);
+    on_established();
+    return true;
+  }
 
   /*
    * +----+-----+-------+------+----------+----------+
@@ -231,47 +1145,10 @@ bool Socks5Server::Session::send_socks5_response(const Reply reply) {
   resp[1] = reply;
 
   if (reply == Reply::kSUCCEDED) {
-    // Get the locally bound address
-    struct sockaddr_storage addr;
-    evutil_socket_t fd = bufferevent_getfd(outgoing_);
-    socklen_t len = sizeof(addr);
-    int ret = ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr),
-                             &len);
-    if (ret == 0) {
-      switch (reinterpret_cast<struct sockaddr*>(&addr)->sa_family) {
-      case AF_INET:
-      {
-        CHECK_EQ(len, sizeof(struct sockaddr_in)) << this
-            << ": send_socks5_response(): Invalid IPv4 addr length: " << len;
-        const struct sockaddr_in* v4addr = reinterpret_cast<struct sockaddr_in*>(&addr);
-        resp_len = 10;
-        resp[3] = AddressType::kIPv4;
-        ::std::memcpy(resp + 4, &v4addr->sin_addr.s_addr, 4);
-        ::std::memcpy(resp + 8, &v4addr->sin_port, 2);
-        break;
-      }
-      case AF_INET6:
-      {
-        CHECK_EQ(len, sizeof(struct sockaddr_in6)) << this
-            << ": send_socks5_response(): Invalid IPv6 addr length: " << len;
-        const struct sockaddr_in6* v6addr = reinterpret_cast<struct sockaddr_in6*>(&addr);
-        resp_len = 22;
-        resp[3] = AddressType::kIPv6;
-        ::std::memcpy(resp + 4, &v6addr->sin6_addr.s6_addr, 16);
-        ::std::memcpy(resp + 20, &v6addr->sin6_port, 2);
-        break;
-      }
-      default:
-        // This should never happen
-        LOG(ERROR) << this << ": getsockname() returned a invalid address, closing";
-        return send_socks5_response(Reply::kGENERAL_FAILURE);
-      }
-
-      state_ = State::kESTABLISHED;
-    } else {
-      PLOG(ERROR) << "Failed to getsockname() outgoing";
+    if (!get_bound_addr(resp, resp_len))
       return send_socks5_response(Reply::kGENERAL_FAILURE);
-    }
+
+    state_ = State::kESTABLISHED;
   } else {
     /* Just send a IPv4 address back on failure */
     resp_len = 10;
@@ -289,15 +1166,169 @@ bool Socks5Server::Session::send_socks5_response(const Reply reply) {
     server_.close_session(this);
     return false;
   } else if (state_ == State::kESTABLISHED) {
-    ::bufferevent_enable(incoming_, EV_READ);
-    LOG(INFO) << this << ": Connection setup complete "
-              << client_addr_str_ << " <-> " << remote_addr_str_;
+    on_established();
+    return true;
+  }
+
+  return false;
+}
+
+bool Socks5Server::Session::send_socks5_early_response() {
+  SL_ASSERT(state_ == State::kCONNECTING);
+  SL_ASSERT(!early_response_sent_);
+
+  uint8_t resp[22] = { 0 };
+  size_t resp_len = 0;
+
+  resp[0] = kSocksVersion;
+  resp[1] = Reply::kSUCCEDED;
+  if (!get_bound_addr(resp, resp_len))
+    return send_socks5_response(Reply::kGENERAL_FAILURE);
+
+  if (0 != ::bufferevent_write(incoming_, resp, resp_len)) {
+    LOG(ERROR) << this << ": Failed to write SOCKS response, closing";
+    server_.close_session(this);
+    return false;
+  }
+
+  /*
+   * Start reading from the client, but only queue up to kMaxEarlyDataSize
+   * bytes till the transport handshake completes.  The data is left in
+   * incoming_'s read buffer and processed once the session is established.
+   */
+  early_response_sent_ = true;
+  ::bufferevent_setwatermark(incoming_, EV_READ, 0, kMaxEarlyDataSize);
+  ::bufferevent_enable(incoming_, EV_READ);
+
+  LOG(DEBUG) << this << ": Sent optimistic SOCKS response";
+
+  return true;
+}
+
+bool Socks5Server::Session::get_bound_addr(uint8_t* resp,
+                                           size_t& resp_len) {
+  // Get the locally bound address
+  struct sockaddr_storage addr;
+  evutil_socket_t fd = bufferevent_getfd(outgoing_);
+  socklen_t len = sizeof(addr);
+  int ret = ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                           &len);
+  if (ret != 0) {
+    PLOG(ERROR) << "Failed to getsockname() outgoing";
+    return false;
+  }
+
+  switch (reinterpret_cast<struct sockaddr*>(&addr)->sa_family) {
+  case AF_INET:
+  {
+    CHECK_EQ(len, sizeof(struct sockaddr_in)) << this
+        << ": send_socks5_response(): Invalid IPv4 addr length: " << len;
+    const struct sockaddr_in* v4addr = reinterpret_cast<struct sockaddr_in*>(&addr);
+    resp_len = 10;
+    resp[3] = AddressType::kIPv4;
+    ::std::memcpy(resp + 4, &v4addr->sin_addr.s_addr, 4);
+    ::std::memcpy(resp + 8, &v4addr->sin_port, 2);
     return true;
   }
+  case AF_INET6:
+  {
+    CHECK_EQ(len, sizeof(struct sockaddr_in6)) << this
+        << ": send_socks5_response(): Invalid IPv6 addr length: " << len;
+    const struct sockaddr_in6* v6addr = reinterpret_cast<struct sockaddr_in6*>(&addr);
+    resp_len = 22;
+    resp[3] = AddressType::kIPv6;
+    ::std::memcpy(resp + 4, &v6addr->sin6_addr.s6_addr, 16);
+    ::std::memcpy(resp + 20, &v6addr->sin6_port, 2);
+    return true;
+  }
+  default:
+    // This should never happen
+    LOG(ERROR) << this << ": getsockname() returned a invalid address, closing";
+  }
 
   return false;
 }
 
+void Socks5Server::Session::set_priority(const Priority priority) {
+  if (incoming_ != nullptr)
+    ::bufferevent_priority_set(incoming_, priority);
+  if (outgoing_ != nullptr)
+    ::bufferevent_priority_set(outgoing_, priority);
+}
+
+void Socks5Server::Session::on_established() {
+  // Relayed data must never be held back
+  if (outgoing_corked_) {
+    net::set_tcp_cork(outgoing_fd(), false);
+    outgoing_corked_ = false;
+  }
+
+#ifdef ENABLE_IO_URING
+  io_uring_attach();
+#endif
+  shaper_attach();
+  idle_arm();
+  buffer_limit_arm();
+  set_priority(Priority::kRELAY);
+
+  LOG(INFO) << this << ": Connection setup complete "
+            << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+  release_handshake_state();
+
+  // Switch to the statically dispatched relay callbacks if available
+  incoming_setcb(incoming_relay_cb_);
+  outgoing_setcb(outgoing_relay_cb_);
+  ::bufferevent_enable(incoming_, EV_READ);
+
+  // Data pipelined behind the request will not trigger a read callback
+  if (::evbuffer_get_length(::bufferevent_get_input(incoming_)) > 0)
+    incoming_kick();
+}
+
+void Socks5Server::Session::release_handshake_state() {
+  // None of this is used once the Session is established
+  connect_timer_.cancel();
+  if (race_ev_ != nullptr) {
+    ::event_free(race_ev_);
+    race_ev_ = nullptr;
+  }
+  if (!auth_creds_.empty()) {
+    crypto::memwipe(&auth_creds_[0], auth_creds_.size());
+    ::std::string().swap(auth_creds_);
+  }
+  addrs_.reset();
+}
+
+bool Socks5Server::Session::flight_add(const void* buf,
+                                       const size_t len) {
+  if (len == 0)
+    return true;
+
+  struct evbuffer* buffer = flight();
+  if (buffer == nullptr)
+    return false;
+
+  return ::evbuffer_add(buffer, buf, len) == 0;
+}
+
+struct evbuffer* Socks5Server::Session::flight() {
+  // Lazy allocation, the buffer is reused for the lifetime of the Session
+  if (flight_ == nullptr)
+    flight_ = ::evbuffer_new();
+
+  return flight_;
+}
+
+bool Socks5Server::Session::flight_commit() {
+  if (flight_ == nullptr || ::evbuffer_get_length(flight_) == 0)
+    return true;
+  if (outgoing_ == nullptr)
+    return false;
+
+  // This moves the chains over to outgoing_ without copying
+  return ::bufferevent_write_buffer(outgoing_, flight_) == 0;
+}
+
 const char* Socks5Server::Session::state_string() const {
   switch (state_) {
   case State::kINVALID: return "kINVALID";
@@ -308,6 +1339,7 @@ const char* Socks5Server::Session::state_string() const {
   case State::kESTABLISHED: return "kESTABLISHED";
   case State::kFLUSHING_INCOMING: return "kFLUSHING_INCOMING";
   case State::kFLUSHING_OUTGOING: return "kFLUSHING_OUTGOING";
+  case State::kPOOLED: return "kPOOLED";
   }
 
   /* Should *NEVER* happen */
@@ -319,29 +1351,84 @@ void Socks5Server::Session::incoming_read_cb() {
   if (!incoming_valid_)
     return;
 
+  /*
+   * Clients are allowed to pipeline the negotiation (method selection,
+   * authentication, and the request may all arrive in a single segment), so
+   * keep going till a handler runs out of complete messages.  Handlers return
+   * false if the session was closed, so state_ is only examined on progress.
+   */
+  // Queued for admission, leave the data till the handshake completes
+  if (handshake_slot_ == HandshakeSlot::kQUEUED)
+    return;
+
+  bool progress = true;
+  while (progress) {
+    switch (state_) {
+    case State::kREAD_METHODS:
+      progress = incoming_read_methods_cb();
+      break;
+    case State::kAUTHENTICATING:
+      progress = incoming_read_auth_cb();
+      break;
+    case State::kREAD_REQUEST:
+      progress = incoming_read_request_cb();
+      break;
+    default:
+      progress = false;
+      incoming_read_established();
+    }
+  }
+}
+
+void Socks5Server::Session::incoming_read_established() {
   switch (state_) {
-  case State::kREAD_METHODS:
-    incoming_read_methods_cb();
-    break;
-  case State::kAUTHENTICATING:
-    incoming_read_auth_cb();
-    break;
-  case State::kREAD_REQUEST:
-    incoming_read_request_cb();
+  case State::kCONNECTING:
+    // Optimistic mode, queued till the handshake completes
+    SL_ASSERT(early_response_sent_);
     break;
-  case State::kESTABLISHED:
+  case State::kESTABLISHED: {
     // Pass it onto the filter
     if (!outgoing_valid_)
       return;
-    if (on_incoming_data())
-      incoming_apply_backpressure();
+    if (!incoming_flow_.begin(incoming_))
+      return;
+    struct evbuffer* buf = ::bufferevent_get_input(incoming_);
+    const size_t len = ::evbuffer_get_length(buf);
+    if (on_incoming_data()) {
+      incoming_flow_.end(incoming_);
+      incoming_apply_backpressure(len != ::evbuffer_get_length(buf));
+    }
     break;
+  }
   default:
     LOG(FATAL) << this << ": incoming_read_cb() Invalid state: " << state_string();
   }
 }
 
-void Socks5Server::Session::incoming_read_methods_cb() {
+void Socks5Server::Session::incoming_kick() {
+  if (incoming_kick_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+
+      // Through the scheduled relay path, which ignores torn down Sessions
+      reinterpret_cast<Session*>(arg)->incoming_flow_cb();
+    };
+    incoming_kick_ev_ = ::event_new(base_, -1, 0, cb, this);
+    if (incoming_kick_ev_ == nullptr) {
+      // Not fatal, the data will get processed on the next read
+      LOG(WARNING) << this << ": Failed to allocate kick event";
+      return;
+    }
+    ::event_priority_set(incoming_kick_ev_, Priority::kRELAY);
+  }
+
+  ::event_active(incoming_kick_ev_, EV_READ, 0);
+}
+
+bool Socks5Server::Session::incoming_read_methods_cb() {
   CHECK(!outgoing_valid_) << this
       << ":incoming_read_methods_cb(): Expected outgoing_ to be invalid";
 
@@ -355,24 +1442,28 @@ void Socks5Server::Session::incoming_read_methods_cb() {
 
   struct evbuffer* buf = ::bufferevent_get_input(incoming_);
   const size_t len = ::evbuffer_get_length(buf);
-  if (len < 2)
-    return;
+  uint8_t hdr[2];
+  if (len < sizeof(hdr))
+    return false;
 
-  const uint8_t* p = ::evbuffer_pullup(buf, len);
-  if (p == nullptr) {
-    LOG(ERROR) << this << ": Failed to pullup buffer";
+  // Only linearize the message itself, not whatever is pipelined behind it
+  ::evbuffer_copyout(buf, hdr, sizeof(hdr));
+  if (hdr[0] != kSocksVersion) {
+    LOG(WARNING) << this << ": Invalid SOCKS protocol version: " << hdr[0];
     server_.close_session(this);
-    return;
+    return false;
   }
+  const uint8_t nmethods = hdr[1];
+  const size_t msg_len = 2 + nmethods;
+  if (len < msg_len)
+    return false;
 
-  if (p[0] != kSocksVersion) {
-    LOG(WARNING) << this << ": Invalid SOCKS protocol version: " << p[0];
+  const uint8_t* p = ::evbuffer_pullup(buf, msg_len);
+  if (p == nullptr) {
+    LOG(ERROR) << this << ": Failed to pullup buffer";
     server_.close_session(this);
-    return;
+    return false;
   }
-  const uint8_t nmethods = p[1];
-  if (len < static_cast<size_t>(2 + nmethods))
-    return;
 
   bool can_none = false;
   bool can_username_password = false;
@@ -394,7 +1485,7 @@ void Socks5Server::Session::incoming_read_methods_cb() {
     else {
       LOG(WARNING) << this << ": Failed to negotiate compatible auth";
       server_.close_session(this);
-      return;
+      return false;
     }
   } else if (can_none)
     auth_method_ = AuthMethod::kNONE_REQUIRED;
@@ -405,24 +1496,84 @@ void Socks5Server::Session::incoming_read_methods_cb() {
   if (0 != ::bufferevent_write(incoming_, method, sizeof(method))) {
     LOG(ERROR) << this << ": Failed to write auth method, closing";
     server_.close_session(this);
-    return;
+    return false;
   }
 
-  ::evbuffer_drain(buf, 2 + nmethods);
+  ::evbuffer_drain(buf, msg_len);
   switch (auth_method_) {
   case AuthMethod::kNONE_REQUIRED:
     state_ = State::kREAD_REQUEST;
-    break;
+    return true;
   case AuthMethod::kUSERNAME_PASSWORD:
     state_ = State::kAUTHENTICATING;
-    break;
+    return true;
   default:
     LOG(WARNING) << this << ": No suitable auth methods, closing";
     state_ = State::kFLUSHING_INCOMING;
   }
+
+  return false;
+}
+
+bool Socks5Server::Session::authenticate(const uint8_t* uname,
+                                         const uint8_t ulen,
+                                         const uint8_t* passwd,
+                                         const uint8_t plen) {
+  if (server_.config().shaper == nullptr)
+    return on_client_authenticate(uname, ulen, passwd, plen);
+
+  /*
+   * The client splits the bridge line arguments across UNAME and PASSWD, so
+   * jam them back together, trimming the NUL padding like the transports do.
+   */
+  crypto::SecureBuffer args(static_cast<size_t>(ulen) + plen, 0);
+  if (uname != nullptr)
+    ::std::memcpy(&args[0], uname, ulen);
+  if (passwd != nullptr)
+    ::std::memcpy(&args[ulen], passwd, plen);
+  while (!args.empty() && args.back() == '\0')
+    args.pop_back();
+
+  // Pull out the rate limit arguments ("k=v;k=v", '\' escapes ';')
+  crypto::SecureBuffer rest;
+  size_t start = 0;
+  while (start < args.size()) {
+    size_t end = start;
+    while (end < args.size() && args[end] != ';')
+      end += (args[end] == '\\') ? 2 : 1;
+    end = ::std::min(end, args.size());
+
+    const uint8_t* arg = args.data() + start;
+    const size_t arg_len = end - start;
+    int ret = parse_size_arg(arg, arg_len, "rate-limit=", bridge_rate_.rate);
+    if (ret == 0)
+      ret = parse_size_arg(arg, arg_len, "rate-burst=", bridge_rate_.burst);
+    if (ret < 0) {
+      LOG(WARNING) << this << ": Invalid rate limit argument";
+      return false;
+    } else if (ret == 0) {
+      if (!rest.empty())
+        rest.push_back(';');
+      rest.append(arg, arg_len);
+    }
+    start = end + 1;
+  }
+
+  if (rest.size() == args.size())
+    return on_client_authenticate(uname, ulen, passwd, plen);
+
+  // Split the rest the same way the client would have
+  const uint8_t rest_ulen = static_cast<uint8_t>(::std::min<size_t>(
+      rest.size(), 255));
+  const uint8_t rest_plen = static_cast<uint8_t>(rest.size() - rest_ulen);
+  return on_client_authenticate(rest_ulen > 0 ? rest.data() : nullptr,
+                                rest_ulen,
+                                rest_plen > 0 ? rest.data() + rest_ulen :
+                                    nullptr,
+                                rest_plen);
 }
 
-void Socks5Server::Session::incoming_read_auth_cb() {
+bool Socks5Server::Session::incoming_read_auth_cb() {
   CHECK_EQ(auth_method_, AuthMethod::kUSERNAME_PASSWORD) << this
       << ": incoming_read_auth_cb(): Invalid auth method: " << auth_method_;
   CHECK(!outgoing_valid_) << this
@@ -438,61 +1589,77 @@ void Socks5Server::Session::incoming_read_auth_cb() {
 
   struct evbuffer* buf = ::bufferevent_get_input(incoming_);
   const size_t len = ::evbuffer_get_length(buf);
-  if (len < 2)
-    return;
+  uint8_t hdr[2];
+  const uint8_t* p = nullptr;
+  if (len < sizeof(hdr))
+    return false;
 
-  const uint8_t* p = ::evbuffer_pullup(buf, len);
-  if (p == nullptr) {
-    LOG(ERROR) << this << ": Failed to pullup buffer";
+  ::evbuffer_copyout(buf, hdr, sizeof(hdr));
+
+  // Version
+  if (hdr[0] != 0x01) {
+    LOG(WARNING) << this << ": Invalid SOCKS auth version: " << hdr[0];
 out_fail:
     // Send a failure response
     const uint8_t resp[2] = { 0x01, 0xff };
     if (0 != ::bufferevent_write(incoming_, resp, sizeof(resp))) {
       LOG(ERROR) << this << ": Failed to write auth response, closing";
       server_.close_session(this);
-      return;
+      return false;
     }
 
     state_ = State::kFLUSHING_INCOMING;
-    return;
+    return false;
   }
 
-  // Version
-  if (p[0] != 0x01) {
-    LOG(WARNING) << this << ": Invalid SOCKS auth version: " << p[0];
+  // Username (The PLEN byte is included so it can be examined)
+  const uint8_t ulen = hdr[1];
+  if (len < static_cast<size_t>(2 + ulen + 1))
+    return false;
+  p = ::evbuffer_pullup(buf, 2 + ulen + 1);
+  if (p == nullptr) {
+    LOG(ERROR) << this << ": Failed to pullup buffer";
     goto out_fail;
   }
 
-  // Username
-  const uint8_t ulen = p[1];
-  if (len < static_cast<size_t>(2 + ulen + 1))
-    return;
-  const uint8_t* uname = (ulen > 0) ? p + 2 : nullptr;
-
   // Password
   const uint8_t plen = p[2 + ulen];
-  if (len < static_cast<size_t>(2 + ulen + 1 + plen))
-    return;
+  const size_t msg_len = 2 + ulen + 1 + plen;
+  if (len < msg_len)
+    return false;
+  p = ::evbuffer_pullup(buf, msg_len);
+  if (p == nullptr) {
+    LOG(ERROR) << this << ": Failed to pullup buffer";
+    goto out_fail;
+  }
+  const uint8_t* uname = (ulen > 0) ? p + 2 : nullptr;
   const uint8_t* passwd = (plen > 0) ? p + 2 + ulen + 1 : nullptr;
 
-  if (!on_client_authenticate(uname, ulen, passwd, plen)) {
+  if (!authenticate(uname, ulen, passwd, plen)) {
     LOG(WARNING) << this << ": Authentication failed, closing";
     goto out_fail;
   }
 
   LOG(DEBUG) << this << ": Authenticated";
 
+  // Warm/fallback connections need to authenticate the same way
+  if (server_.config().warm_pool_size > 0 ||
+      server_.config().handshake_race_delay > 0)
+    auth_creds_.assign(reinterpret_cast<const char*>(p + 1), msg_len - 1);
+
   const uint8_t resp[2] = { 0x01, 0x00 };
   if (0 != ::bufferevent_write(incoming_, resp, sizeof(resp))) {
     LOG(ERROR) << this << ": Failed to write auth response, closing";
     server_.close_session(this);
-    return;
+    return false;
   }
-  ::evbuffer_drain(buf, 2 + ulen + 1 + plen);
+  ::evbuffer_drain(buf, msg_len);
   state_ = State::kREAD_REQUEST;
+
+  return true;
 }
 
-void Socks5Server::Session::incoming_read_request_cb() {
+bool Socks5Server::Session::incoming_read_request_cb() {
   CHECK_EQ(state_, State::kREAD_REQUEST) << this
       << ": incoming_read_request_cb(): Invalid state: " << state_string();
   CHECK(!outgoing_valid_) << this
@@ -508,49 +1675,46 @@ void Socks5Server::Session::incoming_read_request_cb() {
 
   struct evbuffer* buf = ::bufferevent_get_input(incoming_);
   const size_t len = ::evbuffer_get_length(buf);
+  uint8_t p[22];
   if (len < 4)
-    return;
+    return false;
 
   size_t to_drain = 4;
 
-  const uint8_t* p = ::evbuffer_pullup(buf, len);
-  if (p == nullptr) {
-    LOG(ERROR) << this << ": Failed to pullup buffer";
-    send_socks5_response(Reply::kGENERAL_FAILURE);
-    return;
-  }
+  // The request is at most 22 bytes, so just copy it out
+  ::evbuffer_copyout(buf, p, ::std::min(len, sizeof(p)));
 
   if (p[0] != kSocksVersion) {
     LOG(WARNING) << this << ": Invalid SOCKS protocol version: " << p[0];
     send_socks5_response(Reply::kGENERAL_FAILURE);
-    return;
+    return false;
   }
   if (p[1] != Command::kCONNECT) {
     LOG(WARNING) << this << ": Invalid SOCKS command: " << p[1];
     send_socks5_response(Reply::kCOMMAND_NOT_SUPP);
-    return;
+    return false;
   }
   if (p[2] != 0x00) {
     LOG(WARNING) << this << ": Invalid SOCKS reserved field: " << p[2];
     send_socks5_response(Reply::kGENERAL_FAILURE);
-    return;
+    return false;
   }
   if (p[3] == AddressType::kIPv4) {
     if (len < 10)
-      return;
+      return false;
 
-    struct sockaddr_in* v4addr = reinterpret_cast<struct sockaddr_in*>(&remote_addr_);
-    remote_addr_len_ = sizeof(struct sockaddr_in);
+    struct sockaddr_in* v4addr = reinterpret_cast<struct sockaddr_in*>(&addrs_->remote_addr);
+    addrs_->remote_addr_len = sizeof(struct sockaddr_in);
     v4addr->sin_family = AF_INET;
     ::std::memcpy(&v4addr->sin_addr.s_addr, p + 4, 4);
     ::std::memcpy(&v4addr->sin_port, p + 4 + 4, 2);
     to_drain += 6;
   } else if (p[3] == AddressType::kIPv6) {
     if (len < 22)
-      return;
+      return false;
 
-    struct sockaddr_in6* v6addr = reinterpret_cast<struct sockaddr_in6*>(&remote_addr_);
-    remote_addr_len_ = sizeof(struct sockaddr_in6);
+    struct sockaddr_in6* v6addr = reinterpret_cast<struct sockaddr_in6*>(&addrs_->remote_addr);
+    addrs_->remote_addr_len = sizeof(struct sockaddr_in6);
     v6addr->sin6_family = AF_INET6;
     ::std::memcpy(&v6addr->sin6_addr.s6_addr, p + 4, 16);
     ::std::memcpy(&v6addr->sin6_port, p + 4 + 16, 2);
@@ -558,24 +1722,73 @@ void Socks5Server::Session::incoming_read_request_cb() {
   } else {
     LOG(WARNING) << this << ": Invalid SOCKS address type: " << p[3];
     send_socks5_response(Reply::kADDR_NOT_SUPP);
-    return;
+    return false;
   }
 
-  remote_addr_str_ = addr_to_string(reinterpret_cast<struct sockaddr*>(&remote_addr_),
+  addrs_->remote_addr_str = addr_to_string(reinterpret_cast<struct sockaddr*>(&addrs_->remote_addr),
                                 scrub_addrs_);
 
   LOG(INFO) << this << ": Connecting to peer "
-            << client_addr_str_ << " <-> " << remote_addr_str_;
+            << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
 
-  // Connect
   ::evbuffer_drain(buf, to_drain);
+  ::bufferevent_disable(incoming_, EV_READ);
+
+  // Skip the connect and handshake if there is a warm connection
+  if (server_.config().warm_pool_size > 0) {
+    const ::std::string key = pool_key();
+    Session* warm = server_.pool_take(key);
+    if (warm != nullptr) {
+      /*
+       * The client is moved to warm even if the SOCKS response can not be
+       * sent (and warm is torn down), so there is nothing to fall back to.
+       */
+      if (!warm->adopt_client(*this))
+        LOG(WARNING) << this << ": Failed to use warm connection, closing";
+      server_.pool_refill(*this, key);
+      server_.close_session(this);
+      return false;
+    }
+    server_.pool_refill(*this, key);
+  }
+
+  // Wait for a handshake slot
+  if (!server_.admit_handshake(this)) {
+    LOG(WARNING) << this << ": Handshake admission queue full, rejecting";
+    send_socks5_response(Reply::kGENERAL_FAILURE);
+    return false;
+  }
+  if (handshake_slot_ == HandshakeSlot::kACTIVE) {
+    start_connect();
+  } else {
+    /*
+     * Keep reading while queued so that a client that gives up is noticed
+     * (incoming_event_cb() closes the Session, which dequeues it).  Anything
+     * the client sends is left in incoming_'s read buffer, capped at
+     * kMaxEarlyDataSize.
+     */
+    ::bufferevent_setwatermark(incoming_, EV_READ, 0, kMaxEarlyDataSize);
+    ::bufferevent_enable(incoming_, EV_READ);
+  }
+
+  // Anything pipelined behind the request is handled once established
+  return false;
+}
+
+void Socks5Server::Session::start_connect() {
+  SL_ASSERT(handshake_slot_ == HandshakeSlot::kACTIVE);
+
+  // Undo the read side setup done while queued for admission
+  ::bufferevent_disable(incoming_, EV_READ);
+  ::bufferevent_setwatermark(incoming_, EV_READ, 0, 0);
+
+  // Connect
   if (!outgoing_connect()) {
     LOG(ERROR) << this << ": Failed to start connecting, closing";
     send_socks5_response(Reply::kGENERAL_FAILURE);
     return;
   }
 
-  ::bufferevent_disable(incoming_, EV_READ);
   if (outgoing_ != nullptr)
     ::bufferevent_disable(outgoing_, EV_READ);
 }
@@ -589,9 +1802,11 @@ void Socks5Server::Session::connect_timeout_cb() {
 }
 
 void Socks5Server::Session::incoming_write_cb() {
-  if (state_ == State::kESTABLISHED)
-    incoming_apply_backpressure();
-  else if (state_ == State::kFLUSHING_INCOMING) {
+  // incoming_ draining is what unthrottles outgoing->incoming
+  if (state_ == State::kESTABLISHED) {
+    outgoing_apply_backpressure();
+    outgoing_flow_.wake();
+  } else if (state_ == State::kFLUSHING_INCOMING) {
     LOG(INFO) << this << ": Session closed";
     server_.close_session(this);
     return;
@@ -600,10 +1815,15 @@ void Socks5Server::Session::incoming_write_cb() {
 
 void Socks5Server::Session::incoming_event_cb(const short events) {
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    // Relay what the scheduler was holding back first
+    if (!drain_flow(incoming_flow_, &Session::on_incoming_data))
+      return;
     incoming_valid_ = false;
-    const struct evbuffer* buf = ::bufferevent_get_output(outgoing_);
-    if (!outgoing_valid_ || (::evbuffer_get_length(buf) == 0 &&
-                             !on_outgoing_flush())) {
+
+    // outgoing_ does not exist yet if the client gave up before connecting
+    if (!outgoing_valid_ ||
+        (::evbuffer_get_length(::bufferevent_get_output(outgoing_)) == 0 &&
+         on_outgoing_flush())) {
       // Outgoing is invalid or fully flushed, done!
       LOG(INFO) << this << ": Session closed";
       server_.close_session(this);
@@ -624,95 +1844,85 @@ void Socks5Server::Session::outgoing_connect_cb(const short events) {
       << ": outgoing_connect_cb(): Invalid state: " << state_string();
 
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-    const auto err = EVUTIL_SOCKET_ERROR();
-    switch (err) {
-    case ENETUNREACH:
-      LOG(WARNING) << this << ": Peer network unreachable "
-                   << client_addr_str_ << " <-> " << remote_addr_str_;
-      send_socks5_response(Reply::kNETWORK_UNREACHABLE);
-      break;
-    case EHOSTUNREACH:
-      LOG(WARNING) << this << ": Peer host unreachable "
-                             << client_addr_str_ << " <-> " << remote_addr_str_;
-      send_socks5_response(Reply::kHOST_UNREACHABLE);
-      break;
-    case ECONNREFUSED:
-      LOG(WARNING) << this << ": Peer refused connection "
-                   << client_addr_str_ << " <-> " << remote_addr_str_;
-      send_socks5_response(Reply::kCONNECTION_REFUSED);
-      break;
-    case ETIMEDOUT:
-      LOG(WARNING) << this << ": Peer connection timedout "
-                   << client_addr_str_ << " <-> " << remote_addr_str_;
-      send_socks5_response(Reply::kTTL_EXPIRED);
-      break;
-    default:
-      LOG(WARNING) << this << ": Peer connection failed: " << err << " "
-                   << client_addr_str_ << " <-> " << remote_addr_str_;
-      send_socks5_response(Reply::kGENERAL_FAILURE);
-    }
+    /*
+     * errno is only meaningful for an error.  A TCP Fast Open connection
+     * that was refused shows up as EOF (the RST consumes SO_ERROR), so an
+     * EOF before the peer said anything is reported as refused.
+     */
+    outgoing_connect_failed((events & BEV_EVENT_ERROR) ?
+                            EVUTIL_SOCKET_ERROR() : ECONNREFUSED);
 
     // Flush the reply
     outgoing_event_cb(events);
   } else if (events & BEV_EVENT_CONNECTED) {
-    // Initialize the handshake timeout
-    event_callback_fn timeoutcb = [](evutil_socket_t sock,
-                                     short which,
-                                     void* arg) {
-      (void)sock;
-      (void)which;
-
-      reinterpret_cast<Session*>(arg)->connect_timeout_cb();
-    };
-    SL_ASSERT(connect_timer_ev_ == nullptr);
-    connect_timer_ev_ = evtimer_new(base_, timeoutcb, this);
-    if (connect_timer_ev_ == nullptr) {
-      LOG(ERROR) << this << ": Failed to allocate timeout timer, closing";
-      send_socks5_response(Reply::kGENERAL_FAILURE);
-      return;
-    }
-
     // Arm the handshake timeout
     crypto::RandOpenSSL rand;
     ::std::uniform_int_distribution<uint32_t> alpha(0, kConnectTimeout);
-    struct timeval tv;
-    tv.tv_sec = kConnectTimeout + alpha(rand);
-    tv.tv_usec = 0;
-    evtimer_add(connect_timer_ev_, &tv);
-    LOG(INFO) << this << ": Randomizing connect timeout: " << tv.tv_sec << " sec";
+    const uint32_t timeout = kConnectTimeout + alpha(rand);
+    if (!server_.connect_wheel_.add(connect_timer_, timeout * 1000000)) {
+      LOG(ERROR) << this << ": Failed to arm timeout timer, closing";
+      send_socks5_response(Reply::kGENERAL_FAILURE);
+      return;
+    }
+    LOG(INFO) << this << ": Randomizing connect timeout: " << timeout << " sec";
 
     // Setup the bufferevents
-    bufferevent_data_cb readcb = [](struct bufferevent* bev,
-                                    void* ctx) {
-      (void)bev;
-
-      reinterpret_cast<Session*>(ctx)->outgoing_read_cb();
-    };
-    bufferevent_data_cb writecb = [](struct bufferevent* bev,
-                                     void* ctx) {
-      (void)bev;
-
-      reinterpret_cast<Session*>(ctx)->outgoing_write_cb();
-    };
-    bufferevent_event_cb eventcb = [](struct bufferevent* bev,
-                                      short events,
-                                      void* ctx) {
-      (void)bev;
-
-      reinterpret_cast<Session*>(ctx)->outgoing_event_cb(events);
-    };
     ::bufferevent_enable(outgoing_, EV_READ | EV_WRITE);
-    ::bufferevent_setcb(outgoing_, readcb, writecb, eventcb, this);
+    outgoing_setcb(nullptr);
+    set_dead_peer_detection();
 
     LOG(DEBUG) << this << ": Connected "
-               << client_addr_str_ << " <-> " << remote_addr_str_;
+               << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
 
     outgoing_valid_ = true;
-    on_outgoing_connected();
+
+    // Hold back partial segments till the handshake flight is written
+    if (server_.config().tcp_cork && observer_ == nullptr) {
+      outgoing_corked_ = net::set_tcp_cork(outgoing_fd(), true);
+      if (!outgoing_corked_)
+        LOG(DEBUG) << this << ": Failed to cork outgoing connection";
+    }
+
+    if (!on_outgoing_connected())
+      return;
+
+    // Tell the client to start sending data if the handshake is incomplete
+    if (server_.config().optimistic_socks && state_ == State::kCONNECTING &&
+        incoming_ != nullptr && observer_ == nullptr)
+      send_socks5_early_response();
     return;
   }
 }
 
+void Socks5Server::Session::outgoing_connect_failed(const int err) {
+  switch (err) {
+  case ENETUNREACH:
+    LOG(WARNING) << this << ": Peer network unreachable "
+                 << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+    send_socks5_response(Reply::kNETWORK_UNREACHABLE);
+    break;
+  case EHOSTUNREACH:
+    LOG(WARNING) << this << ": Peer host unreachable "
+                 << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+    send_socks5_response(Reply::kHOST_UNREACHABLE);
+    break;
+  case ECONNREFUSED:
+    LOG(WARNING) << this << ": Peer refused connection "
+                 << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+    send_socks5_response(Reply::kCONNECTION_REFUSED);
+    break;
+  case ETIMEDOUT:
+    LOG(WARNING) << this << ": Peer connection timedout "
+                 << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+    send_socks5_response(Reply::kTTL_EXPIRED);
+    break;
+  default:
+    LOG(WARNING) << this << ": Peer connection failed: " << err << " "
+                 << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+    send_socks5_response(Reply::kGENERAL_FAILURE);
+  }
+}
+
 void Socks5Server::Session::outgoing_read_cb() {
   if (!outgoing_valid_)
     return;
@@ -721,22 +1931,64 @@ void Socks5Server::Session::outgoing_read_cb() {
   case State::kCONNECTING:
     on_outgoing_data_connecting();
     break;
-  case State::kESTABLISHED:
+  case State::kESTABLISHED: {
     // Pass it onto the filter
     if (!incoming_valid_)
       return;
-    if (on_outgoing_data())
-      outgoing_apply_backpressure();
+    if (!outgoing_flow_.begin(outgoing_))
+      return;
+    struct evbuffer* buf = ::bufferevent_get_input(outgoing_);
+    const size_t len = ::evbuffer_get_length(buf);
+    if (on_outgoing_data()) {
+      outgoing_flow_.end(outgoing_);
+      outgoing_apply_backpressure(len != ::evbuffer_get_length(buf));
+    }
+    break;
+  }
+  case State::kPOOLED:
+    // Held till a client is spliced on
     break;
   default:
     LOG(FATAL) << this << ": outgoing_read_cb() Invalid state: " << state_string();
   }
 }
 
+void Socks5Server::Session::outgoing_kick() {
+  if (outgoing_kick_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+
+      // Through the scheduled relay path, which ignores torn down Sessions
+      reinterpret_cast<Session*>(arg)->outgoing_flow_cb();
+    };
+    outgoing_kick_ev_ = ::event_new(base_, -1, 0, cb, this);
+    if (outgoing_kick_ev_ == nullptr) {
+      // Not fatal, the data will get processed on the next read
+      LOG(WARNING) << this << ": Failed to allocate kick event";
+      return;
+    }
+    ::event_priority_set(outgoing_kick_ev_, Priority::kRELAY);
+  }
+
+  ::event_active(outgoing_kick_ev_, EV_READ, 0);
+}
+
 void Socks5Server::Session::outgoing_write_cb() {
-  if (state_ == State::kCONNECTING || state_ == State::kESTABLISHED)
-    outgoing_apply_backpressure();
-  else if (state_ == State::kFLUSHING_OUTGOING && on_outgoing_flush()) {
+  // The first flight was written to the socket, push it out
+  if (outgoing_corked_ &&
+      ::evbuffer_get_length(::bufferevent_get_output(outgoing_)) == 0) {
+    net::set_tcp_cork(outgoing_fd(), false);
+    outgoing_corked_ = false;
+  }
+
+  // outgoing_ draining is what unthrottles incoming->outgoing
+  if (state_ == State::kCONNECTING || state_ == State::kESTABLISHED) {
+    incoming_apply_backpressure();
+    incoming_flow_.wake();
+  } else if (state_ == State::kFLUSHING_OUTGOING && on_outgoing_flush()) {
     LOG(INFO) << this << ": Session closed";
     server_.close_session(this);
     return;
@@ -744,7 +1996,57 @@ void Socks5Server::Session::outgoing_write_cb() {
 }
 
 void Socks5Server::Session::outgoing_event_cb(const short events) {
+  // Grab errno before anything (Eg: logging) can clobber it
+  const int err = (events & BEV_EVENT_ERROR) ? EVUTIL_SOCKET_ERROR() : 0;
+
+  // Keepalive/TCP_USER_TIMEOUT expiry, the bridge went away without a word
+  if (err == ETIMEDOUT &&
+      (state_ == State::kESTABLISHED || state_ == State::kPOOLED)) {
+    LOG(INFO) << this << ": Remote peer timed out";
+    server_.nr_dead_peers_++;
+  }
+
+  // Warm pool and race fallback connections have nothing to flush
+  if (incoming_ == nullptr) {
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+      if (race_partner_ != nullptr)
+        race_fallback_failed();
+      server_.pool_discard(this);
+      server_.close_session(this);
+    }
+    return;
+  }
+
+  /*
+   * The remote peer dropped the connection mid-handshake (Eg: It rejected a
+   * Session Ticket).  Leave the client to the fallback if one is racing, or
+   * start one now instead of waiting for the race delay.
+   */
+  if ((events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) && race_ev_ != nullptr &&
+      state_ == State::kCONNECTING && outgoing_valid_) {
+    if (race_partner_ != nullptr || race_start()) {
+      LOG(INFO) << this << ": Handshake failed, waiting on the fallback";
+      evtimer_del(race_ev_);
+      outgoing_valid_ = false;
+      ::bufferevent_disable(outgoing_, EV_READ | EV_WRITE);
+      return;
+    }
+  }
+
+  /*
+   * With TCP Fast Open the connect "completes" before the SYN is sent, so a
+   * refused/unreachable peer shows up here instead of in
+   * outgoing_connect_cb().  Report it to the client the same way if it is
+   * still waiting on a reply.  Only an error carries a errno, a plain EOF
+   * is reported as refused like in outgoing_connect_cb().
+   */
+  if ((events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) && outgoing_fastopen_ &&
+      state_ == State::kCONNECTING && !early_response_sent_)
+    outgoing_connect_failed((events & BEV_EVENT_ERROR) ? err : ECONNREFUSED);
+
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    if (!drain_flow(outgoing_flow_, &Session::on_outgoing_data))
+      return;
     const struct evbuffer* buf = ::bufferevent_get_output(incoming_);
     outgoing_valid_ = false;
     if (!incoming_valid_ || ::evbuffer_get_length(buf) == 0) {
@@ -768,14 +2070,33 @@ bool Socks5Server::Session::outgoing_connect() {
       << ": outgoing_connect(): Expected outgoing_ to be null";
   CHECK_EQ(state_, State::kREAD_REQUEST) << this
       << ": outgoing_connect(): Invalid state: " << state_string();
-  CHECK_GT(remote_addr_len_, 0) << this
+  CHECK_GT(addrs_->remote_addr_len, 0) << this
       << ": outgoing_connect(): Expected remote_addr_len to be > 0: "
-      << remote_addr_len_;
+      << addrs_->remote_addr_len;
+
+  // Set TCP_FASTOPEN_CONNECT before connect(), so create the socket here
+  evutil_socket_t sock = -1;
+  if (server_.config().tcp_fastopen) {
+    sock = ::socket(addrs_->remote_addr.ss_family, SOCK_STREAM, 0);
+    if (sock < 0)
+      return false;
+    if (::evutil_make_socket_nonblocking(sock) != 0) {
+      ::evutil_closesocket(sock);
+      return false;
+    }
+    outgoing_fastopen_ = net::set_tcp_fastopen_connect(sock);
+    if (!outgoing_fastopen_)
+      LOG(DEBUG) << this << ": Failed to enable TCP Fast Open";
+  }
 
-  outgoing_ = ::bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE |
+  outgoing_ = ::bufferevent_socket_new(base_, sock, BEV_OPT_CLOSE_ON_FREE |
                                        BEV_OPT_DEFER_CALLBACKS);
-  if (outgoing_ == nullptr)
+  if (outgoing_ == nullptr) {
+    if (sock >= 0)
+      ::evutil_closesocket(sock);
     return false;
+  }
+  ::bufferevent_priority_set(outgoing_, Priority::kHANDSHAKE);
 
   bufferevent_event_cb eventcb = [](struct bufferevent *bev,
                                     short events,
@@ -788,17 +2109,382 @@ bool Socks5Server::Session::outgoing_connect() {
 
   // Return value is ignored since the callback will get invoked
   ::bufferevent_socket_connect(outgoing_,
-                               reinterpret_cast<struct sockaddr*>(&remote_addr_),
-                               remote_addr_len_);
+                               reinterpret_cast<struct sockaddr*>(&addrs_->remote_addr),
+                               addrs_->remote_addr_len);
+
+  state_ = State::kCONNECTING;
+  return true;
+}
+
+::std::string Socks5Server::Session::pool_key() const {
+  ::std::string key(reinterpret_cast<const char*>(&addrs_->remote_addr),
+                    addrs_->remote_addr_len);
+  key += auth_creds_;
+
+  return key;
+}
+
+bool Socks5Server::Session::warm_connect(const Session& origin) {
+  SL_ASSERT(incoming_ == nullptr);
+  SL_ASSERT(state_ == State::kREAD_METHODS);
+
+  if (!pool_ev_init())
+    return false;
+
+  ::std::memcpy(&addrs_->remote_addr, &origin.addrs_->remote_addr, sizeof(addrs_->remote_addr));
+  addrs_->remote_addr_len = origin.addrs_->remote_addr_len;
+  addrs_->remote_addr_str = origin.addrs_->remote_addr_str;
+  auth_creds_ = origin.auth_creds_;
+  if (!replay_auth())
+    return false;
 
+  LOG(INFO) << this << (race_fallback_ ? ": Racing connection to peer " :
+                        ": Warming connection to peer ") << addrs_->remote_addr_str;
+
+  state_ = State::kREAD_REQUEST;
+  if (!outgoing_connect())
+    return false;
+
+  ::bufferevent_disable(outgoing_, EV_READ);
+  return true;
+}
+
+bool Socks5Server::Session::pool_ev_init() {
+  event_callback_fn cb = [](evutil_socket_t sock,
+                            short which,
+                            void* arg) {
+    (void)sock;
+    (void)which;
+
+    Session* session = reinterpret_cast<Session*>(arg);
+    session->server_.on_pool_event(session);
+  };
+  pool_ev_ = evtimer_new(base_, cb, this);
+  if (pool_ev_ == nullptr)
+    return false;
+  ::event_priority_set(pool_ev_, Priority::kTIMER);
+
+  return true;
+}
+
+bool Socks5Server::Session::replay_auth() {
+  // The client's credentials (ULEN | UNAME | PLEN | PASSWD)
+  if (!auth_creds_.empty()) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(auth_creds_.data());
+    const uint8_t ulen = p[0];
+    const uint8_t plen = p[1 + ulen];
+    const uint8_t* uname = (ulen > 0) ? p + 1 : nullptr;
+    const uint8_t* passwd = (plen > 0) ? p + 1 + ulen + 1 : nullptr;
+    if (!authenticate(uname, ulen, passwd, plen))
+      return false;
+    auth_method_ = AuthMethod::kUSERNAME_PASSWORD;
+  } else
+    auth_method_ = AuthMethod::kNONE_REQUIRED;
+
+  return true;
+}
+
+bool Socks5Server::Session::adopt_client(Session& client) {
+  SL_ASSERT(state_ == State::kPOOLED);
+  SL_ASSERT(pool_slot_ == PoolSlot::kNONE);
+
+  struct bufferevent* bev = client.incoming_;
+  client.incoming_ = nullptr;
+  client.incoming_valid_ = false;
+  incoming_attach(bev);
+  addrs_->client_addr_str = client.addrs_->client_addr_str;
+  early_response_sent_ = client.early_response_sent_;
+
+  LOG(INFO) << this << ": Using warm connection "
+            << addrs_->client_addr_str << " <-> " << addrs_->remote_addr_str;
+
+  ::bufferevent_setwatermark(outgoing_, EV_READ, 0, 0);
+  state_ = State::kCONNECTING;
+  if (!send_socks5_response(Reply::kSUCCEDED))
+    return false;
+
+  /*
+   * Process anything the peer sent while the connection was idle.  This is
+   * deferred since the caller still has to close client, and the read can
+   * tear this Session down.
+   */
+  if (::evbuffer_get_length(::bufferevent_get_input(outgoing_)) > 0)
+    outgoing_kick();
+
+  return true;
+}
+
+void Socks5Server::Session::race_arm() {
+  const int delay = server_.config().handshake_race_delay;
+
+  // Warm pool connections are not worth racing
+  if (delay <= 0 || incoming_ == nullptr || race_fallback_ ||
+      race_ev_ != nullptr)
+    return;
+
+  event_callback_fn cb = [](evutil_socket_t sock,
+                            short which,
+                            void* arg) {
+    (void)sock;
+    (void)which;
+
+    reinterpret_cast<Session*>(arg)->race_timeout_cb();
+  };
+  race_ev_ = evtimer_new(base_, cb, this);
+  if (race_ev_ == nullptr) {
+    LOG(WARNING) << this << ": Failed to allocate race timer";
+    return;
+  }
+  ::event_priority_set(race_ev_, Priority::kTIMER);
+
+  evtimer_add(race_ev_, server_.common_timeout(delay));
+}
+
+void Socks5Server::Session::race_timeout_cb() {
+  if (state_ != State::kCONNECTING || race_partner_ != nullptr)
+    return;
+
+  LOG(INFO) << this << ": Handshake is slow, starting fallback";
+  race_start();
+}
+
+bool Socks5Server::Session::race_start() {
+  SL_ASSERT(race_partner_ == nullptr);
+  SL_ASSERT(!race_fallback_);
+
+  Session* fallback = server_.create_clientless_session("[Fallback]");
+  if (fallback == nullptr)
+    return false;
+
+  fallback->race_fallback_ = true;
+  fallback->race_partner_ = this;
+  race_partner_ = fallback;
+  if (!fallback->warm_connect(*this)) {
+    LOG(WARNING) << this << ": Failed to start fallback handshake";
+    race_unlink();
+    server_.close_session(fallback);
+    return false;
+  }
+  server_.nr_races_++;
+
+  return true;
+}
+
+void Socks5Server::Session::race_fallback_failed() {
+  SL_ASSERT(race_fallback_);
+
+  Session* origin = race_partner_;
+  race_unlink();
+  LOG(INFO) << this << ": Fallback handshake failed";
+
+  // The origin's own handshake already failed, so that's it
+  if (!origin->outgoing_valid_ && origin->state_ == State::kCONNECTING)
+    origin->send_socks5_response(Reply::kGENERAL_FAILURE);
+}
+
+void Socks5Server::Session::race_unlink() {
+  if (race_partner_ == nullptr)
+    return;
+
+  SL_ASSERT(race_partner_->race_partner_ == this);
+  race_partner_->race_partner_ = nullptr;
+  race_partner_ = nullptr;
+}
+
+void Socks5Server::Session::close_deferred() {
+  SL_ASSERT(pool_ev_ != nullptr);
+
+  outgoing_valid_ = false;
+  state_ = State::kFLUSHING_INCOMING;
+  connect_timer_.cancel();
+  ::event_active(pool_ev_, EV_TIMEOUT, 0);
+}
+
+bool Socks5Server::Session::embed_connect(SessionObserver& observer,
+                                          struct bufferevent* plaintext,
+                                          struct bufferevent* ciphertext,
+                                          const struct sockaddr* addr,
+                                          const socklen_t addr_len,
+                                          const ::std::string& args) {
+  SL_ASSERT(incoming_ == nullptr);
+  SL_ASSERT(outgoing_ == nullptr);
+  SL_ASSERT(state_ == State::kREAD_METHODS);
+
+  // Plaintext is held back till the handshake completes
+  incoming_attach(plaintext);
+  ::bufferevent_disable(incoming_, EV_READ);
+  outgoing_ = ciphertext;
+  ::bufferevent_priority_set(outgoing_, Priority::kHANDSHAKE);
+
+  if (addr_len == 0 || addr_len > sizeof(addrs_->remote_addr))
+    return false;
+  if (!pool_ev_init())
+    return false;
+
+  ::std::memcpy(&addrs_->remote_addr, addr, addr_len);
+  addrs_->remote_addr_len = addr_len;
+  addrs_->remote_addr_str = addr_to_string(addr, scrub_addrs_);
+
+  // Split the arguments across UNAME/PASSWD the same way tor does
+  if (!args.empty()) {
+    static constexpr size_t kMaxFieldLen = 255;
+    if (args.size() > 2 * kMaxFieldLen)
+      return false;
+
+    const size_t ulen = ::std::min(args.size(), kMaxFieldLen);
+    const size_t plen = args.size() - ulen;
+    auth_creds_.assign(1, static_cast<char>(ulen));
+    auth_creds_.append(args, 0, ulen);
+    if (plen > 0) {
+      auth_creds_.append(1, static_cast<char>(plen));
+      auth_creds_.append(args, ulen, plen);
+    } else
+      auth_creds_.append(2, '\0');
+  } else if (auth_required_) {
+    LOG(WARNING) << this << ": Transport requires arguments, got nothing";
+    return false;
+  }
+  if (!replay_auth())
+    return false;
+
+  LOG(INFO) << this << ": Embedded session to peer " << addrs_->remote_addr_str;
+
+  observer_ = &observer;
   state_ = State::kCONNECTING;
+  outgoing_connect_cb(BEV_EVENT_CONNECTED);
+
   return true;
 }
 
-void Socks5Server::Session::incoming_apply_backpressure() {
+void Socks5Server::Session::update_buffer_limits(const bool active) {
+  const Config& config = server_.config();
+
+  struct timeval now;
+  if (0 != ::event_base_gettimeofday_cached(base_, &now))
+    return;
+
+  // Every relayed read and write comes through here
+  if (active) {
+    last_active_tv_ = now;
+    idle_ = false;
+  }
+
+  if (config.buffer_mode == BufferMode::kADAPTIVE &&
+      (buffer_limit_tv_.tv_sec == 0 ||
+       now.tv_sec - buffer_limit_tv_.tv_sec >= kBufferLimitInterval)) {
+    buffer_limit_tv_ = now;
+
+    size_t tx_bdp = 0;
+    size_t rx_bdp = 0;
+    if (net::get_tcp_bdp(outgoing_fd(), tx_bdp, rx_bdp)) {
+      outgoing_bdp_limit_ = ::std::min(::std::max(tx_bdp * kBdpMultiplier,
+                                                  config.buffer_min),
+                                       config.buffer_max);
+      incoming_bdp_limit_ = ::std::min(::std::max(rx_bdp * kBdpMultiplier,
+                                                  config.buffer_min),
+                                       config.buffer_max);
+
+      LOG(DEBUG) << this << ": BDP limits (BDP TX/RX: " << tx_bdp << "/"
+                 << rx_bdp << "): " << outgoing_bdp_limit_ << "/"
+                 << incoming_bdp_limit_;
+    }
+  }
+
+  outgoing_buffer_limit_ = outgoing_bdp_limit_;
+  incoming_buffer_limit_ = incoming_bdp_limit_;
+
+  // Each direction gets half of the credit
+  if (budget_account_.registered()) {
+    config.budget->update(budget_account_, buffered_bytes(), now, active);
+    const size_t credit = config.budget->credit(budget_account_) / 2;
+    outgoing_buffer_limit_ = ::std::min(outgoing_buffer_limit_, credit);
+    incoming_buffer_limit_ = ::std::min(incoming_buffer_limit_, credit);
+  }
+}
+
+size_t Socks5Server::Session::buffered_bytes() const {
+  size_t len = 0;
+
+  if (incoming_ != nullptr) {
+    len += ::evbuffer_get_length(::bufferevent_get_input(incoming_));
+    len += ::evbuffer_get_length(::bufferevent_get_output(incoming_));
+  }
+  if (outgoing_ != nullptr) {
+    len += ::evbuffer_get_length(::bufferevent_get_input(outgoing_));
+    len += ::evbuffer_get_length(::bufferevent_get_output(outgoing_));
+  }
+
+  return len;
+}
+
+size_t Socks5Server::Session::budget_shrink_cb() {
+  if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
+    return buffered_bytes();
+
+  /*
+   * The session has been idle and memory is tight, so clamp the thresholds to
+   * the reduced credit, and release whatever the Session can do without.  The
+   * normal backpressure code will take care of unthrottling once things start
+   * moving again.
+   */
+  const size_t credit = server_.config().budget->credit(budget_account_) / 2;
+  outgoing_buffer_limit_ = ::std::min(outgoing_bdp_limit_, credit);
+  incoming_buffer_limit_ = ::std::min(incoming_bdp_limit_, credit);
+
+  LOG(DEBUG) << this << ": Buffer budget reduced to: " << credit * 2;
+
+  // Already throttled Sessions need the watermark lowered to match
+  const struct evbuffer* out_buf = ::bufferevent_get_output(outgoing_);
+  if (::evbuffer_get_length(out_buf) > outgoing_buffer_limit_) {
+    if (0 != (::bufferevent_get_enabled(incoming_) & EV_READ)) {
+      LOG(DEBUG) << this << ": Throttling incoming->outgoing";
+      ::bufferevent_disable(incoming_, EV_READ);
+    }
+    ::bufferevent_setwatermark(outgoing_, EV_WRITE,
+                               outgoing_buffer_limit_ / 2, 0);
+  }
+
+  const struct evbuffer* inc_buf = ::bufferevent_get_output(incoming_);
+  if (::evbuffer_get_length(inc_buf) > incoming_buffer_limit_) {
+    if (0 != (::bufferevent_get_enabled(outgoing_) & EV_READ)) {
+      LOG(DEBUG) << this << ": Throttling outgoing->incoming";
+      ::bufferevent_disable(outgoing_, EV_READ);
+    }
+    ::bufferevent_setwatermark(incoming_, EV_WRITE,
+                               incoming_buffer_limit_ / 2, 0);
+  }
+
+  /*
+   * This can be called from the middle of this Session's own backpressure
+   * update, so only release what is reallocated on demand, and leave the
+   * buffered data alone.
+   */
+  const size_t reclaimed = release_idle_buffers();
+  server_.idle_reclaimed_ += reclaimed;
+  LOG(DEBUG) << this << ": Released " << reclaimed << " bytes";
+
+  return buffered_bytes();
+}
+
+void Socks5Server::Session::incoming_apply_backpressure(const bool active) {
+  if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
+    return;
+
+  const size_t limit = outgoing_buffer_limit_;
+  update_buffer_limits(active);
+  incoming_enforce_limit(outgoing_buffer_limit_ != limit);
+}
+
+void Socks5Server::Session::outgoing_apply_backpressure(const bool active) {
   if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
     return;
 
+  const size_t limit = incoming_buffer_limit_;
+  update_buffer_limits(active);
+  outgoing_enforce_limit(incoming_buffer_limit_ != limit);
+}
+
+void Socks5Server::Session::incoming_enforce_limit(const bool limit_changed) {
   const struct evbuffer* inc_buf = ::bufferevent_get_input(incoming_);
   const size_t inc_len = ::evbuffer_get_length(inc_buf);
 
@@ -807,11 +2493,16 @@ void Socks5Server::Session::incoming_apply_backpressure() {
 
   LOG(DEBUG) << this << ": Outgoing write buffer: " << out_len;
 
-  if (out_len > kMaxBufferSize) {
+  if (out_len > outgoing_buffer_limit_) {
     if (0 != (::bufferevent_get_enabled(incoming_) & EV_READ)) {
       LOG(DEBUG) << this << ": Throttling incoming->outgoing";
       ::bufferevent_disable(incoming_, EV_READ);
-      ::bufferevent_setwatermark(outgoing_, EV_WRITE, kMaxBufferSize / 2, 0);
+      ::bufferevent_setwatermark(outgoing_, EV_WRITE,
+                                 outgoing_buffer_limit_ / 2, 0);
+    } else if (limit_changed) {
+      // Resume at half of the new threshold, not the stale one
+      ::bufferevent_setwatermark(outgoing_, EV_WRITE,
+                                 outgoing_buffer_limit_ / 2, 0);
     }
   } else {
     if (0 == (::bufferevent_get_enabled(incoming_) & EV_READ)) {
@@ -819,15 +2510,12 @@ void Socks5Server::Session::incoming_apply_backpressure() {
       ::bufferevent_enable(incoming_, EV_READ);
       ::bufferevent_setwatermark(outgoing_, EV_WRITE, 0, 0);
       if (inc_len > 0)
-        on_incoming_data();
+        incoming_kick();
     }
   }
 }
 
-void Socks5Server::Session::outgoing_apply_backpressure() {
-  if (state_ != State::kESTABLISHED || !incoming_valid_ || !outgoing_valid_)
-    return;
-
+void Socks5Server::Session::outgoing_enforce_limit(const bool limit_changed) {
   const struct evbuffer* out_buf = ::bufferevent_get_input(outgoing_);
   const size_t out_len = ::evbuffer_get_length(out_buf);
 
@@ -836,11 +2524,15 @@ void Socks5Server::Session::outgoing_apply_backpressure() {
 
   LOG(DEBUG) << this << ": Incoming write buffer: " << inc_len;
 
-  if (inc_len > kMaxBufferSize) {
+  if (inc_len > incoming_buffer_limit_) {
     if (0 != (::bufferevent_get_enabled(outgoing_) & EV_READ)) {
       LOG(DEBUG) << this << ": Throttling outging->incoming";
       ::bufferevent_disable(outgoing_, EV_READ);
-      ::bufferevent_setwatermark(incoming_, EV_WRITE, kMaxBufferSize / 2, 0);
+      ::bufferevent_setwatermark(incoming_, EV_WRITE,
+                                 incoming_buffer_limit_ / 2, 0);
+    } else if (limit_changed) {
+      ::bufferevent_setwatermark(incoming_, EV_WRITE,
+                                 incoming_buffer_limit_ / 2, 0);
     }
   } else {
     if (0 == (::bufferevent_get_enabled(outgoing_) & EV_READ)) {
@@ -848,7 +2540,7 @@ void Socks5Server::Session::outgoing_apply_backpressure() {
       ::bufferevent_enable(outgoing_, EV_READ);
       ::bufferevent_setwatermark(incoming_, EV_WRITE, 0, 0);
       if (out_len > 0)
-        on_outgoing_data();
+        outgoing_kick();
     }
   }
 }
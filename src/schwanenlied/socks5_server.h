@@ -42,6 +42,7 @@
 #include <netinet/in.h>
 
 #include <list>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -50,6 +51,11 @@
 #include <event2/util.h>
 
 #include "schwanenlied/common.h"
+#include "schwanenlied/buffer_budget.h"
+#include "schwanenlied/net/io_uring.h"
+#include "schwanenlied/session_arena.h"
+#include "schwanenlied/shaper.h"
+#include "schwanenlied/timer_wheel.h"
 
 namespace schwanenlied {
 
@@ -76,6 +82,25 @@ namespace schwanenlied {
  */
 class Socks5Server {
  public:
+  /**
+   * libevent2 event priorities
+   *
+   * Lower values are serviced first, so that established sessions stay
+   * responsive while many new sessions are handshaking.
+   */
+  enum Priority {
+    kRELAY = 0,     /**< State::kESTABLISHED I/O */
+    kHANDSHAKE = 1, /**< Negotiation/handshake I/O */
+    kTIMER = 2      /**< Timeouts and IAT timers */
+  };
+
+  /** The number of priorities to initialize the event_base with */
+  static constexpr int kNrPriorities = 3;
+
+  template<class T> class TransportSession;
+  class SessionFactory;
+  class SessionObserver;
+
   /**
    * The SOCKSv5 session
    *
@@ -94,7 +119,8 @@ class Socks5Server {
      * @param[in] server        The Socks5Server associated with the session
      * @param[in] base          The libevent2 event_base associated with the
      *                          Socks5Server
-     * @param[in] sock          The Client to SOCKS server socket
+     * @param[in] sock          The Client to SOCKS server socket (-1 for a
+     *                          warm pool/embedded connection)
      * @param[in] addr          The Client address/port
      * @param[in] require_auth  Authentication is required?
      * @param[in] scrub_addrs   Scrub addresses in logs
@@ -108,6 +134,38 @@ class Socks5Server {
 
     virtual ~Session();
 
+    /** @{ */
+    /**
+     * Allocate a Session from the general heap
+     *
+     * SessionFactory::new_session() uses the placement form instead, so that
+     * the Session and it's Arena are carved from the factory's SessionSlab.
+     * Either way the memory is wiped when the Session is deleted.
+     */
+    static void* operator new(size_t len) noexcept {
+      return SessionSlab::allocate_object(nullptr, len, 0);
+    }
+
+    /** Allocate a Session and an Arena of arena_len bytes from a SessionSlab */
+    static void* operator new(size_t len,
+                              SessionSlab& slab,
+                              const size_t arena_len) noexcept {
+      return SessionSlab::allocate_object(&slab, len, arena_len);
+    }
+
+    static void operator delete(void* p) {
+      SessionSlab::release_object(p);
+    }
+
+    static void operator delete(void* p,
+                                SessionSlab& slab,
+                                const size_t arena_len) {
+      (void)slab;
+      (void)arena_len;
+      SessionSlab::release_object(p);
+    }
+    /** @} */
+
    protected:
     /** The SOCKSv5 reply codes */
     enum Reply {
@@ -206,6 +264,18 @@ class Socks5Server {
     virtual void on_connect_timeout() {
       send_socks5_response(Reply::kTTL_EXPIRED);
     }
+
+    /**
+     * Idle callback
+     *
+     * Called once a State::kESTABLISHED Session has not relayed any data for
+     * Config::idle_timeout seconds.  Implementations that keep per-Session
+     * buffers that are only needed while data is moving (Eg: partial frames)
+     * SHOULD release them here.
+     *
+     * @returns The number of bytes released
+     */
+    virtual size_t on_idle() { return 0; }
     /** @} */
 
     /**
@@ -223,17 +293,102 @@ class Socks5Server {
      *
      * @param[in] reply The reply code to be sent
      *
+     * @note If Config::optimistic_socks is set, a success response may already
+     * have been sent when the outgoing connection was established, in which
+     * case failures will close the session without a response.
+     *
+     * @note Warm pool connections have no client, so on success the Session
+     * is parked in the warm pool and false is returned.  It will not be
+     * relaying till a client is spliced onto it.
+     *
      * @returns true  - reply == kSUCCEEDED and response sent
-     * @returns false - Session torn down
+     * @returns false - Session torn down (or parked in the warm pool)
      */
     bool send_socks5_response(const Reply reply);
 
+    /** @{ */
+    /**
+     * Queue data to be sent to the remote peer as part of a flight
+     *
+     * Multi-part messages (handshakes, frame headers and payloads) should be
+     * assembled with flight_add() and then handed to outgoing_ in a single
+     * append via flight_commit(), rather than with one bufferevent_write()
+     * per piece.
+     *
+     * @param[in] buf The data to queue
+     * @param[in] len The length of the data
+     *
+     * @returns true  - Success
+     * @returns false - Failure
+     */
+    bool flight_add(const void* buf,
+                    const size_t len);
+
+    /**
+     * Get the buffer backing the current flight
+     *
+     * For transport codecs that serialize directly into an evbuffer.  Data
+     * appended here is sent by the next flight_commit().
+     *
+     * @returns A pointer to the flight buffer, nullptr on allocation failure
+     */
+    struct evbuffer* flight();
+
+    /**
+     * Send the current flight to the remote peer
+     *
+     * @returns true  - Success (Including if the flight was empty)
+     * @returns false - Failure
+     */
+    bool flight_commit();
+    /** @} */
+
+    /** @{ */
+    /**
+     * Race a fallback handshake if this one does not complete in time
+     *
+     * For transports with a handshake that can fail silently (Eg: A rejected
+     * ScrambleSuit Session Ticket).  If Config::handshake_race_delay is set
+     * and the Session is still handshaking when it expires, or the remote
+     * peer closes the connection before then, a second Session is created
+     * from the SessionFactory and connects to the same remote peer with
+     * is_race_fallback() returning true.  Whichever Session finishes the
+     * handshake first gets the client, and the other one is closed.
+     */
+    void race_arm();
+
+    /**
+     * Query if the Session is racing another Session's handshake
+     *
+     * Transports should use the handshake that does not fail silently if
+     * this returns true.
+     */
+    bool is_race_fallback() const {
+      return race_fallback_;
+    }
+    /** @} */
+
     /**
      * Return a string representation of SOCKSv5 Session state
      */
     const char* state_string() const;
 
-    /** @{ */
+    /**
+     * Return the Session's Arena
+     *
+     * @returns nullptr - The Session was not created by
+     *                    SessionFactory::new_session()
+     */
+    Arena* arena() const { return arena_; }
+
+    /**
+     * @{
+     * The member layout is split by access pattern.  The state touched by
+     * every relay callback is declared first so that it shares the cache
+     * lines following the vtable pointer, while the addresses, log strings
+     * and handshake only state that are rarely touched once the Session is
+     * kESTABLISHED are declared after it.
+     */
     /** The Socks5Server */
     Socks5Server& server_;
     /** The libevent2 event_base */
@@ -242,10 +397,6 @@ class Socks5Server {
     struct bufferevent* incoming_;
     /** The SOCKS Server to Remote peer bufferevent */
     struct bufferevent* outgoing_;
-    /** The remote peer address */
-    struct sockaddr_storage remote_addr_;
-    /** The length of remote_addr_ */
-    socklen_t remote_addr_len_;
 
     /** The SOCKSv5 session state */
     enum class State {
@@ -257,20 +408,32 @@ class Socks5Server {
       kESTABLISHED,       /**< Established, proxying data */
       kFLUSHING_INCOMING, /**< outgoing_ closed, flushing incoming_ */
       kFLUSHING_OUTGOING, /**< incoming_ closed, flushing outgoing_ */
+      kPOOLED,            /**< Handshaked, waiting for a client (Warm pool) */
     } state_; /**< The SOCKSv5 session state */
     /** @} */
 
-    /** @{ */
-    /** The string representation of the client address */
-    ::std::string client_addr_str_;
-    /** The string representation of the remote peer address */
-    ::std::string remote_addr_str_;
-    /** @} */
-
    private:
     Session(const Session&) = delete;
     void operator=(const Session&) = delete;
 
+    friend class Socks5Server;
+    friend class Socks5Server::SessionFactory;
+    template<class T> friend class Socks5Server::TransportSession;
+
+    /** The handshake admission state */
+    enum class HandshakeSlot {
+      kNONE,    /**< Not admitted (or done handshaking) */
+      kQUEUED,  /**< Waiting for a handshake slot */
+      kACTIVE   /**< Holding a handshake slot */
+    };
+
+    /** The warm pool state */
+    enum class PoolSlot {
+      kNONE,    /**< Not a warm connection (or taken by a client) */
+      kWARMING, /**< Connecting/handshaking for the warm pool */
+      kIDLE     /**< Handshaked, waiting in the warm pool */
+    };
+
     /** The SOCKS protocol version */
     static constexpr uint8_t kSocksVersion = 0x05;
 
@@ -298,31 +461,290 @@ class Socks5Server {
 
     /** The State::kCONNECTING timeout in seconds */
     static constexpr int kConnectTimeout = 60;
-    /** The maximum amount of data to buffer before throttling */
+    /** The maximum amount of data to buffer before throttling (kFIXED) */
     static constexpr size_t kMaxBufferSize = 65536;
+    /** Maximum client data queued behind an optimistic SOCKS response */
+    static constexpr size_t kMaxEarlyDataSize = 65536;
+    /** The minimum interval between backpressure threshold updates in sec */
+    static constexpr time_t kBufferLimitInterval = 1;
+    /** The multiple of the BDP to buffer before throttling (kADAPTIVE) */
+    static constexpr size_t kBdpMultiplier = 2;
+    /** The unanswered TCP keepalive probes before a peer is considered dead */
+    static constexpr int kKeepaliveProbes = 3;
+    /** The largest partial read buffer worth compacting when idle */
+    static constexpr size_t kMaxIdleCompactSize = 4096;
+
+    /** @{ */
+    /** Relay path state (hot) */
+    bufferevent_data_cb incoming_relay_cb_; /**< kESTABLISHED incoming_ read cb */
+    bufferevent_data_cb outgoing_relay_cb_; /**< kESTABLISHED outgoing_ read cb */
+    struct evbuffer* flight_;   /**< The pending outgoing_ flight */
+#ifdef ENABLE_IO_URING
+    net::IoUring::Socket* incoming_uring_; /**< incoming_'s io_uring socket */
+    net::IoUring::Socket* outgoing_uring_; /**< outgoing_'s io_uring socket */
+#endif
+    size_t outgoing_buffer_limit_; /**< outgoing_ write buffer throttle threshold */
+    size_t incoming_buffer_limit_; /**< incoming_ write buffer throttle threshold */
+    size_t outgoing_bdp_limit_; /**< outgoing_ write buffer BDP threshold */
+    size_t incoming_bdp_limit_; /**< incoming_ write buffer BDP threshold */
+    struct timeval buffer_limit_tv_; /**< Time the thresholds were last updated */
+    struct timeval last_active_tv_; /**< Time data was last relayed */
+    bool incoming_valid_; /**< incoming_ connected? */
+    bool outgoing_valid_; /**< outgoing_ connected? */
+    bool idle_;                 /**< Idle buffers released? */
+    bool rate_limited_;         /**< In the Shaper's rate limit groups? */
+    Shaper::Flow incoming_flow_; /**< The incoming_ relay scheduler Flow */
+    Shaper::Flow outgoing_flow_; /**< The outgoing_ relay scheduler Flow */
+    BufferBudget::Account budget_account_; /**< The buffer budget account */
+    /** @} */
+
+   protected:
+    /** @{ */
+    /**
+     * Query the remote peer address
+     *
+     * @warning The address is released once the Session is established.
+     */
+    const struct sockaddr* remote_addr() const {
+      SL_ASSERT(addrs_ != nullptr);
+      return reinterpret_cast<const struct sockaddr*>(&addrs_->remote_addr);
+    }
+
+    /** Query the length of remote_addr() */
+    socklen_t remote_addr_len() const {
+      SL_ASSERT(addrs_ != nullptr);
+      return addrs_->remote_addr_len;
+    }
+    /** @} */
 
+   private:
+    /** The addresses, only needed till the Session is established */
+    struct Addresses {
+      Addresses(const ::std::string& client_addr) :
+          remote_addr(),
+          remote_addr_len(0),
+          client_addr_str(client_addr),
+          remote_addr_str("[Not yet specified]") {}
+
+      struct sockaddr_storage remote_addr;  /**< The remote peer address */
+      socklen_t remote_addr_len;    /**< The length of remote_addr */
+      ::std::string client_addr_str;  /**< The client address string */
+      ::std::string remote_addr_str;  /**< The remote peer address string */
+    };
+
+    /** @{ */
+    /** Setup, handshake and teardown state (cold) */
+    ::std::unique_ptr<Addresses> addrs_;  /**< The addresses (out of line) */
+    Arena* arena_;              /**< The Arena (set by SessionFactory::new_session()) */
     const bool auth_required_;  /**< Client must authenticate? */
     const bool scrub_addrs_;    /**< Should scrub addresses when logging? */
     AuthMethod auth_method_; /**< Negotiated auth method */
-    bool incoming_valid_; /**< incoming_ connected? */
-    bool outgoing_valid_; /**< outgoing_ connected? */
-    struct event* connect_timer_ev_;  /** State::kCONNECTING timeout event */
+    bool outgoing_corked_;      /**< outgoing_ has TCP_CORK set? */
+    bool outgoing_fastopen_;    /**< outgoing_ uses TCP Fast Open? */
+    bool early_response_sent_;  /**< Optimistic SOCKS response sent? */
+    bool race_fallback_;        /**< Racing race_partner_'s handshake? */
+    HandshakeSlot handshake_slot_;  /**< The handshake admission state */
+    PoolSlot pool_slot_;        /**< The warm pool state */
+    TimerWheel::Timer connect_timer_; /**< State::kCONNECTING timeout */
+    struct event* incoming_kick_ev_;  /** Buffered incoming_ data event */
+    struct event* outgoing_kick_ev_;  /** Buffered outgoing_ data event */
+    struct event* idle_ev_;     /**< The idle detection event */
+    struct event* buffer_limit_ev_; /**< The threshold update event */
+    struct timeval queued_tv_;  /**< Time the Session was queued for admission */
+    ::std::list<Session*>::iterator queue_iter_;  /**< Admission queue entry */
+    ::std::string auth_creds_;  /**< The raw RFC1929 credentials (Warm pool) */
+    SessionObserver* observer_; /**< The embedder to notify, if any */
+    ::std::string pool_key_;    /**< The warm pool key */
+    struct event* pool_ev_;     /**< Clientless idle/teardown event */
+    ::std::list<Session*>::iterator pool_iter_;  /**< Warm pool entry */
+    Session* race_partner_;     /**< The Session racing this one */
+    struct event* race_ev_;     /**< The fallback race delay event */
+    Shaper::Rate bridge_rate_;  /**< The per-bridge rate from the bridge line */
+    /** @} */
 
     /** @{ */
     /** The State::kCONNECTING timeout callback */
     void connect_timeout_cb();
 
+    /**
+     * Authenticate the client
+     *
+     * If a Shaper is configured, the per-bridge rate limit arguments
+     * ("rate-limit=BYTES;rate-burst=BYTES") are removed from the bridge line
+     * arguments, and only the rest are passed to on_client_authenticate().
+     *
+     * @param[in] uname   Username
+     * @param[in] ulen    The length of uname
+     * @param[in] passwd  Password
+     * @param[in] plen    The length of password
+     *
+     * @returns true  - Success
+     * @returns false - Failure (Close connection)
+     */
+    bool authenticate(const uint8_t* uname,
+                      const uint8_t ulen,
+                      const uint8_t* passwd,
+                      const uint8_t plen);
+
+    /**
+     * Take ownership of a Client to SOCKS server bufferevent
+     *
+     * @param[in] bev The bufferevent to attach as incoming_
+     */
+    void incoming_attach(struct bufferevent* bev);
+
+    /**
+     * Install the incoming_ callbacks
+     *
+     * @param[in] readcb  The read callback (nullptr = incoming_read_cb())
+     */
+    void incoming_setcb(bufferevent_data_cb readcb);
+
+    /**
+     * Install the outgoing_ callbacks
+     *
+     * @param[in] readcb  The read callback (nullptr = outgoing_read_cb())
+     */
+    void outgoing_setcb(bufferevent_data_cb readcb);
+
+    /** Query the outgoing_ socket (-1 = Not a socket) */
+    evutil_socket_t outgoing_fd() const;
+
+#ifdef ENABLE_IO_URING
+    /** Move the relay I/O over to Config::io_uring */
+    void io_uring_attach();
+#endif
+
+    /** @{ */
+    /** Subject the relay I/O to Config::shaper */
+    void shaper_attach();
+
+    /** @{ */
+    /** Apply Config::tcp_keepalive and Config::tcp_user_timeout to outgoing_ */
+    void set_dead_peer_detection();
+
+    /** Start idle detection (Config::idle_timeout/Config::idle_reap) */
+    void idle_arm();
+
+    /** The idle detection event callback */
+    void idle_cb();
+
+    /** Start the periodic backpressure threshold updates */
+    void buffer_limit_arm();
+
+    /** The backpressure threshold update event callback */
+    void buffer_limit_cb();
+
+    /**
+     * Release the memory an idle Session can do without
+     *
+     * @param[out] reclaimed  The number of bytes released by on_idle()
+     * @param[out] compacted  The amount of buffered data that was compacted
+     *
+     * @returns true  - Success
+     * @returns false - Failure (Buffered data lost, close the Session)
+     */
+    bool idle_reclaim(size_t& reclaimed,
+                      size_t& compacted);
+
+    /**
+     * Release the buffers that are reallocated on demand
+     *
+     * Unlike idle_reclaim() this never touches buffered data, so it is safe
+     * to call from any callback.
+     *
+     * @returns The number of bytes released by on_idle()
+     */
+    size_t release_idle_buffers();
+    /** @} */
+
+    /** The incoming_ Flow scheduler callback */
+    void incoming_flow_cb();
+
+    /** The outgoing_ Flow scheduler callback */
+    void outgoing_flow_cb();
+
+    /**
+     * Relay data held back by the scheduler before tearing down
+     *
+     * @param[in] flow  The Flow with the held back data
+     * @param[in] relay The relay callback for the Flow's direction
+     *
+     * @returns true  - Success (Or nothing was held back)
+     * @returns false - Failure (Object destroyed)
+     */
+    bool drain_flow(Shaper::Flow& flow,
+                    bool (Session::*relay)());
+    /** @} */
+
     /** The Client to SOCKS server bufferevent read callback */
     void incoming_read_cb();
 
-    /** The State::kREAD_METHODS read callback */
-    void incoming_read_methods_cb();
+    /**
+     * The State::kREAD_METHODS read callback
+     *
+     * @returns true  - A message was consumed, and the session is still alive
+     * @returns false - More data is needed, or the session is being closed
+     */
+    bool incoming_read_methods_cb();
+
+    /**
+     * The State::kAUTHENTICATING read callback
+     *
+     * @returns true  - A message was consumed, and the session is still alive
+     * @returns false - More data is needed, or the session is being closed
+     */
+    bool incoming_read_auth_cb();
+
+    /**
+     * The State::kREAD_REQUEST read callback
+     *
+     * @returns false - Always, as the request is the final message
+     */
+    bool incoming_read_request_cb();
 
-    /** The State::kAUTHENTICATING read callback */
-    void incoming_read_auth_cb();
+    /** The State::kESTABLISHED (and later) read callback */
+    void incoming_read_established();
 
-    /** The State::kREAD_REQUEST read callback */
-    void incoming_read_request_cb();
+    /** Schedule a incoming_flow_cb() for already buffered data */
+    void incoming_kick();
+
+    /** Start connecting to the remote peer once admitted */
+    void start_connect();
+
+    /** Set the priority of incoming_ and outgoing_ */
+    void set_priority(const Priority priority);
+
+    /**
+     * Send a optimistic SOCKSv5 success response
+     *
+     * Called when the outgoing connection is established if
+     * Config::optimistic_socks is set, before the transport handshake has
+     * completed.  Client data is queued (up to kMaxEarlyDataSize bytes) till
+     * the transport calls send_socks5_response().
+     *
+     * @returns true  - Response sent
+     * @returns false - Session torn down
+     */
+    bool send_socks5_early_response();
+
+    /**
+     * Fill in the BND.ADDR/BND.PORT fields of a SOCKSv5 response
+     *
+     * @param[out] resp     The response buffer (at least 22 bytes)
+     * @param[out] resp_len The length of the response
+     *
+     * @returns true  - Success
+     * @returns false - Failed to query the outgoing_ local address
+     */
+    bool get_bound_addr(uint8_t* resp,
+                        size_t& resp_len);
+
+    /** Start relaying once the session is established */
+    void on_established();
+
+    /** Free the handshake only state (connect/race timers, credentials) */
+    void release_handshake_state();
 
     /** The SOCKS server to Client bufferevent write callback */
     void incoming_write_cb();
@@ -333,9 +755,19 @@ class Socks5Server {
     /** The SOCKS server to Remote peer bufferevent connect callback */
     void outgoing_connect_cb(const short events);
 
+    /**
+     * Send the SOCKS error response matching a failed outgoing connection
+     *
+     * @param[in] err The socket error the connection attempt failed with
+     */
+    void outgoing_connect_failed(const int err);
+
     /** The Remote peer to SOCKS server bufferevent read callback */
     void outgoing_read_cb();
 
+    /** Schedule a outgoing_flow_cb() for already buffered data */
+    void outgoing_kick();
+
     /** The SOCKS server to Remote peer bufferevent write callback */
     void outgoing_write_cb();
 
@@ -347,6 +779,12 @@ class Socks5Server {
     /**
      * Open a TCP/IP connection to remote_addr_
      *
+     * If Config::tcp_fastopen is set and the platform supports it, the
+     * socket is created with TCP_FASTOPEN_CONNECT so that the connect
+     * completes immediately, and the SYN is sent along with the first
+     * flight written by on_outgoing_connected().  When a Fast Open cookie
+     * for the peer is cached, this saves a round trip.
+     *
      * @note Even if the bufferevent_socket_connect() call fails, this will
      * return true as the failure state for that is handled in
      * outgoing_connect_cb()
@@ -358,11 +796,384 @@ class Socks5Server {
     /** @} */
 
     /** @{ */
-    /** Apply backpressure to incoming if needed */
-    void incoming_apply_backpressure();
+    /**
+     * Query the warm pool key (remote peer and credentials)
+     */
+    ::std::string pool_key() const;
+
+    /**
+     * Start connecting/handshaking a warm pool or race fallback connection
+     *
+     * The Session was created without a client, and will connect to the same
+     * remote peer with the same credentials as origin.  Once the handshake
+     * completes send_socks5_response() parks it in the warm pool (or splices
+     * the race partner's client onto it) instead of responding.
+     *
+     * @param[in] origin  The Session that the connection is for
+     *
+     * @returns true  - Success
+     * @returns false - Failure (Caller should close the Session)
+     */
+    bool warm_connect(const Session& origin);
+
+    /** Allocate pool_ev_ for a Session without a SOCKS client */
+    bool pool_ev_init();
+
+    /**
+     * Replay auth_creds_ through on_client_authenticate()
+     *
+     * @returns true  - Success (Or there were no credentials)
+     * @returns false - The transport rejected the credentials
+     */
+    bool replay_auth();
+
+    /**
+     * Splice a client onto a warm pool connection
+     *
+     * The client's incoming_ is moved over, and the SOCKS response is sent
+     * immediately.  Data the peer sent while idle is processed from a
+     * deferred event, so client is never touched after this returns.  The
+     * caller is responsible for closing client, even on failure.
+     *
+     * @param[in] client  The Session with the client that sent the request
+     *
+     * @returns true  - Success
+     * @returns false - Failure (Object destroyed)
+     */
+    bool adopt_client(Session& client);
+    /** @} */
+
+    /** @{ */
+    /** The fallback race delay callback */
+    void race_timeout_cb();
+
+    /**
+     * Start the fallback Session for race_arm()
+     *
+     * @returns true  - Success
+     * @returns false - Failure (The handshake continues without a fallback)
+     */
+    bool race_start();
+
+    /**
+     * Handle the fallback Session losing
+     *
+     * Called on the fallback Session when its handshake fails.  If the origin
+     * Session was only waiting on the fallback, it is failed as well.
+     */
+    void race_fallback_failed();
+
+    /** Detach from race_partner_ */
+    void race_unlink();
+
+    /** Tear down a Session without a SOCKS client from the event loop */
+    void close_deferred();
+    /** @} */
+
+    /**
+     * Start the transport handshake over embedder supplied bufferevents
+     *
+     * The Session skips SOCKS negotiation and the outgoing connect entirely,
+     * and reports the handshake result to observer instead of sending a
+     * SOCKS response.  Ownership of plaintext and ciphertext is always taken.
+     *
+     * @param[in] observer    The embedder to notify
+     * @param[in] plaintext   The application side bufferevent (incoming_)
+     * @param[in] ciphertext  The remote peer side bufferevent (outgoing_)
+     * @param[in] addr        The remote peer address
+     * @param[in] addr_len    The length of addr
+     * @param[in] args        The transport arguments (Eg: "password=...")
+     *
+     * @returns true  - Success
+     * @returns false - Failure (Caller should close the Session)
+     */
+    bool embed_connect(SessionObserver& observer,
+                       struct bufferevent* plaintext,
+                       struct bufferevent* ciphertext,
+                       const struct sockaddr* addr,
+                       const socklen_t addr_len,
+                       const ::std::string& args);
+
+    /** @{ */
+    /**
+     * Recalculate the backpressure thresholds
+     *
+     * In BufferMode::kADAPTIVE, this queries the outgoing_ socket's
+     * bandwidth-delay product and scales the thresholds to match, clamped to
+     * the configured minimum/maximum.  The BDP query is rate limited to once
+     * every kBufferLimitInterval seconds, and leaves the thresholds unchanged
+     * if the estimate is unavailable.
+     *
+     * If a BufferBudget is configured, the current buffer usage is reported,
+     * and the thresholds are further limited to the Session's credit.
+     *
+     * Besides the relay path, this is driven by buffer_limit_cb() every
+     * kBufferLimitInterval seconds, so that thresholds track the BDP and the
+     * credit even when nothing is being relayed (Eg: while throttled).
+     *
+     * @param[in] active  Was data relayed since the last call?
+     */
+    void update_buffer_limits(const bool active);
+
+    /** Query the total amount of data buffered by the Session */
+    size_t buffered_bytes() const;
+
+    /**
+     * The BufferBudget credit reduction callback
+     *
+     * Throttles to the reduced credit, and releases the buffers that are
+     * reallocated on demand via release_idle_buffers().
+     *
+     * @returns The amount of data buffered afterwards (buffered_bytes())
+     */
+    size_t budget_shrink_cb();
+
+    /**
+     * Apply backpressure to incoming if needed
+     *
+     * @param[in] active  Was data relayed since the last call?
+     */
+    void incoming_apply_backpressure(const bool active = true);
+
+    /**
+     * Apply backpressure to outgoing if needed
+     *
+     * @param[in] active  Was data relayed since the last call?
+     */
+    void outgoing_apply_backpressure(const bool active = true);
+
+    /**
+     * Throttle or unthrottle incoming based on outgoing_'s write buffer
+     *
+     * @param[in] limit_changed  Did outgoing_buffer_limit_ change since the
+     *                           throttling was last applied?
+     */
+    void incoming_enforce_limit(const bool limit_changed);
+
+    /**
+     * Throttle or unthrottle outgoing based on incoming_'s write buffer
+     *
+     * @param[in] limit_changed  Did incoming_buffer_limit_ change since the
+     *                           throttling was last applied?
+     */
+    void outgoing_enforce_limit(const bool limit_changed);
+    /** @} */
+  };
+
+  /**
+   * A statically dispatched SOCKSv5 session
+   *
+   * Transports that derive from TransportSession<T> (where T is the transport
+   * itself) have the relay path dispatched directly to T::on_incoming_data()
+   * and T::on_outgoing_data() once the Session is established, instead of
+   * going through the generic state machine and a virtual call for every read.
+   * The negotiation and handshake still go through Session as usual.
+   *
+   * @warning T must be a friend of TransportSession<T>, as the callbacks are
+   * usually not public.
+   */
+  template<class T>
+  class TransportSession : public Session {
+   public:
+    /**
+     * Construct a TransportSession
+     *
+     * @param[in] server        The Socks5Server associated with the session
+     * @param[in] base          The libevent2 event_base associated with the
+     *                          Socks5Server
+     * @param[in] sock          The Client to SOCKS server socket
+     * @param[in] addr          The Client address/port
+     * @param[in] require_auth  Authentication is required?
+     * @param[in] scrub_addrs   Scrub addresses in logs
+     */
+    TransportSession(Socks5Server& server,
+                     struct event_base* base,
+                     const evutil_socket_t sock,
+                     const ::std::string& addr,
+                     const bool require_auth = false,
+                     const bool scrub_addrs = true) :
+        Session(server, base, sock, addr, require_auth, scrub_addrs) {
+      incoming_relay_cb_ = [](struct bufferevent* bev,
+                              void* ctx) {
+        (void)bev;
+
+        static_cast<TransportSession*>(reinterpret_cast<Session*>(ctx))->
+            relay_incoming();
+      };
+      outgoing_relay_cb_ = [](struct bufferevent* bev,
+                              void* ctx) {
+        (void)bev;
+
+        static_cast<TransportSession*>(reinterpret_cast<Session*>(ctx))->
+            relay_outgoing();
+      };
+    }
+
+    virtual ~TransportSession() = default;
+
+   private:
+    TransportSession(const TransportSession&) = delete;
+    void operator=(const TransportSession&) = delete;
+
+    /** The State::kESTABLISHED incoming_ read callback */
+    void relay_incoming() {
+      if (state_ != State::kESTABLISHED) {
+        incoming_read_cb();
+        return;
+      }
+      if (!incoming_valid_ || !outgoing_valid_)
+        return;
+      if (!incoming_flow_.begin(incoming_))
+        return;
+      struct evbuffer* buf = ::bufferevent_get_input(incoming_);
+      const size_t len = ::evbuffer_get_length(buf);
+      if (static_cast<T*>(this)->T::on_incoming_data()) {
+        incoming_flow_.end(incoming_);
+        incoming_apply_backpressure(len != ::evbuffer_get_length(buf));
+      }
+    }
+
+    /** The State::kESTABLISHED outgoing_ read callback */
+    void relay_outgoing() {
+      if (state_ != State::kESTABLISHED) {
+        outgoing_read_cb();
+        return;
+      }
+      if (!incoming_valid_ || !outgoing_valid_)
+        return;
+      if (!outgoing_flow_.begin(outgoing_))
+        return;
+      struct evbuffer* buf = ::bufferevent_get_input(outgoing_);
+      const size_t len = ::evbuffer_get_length(buf);
+      if (static_cast<T*>(this)->T::on_outgoing_data()) {
+        outgoing_flow_.end(outgoing_);
+        outgoing_apply_backpressure(len != ::evbuffer_get_length(buf));
+      }
+    }
+  };
+
+  /** Warm pool refill policy */
+  enum class WarmPoolRefill {
+    kON_USE,  /**< Top up the pool when a client uses the remote peer */
+    kEAGER    /**< Also replace warm connections that expired */
+  };
+
+  /** The default warm connection idle lifetime in seconds */
+  static constexpr int kDefaultWarmPoolIdle = 60;
+
+  /** Backpressure threshold selection mode */
+  enum class BufferMode {
+    kFIXED,     /**< Always throttle at a fixed buffer size */
+    kADAPTIVE   /**< Throttle based on the measured bandwidth-delay product */
+  };
+
+  /** The default BufferMode::kADAPTIVE minimum threshold */
+  static constexpr size_t kDefaultBufferMin = 16384;
+  /** The default BufferMode::kADAPTIVE maximum threshold */
+  static constexpr size_t kDefaultBufferMax = 4 * 1024 * 1024;
+
+  /**
+   * Socks5Server tunables
+   *
+   * The defaults are what main() uses when nothing is specified on the command
+   * line.
+   */
+  struct Config {
+    Config() :
+        buffer_mode(BufferMode::kADAPTIVE),
+        buffer_min(kDefaultBufferMin),
+        buffer_max(kDefaultBufferMax),
+        budget(nullptr),
+#ifdef ENABLE_IO_URING
+        io_uring(nullptr),
+#endif
+        shaper(nullptr),
+        optimistic_socks(false),
+        handshake_limit(0),
+        handshake_queue_limit(0),
+        listen_backlog(-1),
+        defer_accept(true),
+        tcp_cork(false),
+        tcp_fastopen(false),
+        tcp_keepalive(0),
+        tcp_user_timeout(0),
+        handshake_race_delay(0),
+        warm_pool_size(0),
+        warm_pool_idle(kDefaultWarmPoolIdle),
+        warm_pool_refill(WarmPoolRefill::kON_USE),
+        idle_timeout(0),
+        idle_reap(0) {}
+
+    /** @{ */
+    BufferMode buffer_mode; /**< Backpressure threshold mode */
+    size_t buffer_min;      /**< Minimum threshold (kADAPTIVE) */
+    size_t buffer_max;      /**< Maximum threshold (kADAPTIVE) */
+    /** @} */
+
+    /** The process wide buffer budget (nullptr = Unlimited) */
+    BufferBudget* budget;
+
+#ifdef ENABLE_IO_URING
+    /** The io_uring to relay established sessions with (nullptr = libevent2) */
+    net::IoUring* io_uring;
+#endif
+
+    /**
+     * The rate limits and relay scheduler (nullptr = Unlimited)
+     *
+     * Sessions that are rate limited are never moved to Config::io_uring.
+     */
+    Shaper* shaper;
+
+    /** Send the SOCKS response before the transport handshake completes? */
+    bool optimistic_socks;
+
+    /** @{ */
+    /** Maximum concurrent State::kCONNECTING Sessions (0 = Unlimited) */
+    size_t handshake_limit;
+    /** Maximum Sessions waiting for admission (0 = Unlimited) */
+    size_t handshake_queue_limit;
+    /** @} */
+
+    /** @{ */
+    /** The listen() backlog (-1 = libevent2 default) */
+    int listen_backlog;
+    /** Defer accepting clients till they send data (TCP_DEFER_ACCEPT)? */
+    bool defer_accept;
+    /** @} */
+
+    /** @{ */
+    /** Cork the outgoing connection till the first flight is written? */
+    bool tcp_cork;
+    /** Send the first flight in the SYN (TCP_FASTOPEN_CONNECT)? */
+    bool tcp_fastopen;
+    /** Probe outgoing connections idle for this many sec (0 = Disabled) */
+    int tcp_keepalive;
+    /** Reset outgoing connections unacked for this many ms (0 = Disabled) */
+    unsigned int tcp_user_timeout;
+    /** @} */
+
+    /**
+     * Race a fallback handshake after this many milliseconds (0 = Disabled)
+     *
+     * Only used by transports that call Session::race_arm().
+     */
+    int handshake_race_delay;
+
+    /** @{ */
+    /** Handshaked connections kept per remote peer (0 = Disabled) */
+    size_t warm_pool_size;
+    /** The idle lifetime of a warm connection in seconds */
+    int warm_pool_idle;
+    /** When to replace warm connections */
+    WarmPoolRefill warm_pool_refill;
+    /** @} */
 
-    /** Apply backpressure to outgoing if needed */
-    void outgoing_apply_backpressure();
+    /** @{ */
+    /** Release the buffers of Sessions idle for this many sec (0 = Disabled) */
+    int idle_timeout;
+    /** Close Sessions idle for this many sec (0 = Disabled) */
+    int idle_reap;
     /** @} */
   };
 
@@ -382,7 +1193,8 @@ class Socks5Server {
      * @param[in] server      The Socks5Server associated with the session
      * @param[in] base        The libevent2 event_base associated with the
      *                        Socks5Server
-     * @param[in] sock        The Client to SOCKS server socket
+     * @param[in] sock        The Client to SOCKS server socket (-1 when
+     *                        creating a warm pool connection)
      * @param[in] addr        The Client address/port
      * @param[in] scrub_addrs Scrub addresses in logs
      *
@@ -394,6 +1206,54 @@ class Socks5Server {
                                     const evutil_socket_t sock,
                                     const ::std::string& addr,
                                     const bool scrub_addrs = true) = 0;
+
+    /** Return the SessionSlab that backs the created Sessions */
+    const SessionSlab& slab() const { return slab_; }
+
+   protected:
+    /**
+     * Construct a Session of type T from the SessionSlab
+     *
+     * @param[in] arena_len The minimum size of the Session's Arena
+     * @param[in] args      The arguments to T's constructor
+     *
+     * @returns A pointer to the new Session
+     * @returns nullptr - Allocation failed
+     */
+    template<class T, typename... Args>
+    Session* new_session(const size_t arena_len,
+                         Args&&... args) {
+      T* session = new(slab_, arena_len) T(::std::forward<Args>(args)...);
+      if (session != nullptr)
+        static_cast<Session*>(session)->arena_ =
+            SessionSlab::object_arena(session);
+      return session;
+    }
+
+   private:
+    SessionSlab slab_;  /**< The Session memory recycler */
+  };
+
+  /**
+   * Session Observer
+   *
+   * Sessions created with create_embedded_session() do not have a SOCKS
+   * client to send the handshake result to, so it is reported here instead.
+   * The callbacks are invoked from inside the Session, so implementations
+   * *MUST NOT* close the Session from them.
+   */
+  class SessionObserver {
+   public:
+    virtual ~SessionObserver() = default;
+
+    /** The transport handshake completed, data can be relayed */
+    virtual void on_session_established(Session* session) = 0;
+
+    /** The transport handshake failed, the Session will be closed */
+    virtual void on_session_failed(Session* session) = 0;
+
+    /** The Session is being destroyed */
+    virtual void on_session_closed(Session* session) = 0;
   };
 
   /**
@@ -404,19 +1264,47 @@ class Socks5Server {
    *                        instances for client connections
    * @param[in] base        The libevent2 event_base to use
    * @param[in] scrub_addrs Scrub addresses in logs
+   * @param[in] config      The tunables to use
    */
   Socks5Server(const std::string& state_dir,
                SessionFactory* factory,
                struct event_base* base,
-               const bool scrub_addrs = true) :
+               const bool scrub_addrs = true,
+               const Config& config = Config()) :
       state_dir_(state_dir),
       factory_(factory),
       base_(base),
       scrub_addrs_(scrub_addrs),
+      config_(config),
       logger_(::el::Loggers::getLogger(SOCKS5_LOGGER)),
       listener_(nullptr),
       listener_addr_(),
-      listener_addr_str_() {}
+      listener_addr_str_(),
+      common_timeouts_(),
+      timer_wheel_(base, kTimerWheelTick, kTimerWheelSlots, Priority::kTIMER),
+      connect_wheel_(base, kConnectWheelTick, kConnectWheelSlots,
+                     Priority::kTIMER),
+      admission_ev_(nullptr),
+      nr_handshakes_(0),
+      nr_admitted_(0),
+      nr_queued_(0),
+      nr_rejected_(0),
+      nr_queue_expired_(0),
+      peak_queue_depth_(0),
+      total_wait_usec_(0),
+      max_wait_usec_(0),
+      nr_pool_hits_(0),
+      nr_pool_misses_(0),
+      nr_pool_warmed_(0),
+      nr_pool_failed_(0),
+      nr_pool_expired_(0),
+      nr_races_(0),
+      nr_race_fallback_wins_(0),
+      nr_idle_(0),
+      nr_idle_reaped_(0),
+      nr_dead_peers_(0),
+      idle_reclaimed_(0),
+      idle_compacted_(0) {}
 
   ~Socks5Server();
 
@@ -426,6 +1314,11 @@ class Socks5Server {
     return state_dir_;
   }
 
+  /** Query the tunables */
+  const Config& config() const {
+    return config_;
+  }
+
   /**
    * Query the local address that the Socks5Server is listening on
    *
@@ -435,6 +1328,30 @@ class Socks5Server {
    * @returns false - The Socks5Server is not listening (Call bind())
    */
   bool addr(struct sockaddr_in& addr) const;
+
+  /**
+   * Query the TimerWheel for fine grained Session timers
+   *
+   * The wheel has a 1 ms granularity, and is intended for timers that are
+   * rearmed frequently (eg: IAT obfuscation).
+   */
+  TimerWheel& timer_wheel() {
+    return timer_wheel_;
+  }
+
+  /**
+   * Get a libevent2 common timeout for a fixed duration
+   *
+   * Timers armed with the same common timeout are kept in a FIFO queue
+   * instead of the event_base's min-heap, so arming and cancelling them is
+   * O(1).  The returned timeval should be passed to evtimer_add() as is.
+   *
+   * @param[in] msec  The timeout in milliseconds
+   *
+   * @returns A pointer to a timeval that is valid for the lifetime of the
+   *          Socks5Server
+   */
+  const struct timeval* common_timeout(const uint64_t msec);
   /** @} */
 
   /** @{ */
@@ -464,6 +1381,39 @@ class Socks5Server {
   /** Close all of the existing sessions */
   void close_sessions();
 
+  /**
+   * Create a Session that is driven by an embedding application
+   *
+   * Instead of a SOCKS client and a TCP/IP connection, the Session reads
+   * and writes plaintext and ciphertext from the supplied bufferevents
+   * (typically one end each of a bufferevent_pair), and the transport
+   * handshake is started immediately.  The listener does not need to be
+   * bound.
+   *
+   * @param[in] observer    The embedder to notify of the handshake result
+   * @param[in] plaintext   The application data bufferevent
+   * @param[in] ciphertext  The remote peer bufferevent
+   * @param[in] addr        The remote peer address
+   * @param[in] addr_len    The length of addr
+   * @param[in] args        The transport arguments (Eg: "password=...")
+   *
+   * @note Ownership of plaintext and ciphertext is always taken.
+   * @note plaintext and ciphertext should use BEV_OPT_DEFER_CALLBACKS, as the
+   *       Session reenables reading from its own timers.
+   *
+   * @returns A pointer to a Session in the session table
+   * @returns nullptr - Session creation failed
+   */
+  Session* create_embedded_session(SessionObserver& observer,
+                                   struct bufferevent* plaintext,
+                                   struct bufferevent* ciphertext,
+                                   const struct sockaddr* addr,
+                                   const socklen_t addr_len,
+                                   const ::std::string& args);
+
+  /** Log the SOCKS server's statistics */
+  void log_stats() const;
+
   /**
    * Convert a sockaddr to a std::string
    *
@@ -512,15 +1462,163 @@ class Socks5Server {
                          struct sockaddr* addr,
                          int len);
 
+  /** @{ */
+  /**
+   * Request a handshake slot for a Session
+   *
+   * Sessions that can not be admitted immediately are queued in FIFO order,
+   * and Session::start_connect() is called when a slot frees up.  Sessions
+   * still queued after kHandshakeQueueTimeout seconds are failed.
+   *
+   * @param[in] session The Session that wishes to start handshaking
+   *
+   * @returns true  - The Session was admitted or queued
+   * @returns false - The admission queue is full
+   */
+  bool admit_handshake(Session* session);
+
+  /**
+   * Release a Session's handshake slot or admission queue entry
+   *
+   * @param[in] session The Session that is done handshaking
+   */
+  void release_handshake(Session* session);
+
+  /** Expire stale queued Sessions, and admit the rest while there are slots */
+  void on_admission();
+  /** @} */
+
+  /**
+   * Create a Session that does not have a client (yet)
+   *
+   * @param[in] addr  The string to use as the client address in logs
+   *
+   * @returns A pointer to a Session in the session table
+   * @returns nullptr - Session creation failed
+   */
+  Session* create_clientless_session(const char* addr);
+
+  /** @{ */
+  /**
+   * Take an idle warm connection out of the pool
+   *
+   * @param[in] key The warm pool key (Session::pool_key())
+   *
+   * @returns A handshaked Session in State::kPOOLED
+   * @returns nullptr - No warm connection is available
+   */
+  Session* pool_take(const ::std::string& key);
+
+  /**
+   * Start warm connections till the pool for a remote peer is full
+   *
+   * @param[in] origin  A Session connecting to the remote peer
+   * @param[in] key     The warm pool key (Session::pool_key())
+   */
+  void pool_refill(const Session& origin,
+                   const ::std::string& key);
+
+  /**
+   * Add a Session that just finished handshaking to the warm pool
+   *
+   * @param[in] session The warm connection
+   */
+  void pool_park(Session* session);
+
+  /**
+   * Remove a warm connection that failed or was closed by the remote peer
+   *
+   * @param[in] session The warm connection
+   */
+  void pool_discard(Session* session);
+
+  /**
+   * Release a Session's warm pool entry
+   *
+   * @param[in] session The Session
+   */
+  void pool_release(Session* session);
+
+  /** The warm connection idle/teardown event callback */
+  void on_pool_event(Session* session);
+  /** @} */
+
+  /** The admission queue timeout in seconds */
+  static constexpr int kHandshakeQueueTimeout = 30;
+
+  /** @{ */
+  /**
+   * The TimerWheel granularity in usec
+   *
+   * This matches the millisecond timer resolution of the epoll(7) event
+   * loop, which is the real resolution of the wheel regardless of the tick.
+   */
+  static constexpr uint32_t kTimerWheelTick = 1000;
+  /** The number of TimerWheel buckets (Covers 16 ms per revolution) */
+  static constexpr size_t kTimerWheelSlots = 16;
+  /** The connect timeout TimerWheel granularity in usec */
+  static constexpr uint32_t kConnectWheelTick = 1000000;
+  /** The number of connect timeout TimerWheel buckets (Covers 128 sec) */
+  static constexpr size_t kConnectWheelSlots = 128;
+  /** @} */
+
   ::std::string state_dir_;   /**< The state directory for Sessions */
   SessionFactory* factory_;   /**< The factory used to create Sessions */
   struct event_base* base_;   /**< The libevent2 event_base */
   const bool scrub_addrs_;    /**< Should scrub addresses when logging? */
+  const Config config_;       /**< The tunables */
   ::el::Logger* logger_;      /**< The SOCKS server logger */
   struct evconnlistener* listener_;   /**< The SOCKS server socket */
   struct sockaddr_in listener_addr_;  /**< The SOCKS server socket address */
   ::std::string listener_addr_str_;   /**< The SOCKS 5 server socket address */
+  /** The common timeouts, keyed by duration in milliseconds */
+  ::std::map<uint64_t, struct timeval> common_timeouts_;
+  TimerWheel timer_wheel_;  /**< The fine grained Session timers */
+  TimerWheel connect_wheel_;  /**< The Session connect timeouts */
   ::std::list< ::std::unique_ptr<Session>> sessions_; /**< The session table */
+
+  /** @{ */
+  struct event* admission_ev_;  /**< The admission/queue timeout event */
+  ::std::list<Session*> handshake_queue_; /**< Sessions awaiting admission */
+  size_t nr_handshakes_;        /**< Sessions holding a handshake slot */
+  size_t nr_admitted_;          /**< Total Sessions admitted */
+  size_t nr_queued_;            /**< Total Sessions that had to wait */
+  size_t nr_rejected_;          /**< Total Sessions rejected */
+  size_t nr_queue_expired_;     /**< Total Sessions that waited too long */
+  size_t peak_queue_depth_;     /**< The peak admission queue depth */
+  uint64_t total_wait_usec_;    /**< Total admission wait time */
+  uint64_t max_wait_usec_;      /**< Longest admission wait time */
+  /** @} */
+
+  /** A remote peer's warm connections */
+  struct WarmPool {
+    WarmPool() : nr_warming(0) {}
+
+    ::std::list<Session*> idle; /**< Handshaked Sessions, oldest first */
+    size_t nr_warming;          /**< Sessions still handshaking */
+  };
+
+  /** @{ */
+  ::std::map< ::std::string, WarmPool> warm_pools_; /**< The warm pools */
+  size_t nr_pool_hits_;     /**< Total requests served from the warm pool */
+  size_t nr_pool_misses_;   /**< Total requests that found the pool empty */
+  size_t nr_pool_warmed_;   /**< Total warm connections that handshaked */
+  size_t nr_pool_failed_;   /**< Total warm connections lost before use */
+  size_t nr_pool_expired_;  /**< Total warm connections that idled out */
+  /** @} */
+
+  /** @{ */
+  size_t nr_races_;               /**< Total fallback handshakes started */
+  size_t nr_race_fallback_wins_;  /**< Total fallback handshakes that won */
+  /** @} */
+
+  /** @{ */
+  size_t nr_idle_;              /**< Total times Sessions went idle */
+  size_t nr_idle_reaped_;       /**< Total Sessions closed for being idle */
+  size_t nr_dead_peers_;        /**< Total remote peers that timed out */
+  uint64_t idle_reclaimed_;     /**< Total bytes released by idle Sessions */
+  uint64_t idle_compacted_;     /**< Total bytes compacted by idle Sessions */
+  /** @} */
 };
 
 } // namespace schwanenlied
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "schwanenlied/buffer_budget.h"
+#include "schwanenlied/socks5_server.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+/** The kFIXED threshold (Session::kMaxBufferSize) */
+static constexpr size_t kMaxBufferSize = 65536;
+/** The budget, enough for 2 * kMaxBufferSize per direction when alone */
+static constexpr size_t kBudget = 4 * kMaxBufferSize;
+/** The threshold with the budget split 4 ways */
+static constexpr size_t kSmallLimit = kBudget / 4 / 2;
+static constexpr size_t kChunkSize = 4096;
+
+/** A transport that relays the data as is */
+class PassthroughSession : public Socks5Server::Session {
+ public:
+  PassthroughSession(Socks5Server& server,
+                     struct event_base* base,
+                     const evutil_socket_t sock,
+                     const ::std::string& addr) :
+      Session(server, base, sock, addr) {}
+
+ protected:
+  bool on_outgoing_connected() override {
+    return send_socks5_response(Reply::kSUCCEDED);
+  }
+
+  bool on_incoming_data() override {
+    return 0 == ::bufferevent_write_buffer(outgoing_,
+                                           ::bufferevent_get_input(incoming_));
+  }
+
+  bool on_outgoing_data_connecting() override {
+    return true;
+  }
+
+  bool on_outgoing_data() override {
+    return 0 == ::bufferevent_write_buffer(incoming_,
+                                           ::bufferevent_get_input(outgoing_));
+  }
+};
+
+class PassthroughFactory : public Socks5Server::SessionFactory {
+ public:
+  Socks5Server::Session* create_session(Socks5Server& server,
+                                        struct event_base* base,
+                                        const evutil_socket_t sock,
+                                        const ::std::string& addr,
+                                        const bool scrub_addrs) override {
+    (void)scrub_addrs;
+
+    return new_session<PassthroughSession>(0, server, base, sock, addr);
+  }
+};
+
+/*
+ * The tests run an embedded Session over bufferevent pairs, with the peer
+ * not reading so that the application's data piles up in the Session's
+ * outgoing write buffer, and change the BufferBudget credit under it.
+ */
+class Socks5ServerTest : public ::testing::Test,
+                         public Socks5Server::SessionObserver {
+ protected:
+  virtual void SetUp() {
+    ::el::Configurations conf;
+    conf.setToDefault();
+    conf.setGlobally(::el::ConfigurationType::ToFile, "false");
+    conf.setGlobally(::el::ConfigurationType::Enabled, "false");
+    ::el::Loggers::setDefaultConfigurations(conf, true);
+
+    base_ = ::event_base_new();
+    ASSERT_TRUE(base_ != nullptr);
+    ASSERT_EQ(0, ::event_base_priority_init(base_,
+                                            Socks5Server::kNrPriorities));
+    budget_.reset(new BufferBudget(kBudget, kChunkSize));
+
+    Socks5Server::Config config;
+    config.buffer_mode = Socks5Server::BufferMode::kFIXED;
+    config.budget = budget_.get();
+    server_.reset(new Socks5Server("", &factory_, base_, true, config));
+
+    app_ = nullptr;
+    peer_ = nullptr;
+    session_in_ = nullptr;
+    session_out_ = nullptr;
+    to_send_ = 0;
+    established_ = false;
+    failed_ = false;
+  }
+
+  virtual void TearDown() {
+    server_.reset();
+    dummies_.clear();
+    budget_.reset();
+    if (app_ != nullptr)
+      ::bufferevent_free(app_);
+    if (peer_ != nullptr)
+      ::bufferevent_free(peer_);
+    ::event_base_free(base_);
+  }
+
+  void on_session_established(Socks5Server::Session* session) override {
+    (void)session;
+    established_ = true;
+  }
+
+  void on_session_failed(Socks5Server::Session* session) override {
+    (void)session;
+    failed_ = true;
+  }
+
+  void on_session_closed(Socks5Server::Session* session) override {
+    (void)session;
+    failed_ = true;
+  }
+
+  /** Write the next chunk of the application data once the last one moved */
+  static void app_write_cb(struct bufferevent* bev,
+                           void* arg) {
+    Socks5ServerTest* test = reinterpret_cast<Socks5ServerTest*>(arg);
+    if (test->to_send_ == 0)
+      return;
+
+    static const uint8_t chunk[kChunkSize] = { 0 };
+    const size_t len = ::std::min(test->to_send_, kChunkSize);
+    ASSERT_EQ(0, ::bufferevent_write(bev, chunk, len));
+    test->to_send_ -= len;
+  }
+
+  static void peer_read_cb(struct bufferevent* bev,
+                           void* arg) {
+    (void)arg;
+
+    struct evbuffer* buf = ::bufferevent_get_input(bev);
+    ASSERT_EQ(0, ::evbuffer_drain(buf, ::evbuffer_get_length(buf)));
+  }
+
+  void new_session() {
+    const int opts = BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS;
+    struct bufferevent* plaintext[2];
+    struct bufferevent* ciphertext[2];
+    ASSERT_EQ(0, ::bufferevent_pair_new(base_, opts, plaintext));
+    ASSERT_EQ(0, ::bufferevent_pair_new(base_, opts, ciphertext));
+    app_ = plaintext[1];
+    peer_ = ciphertext[1];
+    session_in_ = plaintext[0];
+    session_out_ = ciphertext[0];
+    ::bufferevent_setcb(app_, nullptr, app_write_cb, nullptr, this);
+    ::bufferevent_enable(app_, EV_WRITE);
+    ::bufferevent_setcb(peer_, peer_read_cb, nullptr, nullptr, this);
+    ::bufferevent_enable(peer_, EV_WRITE);
+
+    struct sockaddr_in addr;
+    ::std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(443);
+    ASSERT_TRUE(server_->create_embedded_session(*this, plaintext[0],
+                                                 ciphertext[0],
+                                                 reinterpret_cast<struct
+                                                     sockaddr*>(&addr),
+                                                 sizeof(addr), "") != nullptr);
+    run(100);
+    ASSERT_TRUE(established_);
+  }
+
+  /** Start sending len bytes of application data */
+  void send(const size_t len) {
+    to_send_ = len;
+    app_write_cb(app_, this);
+  }
+
+  /** Register n Accounts that split the budget with the Session */
+  void add_dummies(const size_t n) {
+    struct timeval now;
+    ASSERT_EQ(0, ::event_base_gettimeofday_cached(base_, &now));
+    for (size_t i = 0; i < n; i++) {
+      dummies_.emplace_back(new BufferBudget::Account(nullptr, nullptr));
+      budget_->register_account(*dummies_.back(), now);
+    }
+  }
+
+  void run(const long msec) {
+    struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+    ASSERT_EQ(0, ::event_base_loopexit(base_, &tv));
+    ASSERT_EQ(0, ::event_base_dispatch(base_));
+    ASSERT_FALSE(failed_);
+  }
+
+  /** The application data buffered toward the peer */
+  size_t buffered() const {
+    return ::evbuffer_get_length(::bufferevent_get_output(session_out_));
+  }
+
+  bool throttled() const {
+    return 0 == (::bufferevent_get_enabled(session_in_) & EV_READ);
+  }
+
+  /** Check the write watermark that will unthrottle the Session */
+  void check_watermark(const size_t expected) {
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+    size_t low, high;
+    ASSERT_EQ(0, ::bufferevent_getwatermark(session_out_, EV_WRITE, &low,
+                                            &high));
+    ASSERT_EQ(expected, low);
+#else
+    (void)expected;
+#endif
+  }
+
+  struct event_base* base_;
+  ::std::unique_ptr<BufferBudget> budget_;
+  PassthroughFactory factory_;
+  ::std::unique_ptr<Socks5Server> server_;
+  ::std::vector< ::std::unique_ptr<BufferBudget::Account>> dummies_;
+  struct bufferevent* app_;         /**< The application end */
+  struct bufferevent* peer_;        /**< The remote peer end */
+  struct bufferevent* session_in_;  /**< The Session's incoming_ */
+  struct bufferevent* session_out_; /**< The Session's outgoing_ */
+  size_t to_send_;                  /**< Application data left to send */
+  bool established_;
+  bool failed_;
+};
+
+TEST_F(Socks5ServerTest, ThrottledLimitGrows) {
+  add_dummies(3);
+  new_session();
+  send(4 * kBudget);
+  run(200);
+  ASSERT_TRUE(throttled());
+  ASSERT_GT(buffered(), kSmallLimit);
+  ASSERT_LE(buffered(), kSmallLimit + kChunkSize);
+  check_watermark(kSmallLimit / 2);
+
+  /*
+   * Nothing is relayed while throttled and the peer is not reading, so only
+   * the periodic update can notice the larger credit and resume reading.
+   */
+  const size_t stalled = buffered();
+  dummies_.clear();
+  run(1500);
+  ASSERT_GT(buffered(), stalled);
+  ASSERT_GT(buffered(), kMaxBufferSize);
+  ASSERT_LE(buffered(), kMaxBufferSize + kChunkSize);
+  ASSERT_TRUE(throttled());
+  check_watermark(kMaxBufferSize / 2);
+}
+
+TEST_F(Socks5ServerTest, LimitShrinks) {
+  const size_t sent = kSmallLimit + kSmallLimit / 2;
+
+  new_session();
+  send(sent);
+  run(200);
+  ASSERT_FALSE(throttled());
+  ASSERT_EQ(sent, buffered());
+
+  // The reduced credit takes effect without any further data
+  add_dummies(3);
+  run(1500);
+  ASSERT_TRUE(throttled());
+  check_watermark(kSmallLimit / 2);
+
+  // And the Session resumes once the peer catches up
+  ::bufferevent_enable(peer_, EV_READ);
+  run(200);
+  ASSERT_FALSE(throttled());
+  ASSERT_EQ(0u, buffered());
+}
+
+TEST_F(Socks5ServerTest, ThrottledLimitShrinks) {
+  new_session();
+  send(4 * kBudget);
+  run(200);
+  ASSERT_TRUE(throttled());
+  ASSERT_GT(buffered(), kMaxBufferSize);
+  check_watermark(kMaxBufferSize / 2);
+
+  // Already throttled, so only the watermark changes
+  add_dummies(3);
+  run(1500);
+  ASSERT_TRUE(throttled());
+  check_watermark(kSmallLimit / 2);
+}
+
+} // namespace schwanenlied
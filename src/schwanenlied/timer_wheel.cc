@@ -0,0 +1,185 @@
+/**
+ * @file    timer_wheel.cc
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Hashed timing wheel for fine grained timers (IMPLEMENTATION)
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <ctime>
+
+#include "schwanenlied/timer_wheel.h"
+
+namespace schwanenlied {
+
+void TimerWheel::Timer::cancel() {
+  if (wheel_ != nullptr)
+    wheel_->unlink(*this);
+}
+
+TimerWheel::~TimerWheel() {
+  for (auto& head : slots_) {
+    while (head != nullptr)
+      unlink(*head);
+  }
+  if (tick_ev_ != nullptr)
+    ::event_free(tick_ev_);
+}
+
+bool TimerWheel::add(Timer& timer,
+                     const uint32_t usec) {
+  // Lazy timer initialization
+  if (tick_ev_ == nullptr) {
+    event_callback_fn cb = [](evutil_socket_t sock,
+                              short which,
+                              void* arg) {
+      (void)sock;
+      (void)which;
+      reinterpret_cast<TimerWheel*>(arg)->on_tick();
+    };
+    tick_ev_ = evtimer_new(base_, cb, this);
+    if (tick_ev_ == nullptr)
+      return false;
+    ::event_priority_set(tick_ev_, priority_);
+  }
+
+  timer.cancel();
+
+  // An idle wheel has nothing to catch up on
+  const uint64_t now_usec = now();
+  const uint64_t now_tick = now_usec / tick_usec_;
+  if (nr_pending_ == 0)
+    current_tick_ = ::std::max(current_tick_, now_tick);
+
+  /*
+   * Round the deadline to the nearest tick boundary, so that Timers are not
+   * biased early or late (A Timer fires within half a tick of it's deadline,
+   * plus the event loop latency).  A short delay can round to a tick that was
+   * already processed, so clamp it to the next tick to be processed instead
+   * of having it wait an entire revolution.
+   */
+  const size_t nr_slots = slots_.size() - 1;
+  const uint64_t expiry = ::std::max(current_tick_,
+      (now_usec + usec + tick_usec_ / 2) / tick_usec_);
+  timer.rounds_ = (expiry - current_tick_) / nr_slots;
+  link(timer, expiry % nr_slots);
+
+  if (!evtimer_pending(tick_ev_, nullptr)) {
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = tick_usec_;
+    evtimer_add(tick_ev_, &tv);
+  }
+
+  return true;
+}
+
+uint64_t TimerWheel::now() const {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void TimerWheel::link(Timer& timer,
+                      const size_t slot) {
+  timer.wheel_ = this;
+  timer.slot_ = slot;
+  timer.prev_ = nullptr;
+  timer.next_ = slots_[slot];
+  if (timer.next_ != nullptr)
+    timer.next_->prev_ = &timer;
+  slots_[slot] = &timer;
+  nr_pending_++;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+  SL_ASSERT(timer.wheel_ == this);
+
+  if (timer.prev_ != nullptr)
+    timer.prev_->next_ = timer.next_;
+  else
+    slots_[timer.slot_] = timer.next_;
+  if (timer.next_ != nullptr)
+    timer.next_->prev_ = timer.prev_;
+  timer.wheel_ = nullptr;
+  timer.prev_ = nullptr;
+  timer.next_ = nullptr;
+  nr_pending_--;
+}
+
+void TimerWheel::on_tick() {
+  const size_t nr_slots = slots_.size() - 1;
+  const uint64_t now_tick = now() / tick_usec_;
+
+  /*
+   * Move everything that expired since the last tick to the expired list.
+   * If the event loop fell behind by more than a revolution, each bucket is
+   * still only walked once, with every revolution that elapsed charged to
+   * the Timers in it.
+   */
+  if (now_tick >= current_tick_) {
+    const uint64_t nr_ticks = now_tick - current_tick_ + 1;
+    const uint64_t nr_walk = ::std::min<uint64_t>(nr_ticks, nr_slots);
+    for (uint64_t i = 0; i < nr_walk; i++) {
+      const uint64_t nr_visits = 1 + (nr_ticks - 1 - i) / nr_slots;
+      Timer* timer = slots_[(current_tick_ + i) % nr_slots];
+      while (timer != nullptr) {
+        Timer* next = timer->next_;
+        if (timer->rounds_ < nr_visits) {
+          unlink(*timer);
+          link(*timer, nr_slots);
+        } else
+          timer->rounds_ -= nr_visits;
+        timer = next;
+      }
+    }
+    current_tick_ = now_tick + 1;
+  }
+
+  /*
+   * Dispatch the expired Timers one at a time, since a callback is free to
+   * cancel, rearm or destroy any Timer (including itself).
+   */
+  while (slots_[nr_slots] != nullptr) {
+    Timer* timer = slots_[nr_slots];
+    unlink(*timer);
+    nr_fired_++;
+    timer->cb_(timer->ctx_);
+  }
+
+  if (nr_pending_ > 0 && !evtimer_pending(tick_ev_, nullptr)) {
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = tick_usec_;
+    evtimer_add(tick_ev_, &tv);
+  }
+}
+
+} // namespace schwanenlied
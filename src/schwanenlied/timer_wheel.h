@@ -0,0 +1,192 @@
+/**
+ * @file    timer_wheel.h
+ * @author  Yawning Angel (yawning at schwanenlied dot me)
+ * @brief   Hashed timing wheel for fine grained timers
+ */
+
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHWANENLIED_TIMER_WHEEL_H__
+#define SCHWANENLIED_TIMER_WHEEL_H__
+
+#include <vector>
+
+#include <event2/event.h>
+
+#include "schwanenlied/common.h"
+
+namespace schwanenlied {
+
+/**
+ * Hashed timing wheel for fine grained timers
+ *
+ * Timers are hashed into one of nr_slots buckets based on their expiry time
+ * (in ticks), so arming and cancelling a Timer is O(1) regardless of how many
+ * are pending.  Timers that expire more than one revolution into the future
+ * stay in their bucket for the remaining number of revolutions.  A single
+ * libevent2 timer drives the wheel, and is only armed while there are pending
+ * Timers.
+ *
+ * This is intended for short, frequently rearmed timers (eg: the ScrambleSuit
+ * IAT obfuscation timer) that would otherwise churn the event_base min-heap.
+ * Deadlines are rounded to the nearest tick, so a Timer fires within half a
+ * tick of when it was requested (plus the event loop latency), with no bias
+ * in either direction.  The wheel can not be driven faster than the event
+ * loop's timer resolution (1 ms for the epoll(7) and kqueue(2) backends), so
+ * ticks finer than that buy nothing.
+ *
+ * @warning This is not and will never be thread safe
+ */
+class TimerWheel {
+ public:
+  /** The callback invoked when a Timer expires */
+  typedef void (*Callback)(void* ctx);
+
+  /**
+   * A timer that can be armed on a TimerWheel
+   *
+   * Timers are intrusive, so arming one never allocates.  Destroying a pending
+   * Timer cancels it.
+   */
+  class Timer {
+   public:
+    /**
+     * Construct a Timer instance
+     *
+     * @param[in] cb  The callback to invoke on expiry
+     * @param[in] ctx The argument to pass to cb
+     */
+    Timer(Callback cb, void* ctx) :
+        wheel_(nullptr),
+        prev_(nullptr),
+        next_(nullptr),
+        slot_(0),
+        rounds_(0),
+        cb_(cb),
+        ctx_(ctx) {}
+
+    ~Timer() { cancel(); }
+
+    /** Query if the Timer is armed */
+    bool pending() const { return wheel_ != nullptr; }
+
+    /** Disarm the Timer, if it is pending */
+    void cancel();
+
+   private:
+    Timer(const Timer&) = delete;
+    void operator=(const Timer&) = delete;
+
+    friend TimerWheel;
+
+    TimerWheel* wheel_; /**< The TimerWheel the Timer is armed on */
+    Timer* prev_;       /**< The previous Timer in the bucket */
+    Timer* next_;       /**< The next Timer in the bucket */
+    size_t slot_;       /**< The bucket the Timer is in */
+    size_t rounds_;     /**< The revolutions left till expiry */
+    Callback cb_;       /**< The expiry callback */
+    void* ctx_;         /**< The expiry callback argument */
+  };
+
+  /**
+   * Construct a TimerWheel instance
+   *
+   * @param[in] base      The libevent2 event_base to use
+   * @param[in] tick_usec The wheel granularity in usec
+   * @param[in] nr_slots  The number of buckets (nr_slots * tick_usec should
+   *                      cover the common timer durations)
+   * @param[in] priority  The libevent2 priority to drive the wheel at
+   */
+  TimerWheel(struct event_base* base,
+             const uint32_t tick_usec,
+             const size_t nr_slots,
+             const int priority) :
+      base_(base),
+      tick_usec_(tick_usec),
+      priority_(priority),
+      slots_(nr_slots + 1, nullptr),
+      tick_ev_(nullptr),
+      current_tick_(0),
+      nr_pending_(0),
+      nr_fired_(0) {}
+
+  ~TimerWheel();
+
+  /**
+   * Arm a Timer
+   *
+   * Arming a Timer that is already pending reschedules it.
+   *
+   * @param[in] timer The Timer to arm
+   * @param[in] usec  The delay in usec
+   *
+   * @returns true  - Success
+   * @returns false - Failed to initialize the libevent2 timer
+   */
+  bool add(Timer& timer,
+           const uint32_t usec);
+
+  /** @{ */
+  /** Query the number of pending Timers */
+  size_t nr_pending() const { return nr_pending_; }
+
+  /** Query the total number of Timers that expired */
+  uint64_t nr_fired() const { return nr_fired_; }
+  /** @} */
+
+ private:
+  TimerWheel(const TimerWheel&) = delete;
+  void operator=(const TimerWheel&) = delete;
+
+  /** Query the current time in usec (CLOCK_MONOTONIC) */
+  uint64_t now() const;
+
+  /** Add a Timer to a bucket */
+  void link(Timer& timer,
+            const size_t slot);
+
+  /** Remove a Timer from it's bucket */
+  void unlink(Timer& timer);
+
+  /** The libevent2 timer callback */
+  void on_tick();
+
+  struct event_base* base_;   /**< The libevent2 event_base */
+  const uint32_t tick_usec_;  /**< The wheel granularity in usec */
+  const int priority_;        /**< The libevent2 priority of tick_ev_ */
+  /** The buckets, followed by the list of expired Timers being dispatched */
+  ::std::vector<Timer*> slots_;
+  struct event* tick_ev_;     /**< The libevent2 timer driving the wheel */
+  uint64_t current_tick_;     /**< The next tick to process */
+  size_t nr_pending_;         /**< The number of pending Timers */
+  uint64_t nr_fired_;         /**< The total number of expired Timers */
+};
+
+} // namespace schwanenlied
+
+#endif // SCHWANENLIED_TIMER_WHEEL_H__
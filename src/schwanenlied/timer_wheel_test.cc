@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2014, Yawning Angel <yawning at schwanenlied dot me>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "schwanenlied/timer_wheel.h"
+#include "gtest/gtest.h"
+
+namespace schwanenlied {
+
+/*
+ * The tests run against the real clock, with a tiny wheel so that most of
+ * the delays span several revolutions.  A Timer is allowed to fire up to
+ * half a tick before it's deadline, and the upper bound is generous since
+ * the test host may be loaded.
+ */
+static constexpr uint32_t kTick = 1000;
+static constexpr size_t kNrSlots = 4;
+static constexpr uint64_t kSlack = 250000;
+
+class TimerWheelTest : public ::testing::Test {
+ protected:
+  /** A Timer and when it fired */
+  struct Entry {
+    Entry(TimerWheelTest* test) :
+        test(test),
+        timer(on_timer, this),
+        deadline(0),
+        fired_at(0),
+        nr_fired(0),
+        rearm(0),
+        victim(nullptr) {}
+
+    TimerWheelTest* test;
+    TimerWheel::Timer timer;
+    uint64_t deadline;
+    uint64_t fired_at;
+    int nr_fired;
+    int rearm;          /**< Times to rearm from the callback */
+    Entry* victim;      /**< Entry to cancel from the callback */
+  };
+
+  virtual void SetUp() {
+    base_ = ::event_base_new();
+    ASSERT_TRUE(base_ != nullptr);
+    wheel_.reset(new TimerWheel(base_, kTick, kNrSlots, 0));
+  }
+
+  virtual void TearDown() {
+    entries_.clear();
+    wheel_.reset();
+    ::event_base_free(base_);
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  static void on_timer(void* arg) {
+    Entry* e = reinterpret_cast<Entry*>(arg);
+    e->fired_at = now();
+    e->nr_fired++;
+    if (e->victim != nullptr)
+      e->victim->timer.cancel();
+    if (e->rearm > 0) {
+      e->rearm--;
+      e->deadline = e->fired_at + 3 * kTick;
+      ASSERT_TRUE(e->test->wheel_->add(e->timer, 3 * kTick));
+    }
+  }
+
+  Entry* arm(const uint32_t usec) {
+    entries_.emplace_back(new Entry(this));
+    Entry* e = entries_.back().get();
+    e->deadline = now() + usec;
+    EXPECT_TRUE(wheel_->add(e->timer, usec));
+    return e;
+  }
+
+  /** Check that an Entry fired once, and not early */
+  void check_fired(const Entry* e) {
+    ASSERT_EQ(1, e->nr_fired);
+    ASSERT_GE(e->fired_at + kTick / 2, e->deadline);
+    ASSERT_LT(e->fired_at, e->deadline + kSlack);
+  }
+
+  struct event_base* base_;
+  ::std::unique_ptr<TimerWheel> wheel_;
+  ::std::vector< ::std::unique_ptr<Entry>> entries_;
+};
+
+TEST_F(TimerWheelTest, ExpireAcrossWrap) {
+  static const uint32_t delays[] = {
+    0, 400, 1000, 2500, 3000, 4000, 5000, 7000, 9500, 13000, 17000, 30000
+  };
+  for (auto usec : delays)
+    arm(usec);
+  ASSERT_EQ(entries_.size(), wheel_->nr_pending());
+
+  // The wheel only keeps the loop alive while Timers are pending (1: idle)
+  ASSERT_EQ(1, ::event_base_dispatch(base_));
+  ASSERT_EQ(0u, wheel_->nr_pending());
+  ASSERT_EQ(entries_.size(), wheel_->nr_fired());
+  for (const auto& e : entries_)
+    check_fired(e.get());
+}
+
+TEST_F(TimerWheelTest, FellBehind) {
+  // Process several revolutions worth of ticks in a single callback
+  for (uint32_t usec = 1000; usec <= 40000; usec += 3000)
+    arm(usec);
+  ::usleep(25000);
+
+  ASSERT_EQ(1, ::event_base_dispatch(base_));
+  ASSERT_EQ(0u, wheel_->nr_pending());
+  for (const auto& e : entries_)
+    check_fired(e.get());
+}
+
+TEST_F(TimerWheelTest, Cancel) {
+  for (uint32_t usec = 0; usec < 16000; usec += 1000)
+    arm(usec);
+  for (size_t i = 0; i < entries_.size(); i += 2)
+    entries_[i]->timer.cancel();
+  ASSERT_EQ(entries_.size() / 2, wheel_->nr_pending());
+
+  // Destroying a pending Timer cancels it
+  entries_[1].reset();
+  ASSERT_EQ(entries_.size() / 2 - 1, wheel_->nr_pending());
+
+  ASSERT_EQ(1, ::event_base_dispatch(base_));
+  ASSERT_EQ(0u, wheel_->nr_pending());
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (entries_[i] == nullptr)
+      continue;
+    if (i % 2 == 0)
+      ASSERT_EQ(0, entries_[i]->nr_fired);
+    else
+      check_fired(entries_[i].get());
+  }
+}
+
+TEST_F(TimerWheelTest, Rearm) {
+  // Rearming a pending Timer reschedules it
+  Entry* e = arm(50000);
+  const uint64_t first_deadline = e->deadline;
+  e->deadline = now() + 2000;
+  ASSERT_TRUE(wheel_->add(e->timer, 2000));
+  ASSERT_EQ(1u, wheel_->nr_pending());
+
+  // Timers can rearm themselves from the callback
+  Entry* periodic = arm(1000);
+  periodic->rearm = 5;
+
+  ASSERT_EQ(1, ::event_base_dispatch(base_));
+  check_fired(e);
+  ASSERT_LT(e->fired_at, first_deadline);
+  ASSERT_EQ(6, periodic->nr_fired);
+  ASSERT_GE(periodic->fired_at + kTick / 2, periodic->deadline);
+}
+
+TEST_F(TimerWheelTest, CancelFromCallback) {
+  // Both expire on the same tick, whichever fires first cancels the other
+  Entry* a = arm(3000);
+  Entry* b = arm(3000);
+  a->victim = b;
+  b->victim = a;
+
+  ASSERT_EQ(1, ::event_base_dispatch(base_));
+  ASSERT_EQ(1, a->nr_fired + b->nr_fired);
+  ASSERT_EQ(1u, wheel_->nr_fired());
+}
+
+} // namespace schwanenlied